@@ -20,12 +20,73 @@ SOURCES += \
         main.cpp \
         ftpserver.cpp \
         ftpconnection.cpp \
+        fileioservice.cpp \
+        fsservice.cpp \
+        hotfilecache.cpp \
+        statcache.cpp \
+        treewalker.cpp \
+        treemanifest.cpp \
+        pathindex.cpp \
+        ssltcpserver.cpp \
+        listenerhandoff.cpp \
+        uploadcommitter.cpp \
+        quotamanager.cpp \
+        transferrecord.cpp \
+        transferlog.cpp \
+        tracer.cpp \
+        stallwatchdog.cpp \
+        capturerecord.cpp \
+        sessioncapture.cpp \
+        listformatter.cpp \
+        socketpolicy.cpp \
+        localvfs.cpp \
+        memoryvfs.cpp \
+        s3vfs.cpp \
+        sessiontablemodel.cpp \
+        throughputgraph.cpp \
         mainwindow.cpp
 
 HEADERS += \
         ftpserver.h \
+        cachepolicy.h \
+        uploadpolicy.h \
+        socketpolicy.h \
         ftpconnection.h \
+        fileioservice.h \
+        fsservice.h \
+        hotfilecache.h \
+        statcache.h \
+        treewalker.h \
+        treemanifest.h \
+        pathindex.h \
+        ssltcpserver.h \
+        listenerhandoff.h \
+        uploadcommitter.h \
+        quotamanager.h \
+        transferrecord.h \
+        transferlog.h \
+        tracer.h \
+        stallwatchdog.h \
+        capturerecord.h \
+        sessioncapture.h \
+        listformatter.h \
+        vfs.h \
+        localvfs.h \
+        memoryvfs.h \
+        s3vfs.h \
+        sessioninfo.h \
+        sessiontablemodel.h \
+        throughputgraph.h \
         mainwindow.h
 
 FORMS += \
         mainwindow.ui
+
+# Share one OpenSSL context between a session's control and data
+# connections, so PROT P data channels resume the control channel's TLS
+# session instead of doing a full handshake. Needs Qt's private network
+# headers: qmake CONFIG+=ftps_session_reuse
+ftps_session_reuse {
+    QT += network-private
+    DEFINES += FTP_TLS_SHARED_CONTEXT
+}
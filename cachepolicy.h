@@ -0,0 +1,27 @@
+#ifndef CACHEPOLICY_H
+#define CACHEPOLICY_H
+
+#include <QtGlobal>
+
+// Page-cache behaviour for large transfers. Bulk downloads are read with
+// sequential read-ahead and dropped from the cache once sent; bulk uploads
+// are written back periodically and dropped once on disk. Transfers below
+// the thresholds are left to the kernel so hot small files stay cached.
+struct CachePolicy
+{
+    bool enabled = true;
+
+    // Downloads of at least this size use the streaming policy
+    qint64 downloadThreshold = 16 * 1024 * 1024;
+    // How far ahead of the current read offset to request read-ahead
+    qint64 readAhead = 4 * 1024 * 1024;
+    // Sent data is evicted in steps of this size
+    qint64 dropBehind = 4 * 1024 * 1024;
+
+    // Uploads switch to periodic writeback after this many bytes
+    qint64 uploadThreshold = 16 * 1024 * 1024;
+    // Writeback is started every this many bytes written
+    qint64 writebackInterval = 8 * 1024 * 1024;
+};
+
+#endif // CACHEPOLICY_H
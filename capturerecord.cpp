@@ -0,0 +1,71 @@
+#include "capturerecord.h"
+#include <QDataStream>
+
+namespace {
+
+const quint32 CaptureMagic = 0x46545052; // "FTPR"
+const quint8 CaptureVersion = 1;
+
+}
+
+QByteArray CaptureRecord::fileHeader()
+{
+    QByteArray header;
+    QDataStream out(&header, QIODevice::WriteOnly);
+    out << CaptureMagic << CaptureVersion;
+    return header;
+}
+
+bool CaptureRecord::readHeader(QDataStream &in)
+{
+    quint32 magic = 0;
+    quint8 version = 0;
+    in >> magic >> version;
+    return in.status() == QDataStream::Ok && magic == CaptureMagic && version == CaptureVersion;
+}
+
+void CaptureRecord::write(QDataStream &out) const
+{
+    out << quint8(kind) << session << time;
+    switch (kind) {
+    case Command:
+        out << line;
+        break;
+    case Reply:
+        out << qint16(code);
+        break;
+    case DataTransfer:
+        out << bytes;
+        break;
+    default:
+        break;
+    }
+}
+
+bool CaptureRecord::read(QDataStream &in)
+{
+    quint8 type = 0;
+    in >> type >> session >> time;
+    if (in.status() != QDataStream::Ok || type > SessionEnd) {
+        return false;
+    }
+
+    kind = Kind(type);
+    switch (kind) {
+    case Command:
+        in >> line;
+        break;
+    case Reply: {
+        qint16 value = 0;
+        in >> value;
+        code = value;
+        break;
+    }
+    case DataTransfer:
+        in >> bytes;
+        break;
+    default:
+        break;
+    }
+    return in.status() == QDataStream::Ok;
+}
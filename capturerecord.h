@@ -0,0 +1,35 @@
+#ifndef CAPTURERECORD_H
+#define CAPTURERECORD_H
+
+#include <QByteArray>
+
+class QDataStream;
+
+// One event of a captured session. Shared by the server, which records
+// sessions with SessionCapture, and tools/ftpreplay, which plays them
+// back against another server. Only the control channel and transfer
+// sizes are kept, never file contents or passwords.
+struct CaptureRecord
+{
+    enum Kind : quint8 { SessionStart, Command, Reply, DataTransfer, SessionEnd };
+
+    Kind kind = SessionStart;
+    quint64 session = 0;
+    // Microseconds since the capture started
+    qint64 time = 0;
+    // Command: the line as received, PASS arguments removed
+    QByteArray line;
+    // Reply: the reply code
+    int code = 0;
+    // DataTransfer: bytes moved over the data connection, either way
+    qint64 bytes = 0;
+
+    // A capture is a header followed by records, in QDataStream format;
+    // a torn last record is ignored when read back
+    static QByteArray fileHeader();
+    static bool readHeader(QDataStream &in);
+    void write(QDataStream &out) const;
+    bool read(QDataStream &in);
+};
+
+#endif // CAPTURERECORD_H
@@ -0,0 +1,860 @@
+#include "fileioservice.h"
+#include "fsservice.h"
+#include <QThread>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QWaitCondition>
+#include <QPointer>
+#include <QList>
+#include <QVector>
+#include <QVarLengthArray>
+#include <QAtomicInteger>
+#include <QDebug>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#ifdef Q_OS_LINUX
+#include <sys/syscall.h>
+// Linux 6.5; the number is shared by every architecture but alpha.
+// Older kernels answer ENOSYS.
+#if !defined(SYS_cachestat) && !defined(__alpha__)
+#define SYS_cachestat 451
+#endif
+#endif
+
+#if defined(Q_OS_LINUX) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#define FTP_HAVE_IO_URING
+#endif
+#endif
+
+struct FileIoRequest
+{
+    // Sample only ever runs on the filesystem pool
+    enum Op { Read, Write, Advise, Writeback, Sample };
+
+    Op op;
+    QSharedPointer<QFile> file;
+    int fd;
+    qint64 offset;
+    qint64 length;
+    qint64 done;
+    QByteArray data;
+    QPointer<QObject> owner;
+    FileIoService::Completion completion;
+    int bufferIndex;
+    int advice;
+    bool dropAfter;
+#ifdef FTP_HAVE_IO_URING
+    struct iovec iov;
+#endif
+};
+
+// Pages of a sampled range found in the page cache, and not
+struct Residency
+{
+    quint64 resident;
+    quint64 missed;
+};
+
+#ifdef SYS_cachestat
+// As in <linux/mman.h>, which older headers lack
+struct CacheStatRange
+{
+    quint64 offset;
+    quint64 length;
+};
+
+struct CacheStat
+{
+    quint64 cache;
+    quint64 dirty;
+    quint64 writeback;
+    quint64 evicted;
+    quint64 recentlyEvicted;
+};
+#endif
+
+class FileIoBackend : public QThread
+{
+public:
+    explicit FileIoBackend(FileIoService *service)
+        : m_service(service), m_stopping(false), m_readCount(0), m_haveCachestat(true) {}
+
+    virtual FileIoService::Backend kind() const = 0;
+
+    void submit(FileIoRequest *request)
+    {
+        {
+            QMutexLocker locker(&m_mutex);
+            m_queue.append(request);
+        }
+        wake();
+    }
+
+    FileIoService::CacheStats cacheStats() const
+    {
+        FileIoService::CacheStats stats;
+        stats.residentPages = m_residentPages.loadAcquire();
+        stats.missedPages = m_missedPages.loadAcquire();
+        return stats;
+    }
+
+    void resetCacheStats()
+    {
+        m_residentPages.storeRelease(0);
+        m_missedPages.storeRelease(0);
+    }
+
+    void shutdown()
+    {
+        {
+            QMutexLocker locker(&m_mutex);
+            m_stopping = true;
+        }
+        wake();
+        wait();
+    }
+
+protected:
+    virtual void wake() = 0;
+
+    // Hands the result back to the service thread and frees the request
+    void complete(FileIoRequest *request, qint64 result)
+    {
+        if (request->op == FileIoRequest::Read && result >= 0) {
+            request->data.truncate(int(result));
+        }
+
+        QPointer<QObject> owner = request->owner;
+        FileIoService::Completion done = std::move(request->completion);
+        QByteArray data = request->op == FileIoRequest::Read ? request->data : QByteArray();
+        // The last reference to the file is dropped on the service thread
+        QSharedPointer<QFile> file = request->file;
+        delete request;
+
+        QMetaObject::invokeMethod(m_service, [owner, done, result, data, file]() mutable {
+            file.clear();
+            if (owner && done) {
+                done(result, data);
+            }
+        }, Qt::QueuedConnection);
+    }
+
+    // Frees a request that has no completion; as in complete(), the last
+    // reference to the file may only be dropped on the service thread
+    void discard(FileIoRequest *request)
+    {
+        QSharedPointer<QFile> file = request->file;
+        delete request;
+
+        QMetaObject::invokeMethod(m_service, [file]() mutable {
+            file.clear();
+        }, Qt::QueuedConnection);
+    }
+
+    // Cache hints need no completion, so both backends run them on the
+    // worker, but only what returns at once: waiting for writeback before
+    // dropping the pages would hold up every other transfer's I/O behind
+    // one large upload, so that part goes to the filesystem pool.
+    // Returns false for ordinary reads/writes.
+    bool performHint(FileIoRequest *request)
+    {
+        if (request->op == FileIoRequest::Advise) {
+            posix_fadvise(request->fd, off_t(request->offset), off_t(request->length),
+                          request->advice);
+        } else if (request->op == FileIoRequest::Writeback) {
+#ifdef Q_OS_LINUX
+            sync_file_range(request->fd, off_t(request->offset), off_t(request->length),
+                            SYNC_FILE_RANGE_WRITE);
+#endif
+            if (request->dropAfter) {
+                runOnPool(request);
+                return true;
+            }
+        } else {
+            return false;
+        }
+
+        discard(request);
+        return true;
+    }
+
+    // Samples page-cache residency of every Nth read, just before it is
+    // issued, so the hit ratio reflects what the disk actually had to do.
+    // cachestat() answers in one syscall; without it the sample is an
+    // mmap and mincore(), which are too costly for the worker and are
+    // taken on the pool instead, racing the read they describe.
+    void sampleResidency(const FileIoRequest *request)
+    {
+        if (request->op != FileIoRequest::Read || (m_readCount++ % ResidencySampleInterval) != 0) {
+            return;
+        }
+
+#ifdef SYS_cachestat
+        if (m_haveCachestat) {
+            CacheStatRange range = { quint64(request->offset), quint64(request->length) };
+            CacheStat stat;
+            if (syscall(SYS_cachestat, request->fd, &range, &stat, 0) == 0) {
+                static const qint64 pageSize = sysconf(_SC_PAGESIZE);
+                quint64 pages = quint64((request->offset + request->length + pageSize - 1) / pageSize
+                                        - request->offset / pageSize);
+                Residency residency;
+                residency.resident = qMin(stat.cache, pages);
+                residency.missed = pages - residency.resident;
+                addResidency(residency);
+                return;
+            }
+            if (errno != ENOSYS) {
+                return;
+            }
+            m_haveCachestat = false;
+        }
+#endif
+
+        FileIoRequest *sample = new FileIoRequest;
+        sample->op = FileIoRequest::Sample;
+        sample->file = request->file;
+        sample->fd = request->fd;
+        sample->offset = request->offset;
+        sample->length = request->length;
+        sample->done = 0;
+        sample->bufferIndex = -1;
+        sample->advice = 0;
+        sample->dropAfter = false;
+        runOnPool(sample);
+    }
+
+    void addResidency(const Residency &residency)
+    {
+        m_residentPages.fetchAndAddRelaxed(residency.resident);
+        m_missedPages.fetchAndAddRelaxed(residency.missed);
+    }
+
+    // Runs a slow hint or sample on the filesystem pool. The request
+    // keeps its file open until then, and is freed on the service thread.
+    void runOnPool(FileIoRequest *request)
+    {
+        FileIoService *service = m_service;
+        FileIoBackend *backend = this;
+        QMetaObject::invokeMethod(service, [service, backend, request]() {
+            service->m_fs->submit<Residency>(service, [request]() {
+                return performOnPool(request);
+            }, [backend, request](const Residency &residency) {
+                backend->addResidency(residency);
+                delete request;
+            });
+        }, Qt::QueuedConnection);
+    }
+
+    static Residency performOnPool(const FileIoRequest *request)
+    {
+        Residency residency;
+        residency.resident = 0;
+        residency.missed = 0;
+
+        if (request->op == FileIoRequest::Writeback) {
+#ifdef Q_OS_LINUX
+            sync_file_range(request->fd, off_t(request->offset), off_t(request->length),
+                            SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE
+                            | SYNC_FILE_RANGE_WAIT_AFTER);
+#endif
+            posix_fadvise(request->fd, off_t(request->offset), off_t(request->length),
+                          POSIX_FADV_DONTNEED);
+            return residency;
+        }
+
+        static const qint64 pageSize = sysconf(_SC_PAGESIZE);
+        qint64 start = request->offset & ~(pageSize - 1);
+        size_t span = size_t(request->offset + request->length - start);
+        if (span == 0) {
+            return residency;
+        }
+
+        void *map = mmap(nullptr, span, PROT_READ, MAP_SHARED, request->fd, off_t(start));
+        if (map == MAP_FAILED) {
+            return residency;
+        }
+
+        QVarLengthArray<unsigned char, 64> pages(int((span + size_t(pageSize) - 1) / size_t(pageSize)));
+        if (mincore(map, span, pages.data()) == 0) {
+            for (unsigned char page : pages) {
+                residency.resident += page & 1;
+            }
+            residency.missed = quint64(pages.size()) - residency.resident;
+        }
+
+        munmap(map, span);
+        return residency;
+    }
+
+    static const unsigned ResidencySampleInterval = 8;
+
+    FileIoService *m_service;
+    QMutex m_mutex;
+    QList<FileIoRequest*> m_queue;
+    bool m_stopping;
+    unsigned m_readCount;
+    bool m_haveCachestat;
+    QAtomicInteger<quint64> m_residentPages;
+    QAtomicInteger<quint64> m_missedPages;
+};
+
+// Fallback backend: one worker thread draining the queue in batches with
+// positional reads and writes, so transfers never share a file offset.
+class ThreadIoBackend : public FileIoBackend
+{
+public:
+    explicit ThreadIoBackend(FileIoService *service) : FileIoBackend(service) {}
+
+    FileIoService::Backend kind() const override { return FileIoService::ThreadBackend; }
+
+protected:
+    void wake() override
+    {
+        QMutexLocker locker(&m_mutex);
+        m_condition.wakeOne();
+    }
+
+    void run() override
+    {
+        forever {
+            QList<FileIoRequest*> batch;
+            {
+                QMutexLocker locker(&m_mutex);
+                while (m_queue.isEmpty() && !m_stopping) {
+                    m_condition.wait(&m_mutex);
+                }
+                if (m_queue.isEmpty()) {
+                    return;
+                }
+                batch.swap(m_queue);
+            }
+
+            for (FileIoRequest *request : batch) {
+                if (performHint(request)) {
+                    continue;
+                }
+                sampleResidency(request);
+                complete(request, perform(request));
+            }
+        }
+    }
+
+private:
+    static qint64 perform(FileIoRequest *request)
+    {
+        if (request->op == FileIoRequest::Read) {
+            request->data.resize(int(request->length));
+            ssize_t n;
+            do {
+                n = ::pread(request->fd, request->data.data(), size_t(request->length),
+                            off_t(request->offset));
+            } while (n < 0 && errno == EINTR);
+            return n < 0 ? -errno : qint64(n);
+        }
+
+        while (request->done < request->length) {
+            ssize_t n = ::pwrite(request->fd, request->data.constData() + request->done,
+                                 size_t(request->length - request->done),
+                                 off_t(request->offset + request->done));
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return -errno;
+            }
+            request->done += n;
+        }
+        return request->done;
+    }
+
+    QWaitCondition m_condition;
+};
+
+#ifdef FTP_HAVE_IO_URING
+
+// io_uring backend. Chunk-sized requests use a pool of registered buffers
+// (READ_FIXED/WRITE_FIXED); larger ones fall back to READV/WRITEV on the
+// request's own buffer. An eventfd read stays armed in the ring as a
+// doorbell so new submissions wake the worker while it waits for disk
+// completions.
+class UringIoBackend : public FileIoBackend
+{
+public:
+    explicit UringIoBackend(FileIoService *service)
+        : FileIoBackend(service),
+          m_ringFd(-1),
+          m_eventFd(-1),
+          m_sqRing(nullptr),
+          m_cqRing(nullptr),
+          m_sqes(nullptr),
+          m_sqRingSize(0),
+          m_cqRingSize(0),
+          m_sqesSize(0),
+          m_buffers(nullptr),
+          m_buffersRegistered(false),
+          m_inFlight(0),
+          m_doorbellArmed(false),
+          m_doorbellValue(0)
+    {
+    }
+
+    ~UringIoBackend() override
+    {
+        if (m_sqes) {
+            munmap(m_sqes, m_sqesSize);
+        }
+        if (m_cqRing && m_cqRing != m_sqRing) {
+            munmap(m_cqRing, m_cqRingSize);
+        }
+        if (m_sqRing) {
+            munmap(m_sqRing, m_sqRingSize);
+        }
+        if (m_ringFd >= 0) {
+            ::close(m_ringFd);
+        }
+        if (m_eventFd >= 0) {
+            ::close(m_eventFd);
+        }
+        ::free(m_buffers);
+    }
+
+    FileIoService::Backend kind() const override { return FileIoService::IoUringBackend; }
+
+    // Runtime detection: fails cleanly on kernels without io_uring or
+    // where it is blocked by seccomp, so the caller can fall back.
+    bool init()
+    {
+        struct io_uring_params params;
+        memset(&params, 0, sizeof(params));
+
+        m_ringFd = int(syscall(__NR_io_uring_setup, RingEntries, &params));
+        if (m_ringFd < 0) {
+            return false;
+        }
+
+        m_sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        m_cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+            m_sqRingSize = m_cqRingSize = qMax(m_sqRingSize, m_cqRingSize);
+        }
+
+        m_sqRing = mmap(nullptr, m_sqRingSize, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, m_ringFd, IORING_OFF_SQ_RING);
+        if (m_sqRing == MAP_FAILED) {
+            m_sqRing = nullptr;
+            return false;
+        }
+
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+            m_cqRing = m_sqRing;
+        } else {
+            m_cqRing = mmap(nullptr, m_cqRingSize, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, m_ringFd, IORING_OFF_CQ_RING);
+            if (m_cqRing == MAP_FAILED) {
+                m_cqRing = nullptr;
+                return false;
+            }
+        }
+
+        m_sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+        m_sqes = static_cast<struct io_uring_sqe *>(
+            mmap(nullptr, m_sqesSize, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, m_ringFd, IORING_OFF_SQES));
+        if (m_sqes == MAP_FAILED) {
+            m_sqes = nullptr;
+            return false;
+        }
+
+        char *sq = static_cast<char *>(m_sqRing);
+        char *cq = static_cast<char *>(m_cqRing);
+        m_sqHead = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+        m_sqTail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+        m_sqMask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+        m_sqArray = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+        m_cqHead = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+        m_cqTail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+        m_cqMask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+        m_cqes = reinterpret_cast<struct io_uring_cqe *>(cq + params.cq_off.cqes);
+        m_sqEntries = params.sq_entries;
+
+        m_eventFd = eventfd(0, EFD_CLOEXEC);
+        if (m_eventFd < 0) {
+            return false;
+        }
+
+        // Registered buffers are an optimisation; carry on without them
+        // if the memlock limit is too small.
+        if (posix_memalign(&m_buffers, 4096, size_t(BufferCount * FileIoService::ChunkSize)) == 0) {
+            QVector<struct iovec> iovecs(BufferCount);
+            for (int i = 0; i < BufferCount; ++i) {
+                iovecs[i].iov_base = bufferAt(i);
+                iovecs[i].iov_len = size_t(FileIoService::ChunkSize);
+            }
+            m_buffersRegistered = syscall(__NR_io_uring_register, m_ringFd,
+                                          IORING_REGISTER_BUFFERS,
+                                          iovecs.data(), unsigned(BufferCount)) == 0;
+        } else {
+            m_buffers = nullptr;
+        }
+
+        if (m_buffersRegistered) {
+            for (int i = BufferCount - 1; i >= 0; --i) {
+                m_freeBuffers.append(i);
+            }
+        }
+
+        return true;
+    }
+
+protected:
+    void wake() override
+    {
+        quint64 one = 1;
+        ssize_t ignored = ::write(m_eventFd, &one, sizeof(one));
+        Q_UNUSED(ignored);
+    }
+
+    void run() override
+    {
+        forever {
+            if (!m_doorbellArmed && freeSlots() > 0) {
+                armDoorbell();
+            }
+
+            QList<FileIoRequest*> batch;
+            bool stopping;
+            {
+                QMutexLocker locker(&m_mutex);
+                while (!m_queue.isEmpty() && unsigned(batch.size()) < freeSlots()) {
+                    batch.append(m_queue.takeFirst());
+                }
+                stopping = m_stopping && m_queue.isEmpty();
+            }
+
+            for (FileIoRequest *request : batch) {
+                if (performHint(request)) {
+                    continue;
+                }
+                sampleResidency(request);
+                prepare(request);
+            }
+
+            if (stopping && m_inFlight == 0) {
+                return;
+            }
+
+            // Anything the kernel did not consume last time is resubmitted
+            unsigned toSubmit = *m_sqTail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+            int ret = int(syscall(__NR_io_uring_enter, m_ringFd, toSubmit, 1,
+                                  IORING_ENTER_GETEVENTS, nullptr, 0));
+            if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                qWarning() << "io_uring_enter failed:" << strerror(errno);
+            }
+
+            reap();
+        }
+    }
+
+private:
+    static const unsigned RingEntries = 256;
+    static const int BufferCount = 64;
+    static const quint64 DoorbellTag = 0;
+
+    unsigned freeSlots() const
+    {
+        unsigned used = m_inFlight + (m_doorbellArmed ? 1 : 0);
+        return used < m_sqEntries ? m_sqEntries - used : 0;
+    }
+
+    char *bufferAt(int index) const
+    {
+        return static_cast<char *>(m_buffers) + index * FileIoService::ChunkSize;
+    }
+
+    struct io_uring_sqe *nextSqe()
+    {
+        unsigned tail = *m_sqTail;
+        unsigned index = tail & *m_sqMask;
+        struct io_uring_sqe *sqe = &m_sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        m_sqArray[index] = index;
+        return sqe;
+    }
+
+    void pushSqe()
+    {
+        __atomic_store_n(m_sqTail, *m_sqTail + 1, __ATOMIC_RELEASE);
+    }
+
+    void armDoorbell()
+    {
+        m_doorbellIov.iov_base = &m_doorbellValue;
+        m_doorbellIov.iov_len = sizeof(m_doorbellValue);
+
+        struct io_uring_sqe *sqe = nextSqe();
+        sqe->opcode = IORING_OP_READV;
+        sqe->fd = m_eventFd;
+        sqe->addr = reinterpret_cast<quint64>(&m_doorbellIov);
+        sqe->len = 1;
+        sqe->user_data = DoorbellTag;
+        pushSqe();
+        m_doorbellArmed = true;
+    }
+
+    void prepare(FileIoRequest *request)
+    {
+        qint64 remaining = request->length - request->done;
+        struct io_uring_sqe *sqe = nextSqe();
+        sqe->fd = request->fd;
+        sqe->off = quint64(request->offset + request->done);
+        sqe->user_data = reinterpret_cast<quint64>(request);
+
+        if (remaining <= FileIoService::ChunkSize && !m_freeBuffers.isEmpty()) {
+            request->bufferIndex = m_freeBuffers.takeLast();
+            char *buffer = bufferAt(request->bufferIndex);
+            if (request->op == FileIoRequest::Write) {
+                memcpy(buffer, request->data.constData() + request->done, size_t(remaining));
+            }
+            sqe->opcode = request->op == FileIoRequest::Read ? IORING_OP_READ_FIXED
+                                                            : IORING_OP_WRITE_FIXED;
+            sqe->addr = reinterpret_cast<quint64>(buffer);
+            sqe->len = unsigned(remaining);
+            sqe->buf_index = quint16(request->bufferIndex);
+        } else {
+            if (request->op == FileIoRequest::Read) {
+                request->data.resize(int(request->length));
+                request->iov.iov_base = request->data.data() + request->done;
+            } else {
+                request->iov.iov_base = const_cast<char *>(request->data.constData()) + request->done;
+            }
+            request->iov.iov_len = size_t(remaining);
+            sqe->opcode = request->op == FileIoRequest::Read ? IORING_OP_READV
+                                                            : IORING_OP_WRITEV;
+            sqe->addr = reinterpret_cast<quint64>(&request->iov);
+            sqe->len = 1;
+        }
+
+        pushSqe();
+        ++m_inFlight;
+    }
+
+    void reap()
+    {
+        unsigned head = *m_cqHead;
+        while (head != __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &m_cqes[head & *m_cqMask];
+            quint64 tag = cqe->user_data;
+            qint64 result = cqe->res;
+            ++head;
+
+            if (tag == DoorbellTag) {
+                m_doorbellArmed = false;
+                continue;
+            }
+
+            --m_inFlight;
+            FileIoRequest *request = reinterpret_cast<FileIoRequest *>(tag);
+
+            if (request->bufferIndex >= 0) {
+                if (request->op == FileIoRequest::Read && result > 0) {
+                    request->data = QByteArray(bufferAt(request->bufferIndex), int(result));
+                }
+                m_freeBuffers.append(request->bufferIndex);
+                request->bufferIndex = -1;
+            }
+
+            if (result < 0) {
+                complete(request, result);
+            } else if (request->op == FileIoRequest::Read) {
+                complete(request, result);
+            } else {
+                // Short write: queue the remainder ahead of new work
+                request->done += result;
+                if (result > 0 && request->done < request->length) {
+                    QMutexLocker locker(&m_mutex);
+                    m_queue.prepend(request);
+                } else {
+                    complete(request, result > 0 ? request->done : -EIO);
+                }
+            }
+        }
+        __atomic_store_n(m_cqHead, head, __ATOMIC_RELEASE);
+    }
+
+    int m_ringFd;
+    int m_eventFd;
+    void *m_sqRing;
+    void *m_cqRing;
+    struct io_uring_sqe *m_sqes;
+    size_t m_sqRingSize;
+    size_t m_cqRingSize;
+    size_t m_sqesSize;
+    unsigned m_sqEntries;
+    unsigned *m_sqHead;
+    unsigned *m_sqTail;
+    unsigned *m_sqMask;
+    unsigned *m_sqArray;
+    unsigned *m_cqHead;
+    unsigned *m_cqTail;
+    unsigned *m_cqMask;
+    struct io_uring_cqe *m_cqes;
+
+    void *m_buffers;
+    bool m_buffersRegistered;
+    QVector<int> m_freeBuffers;
+
+    unsigned m_inFlight;
+    bool m_doorbellArmed;
+    quint64 m_doorbellValue;
+    struct iovec m_doorbellIov;
+};
+
+#endif // FTP_HAVE_IO_URING
+
+const qint64 FileIoService::ChunkSize;
+
+FileIoService::FileIoService(FsService *fs, QObject *parent) : QObject(parent),
+    m_fs(fs),
+    m_backend(nullptr)
+{
+#ifdef FTP_HAVE_IO_URING
+    if (qEnvironmentVariableIsEmpty("FTP_DISABLE_IO_URING")) {
+        UringIoBackend *uring = new UringIoBackend(this);
+        if (uring->init()) {
+            m_backend = uring;
+        } else {
+            qDebug() << "io_uring unavailable, using thread backend";
+            delete uring;
+        }
+    }
+#endif
+
+    if (!m_backend) {
+        m_backend = new ThreadIoBackend(this);
+    }
+
+    m_backend->start();
+}
+
+FileIoService::~FileIoService()
+{
+    m_backend->shutdown();
+    delete m_backend;
+}
+
+void FileIoService::read(const QSharedPointer<QFile> &file, qint64 offset, qint64 length,
+                         QObject *owner, Completion done)
+{
+    FileIoRequest *request = new FileIoRequest;
+    request->op = FileIoRequest::Read;
+    request->file = file;
+    request->fd = file->handle();
+    request->offset = offset;
+    request->length = length;
+    request->done = 0;
+    request->owner = owner;
+    request->completion = std::move(done);
+    request->bufferIndex = -1;
+    request->advice = 0;
+    request->dropAfter = false;
+    m_backend->submit(request);
+}
+
+void FileIoService::write(const QSharedPointer<QFile> &file, qint64 offset, const QByteArray &data,
+                          QObject *owner, Completion done)
+{
+    FileIoRequest *request = new FileIoRequest;
+    request->op = FileIoRequest::Write;
+    request->file = file;
+    request->fd = file->handle();
+    request->offset = offset;
+    request->length = data.size();
+    request->done = 0;
+    request->data = data;
+    request->owner = owner;
+    request->completion = std::move(done);
+    request->bufferIndex = -1;
+    request->advice = 0;
+    request->dropAfter = false;
+    m_backend->submit(request);
+}
+
+void FileIoService::advise(const QSharedPointer<QFile> &file, qint64 offset, qint64 length,
+                           Advice advice)
+{
+    FileIoRequest *request = new FileIoRequest;
+    request->op = FileIoRequest::Advise;
+    request->file = file;
+    request->fd = file->handle();
+    request->offset = offset;
+    request->length = length;
+    request->done = 0;
+    request->bufferIndex = -1;
+    request->dropAfter = false;
+
+    switch (advice) {
+    case AdviseSequential:
+        request->advice = POSIX_FADV_SEQUENTIAL;
+        break;
+    case AdviseWillNeed:
+        request->advice = POSIX_FADV_WILLNEED;
+        break;
+    case AdviseDontNeed:
+        request->advice = POSIX_FADV_DONTNEED;
+        break;
+    }
+
+    m_backend->submit(request);
+}
+
+void FileIoService::writeback(const QSharedPointer<QFile> &file, qint64 offset, qint64 length,
+                              bool dropAfter)
+{
+    FileIoRequest *request = new FileIoRequest;
+    request->op = FileIoRequest::Writeback;
+    request->file = file;
+    request->fd = file->handle();
+    request->offset = offset;
+    request->length = length;
+    request->done = 0;
+    request->bufferIndex = -1;
+    request->advice = 0;
+    request->dropAfter = dropAfter;
+    m_backend->submit(request);
+}
+
+FileIoService::CacheStats FileIoService::cacheStats() const
+{
+    return m_backend->cacheStats();
+}
+
+void FileIoService::resetCacheStats()
+{
+    m_backend->resetCacheStats();
+}
+
+double FileIoService::CacheStats::hitRatio() const
+{
+    quint64 total = residentPages + missedPages;
+    return total ? double(residentPages) / double(total) : 0.0;
+}
+
+FileIoService::Backend FileIoService::backend() const
+{
+    return m_backend->kind();
+}
+
+QString FileIoService::backendName() const
+{
+    return backend() == IoUringBackend ? "io_uring" : "thread";
+}
@@ -0,0 +1,71 @@
+#ifndef FILEIOSERVICE_H
+#define FILEIOSERVICE_H
+
+#include <QObject>
+#include <QByteArray>
+#include <QSharedPointer>
+#include <QFile>
+#include <functional>
+
+class FileIoBackend;
+class FsService;
+
+// Runs file reads and writes for all transfers off the event loop.
+// Requests are batched by a worker thread (io_uring when the kernel
+// supports it, plain pread/pwrite otherwise) and each completion is
+// delivered back on the service's thread to the object that asked for it.
+class FileIoService : public QObject
+{
+    Q_OBJECT
+public:
+    enum Backend { ThreadBackend, IoUringBackend };
+    enum Advice { AdviseSequential, AdviseWillNeed, AdviseDontNeed };
+
+    // Sampled page-cache residency of the ranges read by transfers
+    struct CacheStats
+    {
+        quint64 residentPages;
+        quint64 missedPages;
+
+        double hitRatio() const;
+    };
+
+    // result is the number of bytes transferred, or -errno on failure
+    using Completion = std::function<void(qint64 result, const QByteArray &data)>;
+
+    // fs runs what would hold up the I/O worker: writeback that has to be
+    // waited for, and residency samples where cachestat() is missing
+    explicit FileIoService(FsService *fs, QObject *parent = nullptr);
+    ~FileIoService();
+
+    // The file is kept open until the request completes. If owner is
+    // destroyed before then, the completion is dropped.
+    void read(const QSharedPointer<QFile> &file, qint64 offset, qint64 length,
+              QObject *owner, Completion done);
+    void write(const QSharedPointer<QFile> &file, qint64 offset, const QByteArray &data,
+               QObject *owner, Completion done);
+
+    // Page-cache hints, run on the I/O worker once the requests queued
+    // before them have been issued. writeback starts flushing the range;
+    // with dropAfter it also waits for the flush on the filesystem pool
+    // and then evicts the pages.
+    void advise(const QSharedPointer<QFile> &file, qint64 offset, qint64 length, Advice advice);
+    void writeback(const QSharedPointer<QFile> &file, qint64 offset, qint64 length, bool dropAfter);
+
+    CacheStats cacheStats() const;
+    void resetCacheStats();
+
+    Backend backend() const;
+    QString backendName() const;
+
+    // Size of the registered buffers, and the preferred request size
+    static const qint64 ChunkSize = 64 * 1024;
+
+private:
+    friend class FileIoBackend;
+
+    FsService *m_fs;
+    FileIoBackend *m_backend;
+};
+
+#endif // FILEIOSERVICE_H
@@ -0,0 +1,24 @@
+#include "fsservice.h"
+
+FsService::FsService(QObject *parent) : QObject(parent),
+    m_pool(new QThreadPool(this))
+{
+    // Enough to overlap a few slow network-filesystem round trips
+    // without letting metadata traffic swamp the machine
+    m_pool->setMaxThreadCount(4);
+}
+
+FsService::~FsService()
+{
+    m_pool->waitForDone();
+}
+
+void FsService::setMaxThreads(int count)
+{
+    m_pool->setMaxThreadCount(qMax(1, count));
+}
+
+int FsService::maxThreads() const
+{
+    return m_pool->maxThreadCount();
+}
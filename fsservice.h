@@ -0,0 +1,41 @@
+#ifndef FSSERVICE_H
+#define FSSERVICE_H
+
+#include <QObject>
+#include <QThreadPool>
+#include <QRunnable>
+#include <QPointer>
+
+// Runs blocking filesystem metadata calls (stat, readdir, mkdir, rename...)
+// on a bounded thread pool so a slow mount does not stall the event loop.
+// Results are delivered on the service's thread; if the owner has been
+// destroyed in the meantime the result is dropped.
+class FsService : public QObject
+{
+    Q_OBJECT
+public:
+    explicit FsService(QObject *parent = nullptr);
+    ~FsService();
+
+    void setMaxThreads(int count);
+    int maxThreads() const;
+
+    template <typename Result, typename Work, typename Done>
+    void submit(QObject *owner, Work work, Done done)
+    {
+        QPointer<QObject> guard(owner);
+        m_pool->start(QRunnable::create([this, guard, work, done]() {
+            Result result = work();
+            QMetaObject::invokeMethod(this, [guard, done, result]() {
+                if (guard) {
+                    done(result);
+                }
+            }, Qt::QueuedConnection);
+        }));
+    }
+
+private:
+    QThreadPool *m_pool;
+};
+
+#endif // FSSERVICE_H
@@ -1,15 +1,75 @@
 #include "ftpconnection.h"
 #include "ftpserver.h"
-#include <QFileInfo>
+#include "fileioservice.h"
+#include "fsservice.h"
+#include "hotfilecache.h"
+#include "statcache.h"
+#include "treewalker.h"
+#include "uploadcommitter.h"
+#include "quotamanager.h"
+#include "transferlog.h"
+#include "tracer.h"
+#include "stallwatchdog.h"
+#include "sessioncapture.h"
+#include "listformatter.h"
+#include "ssltcpserver.h"
 #include <QDateTime>
-#include <QDir>
 #include <QRandomGenerator>
+#include <QThread>
 #include <QHostAddress>
 #include <QDebug>
+#include <QRegularExpression>
+#include <QSslSocket>
+#ifdef FTP_TLS_SHARED_CONTEXT
+#include <QtNetwork/private/qsslsocket_p.h>
+#endif
+#include <sys/stat.h>
 
-FtpConnection::FtpConnection(QTcpSocket *socket, FtpServer *server) : QObject(server),
+FtpConnection::FtpConnection(QTcpSocket *socket, FtpServer *server, quint64 id) : QObject(server),
     m_controlSocket(socket),
-    m_server(server)
+    m_dataSocket(nullptr),
+    m_passiveServer(nullptr),
+    m_server(server),
+    m_id(id),
+    m_sessionBytes(0),
+    m_transferDirection(NoTransfer),
+    m_transferId(0),
+    m_bytesTotal(0),
+    m_bytesSent(0),
+    m_fileOffset(0),
+    m_pendingIo(0),
+    m_dataFinished(false),
+    m_transferFailed(false),
+    m_transferStart(0),
+    m_uploadDurability(UploadPolicy::SyncData),
+    m_uploadAllowance(-1),
+    m_quotaExceeded(false),
+    m_streamingCache(false),
+    m_readAheadEnd(0),
+    m_cacheOffset(0),
+    m_transferMode(Passive),
+    m_transferType(Binary),
+    m_renameFromDir(false),
+    m_isLoggedIn(false),
+    m_waitingForPassword(false),
+    m_commandPending(false),
+    m_protectData(false),
+    m_draining(false),
+    m_closing(false),
+    m_transferActive(false),
+    m_treeWalker(nullptr),
+    m_listingSink(nullptr),
+    m_listingReading(false),
+    m_listingNamesOnly(false),
+    m_dataHostAddress(0),
+    m_dataPort(0),
+    m_traceTrack(0),
+    m_sessionStart(Tracer::now()),
+    m_loginStart(0),
+    m_dataConnectStart(0),
+    m_commandStart(0),
+    m_captureSession(0),
+    m_captureDataMark(0)
 {
     // Verify socket
     if (!m_controlSocket || !m_controlSocket->isOpen()) {
@@ -18,18 +78,35 @@ FtpConnection::FtpConnection(QTcpSocket *socket, FtpServer *server) : QObject(se
         return;
     }
 
-    // Basic setup
-    m_currentPath = "/";
+    // Basic setup; the literal's data is static, so this costs nothing
+    m_currentPath = QStringLiteral("/");
     m_controlSocket->setParent(this);
+    
+    // Bound what a client can make us buffer; see processCommand()
+    m_controlSocket->setReadBufferSize(MaxCommandLength);
+    m_server->socketPolicy().applyToControl(m_controlSocket);
 
     // Connect signals
     connect(m_controlSocket, &QTcpSocket::readyRead, this, &FtpConnection::processCommand);
     connect(m_controlSocket, &QTcpSocket::disconnected, this, &FtpConnection::disconnected);
+    connect(m_controlSocket, &QTcpSocket::bytesWritten, this, &FtpConnection::resumeListing);
+    connect(this, &FtpConnection::disconnected, this, &FtpConnection::recordSessionEnd);
+    
+    // Sampled sessions are traced from here; others may be at login
+    m_traceTrack = m_server->tracer()->sampleSession();
+    Tracer::nameTrack(m_traceTrack, m_controlSocket->peerAddress().toString());
+    
+    // Captured from the start or not at all, so a replay sees whole sessions
+    if (m_server->sessionCapture()->isEnabled()) {
+        m_captureSession = m_server->sessionCapture()->startSession();
+        captureEvent(CaptureRecord::SessionStart);
+    }
 
     // Send welcome message after a short delay
     QTimer::singleShot(100, this, [this]() {
         if (m_controlSocket && m_controlSocket->state() == QTcpSocket::ConnectedState) {
             sendResponse(220, "FTP Server Ready");
+            Tracer::span(m_traceTrack, QStringLiteral("accept"), m_sessionStart);
             qDebug() << "Welcome message sent";
         }
     });
@@ -50,6 +127,51 @@ void FtpConnection::close()
     }
     
     closeDataConnection();
+    recordSessionEnd();
+}
+
+void FtpConnection::recordSessionEnd()
+{
+    Tracer::span(m_traceTrack, QStringLiteral("session"), m_sessionStart, m_username);
+    m_traceTrack = 0;
+    captureEvent(CaptureRecord::SessionEnd);
+    m_captureSession = 0;
+}
+
+void FtpConnection::captureEvent(CaptureRecord::Kind kind, const QByteArray &line, int code,
+                                 qint64 bytes)
+{
+    if (!m_captureSession) {
+        return;
+    }
+    
+    SessionCapture *capture = m_server->sessionCapture();
+    CaptureRecord record;
+    record.kind = kind;
+    record.session = m_captureSession;
+    record.time = capture->now();
+    record.line = line;
+    record.code = code;
+    record.bytes = bytes;
+    capture->append(record);
+}
+
+void FtpConnection::drain()
+{
+    m_draining = true;
+    finishDrainIfIdle();
+}
+
+void FtpConnection::finishDrainIfIdle()
+{
+    if (m_closing || m_transferActive || m_commandPending
+            || m_controlSocket->state() != QAbstractSocket::ConnectedState) {
+        return;
+    }
+    
+    m_commandQueue.clear();
+    sendResponse(421, "Server shutting down, closing control connection");
+    m_controlSocket->disconnectFromHost();
 }
 
 QHostAddress FtpConnection::peerAddress() const
@@ -68,14 +190,76 @@ quint16 FtpConnection::peerPort() const
     return 0;
 }
 
+SessionInfo FtpConnection::info() const
+{
+    SessionInfo info;
+    info.id = m_id;
+    info.peer = peerAddress().toString() + ':' + QString::number(peerPort());
+    info.user = m_isLoggedIn ? m_username : QString();
+    info.directory = m_currentPath;
+    if (m_transferDirection == Download) {
+        info.transfer = "RETR " + m_transferPath;
+    } else if (m_transferDirection == Upload) {
+        info.transfer = "STOR " + m_transferPath;
+    } else if (m_transferActive) {
+        info.transfer = "listing";
+    }
+    info.bytes = m_sessionBytes;
+    return info;
+}
+
 void FtpConnection::processCommand()
 {
-    // Reset timer on each command
-    m_timer->start();
+    if (m_closing) {
+        return;
+    }
+    
+    // No new work is started while the server drains
+    if (m_draining) {
+        finishDrainIfIdle();
+        return;
+    }
+    
+    if (!readCommands()) {
+        return;
+    }
+    
+    // Commands run strictly in order. One waiting on the filesystem holds
+    // back the rest; while a transfer is in flight only commands that
+    // leave the data connection alone may run.
+    while (!m_commandPending && !m_commandQueue.isEmpty()) {
+        if (m_transferActive && !canOverlapTransfer(m_commandQueue.head())) {
+            break;
+        }
+        
+        Command command = m_commandQueue.dequeue();
+        executeCommand(command.verb, command.parameter);
+        
+        // Pick up lines held back while the queue was full
+        if (!readCommands()) {
+            return;
+        }
+    }
+}
+
+bool FtpConnection::readCommands()
+{
+    if (m_closing) {
+        return false;
+    }
     
-    while (m_controlSocket->canReadLine()) {
-        QString line = QString::fromUtf8(m_controlSocket->readLine()).trimmed();
+    // Queue everything the client has pipelined, so a whole batch is
+    // read in one go rather than one line per round trip. Past the queue
+    // limit lines stay in the socket and TCP pushes back on the client.
+    while (m_commandQueue.size() < MaxQueuedCommands && m_controlSocket->canReadLine()) {
+        QByteArray raw = m_controlSocket->readLine();
+        
+        // Drop the Telnet IP/Synch sequence clients send ahead of ABOR
+        while (!raw.isEmpty() && uchar(raw.at(0)) >= 0xF0) {
+            raw.remove(0, 1);
+        }
         
+        QString line = QString::fromUtf8(raw).trimmed();
         if (line.isEmpty()) {
             continue;
         }
@@ -84,66 +268,143 @@ void FtpConnection::processCommand()
         emit logMessage("Received: " + line);
         
         // Parse command and parameters
-        QString command, parameter;
+        Command command;
         int spaceIndex = line.indexOf(' ');
         
         if (spaceIndex == -1) {
-            command = line.toUpper();
-            parameter = "";
+            command.verb = line.toUpper();
         } else {
-            command = line.left(spaceIndex).toUpper();
-            parameter = line.mid(spaceIndex + 1);
-        }
-        
-        // Handle different commands
-        if (command == "USER") {
-            handleUSER(parameter);
-        } else if (command == "PASS") {
-            handlePASS(parameter);
-        } else if (command == "SYST") {
-            handleSYST(parameter);
-        } else if (command == "QUIT") {
-            handleQUIT(parameter);
-        } else if (command == "TYPE") {
-            handleTYPE(parameter);
-        } else if (command == "PORT") {
-            handlePORT(parameter);
-        } else if (command == "PASV") {
-            handlePASV(parameter);
-        } else if (command == "LIST") {
-            handleLIST(parameter);
-        } else if (command == "CWD") {
-            handleCWD(parameter);
-        } else if (command == "PWD") {
-            handlePWD(parameter);
-        } else if (command == "MKD") {
-            handleMKD(parameter);
-        } else if (command == "RMD") {
-            handleRMD(parameter);
-        } else if (command == "DELE") {
-            handleDELE(parameter);
-        } else if (command == "RNFR") {
-            handleRNFR(parameter);
-        } else if (command == "RNTO") {
-            handleRNTO(parameter);
-        } else if (command == "STOR") {
-            handleSTOR(parameter);
-        } else if (command == "RETR") {
-            handleRETR(parameter);
-        } else if (command == "NOOP") {
-            handleNOOP(parameter);
-        } else {
-            // Unrecognized command
-            sendResponse(502, "Command not implemented");
+            command.verb = line.left(spaceIndex).toUpper();
+            command.parameter = line.mid(spaceIndex + 1);
+        }
+        
+        // Timed as received, which is the pacing the client chose
+        if (m_captureSession) {
+            captureEvent(CaptureRecord::Command,
+                         command.verb == "PASS" ? QByteArray("PASS") : line.toUtf8());
+        }
+        
+        // ABOR must not wait behind the transfer it is meant to stop
+        if (command.verb == "ABOR" && m_transferActive) {
+            handleABOR(command.parameter);
+            continue;
         }
+        
+        m_commandQueue.enqueue(command);
+    }
+    
+    // A full buffer with no line ending in it will never become a command
+    if (!m_controlSocket->canReadLine() && m_controlSocket->bytesAvailable() >= MaxCommandLength) {
+        sendResponse(500, "Command line too long");
+        m_commandQueue.clear();
+        m_controlSocket->disconnectFromHost();
+        return false;
+    }
+    
+    return true;
+}
+
+bool FtpConnection::canOverlapTransfer(const Command &command) const
+{
+    return command.verb == "NOOP" || command.verb == "ABOR"
+        || (command.verb == "STAT" && command.parameter.isEmpty());
+}
+
+void FtpConnection::executeCommand(const QString &command, const QString &parameter)
+{
+    // Timed up to its final reply, in sendResponse(). Commands overlapping
+    // a transfer only get their reply timed.
+    if (m_traceTrack && !m_transferActive) {
+        m_tracedCommand = command;
+        m_commandStart = Tracer::now();
+    }
+    
+    m_server->countCommand();
+    
+    // Named in the report if the event loop stalls; passwords stay out
+    m_server->stallWatchdog()->setActivity(m_username + ": " + command
+                                           + (command == "PASS" ? QString() : ' ' + parameter));
+    
+    // Handle different commands
+    if (command == "USER") {
+        handleUSER(parameter);
+    } else if (command == "PASS") {
+        handlePASS(parameter);
+    } else if (command == "SYST") {
+        handleSYST(parameter);
+    } else if (command == "QUIT") {
+        handleQUIT(parameter);
+    } else if (command == "TYPE") {
+        handleTYPE(parameter);
+    } else if (command == "PORT") {
+        handlePORT(parameter);
+    } else if (command == "PASV") {
+        handlePASV(parameter);
+    } else if (command == "LIST") {
+        handleLIST(parameter);
+    } else if (command == "NLST") {
+        handleNLST(parameter);
+    } else if (command == "CWD") {
+        handleCWD(parameter);
+    } else if (command == "PWD") {
+        handlePWD(parameter);
+    } else if (command == "MKD") {
+        handleMKD(parameter);
+    } else if (command == "RMD") {
+        handleRMD(parameter);
+    } else if (command == "DELE") {
+        handleDELE(parameter);
+    } else if (command == "RNFR") {
+        handleRNFR(parameter);
+    } else if (command == "RNTO") {
+        handleRNTO(parameter);
+    } else if (command == "STOR") {
+        handleSTOR(parameter);
+    } else if (command == "RETR") {
+        handleRETR(parameter);
+    } else if (command == "NOOP") {
+        handleNOOP(parameter);
+    } else if (command == "FEAT") {
+        handleFEAT(parameter);
+    } else if (command == "SIZE") {
+        handleSIZE(parameter);
+    } else if (command == "MDTM") {
+        handleMDTM(parameter);
+    } else if (command == "MFMT") {
+        handleMFMT(parameter);
+    } else if (command == "STAT") {
+        handleSTAT(parameter);
+    } else if (command == "SITE") {
+        handleSITE(parameter);
+    } else if (command == "AUTH") {
+        handleAUTH(parameter);
+    } else if (command == "PBSZ") {
+        handlePBSZ(parameter);
+    } else if (command == "PROT") {
+        handlePROT(parameter);
+    } else if (command == "ABOR") {
+        handleABOR(parameter);
+    } else {
+        // Unrecognized command
+        sendResponse(502, "Command not implemented");
     }
 }
 
 void FtpConnection::sendResponse(int code, const QString &message)
 {
+    qint64 start = m_traceTrack ? Tracer::now() : 0;
     QString response = QString("%1 %2\r\n").arg(code).arg(message);
     m_controlSocket->write(response.toUtf8());
     m_controlSocket->flush();
+    captureEvent(CaptureRecord::Reply, QByteArray(), code);
+    
+    if (m_traceTrack) {
+        Tracer::span(m_traceTrack, QStringLiteral("reply"), start, QString::number(code));
+        if (code >= 200 && !m_tracedCommand.isEmpty()) {
+            Tracer::span(m_traceTrack, m_tracedCommand, m_commandStart, response.trimmed());
+            m_tracedCommand.clear();
+        }
+    }
     
     // Log sent response
     emit logMessage("Sent: " + response.trimmed());
@@ -152,10 +413,13 @@ void FtpConnection::sendResponse(int code, const QString &message)
 void FtpConnection::setupDataConnection()
 {
     closeDataConnection();
+    m_dataConnectStart = Tracer::now();
     
     if (m_transferMode == Passive) {
         // In passive mode, we need to create a server and wait for client to connect
-        m_passiveServer = new QTcpServer(this);
+        SslTcpServer *server = new SslTcpServer(this);
+        server->setTlsEnabled(isControlEncrypted());
+        m_passiveServer = server;
         
         // Connect to server signals
         connect(m_passiveServer, &QTcpServer::newConnection, this, &FtpConnection::onDataConnected);
@@ -167,29 +431,41 @@ void FtpConnection::setupDataConnection()
             m_passiveServer = nullptr;
             return;
         }
+        m_server->socketPolicy().applyToListener(m_passiveServer);
     } else {
         // In active mode, we connect to the client
-        m_dataSocket = new QTcpSocket(this);
+        // A plain socket unless this transfer will be encrypted
+        m_dataSocket = m_protectData ? new QSslSocket(this) : new QTcpSocket(this);
         
         // Connect to socket signals
         connect(m_dataSocket, &QTcpSocket::connected, this, &FtpConnection::onDataConnected);
+        connect(m_dataSocket, &QTcpSocket::errorOccurred, this, &FtpConnection::onDataError);
         connect(m_dataSocket, &QTcpSocket::readyRead, this, &FtpConnection::onDataReadyRead);
         connect(m_dataSocket, &QTcpSocket::disconnected, this, &FtpConnection::onDataDisconnected);
         connect(m_dataSocket, &QTcpSocket::bytesWritten, this, &FtpConnection::onBytesWritten);
         
         // Connect to the specified address and port
-        m_dataSocket->connectToHost(m_dataHostAddress, m_dataPort);
+        m_dataSocket->connectToHost(QHostAddress(m_dataHostAddress), m_dataPort);
     }
 }
 
 void FtpConnection::closeDataConnection()
 {
-    // Clean up data socket
+    // Clean up data socket. A finished transfer may still have data queued
+    // for the client, so that socket is closed once it has drained.
     if (m_dataSocket) {
-        m_dataSocket->close();
-        m_dataSocket->deleteLater();
+        m_dataSocket->disconnect(this);
+        if (m_dataSocket->state() == QAbstractSocket::ConnectedState && m_dataSocket->bytesToWrite() > 0) {
+            connect(m_dataSocket, &QTcpSocket::disconnected, m_dataSocket, &QObject::deleteLater);
+            QTimer::singleShot(DataLingerTimeout, m_dataSocket, &QObject::deleteLater);
+            m_dataSocket->disconnectFromHost();
+        } else {
+            m_dataSocket->close();
+            m_dataSocket->deleteLater();
+        }
         m_dataSocket = nullptr;
     }
+    m_dataReady = nullptr;
     
     // Clean up passive server
     if (m_passiveServer) {
@@ -198,14 +474,330 @@ void FtpConnection::closeDataConnection()
         m_passiveServer = nullptr;
     }
     
-    // Clean up file
-    if (m_file) {
-        m_file->close();
-        delete m_file;
-        m_file = nullptr;
+    // Drop the file; reads and writes still in flight keep it open until
+    // they complete, and their results are ignored. An unfinished atomic
+    // upload leaves nothing behind.
+    if (m_transferDirection == Download) {
+        logTransfer(TransferRecord::Retrieve, TransferRecord::Incomplete, m_transferPath,
+                    m_bytesSent, m_transferStart);
+    } else if (m_transferDirection == Upload) {
+        logTransfer(TransferRecord::Store, TransferRecord::Incomplete, m_transferPath,
+                    m_fileOffset, m_transferStart);
+        if (m_stream) {
+            m_stream->abort();
+        }
+        discardUpload(m_uploadTempPath);
+    }
+    m_uploadTempPath.clear();
+    m_transferVfs.clear();
+    m_file.clear();
+    m_stream.clear();
+    m_cachedContents.clear();
+    m_transferDirection = NoTransfer;
+    m_pendingIo = 0;
+    ++m_transferId;
+}
+
+void FtpConnection::startTransfer()
+{
+    if (m_transferDirection == Download) {
+        sendNextChunk();
+    } else if (m_transferDirection == Upload) {
+        // Let TCP flow control push back while the disk catches up, and
+        // pick up anything the client sent before we were ready
+        if (m_dataSocket) {
+            m_dataSocket->setReadBufferSize(MaxPendingWrites * FileIoService::ChunkSize);
+        }
+        onDataReadyRead();
+    }
+}
+
+void FtpConnection::sendNextChunk()
+{
+    if (m_transferDirection != Download || !m_dataSocket || m_pendingIo > 0) {
+        return;
+    }
+    
+    // Keep at most a couple of chunks queued on the socket
+    if (m_dataSocket->bytesToWrite() >= 2 * FileIoService::ChunkSize) {
+        return;
+    }
+    
+    if (m_fileOffset >= m_bytesTotal) {
+        if (m_dataSocket->bytesToWrite() == 0) {
+            setDataCorked(false);
+            m_dataSocket->disconnectFromHost();
+        }
+        return;
+    }
+    
+    if (!m_cachedContents.isNull()) {
+        // Served from the hot file cache; no disk access needed
+        while (m_fileOffset < m_bytesTotal
+               && m_dataSocket->bytesToWrite() < 2 * FileIoService::ChunkSize) {
+            qint64 length = qMin(m_bytesTotal - m_fileOffset, FileIoService::ChunkSize);
+            m_dataSocket->write(m_cachedContents.constData() + m_fileOffset, length);
+            m_fileOffset += length;
+        }
+        return;
+    }
+    
+    updateDownloadCache();
+    
+    quint32 transferId = m_transferId;
+    qint64 length = qMin(m_bytesTotal - m_fileOffset, FileIoService::ChunkSize);
+    qint64 issued = m_traceTrack ? Tracer::now() : 0;
+    ++m_pendingIo;
+    
+    auto done = [this, transferId, issued](qint64 result, const QByteArray &data) {
+        if (transferId != m_transferId) {
+            return;
+        }
+        --m_pendingIo;
+        Tracer::asyncSpan(m_traceTrack, QStringLiteral("disk read"), issued, QString::number(result));
+        
+        if (result <= 0 || !m_dataSocket) {
+            // Read error or file shrunk underneath us
+            m_transferFailed = true;
+            if (m_dataSocket) {
+                m_dataSocket->disconnectFromHost();
+            }
+            return;
+        }
+        
+        m_fileOffset += result;
+        m_dataSocket->write(data);
+        sendNextChunk();
+    };
+    
+    if (m_stream) {
+        m_stream->read(m_fileOffset, length, this, done);
+    } else {
+        m_server->fileIo()->read(m_file, m_fileOffset, length, this, done);
+    }
+}
+
+void FtpConnection::updateDownloadCache()
+{
+    if (!m_streamingCache) {
+        return;
+    }
+    
+    CachePolicy policy = m_server->cachePolicy();
+    FileIoService *fileIo = m_server->fileIo();
+    
+    // Keep read-ahead a window in front of the reader
+    if (m_readAheadEnd < m_bytesTotal && m_fileOffset + policy.readAhead / 2 >= m_readAheadEnd) {
+        fileIo->advise(m_file, m_readAheadEnd, policy.readAhead, FileIoService::AdviseWillNeed);
+        m_readAheadEnd += policy.readAhead;
+    }
+    
+    // Drop what the socket has already taken
+    if (m_bytesSent - m_cacheOffset >= policy.dropBehind) {
+        fileIo->advise(m_file, m_cacheOffset, m_bytesSent - m_cacheOffset,
+                       FileIoService::AdviseDontNeed);
+        m_cacheOffset = m_bytesSent;
+    }
+}
+
+void FtpConnection::updateUploadCache()
+{
+    // Streams do their own buffering
+    CachePolicy policy = m_server->cachePolicy();
+    if (!m_file || !policy.enabled || m_fileOffset < policy.uploadThreshold) {
+        return;
+    }
+    
+    // Start writeback of each completed window, and wait for and evict
+    // the one before it, which has normally reached disk by now
+    while (m_fileOffset - m_cacheOffset >= policy.writebackInterval) {
+        m_server->fileIo()->writeback(m_file, m_cacheOffset, policy.writebackInterval, false);
+        if (m_cacheOffset >= policy.writebackInterval) {
+            m_server->fileIo()->writeback(m_file, m_cacheOffset - policy.writebackInterval,
+                                          policy.writebackInterval, true);
+        }
+        m_cacheOffset += policy.writebackInterval;
+    }
+}
+
+void FtpConnection::finishUpload()
+{
+    if (!m_dataFinished || m_pendingIo > 0) {
+        return;
+    }
+    
+    if (m_dataSocket && m_dataSocket->bytesAvailable() > 0) {
+        return;
+    }
+    
+    bool failed = m_transferFailed;
+    QSharedPointer<QFile> file = m_file;
+    QSharedPointer<VfsStream> stream = m_stream;
+    QSharedPointer<Vfs> vfs = m_transferVfs;
+    QString tempPath = m_uploadTempPath;
+    QString finalPath = m_transferPath;
+    QuotaManager::Usage replaced = m_uploadReplaced;
+    qint64 size = m_fileOffset;
+    qint64 start = m_transferStart;
+    QString user = m_username;
+    
+    m_file.clear();
+    m_stream.clear();
+    m_uploadTempPath.clear();
+    m_transferDirection = NoTransfer;
+    m_dataFinished = false;
+    
+    if (m_dataSocket) {
+        m_dataSocket->deleteLater();
+        m_dataSocket = nullptr;
+    }
+    
+    if (failed) {
+        // Written in place, what did arrive has replaced the old file; a
+        // stream leaves nothing behind
+        if (stream) {
+            stream->abort();
+        } else if (tempPath.isEmpty()) {
+            m_server->quota()->recordStored(user, finalPath, size, replaced);
+        }
+        discardUpload(tempPath);
+        notifyPathChanged(finalPath);
+        logTransfer(TransferRecord::Store, TransferRecord::Incomplete, finalPath, size, start);
+        if (m_quotaExceeded) {
+            finishTransfer(552, "Quota exceeded");
+        } else {
+            finishTransfer(451, "Local error in processing");
+        }
+        return;
+    }
+    
+    // 226 only once the upload is in place and as durable as configured;
+    // until then the transfer holds back the commands queued behind it
+    quint32 transferId = m_transferId;
+    qint64 commitStart = Tracer::now();
+    auto committed = [this, transferId, finalPath, replaced, size, start, user, commitStart](bool ok) {
+        Tracer::span(m_traceTrack, QStringLiteral("commit"), commitStart);
+        notifyPathChanged(finalPath);
+        if (ok) {
+            m_server->quota()->recordStored(user, finalPath, size, replaced);
+        }
+        logTransfer(TransferRecord::Store, ok ? TransferRecord::Complete : TransferRecord::Failed,
+                    finalPath, size, start);
+        if (transferId != m_transferId) {
+            // Aborted while committing
+            return;
+        }
+        
+        if (ok) {
+            finishTransfer(226, "Transfer complete");
+        } else {
+            finishTransfer(451, "Local error in processing");
+        }
+    };
+    
+    if (stream) {
+        // The stream stays alive until the store has the whole file
+        stream->commit(this, [stream, committed](bool ok) {
+            if (!ok) {
+                stream->abort();
+            }
+            committed(ok);
+        });
+    } else {
+        m_server->uploadCommitter()->commit(vfs, file, tempPath, finalPath, m_uploadDurability,
+                                            this, committed);
+    }
+}
+
+void FtpConnection::discardUpload(const QString &tempPath)
+{
+    if (tempPath.isEmpty()) {
+        return;
+    }
+    
+    QSharedPointer<Vfs> vfs = m_transferVfs;
+    m_server->fsService()->submit<bool>(this, [vfs, tempPath]() {
+        return vfs->remove(tempPath);
+    }, [](bool) {});
+}
+
+void FtpConnection::finishTransfer(int code, const QString &message)
+{
+    captureEvent(CaptureRecord::DataTransfer, QByteArray(), 0,
+                 qint64(m_sessionBytes - m_captureDataMark));
+    sendResponse(code, message);
+    m_transferActive = false;
+    
+    // Run whatever was queued behind the transfer
+    processCommand();
+}
+
+template <typename Result, typename Work, typename Done>
+void FtpConnection::runFsOperation(Work work, Done done)
+{
+    m_commandPending = true;
+    
+    m_server->fsService()->submit<Result>(this, work, [this, done](const Result &result) {
+        m_commandPending = false;
+        done(result);
+        
+        // Pick up any commands that arrived in the meantime
+        processCommand();
+    });
+}
+
+void FtpConnection::statPath(const QString &path,
+                             std::function<void(const StatCache::Info &)> done)
+{
+    StatCache::Info info;
+    if (m_server->statCache()->lookup(path, &info)) {
+        done(info);
+        return;
+    }
+    
+    QSharedPointer<Vfs> vfs = m_server->vfs();
+    runFsOperation<StatCache::Info>([vfs, path]() {
+        Vfs::Entry entry = vfs->stat(path);
+        StatCache::Info info;
+        info.exists = entry.exists;
+        info.isDir = entry.isDir;
+        info.size = entry.size;
+        info.modified = entry.modified;
+        return info;
+    }, [this, path, done](const StatCache::Info &info) {
+        m_server->statCache()->insert(path, info);
+        done(info);
+    });
+}
+
+void FtpConnection::notifyPathChanged(const QString &path)
+{
+    m_server->statCache()->invalidate(path);
+    
+    QString localPath = m_server->vfs()->localPath(path);
+    if (!localPath.isEmpty()) {
+        m_server->manifest()->notifyChanged(localPath);
     }
 }
 
+void FtpConnection::logTransfer(TransferRecord::Operation operation, TransferRecord::Result result,
+                                const QString &path, qint64 bytes, qint64 start,
+                                const QString &target)
+{
+    TransferRecord record;
+    record.operation = operation;
+    record.result = result;
+    record.ascii = m_transferType == ASCII;
+    record.start = start;
+    record.duration = QDateTime::currentMSecsSinceEpoch() - start;
+    record.bytes = bytes;
+    record.user = m_username;
+    record.peer = peerAddress();
+    record.path = path;
+    record.target = target;
+    m_server->transferLog()->append(record);
+}
+
 bool FtpConnection::checkLogin()
 {
     if (!m_isLoggedIn) {
@@ -265,6 +857,9 @@ void FtpConnection::onDataConnected()
         m_dataSocket = m_passiveServer->nextPendingConnection();
         
         if (m_dataSocket) {
+            // Accepted sockets are children of the server, which is about to go
+            m_dataSocket->setParent(this);
+            
             // Connect to socket signals
             connect(m_dataSocket, &QTcpSocket::readyRead, this, &FtpConnection::onDataReadyRead);
             connect(m_dataSocket, &QTcpSocket::disconnected, this, &FtpConnection::onDataDisconnected);
@@ -277,62 +872,176 @@ void FtpConnection::onDataConnected()
         }
     }
     
-    // Signal successful connection
-    sendResponse(150, "Data connection established");
+    if (!m_dataSocket || m_dataSocket->state() != QAbstractSocket::ConnectedState) {
+        return;
+    }
+    
+    // Overlaps the commands around it, so it goes on a lane of its own
+    Tracer::asyncSpan(m_traceTrack, QStringLiteral("data connect"), m_dataConnectStart);
+    m_server->socketPolicy().applyToData(m_dataSocket);
+    protectDataSocket();
+    
+    // Handshake records must go out at once, so an encrypted connection
+    // is corked only once the handshake is done
+    QSslSocket *socket = qobject_cast<QSslSocket*>(m_dataSocket);
+    if (socket && socket->mode() != QSslSocket::UnencryptedMode && !socket->isEncrypted()) {
+        connect(socket, &QSslSocket::encrypted, this, [this, socket]() {
+            if (socket == m_dataSocket) {
+                setDataCorked(true);
+            }
+        });
+    } else {
+        setDataCorked(true);
+    }
+    
+    // The client may connect after the transfer command has been accepted
+    if (m_dataReady) {
+        std::function<void()> ready = m_dataReady;
+        m_dataReady = nullptr;
+        ready();
+    }
+}
+
+void FtpConnection::onDataError()
+{
+    // Only a connection that never came up is handled here; failures
+    // during a transfer end up in onDataDisconnected
+    if (m_dataReady && m_dataSocket && m_dataSocket->state() != QAbstractSocket::ConnectedState) {
+        closeDataConnection();
+        finishTransfer(425, "Can't open data connection");
+    }
 }
 
 void FtpConnection::onDataReadyRead()
 {
-    if (m_dataSocket && m_file) {
-        // Read data from socket and write to file
-        QByteArray data = m_dataSocket->readAll();
-        m_file->write(data);
+    if (!m_dataSocket || m_transferDirection != Upload) {
+        return;
+    }
+    
+    // Hand the data to the I/O service in chunks, leaving the rest in the
+    // socket buffer while too many writes are outstanding
+    while (m_pendingIo < MaxPendingWrites && m_dataSocket->bytesAvailable() > 0) {
+        QByteArray data = m_dataSocket->read(FileIoService::ChunkSize);
+        
+        // Stop as soon as the upload goes over quota, not at the end
+        if (m_uploadAllowance >= 0 && m_fileOffset + data.size() > m_uploadAllowance) {
+            m_quotaExceeded = true;
+            m_transferFailed = true;
+            m_dataSocket->abort();
+            return;
+        }
+        
+        qint64 offset = m_fileOffset;
+        quint32 transferId = m_transferId;
+        
+        m_fileOffset += data.size();
+        m_sessionBytes += data.size();
+        m_server->countBytesReceived(data.size());
+        qint64 issued = m_traceTrack ? Tracer::now() : 0;
+        ++m_pendingIo;
+        
+        auto done = [this, transferId, issued](qint64 result, const QByteArray &) {
+            if (transferId != m_transferId) {
+                return;
+            }
+            --m_pendingIo;
+            Tracer::asyncSpan(m_traceTrack, QStringLiteral("disk write"), issued, QString::number(result));
+            
+            if (result < 0) {
+                m_transferFailed = true;
+            }
+            
+            onDataReadyRead();
+            finishUpload();
+        };
+        
+        if (m_stream) {
+            m_stream->write(offset, data, this, done);
+        } else {
+            m_server->fileIo()->write(m_file, offset, data, this, done);
+        }
+        
+        updateUploadCache();
     }
 }
 
 void FtpConnection::onDataDisconnected()
 {
-    if (m_file) {
-        m_file->close();
-        delete m_file;
-        m_file = nullptr;
-        
-        sendResponse(226, "Transfer complete");
+    if (m_transferDirection == Upload) {
+        // Keep the socket until its buffered data has been written out
+        m_dataFinished = true;
+        onDataReadyRead();
+        finishUpload();
+        return;
+    }
+    
+    bool downloadEnded = m_transferDirection == Download;
+    bool downloadFailed = m_transferFailed || m_bytesSent < m_bytesTotal;
+    if (downloadEnded) {
+        logTransfer(TransferRecord::Retrieve,
+                    downloadFailed ? TransferRecord::Incomplete : TransferRecord::Complete,
+                    m_transferPath, m_bytesSent, m_transferStart);
+        m_file.clear();
+        m_stream.clear();
+        m_cachedContents.clear();
+        m_transferDirection = NoTransfer;
+    }
+    
+    // A listing or manifest still streaming notices on its next write
+    bool listingAborted = m_treeWalker && m_listingSink && m_listingSink == m_dataSocket;
+    if (listingAborted) {
+        m_listingSink = nullptr;
     }
     
     if (m_dataSocket) {
         m_dataSocket->deleteLater();
         m_dataSocket = nullptr;
     }
-}
-
-void FtpConnection::onTimeout()
-{
-    sendResponse(421, "Timeout: closing control connection");
-    emit disconnected();
+    
+    if (listingAborted) {
+        m_treeWalker->resume();
+    }
+    readListingBatch();
+    sendManifestChunk();
+    sendSearchChunk();
+    
+    if (downloadEnded) {
+        if (downloadFailed) {
+            finishTransfer(426, "Connection closed; transfer aborted");
+        } else {
+            finishTransfer(226, "Transfer complete");
+        }
+    }
 }
 
 void FtpConnection::onBytesWritten(qint64 bytes)
 {
     m_bytesSent += bytes;
+    m_sessionBytes += bytes;
+    m_server->countBytesSent(bytes);
     
-    if (m_file && m_dataSocket) {
-        // If we're sending a file, continue sending data
-        if (m_bytesSent < m_bytesTotal) {
-            QByteArray data = m_file->read(qMin(m_bytesTotal - m_bytesSent, qint64(4096)));
-            m_dataSocket->write(data);
-        } else {
-            // File transfer complete
-            m_dataSocket->disconnectFromHost();
-        }
+    resumeListing();
+    sendManifestChunk();
+    sendSearchChunk();
+    
+    if (m_transferDirection == Download) {
+        // Queue the next read once the socket has drained
+        updateDownloadCache();
+        sendNextChunk();
     }
 }
 
 // Command handlers
 void FtpConnection::handleUSER(const QString &param)
 {
+    if (m_server->isTlsRequired() && !isControlEncrypted()) {
+        sendResponse(530, "TLS required, use AUTH TLS");
+        return;
+    }
+    
     m_username = param;
     m_waitingForPassword = true;
+    m_loginStart = Tracer::now();
     sendResponse(331, "User name okay, need password");
 }
 
@@ -344,8 +1053,14 @@ void FtpConnection::handlePASS(const QString &param)
     }
     
     if (m_server->authenticateUser(m_username, param)) {
+        m_username = m_server->internString(m_username);
         m_isLoggedIn = true;
+        if (!m_traceTrack) {
+            m_traceTrack = m_server->tracer()->traceUser(m_username);
+        }
+        Tracer::nameTrack(m_traceTrack, m_username + '@' + peerAddress().toString());
         sendResponse(230, "User logged in, proceed");
+        Tracer::span(m_traceTrack, QStringLiteral("login"), m_loginStart);
     } else {
         m_isLoggedIn = false;
         sendResponse(530, "Login incorrect");
@@ -363,6 +1078,8 @@ void FtpConnection::handleSYST(const QString &param)
 void FtpConnection::handleQUIT(const QString &param)
 {
     Q_UNUSED(param);
+    m_closing = true;
+    m_commandQueue.clear();
     sendResponse(221, "Goodbye");
     emit disconnected();
 }
@@ -394,14 +1111,16 @@ void FtpConnection::handlePORT(const QString &param)
     }
     
     // Extract IP address and port
-    QStringList ipParts = parts.mid(0, 4);
-    QString ipAddress = ipParts.join('.');
+    quint32 address = 0;
+    for (int i = 0; i < 4; ++i) {
+        address = (address << 8) | (parts[i].toUInt() & 0xFF);
+    }
     int portHi = parts[4].toInt();
     int portLo = parts[5].toInt();
     quint16 port = (portHi << 8) + portLo;
     
     // Set up data connection details
-    m_dataHostAddress = QHostAddress(ipAddress);
+    m_dataHostAddress = address;
     m_dataPort = port;
     m_transferMode = Active;
     
@@ -456,91 +1175,316 @@ void FtpConnection::handlePASV(const QString &param)
 }
 
 void FtpConnection::handleLIST(const QString &param)
+{
+    startListing(param, false);
+}
+
+void FtpConnection::handleNLST(const QString &param)
+{
+    startListing(param, true);
+}
+
+void FtpConnection::startListing(const QString &param, bool namesOnly)
 {
     if (!checkLogin()) {
         return;
     }
     
-    // Set up data connection
-    setupDataConnection();
+    if (!openDataChannel("directory listing")) {
+        return;
+    }
     
-    if (!m_dataSocket && !m_passiveServer) {
-        sendResponse(425, "Can't open data connection");
+    // Resolve the path
+    bool recursive = false;
+    QString argument = parseListOptions(param, &recursive);
+    
+    if (recursive && !namesOnly) {
+        QString path = resolvePath(argument);
+        whenDataConnected([this, path]() {
+            startRecursiveListing(path, m_dataSocket);
+        });
         return;
     }
     
-    if (m_transferMode == Active && m_dataSocket) {
-        // Active mode, wait for connection
-        if (!m_dataSocket->waitForConnected(5000)) {
-            sendResponse(425, "Can't open data connection");
+    // "LIST *.csv", "NLST logs/2026-10-*": the pattern is compiled once
+    // and checked on the pool as the directory is read, so entries that
+    // don't match are never stat'ed or formatted
+    QRegularExpression names;
+    QString directory = splitListPattern(argument, &names);
+    QString path = resolvePath(directory);
+    // As in a shell, hidden names only match a pattern asking for them
+    bool includeHidden = !names.pattern().isEmpty() && argument.mid(directory.size()).startsWith('.');
+    
+    // NLST names come back the way the client asked for them
+    m_listingNamesOnly = namesOnly;
+    m_listingPrefix = names.pattern().isEmpty() ? QByteArray() : directory.toUtf8();
+    m_listingPath = path;
+    
+    // Open the directory on the pool while the client connects; entries
+    // are then read and sent a batch at a time, so memory stays the same
+    // however large the directory is
+    quint32 transferId = m_transferId;
+    QSharedPointer<Vfs> vfs = m_server->vfs();
+    runFsOperation<QSharedPointer<Vfs::Listing>>([vfs, path, includeHidden, names]() {
+        return vfs->openListing(path, includeHidden, names);
+    }, [this, transferId](const QSharedPointer<Vfs::Listing> &listing) {
+        if (transferId != m_transferId) {
+            // Aborted in the meantime
+            return;
+        }
+        
+        if (!listing) {
             closeDataConnection();
+            finishTransfer(550, "Directory not found");
             return;
         }
         
-        onDataConnected();
-    } else {
-        // Passive mode, notify client that we're ready
-        sendResponse(150, "Opening data connection for directory listing");
+        whenDataConnected([this, listing]() {
+            m_listing = listing;
+            readListingBatch();
+        });
+    });
+}
+
+QString FtpConnection::splitListPattern(const QString &argument, QRegularExpression *names) const
+{
+    // Only the last segment may hold wildcards; the rest is a directory
+    static const QRegularExpression wildcard("[*?\\[]");
+    int slash = argument.lastIndexOf('/');
+    QString last = argument.mid(slash + 1);
+    if (!last.contains(wildcard)) {
+        return argument;
     }
     
-    // Resolve the path
-    QString path = resolvePath(param);
-    QString fullPath = m_server->rootPath() + path;
+    QRegularExpression pattern(QRegularExpression::wildcardToRegularExpression(last));
+    if (!pattern.isValid()) {
+        // An unterminated "[" and the like: taken literally
+        return argument;
+    }
+    pattern.optimize();
+    *names = pattern;
+    return argument.left(slash + 1);
+}
+
+void FtpConnection::readListingBatch()
+{
+    if (!m_listing || m_listingReading) {
+        return;
+    }
+    
+    if (!m_dataSocket) {
+        m_listing.clear();
+        finishTransfer(426, "Connection closed; transfer aborted");
+        return;
+    }
+    
+    // Entries are stat'ed on the pool, so formatting them needs no
+    // filesystem calls
+    m_listingReading = true;
+    quint32 transferId = m_transferId;
+    QSharedPointer<Vfs::Listing> listing = m_listing;
+    m_server->fsService()->submit<ListingBatch>(this, [listing]() {
+        ListingBatch batch;
+        batch.entries.reserve(ListingBatchSize);
+        batch.more = listing->next(ListingBatchSize, &batch.entries);
+        return batch;
+    }, [this, transferId](const ListingBatch &batch) {
+        m_listingReading = false;
+        if (transferId != m_transferId || !m_listing) {
+            // Aborted in the meantime
+            return;
+        }
+        
+        if (!m_dataSocket) {
+            readListingBatch();
+            return;
+        }
+        
+        // A mirror client's SIZE/MDTM probes for these come next
+        m_server->statCache()->insertListing(m_listingPath, batch.entries);
+        
+        ListFormatter formatter;
+        QByteArray block;
+        block.reserve(batch.entries.size() * 80);
+        for (const Vfs::Entry &entry : batch.entries) {
+            if (m_listingNamesOnly) {
+                block += m_listingPrefix + entry.name.toUtf8() + "\r\n";
+            } else {
+                formatter.append(entry, &block);
+            }
+        }
+        m_dataSocket->write(block);
+        
+        if (!batch.more) {
+            m_listing.clear();
+            setDataCorked(false);
+            m_dataSocket->disconnectFromHost();
+            finishTransfer(226, "Transfer complete");
+            return;
+        }
+        
+        // Otherwise resumed from onBytesWritten once the client catches up
+        if (m_dataSocket->bytesToWrite() < ListingHighWater) {
+            readListingBatch();
+        }
+    });
+}
+
+bool FtpConnection::openDataChannel(const QString &purpose)
+{
+    if (!checkDataProtection()) {
+        return false;
+    }
+    
+    // Set up data connection; in passive mode PASV already did this
+    if (m_transferMode == Active) {
+        setupDataConnection();
+    }
+    
+    if (!m_dataSocket && !m_passiveServer) {
+        sendResponse(425, "Can't open data connection");
+        return false;
+    }
     
-    QDir dir(fullPath);
-    if (!dir.exists()) {
-        sendResponse(550, "Directory not found");
+    // The connection completes in the background; the transfer's final
+    // reply is sent through finishTransfer()
+    m_transferActive = true;
+    m_captureDataMark = m_sessionBytes;
+    sendResponse(150, "Opening data connection for " + purpose);
+    return true;
+}
+
+void FtpConnection::whenDataConnected(std::function<void()> ready)
+{
+    if (m_dataSocket && m_dataSocket->state() == QAbstractSocket::ConnectedState) {
+        ready();
+        return;
+    }
+    
+    if (!m_dataSocket && !m_passiveServer) {
+        // The client connected and hung up before we got to it
         closeDataConnection();
+        finishTransfer(425, "Can't open data connection");
         return;
     }
     
-    // Get directory entries
-    QFileInfoList entries = dir.entryInfoList(QDir::AllEntries | QDir::NoDotAndDotDot);
+    m_dataReady = ready;
     
-    // Wait for data connection if in passive mode
-    if (m_transferMode == Passive && !m_dataSocket) {
-        if (!m_passiveServer->waitForNewConnection(5000)) {
-            sendResponse(425, "Can't open data connection");
+    // Give up if the client never connects
+    QObject *pending = m_dataSocket ? static_cast<QObject *>(m_dataSocket) : m_passiveServer;
+    quint32 transferId = m_transferId;
+    QTimer::singleShot(DataConnectTimeout, pending, [this, transferId]() {
+        if (transferId == m_transferId && m_dataReady) {
             closeDataConnection();
-            return;
+            finishTransfer(425, "Can't open data connection");
+        }
+    });
+}
+
+QString FtpConnection::parseListOptions(const QString &param, bool *recursive) const
+{
+    // Clients commonly send ls-style flags ("-la", "-R") ahead of the path
+    QString path = param;
+    *recursive = false;
+    
+    while (path.startsWith('-')) {
+        int spaceIndex = path.indexOf(' ');
+        QString options = spaceIndex == -1 ? path : path.left(spaceIndex);
+        if (options.contains('R')) {
+            *recursive = true;
         }
+        path = spaceIndex == -1 ? QString() : path.mid(spaceIndex + 1).trimmed();
     }
     
-    // Send directory listing
-    QString listing;
-    for (const QFileInfo &info : entries) {
-        QString permissions = "-rw-r--r--";
-        if (info.isDir()) {
-            permissions[0] = 'd';
+    return path;
+}
+
+void FtpConnection::startRecursiveListing(const QString &path, QTcpSocket *sink)
+{
+    // The listing streams out as directories are read. Over the control
+    // connection no other command runs until it is done; over a data
+    // connection it is a transfer like any other.
+    m_commandPending = sink == m_controlSocket;
+    m_listingSink = sink;
+    m_treeWalker = new TreeWalker(m_server->fsService(), m_server->vfs(), path, this);
+    
+    connect(m_treeWalker, &TreeWalker::directoryReady, this,
+            [this, path](const QString &relativePath, const QVector<Vfs::Entry> &entries) {
+        if (!m_listingSink) {
+            // The data connection went away underneath us
+            m_treeWalker->abort();
+            m_treeWalker->disconnect(this);
+            m_treeWalker->deleteLater();
+            m_treeWalker = nullptr;
+            m_commandPending = false;
+            finishTransfer(426, "Connection closed; transfer aborted");
+            return;
         }
         
-        QString ownerName = "owner";
-        QString groupName = "group";
-        qint64 size = info.size();
+        QString directory = relativePath.isEmpty()
+                            ? path : (path == "/" ? QString() : path) + relativePath.mid(1);
+        m_server->statCache()->insertListing(directory, entries);
+        
+        // Over the control channel each line needs a leading space so it
+        // cannot be mistaken for the final reply line
+        QByteArray indent = m_listingSink == m_controlSocket ? QByteArray(" ") : QByteArray();
         
-        // Format date (as per Unix 'ls' command)
-        QDateTime modTime = info.lastModified();
-        QString dateStr = modTime.toString("MMM dd  yyyy");
-        if (modTime.date().year() == QDate::currentDate().year()) {
-            dateStr = modTime.toString("MMM dd hh:mm");
+        ListFormatter formatter;
+        QByteArray block;
+        block.reserve(entries.size() * 80);
+        if (!relativePath.isEmpty()) {
+            block += indent + "\r\n" + indent + relativePath.toUtf8() + ":\r\n";
+        }
+        for (const Vfs::Entry &entry : entries) {
+            block += indent;
+            formatter.append(entry, &block);
         }
         
-        QString filename = info.fileName();
+        m_listingSink->write(block);
+        if (m_listingSink->bytesToWrite() > ListingHighWater) {
+            m_treeWalker->pause();
+        }
+    });
+    
+    connect(m_treeWalker, &TreeWalker::finished, this, [this](bool ok) {
+        bool toControl = m_listingSink == m_controlSocket;
         
-        // Format the line similar to Unix 'ls -l' output
-        listing += QString("%1 %2 %3 %4 %5 %6 %7\r\n")
-            .arg(permissions)
-            .arg(1, 3)  // Link count
-            .arg(ownerName, 8)
-            .arg(groupName, 8)
-            .arg(size, 8)
-            .arg(dateStr)
-            .arg(filename);
-    }
+        m_treeWalker->deleteLater();
+        m_treeWalker = nullptr;
+        m_listingSink = nullptr;
+        
+        if (toControl) {
+            // The root was checked before the 213- line went out; if it
+            // has gone since, say so inside the reply
+            if (!ok) {
+                m_controlSocket->write(" Directory not found\r\n");
+            }
+            sendResponse(213, "End of status");
+            m_commandPending = false;
+            processCommand();
+        } else {
+            if (m_dataSocket) {
+                setDataCorked(false);
+                m_dataSocket->disconnectFromHost();
+            }
+            if (ok) {
+                finishTransfer(226, "Transfer complete");
+            } else {
+                finishTransfer(550, "Directory not found");
+            }
+        }
+    });
     
-    if (m_dataSocket) {
-        m_dataSocket->write(listing.toUtf8());
-        m_dataSocket->disconnectFromHost();
+    m_treeWalker->start();
+}
+
+void FtpConnection::resumeListing()
+{
+    if (m_treeWalker && m_listingSink && m_listingSink->bytesToWrite() < ListingLowWater) {
+        m_treeWalker->resume();
+    }
+    if (m_listing && m_dataSocket && m_dataSocket->bytesToWrite() < ListingLowWater) {
+        readListingBatch();
     }
 }
 
@@ -551,16 +1495,19 @@ void FtpConnection::handleCWD(const QString &param)
     }
     
     QString newPath = resolvePath(param);
-    QString fullPath = m_server->rootPath() + newPath;
-    
-    QDir dir(fullPath);
-    if (!dir.exists()) {
-        sendResponse(550, "Directory not found");
-        return;
-    }
+    QSharedPointer<Vfs> vfs = m_server->vfs();
     
-    m_currentPath = newPath;
-    sendResponse(250, "Directory changed to " + newPath);
+    runFsOperation<bool>([vfs, newPath]() {
+        return vfs->stat(newPath).isDir;
+    }, [this, newPath](bool exists) {
+        if (!exists) {
+            sendResponse(550, "Directory not found");
+            return;
+        }
+        
+        m_currentPath = m_server->internString(newPath);
+        sendResponse(250, "Directory changed to " + newPath);
+    });
 }
 
 void FtpConnection::handlePWD(const QString &param)
@@ -586,14 +1533,18 @@ void FtpConnection::handleMKD(const QString &param)
     }
     
     QString newPath = resolvePath(param);
-    QString fullPath = m_server->rootPath() + newPath;
-    
-    QDir dir;
-    if (dir.mkdir(fullPath)) {
-        sendResponse(257, "\"" + newPath + "\" created");
-    } else {
-        sendResponse(550, "Failed to create directory");
-    }
+    QSharedPointer<Vfs> vfs = m_server->vfs();
+    
+    runFsOperation<bool>([vfs, newPath]() {
+        return vfs->mkdir(newPath);
+    }, [this, newPath](bool created) {
+        notifyPathChanged(newPath);
+        if (created) {
+            sendResponse(257, "\"" + newPath + "\" created");
+        } else {
+            sendResponse(550, "Failed to create directory");
+        }
+    });
 }
 
 void FtpConnection::handleRMD(const QString &param)
@@ -608,14 +1559,24 @@ void FtpConnection::handleRMD(const QString &param)
     }
     
     QString path = resolvePath(param);
-    QString fullPath = m_server->rootPath() + path;
-    
-    QDir dir;
-    if (dir.rmdir(fullPath)) {
-        sendResponse(250, "Directory removed");
-    } else {
-        sendResponse(550, "Failed to remove directory");
-    }
+    QSharedPointer<Vfs> vfs = m_server->vfs();
+    
+    runFsOperation<bool>([vfs, path]() {
+        return vfs->rmdir(path);
+    }, [this, path](bool removed) {
+        // Whatever was cached inside it went with it
+        m_server->statCache()->invalidateTree(path);
+        notifyPathChanged(path);
+        if (removed) {
+            QuotaManager::Usage usage;
+            usage.exists = true;
+            usage.isDir = true;
+            m_server->quota()->recordRemoved(path, usage);
+            sendResponse(250, "Directory removed");
+        } else {
+            sendResponse(550, "Failed to remove directory");
+        }
+    });
 }
 
 void FtpConnection::handleDELE(const QString &param)
@@ -630,14 +1591,25 @@ void FtpConnection::handleDELE(const QString &param)
     }
     
     QString path = resolvePath(param);
-    QString fullPath = m_server->rootPath() + path;
-    
-    QFile file(fullPath);
-    if (file.remove()) {
-        sendResponse(250, "File deleted");
-    } else {
-        sendResponse(550, "Failed to delete file");
-    }
+    QSharedPointer<Vfs> vfs = m_server->vfs();
+    qint64 start = QDateTime::currentMSecsSinceEpoch();
+    
+    // Measured first so the quota knows what was freed, and whose it was
+    runFsOperation<QPair<bool, QuotaManager::Usage>>([vfs, path]() {
+        QuotaManager::Usage usage = QuotaManager::measure(vfs.data(), path, false);
+        return qMakePair(vfs->remove(path), usage);
+    }, [this, path, start](const QPair<bool, QuotaManager::Usage> &result) {
+        notifyPathChanged(path);
+        logTransfer(TransferRecord::Delete,
+                    result.first ? TransferRecord::Complete : TransferRecord::Failed,
+                    path, result.second.bytes, start);
+        if (result.first) {
+            m_server->quota()->recordRemoved(path, result.second);
+            sendResponse(250, "File deleted");
+        } else {
+            sendResponse(550, "Failed to delete file");
+        }
+    });
 }
 
 void FtpConnection::handleRNFR(const QString &param)
@@ -651,15 +1623,21 @@ void FtpConnection::handleRNFR(const QString &param)
         return;
     }
     
-    m_renameFrom = resolvePath(param);
-    QString fullPath = m_server->rootPath() + m_renameFrom;
+    QString path = resolvePath(param);
+    QSharedPointer<Vfs> vfs = m_server->vfs();
+    m_renameFrom.clear();
     
-    if (QFile::exists(fullPath)) {
-        sendResponse(350, "Ready for RNTO");
-    } else {
-        sendResponse(550, "File not found");
-        m_renameFrom.clear();
-    }
+    runFsOperation<Vfs::Entry>([vfs, path]() {
+        return vfs->stat(path);
+    }, [this, path](const Vfs::Entry &entry) {
+        if (entry.exists) {
+            m_renameFrom = path;
+            m_renameFromDir = entry.isDir;
+            sendResponse(350, "Ready for RNTO");
+        } else {
+            sendResponse(550, "File not found");
+        }
+    });
 }
 
 void FtpConnection::handleRNTO(const QString &param)
@@ -679,17 +1657,44 @@ void FtpConnection::handleRNTO(const QString &param)
         return;
     }
     
+    QString oldPath = m_renameFrom;
+    bool isDir = m_renameFromDir;
     QString newPath = resolvePath(param);
-    QString oldFullPath = m_server->rootPath() + m_renameFrom;
-    QString newFullPath = m_server->rootPath() + newPath;
-    
-    if (QFile::rename(oldFullPath, newFullPath)) {
-        sendResponse(250, "File renamed");
-    } else {
-        sendResponse(550, "Failed to rename file");
-    }
+    QSharedPointer<Vfs> vfs = m_server->vfs();
     
     m_renameFrom.clear();
+    
+    // Only a move between directory quotas needs the size of what moved,
+    // which for a directory means walking it
+    bool measure = m_server->quota()->affectsDirectoryQuotas(oldPath, newPath);
+    qint64 start = QDateTime::currentMSecsSinceEpoch();
+    
+    runFsOperation<QPair<bool, QuotaManager::Usage>>([vfs, oldPath, newPath, measure]() {
+        QuotaManager::Usage usage;
+        if (measure) {
+            usage = QuotaManager::measure(vfs.data(), oldPath, true);
+        }
+        return qMakePair(vfs->rename(oldPath, newPath, false), usage);
+    }, [this, oldPath, newPath, isDir, start](const QPair<bool, QuotaManager::Usage> &result) {
+        // A directory's cached children moved with it; a file only needs
+        // its own entries dropped, which notifyPathChanged() does
+        if (isDir) {
+            m_server->statCache()->invalidateTree(oldPath);
+            m_server->statCache()->invalidateTree(newPath);
+        }
+        notifyPathChanged(oldPath);
+        notifyPathChanged(newPath);
+        // Bytes are only known when a quota needed them
+        logTransfer(TransferRecord::Rename,
+                    result.first ? TransferRecord::Complete : TransferRecord::Failed,
+                    oldPath, result.second.bytes, start, newPath);
+        if (result.first) {
+            m_server->quota()->recordMoved(oldPath, newPath, result.second);
+            sendResponse(250, "File renamed");
+        } else {
+            sendResponse(550, "Failed to rename file");
+        }
+    });
 }
 
 void FtpConnection::handleSTOR(const QString &param)
@@ -703,39 +1708,102 @@ void FtpConnection::handleSTOR(const QString &param)
         return;
     }
     
-    // Set up data connection
-    setupDataConnection();
-    
-    if (!m_dataSocket && !m_passiveServer) {
-        sendResponse(425, "Can't open data connection");
-        return;
-    }
-    
     // Resolve path
     QString path = resolvePath(param);
-    QString fullPath = m_server->rootPath() + path;
+    QSharedPointer<Vfs> vfs = m_server->vfs();
     
-    // Create file
-    m_file = new QFile(fullPath);
-    if (!m_file->open(QIODevice::WriteOnly)) {
-        sendResponse(550, "Failed to open file");
-        closeDataConnection();
+    // Whatever the upload replaces is credited back to its owner's quota
+    runFsOperation<QuotaManager::Usage>([vfs, path]() {
+        return QuotaManager::measure(vfs.data(), path, false);
+    }, [this, path](const QuotaManager::Usage &replaced) {
+        startUpload(path, replaced);
+    });
+}
+
+void FtpConnection::startUpload(const QString &path, const QuotaManager::Usage &replaced)
+{
+    // Checked against the in-memory counters, without touching the disk
+    qint64 allowance = m_server->quota()->remaining(m_username, path);
+    if (allowance >= 0 && replaced.exists && !replaced.isDir) {
+        allowance += replaced.bytes;
+    }
+    if (allowance == 0) {
+        sendResponse(552, "Quota exceeded");
         return;
     }
     
-    if (m_transferMode == Active && m_dataSocket) {
-        // Active mode, wait for connection
-        if (!m_dataSocket->waitForConnected(5000)) {
-            sendResponse(425, "Can't open data connection");
-            closeDataConnection();
+    // Atomic uploads are written to a hidden file next to the target, so
+    // readers see either the old file or the complete new one. Streamed
+    // uploads only appear once committed, so they are atomic anyway.
+    UploadPolicy policy = m_server->uploadPolicy();
+    QSharedPointer<Vfs> vfs = m_server->vfs();
+    bool atomic = policy.atomic && !vfs->usesStreams();
+    QString writePath = path;
+    QIODevice::OpenMode mode = QIODevice::WriteOnly;
+    if (atomic) {
+        int slash = path.lastIndexOf('/');
+        writePath = QString("%1/.%2.%3.part")
+                    .arg(path.left(slash), path.mid(slash + 1))
+                    .arg(QRandomGenerator::global()->generate(), 0, 36);
+        mode |= QIODevice::NewOnly;
+    } else {
+        notifyPathChanged(path);
+    }
+    
+    // Create the file on the pool; the QFile comes back to this thread,
+    // where the transfer uses it
+    QString username = m_username;
+    QThread *thread = this->thread();
+    runFsOperation<OpenedFile>([vfs, writePath, mode, username, thread]() {
+        OpenedFile opened;
+        if (vfs->usesStreams()) {
+            opened.stream = vfs->openStream(writePath, mode, username);
+        } else {
+            opened.file = vfs->open(writePath, mode);
+            if (opened.file) {
+                vfs->setOwner(writePath, username);
+                opened.file->moveToThread(thread);
+            }
+        }
+        return opened;
+    }, [this, path, vfs, writePath, atomic, policy, replaced, allowance](const OpenedFile &opened) {
+        if (!opened.file && !opened.stream) {
+            sendResponse(550, "Failed to open file");
             return;
         }
         
-        onDataConnected();
-    } else {
-        // Passive mode, notify client that we're ready
-        sendResponse(150, "Opening data connection for file upload");
-    }
+        if (!openDataChannel("file upload")) {
+            if (atomic) {
+                // Nothing was written to it yet
+                runFsOperation<bool>([vfs, writePath]() {
+                    return vfs->remove(writePath);
+                }, [](bool) {});
+            }
+            return;
+        }
+        
+        m_file = opened.file;
+        m_stream = opened.stream;
+        m_transferPath = path;
+        m_transferVfs = vfs;
+        m_uploadTempPath = atomic ? writePath : QString();
+        m_uploadDurability = policy.durability;
+        m_uploadReplaced = replaced;
+        m_uploadAllowance = allowance;
+        m_quotaExceeded = false;
+        m_transferDirection = Upload;
+        m_transferStart = QDateTime::currentMSecsSinceEpoch();
+        m_fileOffset = 0;
+        m_pendingIo = 0;
+        ++m_transferId;
+        m_dataFinished = false;
+        m_transferFailed = false;
+        m_cacheOffset = 0;
+        
+        whenDataConnected([this]() {
+            startTransfer();
+        });
+    });
 }
 
 void FtpConnection::handleRETR(const QString &param)
@@ -751,54 +1819,594 @@ void FtpConnection::handleRETR(const QString &param)
     
     // Resolve path
     QString path = resolvePath(param);
-    QString fullPath = m_server->rootPath() + path;
+    QSharedPointer<Vfs> vfs = m_server->vfs();
+    
+    // Opening can wait on the disk, or ask a store for the size, so it
+    // goes to the pool
+    QThread *thread = this->thread();
+    runFsOperation<OpenedFile>([vfs, path, thread]() {
+        OpenedFile opened;
+        if (vfs->usesStreams()) {
+            opened.stream = vfs->openStream(path, QIODevice::ReadOnly, QString());
+        } else {
+            opened.file = vfs->open(path, QIODevice::ReadOnly);
+            if (opened.file) {
+                opened.file->moveToThread(thread);
+            }
+        }
+        return opened;
+    }, [this, path, vfs](const OpenedFile &opened) {
+        if (!opened.file && !opened.stream) {
+            sendResponse(550, "Failed to open file");
+            return;
+        }
+        startDownload(path, vfs, opened.file, opened.stream);
+    });
+}
+
+void FtpConnection::startDownload(const QString &path, const QSharedPointer<Vfs> &vfs,
+                                  const QSharedPointer<QFile> &file,
+                                  const QSharedPointer<VfsStream> &stream)
+{
+    if (!openDataChannel("file download")) {
+        return;
+    }
+    
+    m_file = file;
+    m_stream = stream;
+    m_transferPath = path;
+    m_transferVfs = vfs;
+    m_transferDirection = Download;
+    m_transferStart = QDateTime::currentMSecsSinceEpoch();
+    m_bytesTotal = file ? file->size() : stream->size();
+    m_bytesSent = 0;
+    m_fileOffset = 0;
+    m_pendingIo = 0;
+    m_transferFailed = false;
+    ++m_transferId;
+    
+    // Stream large files through the cache instead of letting them
+    // displace everything else. Streams have no page cache to manage.
+    CachePolicy policy = m_server->cachePolicy();
+    m_streamingCache = file && policy.enabled && m_bytesTotal >= policy.downloadThreshold;
+    m_readAheadEnd = 0;
+    m_cacheOffset = 0;
+    if (m_streamingCache) {
+        m_server->fileIo()->advise(m_file, 0, 0, FileIoService::AdviseSequential);
+    }
+    
+    // Small popular files are served from the shared in-memory cache,
+    // keyed on size and mtime so a modified file is re-read
+    HotFileCache *hotFiles = m_server->hotFileCache();
+    m_cachedContents.clear();
+    struct stat st;
+    if (file && !m_streamingCache && hotFiles->isCacheable(m_bytesTotal)
+            && fstat(m_file->handle(), &st) == 0) {
+        qint64 mtime = qint64(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+        m_cachedContents = hotFiles->lookup(path, m_bytesTotal, mtime);
+        
+        if (m_cachedContents.isNull()) {
+            quint32 transferId = m_transferId;
+            ++m_pendingIo;
+            hotFiles->load(m_file, path, m_bytesTotal, mtime, this,
+                           [this, transferId](const QByteArray &contents) {
+                if (transferId != m_transferId) {
+                    return;
+                }
+                --m_pendingIo;
+                
+                // A failed load leaves this null and we read the file instead
+                m_cachedContents = contents;
+                sendNextChunk();
+            });
+        }
+    }
     
-    // Open file
-    m_file = new QFile(fullPath);
-    if (!m_file->open(QIODevice::ReadOnly)) {
-        sendResponse(550, "Failed to open file");
-        delete m_file;
-        m_file = nullptr;
+    whenDataConnected([this]() {
+        startTransfer();
+    });
+}
+
+void FtpConnection::handleNOOP(const QString &param)
+{
+    Q_UNUSED(param);
+    sendResponse(200, "NOOP command successful");
+}
+
+void FtpConnection::handleABOR(const QString &param)
+{
+    Q_UNUSED(param);
+    
+    if (!m_transferActive) {
+        sendResponse(226, "No transfer to abort");
         return;
     }
     
-    // Set up data connection
-    setupDataConnection();
+    // Stop whatever is feeding the data connection
+    if (m_treeWalker) {
+        m_treeWalker->abort();
+        m_treeWalker->disconnect(this);
+        m_treeWalker->deleteLater();
+        m_treeWalker = nullptr;
+        m_listingSink = nullptr;
+    }
+    m_listing.clear();
+    m_manifestReader.clear();
+    m_search.clear();
     
-    if (!m_dataSocket && !m_passiveServer) {
-        sendResponse(425, "Can't open data connection");
-        closeDataConnection();
+    if (m_transferDirection == Upload && m_uploadTempPath.isEmpty()) {
+        notifyPathChanged(m_transferPath);
+    }
+    
+    // Drop anything still queued for the client rather than draining it
+    if (m_dataSocket) {
+        m_dataSocket->abort();
+    }
+    closeDataConnection();
+    
+    sendResponse(426, "Connection closed; transfer aborted");
+    finishTransfer(226, "Abort successful");
+}
+
+void FtpConnection::handleFEAT(const QString &param)
+{
+    Q_UNUSED(param);
+    
+    QString features = "211-Features:\r\n"
+                       " SIZE\r\n"
+                       " MDTM\r\n"
+                       " MFMT\r\n";
+    if (m_server->isTlsAvailable()) {
+        features += " AUTH TLS\r\n"
+                    " PBSZ\r\n"
+                    " PROT\r\n";
+    }
+    features += "211 End\r\n";
+    m_controlSocket->write(features.toUtf8());
+    m_controlSocket->flush();
+    captureEvent(CaptureRecord::Reply, QByteArray(), 211);
+    
+    emit logMessage("Sent: FEAT response");
+}
+
+void FtpConnection::handleSIZE(const QString &param)
+{
+    if (!checkLogin()) {
         return;
     }
     
-    m_bytesTotal = m_file->size();
-    m_bytesSent = 0;
+    if (param.isEmpty()) {
+        sendResponse(501, "Missing file name");
+        return;
+    }
     
-    if (m_transferMode == Active && m_dataSocket) {
-        // Active mode, wait for connection
-        if (!m_dataSocket->waitForConnected(5000)) {
-            sendResponse(425, "Can't open data connection");
-            closeDataConnection();
+    statPath(resolvePath(param), [this](const StatCache::Info &info) {
+        if (!info.exists || info.isDir) {
+            sendResponse(550, "File not found");
             return;
         }
         
-        onDataConnected();
+        sendResponse(213, QString::number(info.size));
+    });
+}
+
+void FtpConnection::handleMDTM(const QString &param)
+{
+    if (!checkLogin()) {
+        return;
+    }
+    
+    if (param.isEmpty()) {
+        sendResponse(501, "Missing file name");
+        return;
+    }
+    
+    statPath(resolvePath(param), [this](const StatCache::Info &info) {
+        if (!info.exists || info.isDir) {
+            sendResponse(550, "File not found");
+            return;
+        }
         
-        // Start sending data
-        QByteArray data = m_file->read(qMin(m_bytesTotal, qint64(4096)));
-        if (!data.isEmpty()) {
-            m_dataSocket->write(data);
+        sendResponse(213, info.modified.toUTC().toString("yyyyMMddhhmmss"));
+    });
+}
+
+void FtpConnection::handleMFMT(const QString &param)
+{
+    if (!checkLogin()) {
+        return;
+    }
+    
+    // MFMT YYYYMMDDHHMMSS path
+    int spaceIndex = param.indexOf(' ');
+    if (spaceIndex == -1) {
+        sendResponse(501, "Syntax: MFMT YYYYMMDDHHMMSS path");
+        return;
+    }
+    
+    QString timeString = param.left(spaceIndex);
+    QString name = param.mid(spaceIndex + 1);
+    // Parsed as UTC from the start; read as local time first, a time in a
+    // DST gap would come out invalid
+    QDate date = QDate::fromString(timeString.left(8), "yyyyMMdd");
+    QTime time = QTime::fromString(timeString.mid(8, 6), "hhmmss");
+    QDateTime modified(date, time, Qt::UTC);
+    
+    if (!time.isValid() || !modified.isValid() || name.isEmpty()) {
+        sendResponse(501, "Invalid time or file name");
+        return;
+    }
+    
+    QString path = resolvePath(name);
+    QSharedPointer<Vfs> vfs = m_server->vfs();
+    
+    runFsOperation<bool>([vfs, path, modified]() {
+        return vfs->setModified(path, modified);
+    }, [this, path, timeString, name](bool changed) {
+        notifyPathChanged(path);
+        if (changed) {
+            sendResponse(213, "Modify=" + timeString.left(14) + "; " + name);
         } else {
-            m_dataSocket->disconnectFromHost();
+            sendResponse(550, "Failed to set modification time");
         }
+    });
+}
+
+void FtpConnection::handleSTAT(const QString &param)
+{
+    if (param.isEmpty()) {
+        QString status = QString("FTP server status: %1, current directory %2")
+                         .arg(m_isLoggedIn ? "logged in as " + m_username : QString("not logged in"))
+                         .arg(m_currentPath);
+        
+        // Answered while a transfer is running, so report its progress
+        if (m_transferDirection == Download) {
+            status += QString(", sending %1 (%2 of %3 bytes)")
+                      .arg(m_transferPath)
+                      .arg(m_bytesSent).arg(m_bytesTotal);
+        } else if (m_transferDirection == Upload) {
+            status += QString(", receiving %1 (%2 bytes)")
+                      .arg(m_transferPath)
+                      .arg(m_fileOffset);
+        } else if (m_transferActive) {
+            status += ", data transfer in progress";
+        }
+        
+        sendResponse(211, status);
+        return;
+    }
+    
+    if (!checkLogin()) {
+        return;
+    }
+    
+    // STAT [-R] path lists over the control connection, saving the
+    // client a data connection per directory
+    bool recursive = false;
+    QString path = resolvePath(parseListOptions(param, &recursive));
+    
+    // The 213- line only goes out once the path is known to be there; a
+    // reply opened with 213 can't end in 550
+    if (recursive) {
+        statPath(path, [this, path](const StatCache::Info &info) {
+            if (!info.exists || !info.isDir) {
+                sendResponse(550, "Directory not found");
+                return;
+            }
+            m_controlSocket->write(QString("213-Status of %1:\r\n").arg(path).toUtf8());
+            startRecursiveListing(path, m_controlSocket);
+        });
+        return;
+    }
+    
+    QSharedPointer<Vfs> vfs = m_server->vfs();
+    runFsOperation<DirectoryListing>([vfs, path]() {
+        DirectoryListing listing;
+        listing.exists = vfs->list(path, false, &listing.entries);
+        return listing;
+    }, [this, path](const DirectoryListing &listing) {
+        if (!listing.exists) {
+            sendResponse(550, "Directory not found");
+            return;
+        }
+        
+        m_server->statCache()->insertListing(path, listing.entries);
+        
+        m_controlSocket->write(QString("213-Status of %1:\r\n").arg(path).toUtf8());
+        ListFormatter formatter;
+        QByteArray block;
+        block.reserve(listing.entries.size() * 80);
+        for (const Vfs::Entry &entry : listing.entries) {
+            block += ' ';
+            formatter.append(entry, &block);
+        }
+        m_controlSocket->write(block);
+        sendResponse(213, "End of status");
+    });
+}
+
+void FtpConnection::handleSITE(const QString &param)
+{
+    if (!checkLogin()) {
+        return;
+    }
+    
+    int spaceIndex = param.indexOf(' ');
+    QString command = (spaceIndex == -1 ? param : param.left(spaceIndex)).toUpper();
+    QString args = spaceIndex == -1 ? QString() : param.mid(spaceIndex + 1).trimmed();
+    
+    if (command == "MANIFEST") {
+        handleSiteManifest(args);
+    } else if (command == "FIND") {
+        handleSiteFind(args);
+    } else if (command == "QUOTA") {
+        QString reply = "211-Quota usage:\r\n";
+        for (const QString &line : m_server->quota()->report(m_username)) {
+            reply += ' ' + line + "\r\n";
+        }
+        m_controlSocket->write(reply.toUtf8());
+        sendResponse(211, "End");
     } else {
-        // Passive mode, notify client that we're ready
-        sendResponse(150, "Opening data connection for file download");
+        sendResponse(504, "SITE command not implemented");
     }
 }
 
-void FtpConnection::handleNOOP(const QString &param)
+void FtpConnection::handleSiteManifest(const QString &args)
+{
+    // SITE MANIFEST [path] [since-token]; a lone argument that looks like
+    // a token is taken as one
+    static const QRegularExpression tokenPattern("^[0-9a-z]+:[0-9]+$");
+    
+    QStringList parts = args.split(' ', Qt::SkipEmptyParts);
+    QString pathArg;
+    QString token;
+    if (parts.size() >= 2) {
+        token = parts.takeLast();
+        pathArg = parts.join(' ');
+    } else if (parts.size() == 1) {
+        if (tokenPattern.match(parts.first()).hasMatch()) {
+            token = parts.first();
+        } else {
+            pathArg = parts.first();
+        }
+    }
+    
+    // The manifest indexes and watches the tree on the local disk
+    if (m_server->vfs()->localPath(QString()).isEmpty()) {
+        sendResponse(504, "SITE MANIFEST is not available for this storage");
+        return;
+    }
+    
+    if (!openDataChannel("manifest")) {
+        return;
+    }
+    
+    QString prefix = resolvePath(pathArg).mid(1);
+    
+    // The first request builds the manifest; later ones are served from memory
+    quint32 transferId = m_transferId;
+    m_server->manifest()->whenReady(this, [this, prefix, token, transferId]() {
+        if (transferId != m_transferId) {
+            // Aborted in the meantime
+            return;
+        }
+        
+        whenDataConnected([this, prefix, token]() {
+            m_manifestReader = m_server->manifest()->read(prefix, token);
+            sendManifestChunk();
+        });
+    });
+}
+
+void FtpConnection::sendManifestChunk()
+{
+    if (!m_manifestReader) {
+        return;
+    }
+    
+    if (!m_dataSocket) {
+        m_manifestReader.clear();
+        finishTransfer(426, "Connection closed; transfer aborted");
+        return;
+    }
+    
+    while (!m_manifestReader->atEnd() && m_dataSocket->bytesToWrite() < ListingHighWater) {
+        m_dataSocket->write(m_manifestReader->next(int(ListingLowWater)));
+    }
+    
+    if (m_manifestReader->atEnd()) {
+        m_manifestReader.clear();
+        setDataCorked(false);
+        m_dataSocket->disconnectFromHost();
+        finishTransfer(226, "Transfer complete");
+    }
+}
+
+void FtpConnection::handleSiteFind(const QString &args)
 {
+    // SITE FIND <pattern>: every file and directory whose name matches,
+    // as full paths, one per line
+    if (args.isEmpty() || args.contains('/')) {
+        sendResponse(501, "Usage: SITE FIND <name pattern>");
+        return;
+    }
+    
+    // Answered from the manifest's index of the tree on the local disk
+    if (m_server->vfs()->localPath(QString()).isEmpty()) {
+        sendResponse(504, "SITE FIND is not available for this storage");
+        return;
+    }
+    
+    if (!openDataChannel("search results")) {
+        return;
+    }
+    
+    quint32 transferId = m_transferId;
+    m_server->manifest()->whenReady(this, [this, args, transferId]() {
+        if (transferId != m_transferId) {
+            // Aborted in the meantime
+            return;
+        }
+        
+        whenDataConnected([this, args]() {
+            m_search = m_server->manifest()->find(args);
+            sendSearchChunk();
+        });
+    });
+}
+
+void FtpConnection::sendSearchChunk()
+{
+    if (!m_search) {
+        return;
+    }
+    
+    if (!m_dataSocket) {
+        m_search.clear();
+        finishTransfer(426, "Connection closed; transfer aborted");
+        return;
+    }
+    
+    while (!m_search->atEnd() && m_dataSocket->bytesToWrite() < ListingHighWater) {
+        QByteArray matches = m_search->next(int(ListingLowWater));
+        if (matches.isEmpty()) {
+            // A batch without matches writes nothing to wake us up, so
+            // come back once other events have had their turn
+            QTimer::singleShot(0, this, &FtpConnection::sendSearchChunk);
+            return;
+        }
+        m_dataSocket->write(matches);
+    }
+    
+    if (m_search->atEnd()) {
+        m_search.clear();
+        setDataCorked(false);
+        m_dataSocket->disconnectFromHost();
+        finishTransfer(226, "Transfer complete");
+    }
+}
+
+void FtpConnection::handleAUTH(const QString &param)
+{
+    QString mechanism = param.trimmed().toUpper();
+    if (mechanism != "TLS" && mechanism != "TLS-C" && mechanism != "SSL") {
+        sendResponse(504, "Unsupported security mechanism");
+        return;
+    }
+    
+    QSslSocket *socket = qobject_cast<QSslSocket*>(m_controlSocket);
+    if (!socket || !m_server->isTlsAvailable()) {
+        sendResponse(431, "TLS is not available");
+        return;
+    }
+    
+    if (socket->isEncrypted()) {
+        sendResponse(503, "Control connection already encrypted");
+        return;
+    }
+    
+    sendResponse(234, "Proceed with TLS negotiation");
+    
+    // Anything the client pipelined after AUTH was sent in the clear
+    // and must not be run as if it came over the encrypted channel
+    m_commandQueue.clear();
+    socket->readAll();
+    
+    // RFC 4217: the session starts over once the channel is secured
+    m_isLoggedIn = false;
+    m_waitingForPassword = false;
+    m_username.clear();
+    m_protectData = false;
+    
+    connect(socket, QOverload<const QList<QSslError> &>::of(&QSslSocket::sslErrors),
+            this, [this](const QList<QSslError> &errors) {
+        for (const QSslError &error : errors) {
+            emit logMessage("TLS error: " + error.errorString());
+        }
+    });
+    
+    socket->setSslConfiguration(m_server->tlsConfiguration());
+    socket->startServerEncryption();
+}
+
+void FtpConnection::handlePBSZ(const QString &param)
+{
+    if (!isControlEncrypted()) {
+        sendResponse(503, "PBSZ requires AUTH first");
+        return;
+    }
+    
+    // TLS does its own framing, so the only valid buffer size is 0
     Q_UNUSED(param);
-    sendResponse(200, "NOOP command successful");
+    sendResponse(200, "PBSZ=0");
+}
+
+void FtpConnection::handlePROT(const QString &param)
+{
+    QString level = param.trimmed().toUpper();
+    
+    if (level == "C") {
+        if (m_server->isTlsRequired()) {
+            sendResponse(534, "Data connections must be protected");
+            return;
+        }
+        m_protectData = false;
+        sendResponse(200, "Protection level set to Clear");
+    } else if (level == "P") {
+        if (!isControlEncrypted()) {
+            sendResponse(503, "PROT P requires AUTH first");
+            return;
+        }
+        m_protectData = true;
+        sendResponse(200, "Protection level set to Private");
+    } else if (level == "S" || level == "E") {
+        sendResponse(536, "Protection level not supported");
+    } else {
+        sendResponse(504, "Unknown protection level");
+    }
+}
+
+bool FtpConnection::isControlEncrypted() const
+{
+    QSslSocket *socket = qobject_cast<QSslSocket*>(m_controlSocket);
+    return socket && socket->isEncrypted();
+}
+
+bool FtpConnection::checkDataProtection()
+{
+    if (m_server->isTlsRequired() && !m_protectData) {
+        sendResponse(521, "Data connections must be protected, use PROT P");
+        return false;
+    }
+    return true;
+}
+
+void FtpConnection::protectDataSocket()
+{
+    QSslSocket *socket = qobject_cast<QSslSocket*>(m_dataSocket);
+    if (!m_protectData || !socket || socket->isEncrypted()) {
+        return;
+    }
+    
+    socket->setSslConfiguration(m_server->tlsConfiguration());
+    
+#ifdef FTP_TLS_SHARED_CONTEXT
+    // Use the control connection's OpenSSL context, so the client can
+    // resume that session instead of doing a full handshake per transfer
+    QSslSocket *control = qobject_cast<QSslSocket*>(m_controlSocket);
+    if (control && control->isEncrypted()) {
+        QSslSocketPrivate::checkSettingSslContext(socket, QSslSocketPrivate::sslContext(control));
+    }
+#endif
+    
+    // Writes made before the handshake finishes are buffered and sent
+    // encrypted, so the transfer can start right away
+    socket->startServerEncryption();
+}
+
+void FtpConnection::setDataCorked(bool corked)
+{
+    if (m_dataSocket) {
+        m_server->socketPolicy().setCorked(m_dataSocket, corked);
+    }
 }
@@ -5,23 +5,42 @@
 #include <QTcpSocket>
 #include <QTimer>
 #include <QFile>
+#include <QSharedPointer>
+#include <QPointer>
+#include <QQueue>
 #include <QTcpServer>
 #include <QHostAddress>
+#include <functional>
+#include "statcache.h"
+#include "treemanifest.h"
+#include "uploadpolicy.h"
+#include "quotamanager.h"
+#include "transferrecord.h"
+#include "sessioninfo.h"
+#include "capturerecord.h"
+#include "vfs.h"
 
 class FtpServer;
+class TreeWalker;
 
 class FtpConnection : public QObject
 {
     Q_OBJECT
 public:
-    explicit FtpConnection(QTcpSocket *socket, FtpServer *server);
+    explicit FtpConnection(QTcpSocket *socket, FtpServer *server, quint64 id);
     ~FtpConnection();
 
     void close();
     
+    // Server is shutting down: say goodbye once no transfer is running
+    void drain();
+    
     QHostAddress peerAddress() const;
     quint16 peerPort() const;
     
+    // What the dashboard shows of this session
+    SessionInfo info() const;
+    
 signals:
     void disconnected();
     void logMessage(const QString &message);
@@ -29,10 +48,11 @@ signals:
 private slots:
     void processCommand();
     void onDataConnected();
+    void onDataError();
     void onDataReadyRead();
     void onDataDisconnected();
-    void onTimeout();
     void onBytesWritten(qint64 bytes);
+    void resumeListing();
 
 private:
     // Command handlers
@@ -44,6 +64,7 @@ private:
     void handlePORT(const QString &param);
     void handlePASV(const QString &param);
     void handleLIST(const QString &param);
+    void handleNLST(const QString &param);
     void handleCWD(const QString &param);
     void handlePWD(const QString &param);
     void handleMKD(const QString &param);
@@ -54,25 +75,160 @@ private:
     void handleSTOR(const QString &param);
     void handleRETR(const QString &param);
     void handleNOOP(const QString &param);
+    void handleABOR(const QString &param);
+    void handleFEAT(const QString &param);
+    void handleSIZE(const QString &param);
+    void handleMDTM(const QString &param);
+    void handleMFMT(const QString &param);
+    void handleSTAT(const QString &param);
+    void handleSITE(const QString &param);
+    void handleSiteManifest(const QString &args);
+    void handleSiteFind(const QString &args);
+    void handleAUTH(const QString &param);
+    void handlePBSZ(const QString &param);
+    void handlePROT(const QString &param);
+    
+    // Result of reading a directory on the filesystem pool
+    struct DirectoryListing
+    {
+        bool exists;
+        QVector<Vfs::Entry> entries;
+    };
+    
+    // File or stream opened on the filesystem pool; neither if it failed
+    struct OpenedFile
+    {
+        QSharedPointer<QFile> file;
+        QSharedPointer<VfsStream> stream;
+    };
+    
+    // Next part of a directory being listed
+    struct ListingBatch
+    {
+        bool more;
+        QVector<Vfs::Entry> entries;
+    };
+    
+    // One pipelined command waiting its turn
+    struct Command
+    {
+        QString verb;
+        QString parameter;
+    };
+    
+    bool readCommands();
+    void finishDrainIfIdle();
+    void executeCommand(const QString &command, const QString &parameter);
+    bool canOverlapTransfer(const Command &command) const;
+    
+    void startListing(const QString &param, bool namesOnly);
+    void readListingBatch();
+    bool openDataChannel(const QString &purpose);
+    void whenDataConnected(std::function<void()> ready);
+    void finishTransfer(int code, const QString &message);
+    void sendManifestChunk();
+    void sendSearchChunk();
+    QString parseListOptions(const QString &param, bool *recursive) const;
+    // Splits a wildcard off the last segment of a listing argument into
+    // names; returns the directory part, or the whole argument if none
+    QString splitListPattern(const QString &argument, QRegularExpression *names) const;
+    void startRecursiveListing(const QString &path, QTcpSocket *sink);
+    
+    // FTPS: PROT P data connections are encrypted as soon as they connect
+    bool isControlEncrypted() const;
+    bool checkDataProtection();
+    void protectDataSocket();
+    // TCP_CORK on the data connection for the length of a transfer, if
+    // the socket policy asks for it; cleared at EOF so the tail goes out
+    void setDataCorked(bool corked);
+    
+    // Longest command line accepted; the control socket never buffers more
+    static const int MaxCommandLength = 4096;
     
     // Helper methods
     void sendResponse(int code, const QString &message);
     void setupDataConnection();
     void closeDataConnection();
+    void startTransfer();
+    void sendNextChunk();
+    void startDownload(const QString &path, const QSharedPointer<Vfs> &vfs,
+                       const QSharedPointer<QFile> &file, const QSharedPointer<VfsStream> &stream);
+    void startUpload(const QString &path, const QuotaManager::Usage &replaced);
+    void finishUpload();
+    void discardUpload(const QString &tempPath);
+    void updateDownloadCache();
+    void updateUploadCache();
     bool checkLogin();
     QString resolvePath(const QString &path) const;
     
+    // Runs a filesystem call on the server's pool; no further commands
+    // are processed until done has run
+    template <typename Result, typename Work, typename Done>
+    void runFsOperation(Work work, Done done);
+    
+    // Metadata for a path, from the stat cache when possible
+    void statPath(const QString &path, std::function<void(const StatCache::Info &)> done);
+    
+    // Tells the caches and the manifest about a path this session changed
+    void notifyPathChanged(const QString &path);
+    
+    // Records the end of the session in the trace and the capture
+    void recordSessionEnd();
+    
+    // Adds an event to the session capture, if this session is captured
+    void captureEvent(CaptureRecord::Kind kind, const QByteArray &line = QByteArray(),
+                      int code = 0, qint64 bytes = 0);
+    
+    // Queues an audit record; start is in milliseconds since the epoch
+    void logTransfer(TransferRecord::Operation operation, TransferRecord::Result result,
+                     const QString &path, qint64 bytes, qint64 start,
+                     const QString &target = QString());
+    
     // Member variables
     QTcpSocket *m_controlSocket;
     QTcpSocket *m_dataSocket;
     QTcpServer *m_passiveServer;
     FtpServer *m_server;
-    QTimer *m_timer;
+    quint64 m_id;
+    // Data-connection bytes in both directions, for the dashboard
+    quint64 m_sessionBytes;
     
     // File transfer variables
-    QFile *m_file;
+    static const int MaxPendingWrites = 16;
+    enum TransferDirection { NoTransfer, Download, Upload };
+    
+    QSharedPointer<QFile> m_file;
+    // Used instead of m_file on storage without descriptors
+    QSharedPointer<VfsStream> m_stream;
+    TransferDirection m_transferDirection;
+    quint32 m_transferId;
     qint64 m_bytesTotal;
     qint64 m_bytesSent;
+    qint64 m_fileOffset;
+    int m_pendingIo;
+    bool m_dataFinished;
+    bool m_transferFailed;
+    qint64 m_transferStart;
+    
+    // File being transferred; for an upload, where it ends up. Uploads
+    // are written to a hidden file until then (empty when written in
+    // place). Transfers stay on the storage they started on.
+    QString m_transferPath;
+    QSharedPointer<Vfs> m_transferVfs;
+    QString m_uploadTempPath;
+    UploadPolicy::Durability m_uploadDurability;
+    
+    // Quota accounting for the upload: the file it replaces, and how many
+    // bytes it may write (-1 when no quota applies)
+    QuotaManager::Usage m_uploadReplaced;
+    qint64 m_uploadAllowance;
+    bool m_quotaExceeded;
+    
+    // Page-cache policy state for the current transfer
+    bool m_streamingCache;
+    qint64 m_readAheadEnd;
+    qint64 m_cacheOffset;
+    QByteArray m_cachedContents;
     
     // State variables
     enum TransferMode { Passive, Active };
@@ -83,12 +239,66 @@ private:
     QString m_username;
     QString m_currentPath;
     QString m_renameFrom;
+    bool m_renameFromDir;
     bool m_isLoggedIn;
     bool m_waitingForPassword;
+    bool m_commandPending;
+    bool m_protectData;
+    bool m_draining;
+    // QUIT answered; nothing the client sent after it is run
+    bool m_closing;
+    static const int MaxQueuedCommands = 64;
+    QQueue<Command> m_commandQueue;
+    
+    // Between a transfer's 150 and its final reply. The data connection
+    // may still be coming up; m_dataReady runs once it has.
+    static const int DataConnectTimeout = 5000;
+    static const int DataLingerTimeout = 30000;
+    bool m_transferActive;
+    std::function<void()> m_dataReady;
     
-    // For active mode
-    QHostAddress m_dataHostAddress;
+    // Recursive listing in progress, and where it is being written
+    static const qint64 ListingHighWater = 256 * 1024;
+    static const qint64 ListingLowWater = 64 * 1024;
+    TreeWalker *m_treeWalker;
+    QPointer<QTcpSocket> m_listingSink;
+    
+    // Plain listing being streamed, a batch at a time; at most one batch
+    // is read ahead of the data connection
+    static const int ListingBatchSize = 1024;
+    QSharedPointer<Vfs::Listing> m_listing;
+    bool m_listingReading;
+    // NLST: bare names, behind the directory the client gave with its
+    // pattern
+    bool m_listingNamesOnly;
+    QByteArray m_listingPrefix;
+    QString m_listingPath;
+    
+    // SITE MANIFEST being streamed over the data connection
+    QSharedPointer<TreeManifest::Reader> m_manifestReader;
+    
+    // SITE FIND matches being streamed over the data connection
+    QSharedPointer<PathIndex::Search> m_search;
+    
+    // For active mode; PORT only carries IPv4, and a bare address avoids
+    // a QHostAddress allocation per session
+    quint32 m_dataHostAddress;
     quint16 m_dataPort;
+    
+    // Span tracing; the track is 0 while the session isn't traced. Start
+    // times are kept regardless, as a session may start being traced at
+    // login.
+    quint64 m_traceTrack;
+    qint64 m_sessionStart;
+    qint64 m_loginStart;
+    qint64 m_dataConnectStart;
+    qint64 m_commandStart;
+    QString m_tracedCommand;
+    
+    // Session capture for replay; 0 while the session isn't captured.
+    // The mark is the byte count when the data connection was opened.
+    quint64 m_captureSession;
+    quint64 m_captureDataMark;
 };
 
 #endif // FTPCONNECTION_H
@@ -1,24 +1,91 @@
 #include "ftpserver.h"
 #include "ftpconnection.h"
+#include "fileioservice.h"
+#include "fsservice.h"
+#include "hotfilecache.h"
+#include "statcache.h"
+#include "treemanifest.h"
+#include "uploadcommitter.h"
+#include "quotamanager.h"
+#include "transferlog.h"
+#include "tracer.h"
+#include "stallwatchdog.h"
+#include "sessioncapture.h"
+#include "ssltcpserver.h"
+#include "listenerhandoff.h"
+#include "localvfs.h"
 #include <QDir>
 #include <QDebug>
+#include <QFile>
+#include <QSslCertificate>
+#include <QSslKey>
+#include <QTimer>
+#include <QStandardPaths>
+#include <QCryptographicHash>
+#include <unistd.h>
+#include <algorithm>
 
 FtpServer::FtpServer(QObject *parent) : QObject(parent),
-    m_server(new QTcpServer(this)),
+    m_server(new SslTcpServer(this)),
+    m_fsService(new FsService(this)),
+    m_fileIo(new FileIoService(m_fsService, this)),
+    m_hotFileCache(new HotFileCache(m_fileIo, this)),
+    m_statCache(new StatCache(this)),
+    m_manifest(new TreeManifest(m_fsService, this)),
+    m_uploadCommitter(new UploadCommitter(m_fsService, this)),
+    m_quota(new QuotaManager(m_fsService, this)),
+    m_transferLog(new TransferLog(m_fsService, this)),
+    m_tracer(new Tracer(m_fsService, this)),
+    m_stallWatchdog(new StallWatchdog(this)),
+    m_sessionCapture(new SessionCapture(m_fsService, this)),
+    m_tlsRequired(false),
+    m_handoff(new ListenerHandoff(this)),
+    m_drainTimer(new QTimer(this)),
+    m_draining(false),
     m_port(21),
-    m_isRunning(false)
+    m_isRunning(false),
+    m_connectionCount(0),
+    m_commandCount(0),
+    m_bytesReceived(0),
+    m_bytesSent(0)
 {
     // Initialize with default root path
-    m_rootPath = QDir::homePath() + "/ftp";
+    setRootPath(QDir::homePath() + "/ftp");
     
-    // Create directory if it doesn't exist
-    QDir dir(m_rootPath);
-    if (!dir.exists()) {
-        dir.mkpath(".");
-    }
+    // Transfer logs go next to the quota journals
+    QString dataDir = QStandardPaths::writableLocation(QStandardPaths::AppDataLocation);
+    QDir().mkpath(dataDir);
+    m_transferLog->setPaths(dataDir + "/xferlog.bin", dataDir + "/xferlog");
+    
+    // Every session runs on this thread's event loop, so a blocking call
+    // anywhere in it holds all of them up
+    m_stallWatchdog->watch(thread(), "main");
+    connect(m_stallWatchdog, &StallWatchdog::stalled, this,
+            [this](const QString &thread, qint64 durationMs, const QString &activity,
+                   const QStringList &stack) {
+        QString message = QString("Event loop of %1 stalled for %2 ms, last command: %3")
+                          .arg(thread).arg(durationMs).arg(activity.isEmpty() ? "none" : activity);
+        if (!stack.isEmpty()) {
+            message += "\n    " + stack.mid(0, 8).join("\n    ");
+        }
+        emit logMessage(message);
+    });
     
     // Connect signal for incoming connections
     connect(m_server, &QTcpServer::newConnection, this, &FtpServer::onNewConnection);
+    
+    // A successor has our listener; finish up and get out of its way
+    connect(m_handoff, &ListenerHandoff::handedOff, this, [this]() {
+        emit logMessage("Listener handed off to new server process");
+        emit handedOff();
+        drain();
+    });
+    
+    m_drainTimer->setSingleShot(true);
+    connect(m_drainTimer, &QTimer::timeout, this, [this]() {
+        emit logMessage(QString("Drain deadline reached, closing %1 sessions").arg(m_connections.size()));
+        stop();
+    });
 }
 
 FtpServer::~FtpServer()
@@ -40,27 +107,159 @@ bool FtpServer::start(int port)
         return false;
     }
     
+    onListening();
+    return true;
+}
+
+bool FtpServer::takeOverListener(const std::function<void(const QString &rootPath)> &configure)
+{
+    if (m_isRunning || m_handoffPath.isEmpty()) {
+        return false;
+    }
+    
+    QString rootPath;
+    qintptr fd = ListenerHandoff::adopt(m_handoffPath, 5000, &rootPath);
+    if (fd < 0) {
+        return false;
+    }
+    
+    // Set up like a cold start, before the first client is accepted
+    configure(rootPath);
+    
+    if (!m_server->setSocketDescriptor(fd)) {
+        emit logMessage("Failed to take over listener: " + m_server->errorString());
+        ::close(int(fd));
+        return false;
+    }
+    
+    m_port = m_server->serverPort();
+    emit logMessage("Took over listener from previous server process");
+    onListening();
+    return true;
+}
+
+void FtpServer::onListening()
+{
+    // Only pay for QSslSocket when AUTH TLS can actually be used
+    m_server->setTlsEnabled(isTlsAvailable());
+    
     m_isRunning = true;
+    m_fileIo->resetCacheStats();
+    m_uploadCommitter->resetStats();
+    m_stallWatchdog->resetStats();
+    m_stallWatchdog->start();
     emit logMessage(QString("FTP Server started on port %1").arg(m_port));
+    emit logMessage("File I/O backend: " + m_fileIo->backendName());
     
-    return true;
+    // Scan and index the tree in the background, so the first SITE FIND
+    // or MANIFEST doesn't have to wait for it
+    if (!m_vfs->localPath(QString()).isEmpty()) {
+        m_manifest->whenReady(this, []() {});
+    }
+    
+    if (!m_handoffPath.isEmpty()) {
+        m_handoff->offer(m_handoffPath, m_server->socketDescriptor(), m_vfs->localPath(QString()));
+    }
+}
+
+void FtpServer::setHandoffPath(const QString &path)
+{
+    m_handoffPath = path;
+    if (m_isRunning && !m_draining) {
+        m_handoff->offer(m_handoffPath, m_server->socketDescriptor(), m_vfs->localPath(QString()));
+    }
+}
+
+void FtpServer::drain(int timeoutMs)
+{
+    if (!m_isRunning || m_draining) {
+        return;
+    }
+    
+    // After a handoff this only closes our copy of the listener
+    m_draining = true;
+    m_handoff->withdraw();
+    m_server->close();
+    
+    emit logMessage(QString("Draining %1 sessions").arg(m_connections.size()));
+    
+    // Idle sessions leave now, busy ones as their transfers complete
+    const QSet<FtpConnection*> connections = m_connections;
+    for (FtpConnection *connection : connections) {
+        connection->drain();
+    }
+    
+    m_drainTimer->start(timeoutMs);
+    checkDrained();
+}
+
+bool FtpServer::isDraining() const
+{
+    return m_draining;
+}
+
+void FtpServer::checkDrained()
+{
+    if (m_draining && m_connections.isEmpty()) {
+        stop();
+    }
 }
 
 void FtpServer::stop()
 {
     if (m_isRunning) {
+        // Cleared first so sessions closing below don't re-enter via checkDrained()
+        m_isRunning = false;
+        m_handoff->withdraw();
+        m_drainTimer->stop();
         m_server->close();
         
-        // Clean up all active connections
-        for (FtpConnection *connection : m_connections) {
+        // Clean up all active connections; closing one removes it from the set
+        const QSet<FtpConnection*> connections = m_connections;
+        for (FtpConnection *connection : connections) {
             connection->close();
             connection->deleteLater();
         }
         
         m_connections.clear();
-        m_isRunning = false;
+        m_tracer->flushNow();
+        m_sessionCapture->flushNow();
+        m_stallWatchdog->stop();
         
+        FileIoService::CacheStats stats = m_fileIo->cacheStats();
+        emit logMessage(QString("Page cache hit ratio for transfers: %1% (%2 of %3 sampled pages)")
+                        .arg(stats.hitRatio() * 100.0, 0, 'f', 1)
+                        .arg(stats.residentPages)
+                        .arg(stats.residentPages + stats.missedPages));
+        HotFileCache::Stats cacheStats = m_hotFileCache->stats();
+        emit logMessage(QString("Hot file cache: %1 hits, %2 misses, %3 files in %4 KiB")
+                        .arg(cacheStats.hits)
+                        .arg(cacheStats.misses)
+                        .arg(cacheStats.entries)
+                        .arg(cacheStats.usedBytes / 1024));
+        UploadCommitter::Stats commitStats = m_uploadCommitter->stats();
+        emit logMessage(QString("Upload commits: %1 files in %2 batches, %3 flushes")
+                        .arg(commitStats.files)
+                        .arg(commitStats.batches)
+                        .arg(commitStats.syncCalls));
+        StallWatchdog::Stats stallStats = m_stallWatchdog->stats();
+        QStringList buckets;
+        for (int i = 0; i < StallWatchdog::BucketCount; ++i) {
+            QString bound = i < StallWatchdog::BucketCount - 1
+                ? QString("<%1ms").arg(StallWatchdog::BucketLimits[i])
+                : QString(">=%1ms").arg(StallWatchdog::BucketLimits[i - 1]);
+            buckets << QString("%1: %2").arg(bound).arg(stallStats.histogram[i]);
+        }
+        emit logMessage(QString("Event loop stalls: %1, longest %2 ms (%3)")
+                        .arg(stallStats.stalls)
+                        .arg(stallStats.longest)
+                        .arg(buckets.join(", ")));
         emit logMessage("FTP Server stopped");
+        
+        if (m_draining) {
+            m_draining = false;
+            emit drained();
+        }
     }
 }
 
@@ -80,6 +279,7 @@ void FtpServer::setRootPath(const QString &path)
     }
     
     emit logMessage("Root path set to: " + m_rootPath);
+    setVfs(QSharedPointer<Vfs>(new LocalVfs(m_rootPath)));
 }
 
 QString FtpServer::rootPath() const
@@ -87,6 +287,195 @@ QString FtpServer::rootPath() const
     return m_rootPath;
 }
 
+void FtpServer::setVfs(const QSharedPointer<Vfs> &vfs)
+{
+    m_vfs = vfs;
+    
+    m_statCache->clear();
+    m_hotFileCache->clear();
+    m_internedStrings.clear();
+    
+    // The manifest watches the real tree, and the quota journal is only
+    // worth keeping for storage that outlives the process
+    QString localRoot = m_vfs->localPath(QString());
+    m_manifest->setRootPath(localRoot);
+    m_quota->setStorage(m_vfs, localRoot.isEmpty() ? QString() : quotaJournalPath(localRoot));
+    
+    emit logMessage("Serving files from " + m_vfs->description());
+}
+
+QSharedPointer<Vfs> FtpServer::vfs() const
+{
+    return m_vfs;
+}
+
+FileIoService *FtpServer::fileIo() const
+{
+    return m_fileIo;
+}
+
+FsService *FtpServer::fsService() const
+{
+    return m_fsService;
+}
+
+HotFileCache *FtpServer::hotFileCache() const
+{
+    return m_hotFileCache;
+}
+
+StatCache *FtpServer::statCache() const
+{
+    return m_statCache;
+}
+
+TreeManifest *FtpServer::manifest() const
+{
+    return m_manifest;
+}
+
+void FtpServer::setCachePolicy(const CachePolicy &policy)
+{
+    m_cachePolicy = policy;
+}
+
+CachePolicy FtpServer::cachePolicy() const
+{
+    return m_cachePolicy;
+}
+
+UploadCommitter *FtpServer::uploadCommitter() const
+{
+    return m_uploadCommitter;
+}
+
+QuotaManager *FtpServer::quota() const
+{
+    return m_quota;
+}
+
+TransferLog *FtpServer::transferLog() const
+{
+    return m_transferLog;
+}
+
+Tracer *FtpServer::tracer() const
+{
+    return m_tracer;
+}
+
+StallWatchdog *FtpServer::stallWatchdog() const
+{
+    return m_stallWatchdog;
+}
+
+SessionCapture *FtpServer::sessionCapture() const
+{
+    return m_sessionCapture;
+}
+
+QString FtpServer::quotaJournalPath(const QString &rootPath)
+{
+    // Kept outside the served tree, one journal per root
+    QString directory = QStandardPaths::writableLocation(QStandardPaths::AppDataLocation);
+    QDir().mkpath(directory);
+    QByteArray hash = QCryptographicHash::hash(QDir(rootPath).absolutePath().toUtf8(),
+                                               QCryptographicHash::Sha1).toHex().left(16);
+    return directory + "/quota-" + QString::fromLatin1(hash) + ".journal";
+}
+
+void FtpServer::setUploadPolicy(const UploadPolicy &policy)
+{
+    m_uploadPolicy = policy;
+}
+
+UploadPolicy FtpServer::uploadPolicy() const
+{
+    return m_uploadPolicy;
+}
+
+void FtpServer::setSocketPolicy(const SocketPolicy &policy)
+{
+    m_socketPolicy = policy;
+}
+
+const SocketPolicy &FtpServer::socketPolicy() const
+{
+    return m_socketPolicy;
+}
+
+bool FtpServer::setTlsCertificate(const QString &certificatePath, const QString &keyPath)
+{
+    QFile certificateFile(certificatePath);
+    QFile keyFile(keyPath);
+    if (!certificateFile.open(QIODevice::ReadOnly) || !keyFile.open(QIODevice::ReadOnly)) {
+        emit logMessage("Failed to open TLS certificate or key");
+        return false;
+    }
+    
+    QList<QSslCertificate> chain = QSslCertificate::fromDevice(&certificateFile, QSsl::Pem);
+    QSslKey key(&keyFile, QSsl::Rsa, QSsl::Pem);
+    if (key.isNull()) {
+        keyFile.seek(0);
+        key = QSslKey(&keyFile, QSsl::Ec, QSsl::Pem);
+    }
+    
+    if (chain.isEmpty() || key.isNull()) {
+        emit logMessage("Invalid TLS certificate or key");
+        return false;
+    }
+    
+    QSslConfiguration configuration = QSslConfiguration::defaultConfiguration();
+    configuration.setLocalCertificate(chain.takeFirst());
+    configuration.setLocalCertificateChain(QList<QSslCertificate>() << configuration.localCertificate() << chain);
+    configuration.setPrivateKey(key);
+    configuration.setPeerVerifyMode(QSslSocket::VerifyNone);
+    configuration.setProtocol(QSsl::TlsV1_2OrLater);
+    // Let data connections resume the control connection's session
+    configuration.setSslOption(QSsl::SslOptionDisableSessionTickets, false);
+    configuration.setSslOption(QSsl::SslOptionDisableSessionSharing, false);
+    
+    m_tlsConfiguration = configuration;
+    m_server->setTlsEnabled(true);
+    emit logMessage("TLS enabled with certificate for " +
+                    configuration.localCertificate().subjectInfo(QSslCertificate::CommonName).join(", "));
+    return true;
+}
+
+bool FtpServer::isTlsAvailable() const
+{
+    return !m_tlsConfiguration.localCertificate().isNull();
+}
+
+QSslConfiguration FtpServer::tlsConfiguration() const
+{
+    return m_tlsConfiguration;
+}
+
+void FtpServer::setTlsRequired(bool required)
+{
+    m_tlsRequired = required;
+}
+
+bool FtpServer::isTlsRequired() const
+{
+    return m_tlsRequired;
+}
+
+QString FtpServer::internString(const QString &value)
+{
+    QSet<QString>::const_iterator it = m_internedStrings.constFind(value);
+    if (it != m_internedStrings.constEnd()) {
+        return *it;
+    }
+    
+    // Past the cap new values are just not shared
+    if (m_internedStrings.size() < MaxInternedStrings) {
+        m_internedStrings.insert(value);
+    }
+    return value;
+}
+
 bool FtpServer::authenticateUser(const QString &username, const QString &password)
 {
     // This is a very basic implementation for demo purposes
@@ -112,8 +501,9 @@ void FtpServer::onNewConnection()
             }
 
             // Create and store connection
-            FtpConnection *connection = new FtpConnection(socket, this);
-            m_connections.append(connection);
+            quint64 id = m_connectionCount.fetchAndAddRelaxed(1) + 1;
+            FtpConnection *connection = new FtpConnection(socket, this, id);
+            m_connections.insert(connection);
 
             // Connect signals with lambda to ensure proper cleanup
             connect(connection, &FtpConnection::disconnected, this, [this, connection]() {
@@ -121,14 +511,15 @@ void FtpServer::onNewConnection()
                                         QString::number(connection->peerPort());
 
                 qDebug() << "Client disconnected:" << clientAddress;
-                m_connections.removeOne(connection);
+                m_connections.remove(connection);
                 connection->deleteLater();
 
+                // Sessions are shown on the dashboard rather than logged
                 emit clientDisconnected(clientAddress);
-                emit logMessage("Client disconnected: " + clientAddress);
+                checkDrained();
             });
 
-            emit logMessage("New connection from: " + socket->peerAddress().toString());
+            emit newConnection(socket->peerAddress().toString());
         }
     }
 }
@@ -140,10 +531,51 @@ void FtpServer::onClientDisconnected()
         QString clientAddress = connection->peerAddress().toString() + ":" + 
                                QString::number(connection->peerPort());
         
-        m_connections.removeOne(connection);
+        m_connections.remove(connection);
         connection->deleteLater();
         
         emit clientDisconnected(clientAddress);
-        emit logMessage("Client disconnected: " + clientAddress);
+        checkDrained();
+    }
+}
+
+FtpServer::Counters FtpServer::counters() const
+{
+    Counters counters;
+    counters.connections = m_connectionCount.loadRelaxed();
+    counters.commands = m_commandCount.loadRelaxed();
+    counters.bytesReceived = m_bytesReceived.loadRelaxed();
+    counters.bytesSent = m_bytesSent.loadRelaxed();
+    FileIoService::CacheStats cache = m_fileIo->cacheStats();
+    counters.cacheResidentPages = cache.residentPages;
+    counters.cacheMissedPages = cache.missedPages;
+    return counters;
+}
+
+void FtpServer::countCommand()
+{
+    m_commandCount.fetchAndAddRelaxed(1);
+}
+
+void FtpServer::countBytesReceived(qint64 bytes)
+{
+    m_bytesReceived.fetchAndAddRelaxed(quint64(bytes));
+}
+
+void FtpServer::countBytesSent(qint64 bytes)
+{
+    m_bytesSent.fetchAndAddRelaxed(quint64(bytes));
+}
+
+QVector<SessionInfo> FtpServer::sessions() const
+{
+    QVector<SessionInfo> sessions;
+    sessions.reserve(m_connections.size());
+    for (FtpConnection *connection : m_connections) {
+        sessions.append(connection->info());
     }
+    std::sort(sessions.begin(), sessions.end(), [](const SessionInfo &a, const SessionInfo &b) {
+        return a.id < b.id;
+    });
+    return sessions;
 }
@@ -3,10 +3,34 @@
 
 #include <QObject>
 #include <QTcpServer>
-#include <QList>
+#include <QSet>
 #include <QDir>
+#include <QSslConfiguration>
+#include <QSharedPointer>
+#include <QAtomicInteger>
+#include <QVector>
+#include <functional>
+#include "cachepolicy.h"
+#include "uploadpolicy.h"
+#include "socketpolicy.h"
+#include "sessioninfo.h"
+#include "vfs.h"
 
 class FtpConnection;
+class FileIoService;
+class FsService;
+class HotFileCache;
+class StatCache;
+class TreeManifest;
+class UploadCommitter;
+class TransferLog;
+class Tracer;
+class StallWatchdog;
+class SessionCapture;
+class QuotaManager;
+class SslTcpServer;
+class ListenerHandoff;
+class QTimer;
 
 class FtpServer : public QObject
 {
@@ -19,9 +43,109 @@ public:
     void stop();
     bool isRunning() const;
     
+    // Stops accepting, lets running transfers finish for up to timeoutMs
+    // and sends 421 to everyone else; emits drained() once all are gone
+    void drain(int timeoutMs = DrainTimeout);
+    bool isDraining() const;
+    
+    // Unix socket over which a restarted server takes over our listener.
+    // takeOverListener() starts serving on the listener of a server
+    // already running there; that server then drains. configure is
+    // given the root that server serves (empty if not a local directory)
+    // and runs before any client is accepted.
+    void setHandoffPath(const QString &path);
+    bool takeOverListener(const std::function<void(const QString &rootPath)> &configure);
+    
+    static const int DrainTimeout = 60000;
+    
+    // Serves path on the local disk
     void setRootPath(const QString &path);
     QString rootPath() const;
     
+    // Storage every session's file operations go through. Work on the
+    // filesystem pool holds its own reference, so this can be swapped
+    // while operations are in flight.
+    void setVfs(const QSharedPointer<Vfs> &vfs);
+    QSharedPointer<Vfs> vfs() const;
+    
+    // Shared file I/O service used by all transfers
+    FileIoService *fileIo() const;
+    
+    // Thread pool for blocking filesystem metadata calls
+    FsService *fsService() const;
+    
+    // In-memory cache of small, frequently downloaded files
+    HotFileCache *hotFileCache() const;
+    
+    // Short-lived metadata cache behind SIZE and MDTM
+    StatCache *statCache() const;
+    
+    // Incrementally maintained manifest of the whole tree
+    TreeManifest *manifest() const;
+    
+    // Page-cache policy applied to large transfers
+    void setCachePolicy(const CachePolicy &policy);
+    CachePolicy cachePolicy() const;
+    
+    // Flushes and renames finished uploads, batching the flushes
+    UploadCommitter *uploadCommitter() const;
+    
+    // Per-user and per-directory storage quotas
+    QuotaManager *quota() const;
+    
+    // Audit record of every RETR, STOR, DELE and RNTO
+    TransferLog *transferLog() const;
+    
+    // Span tracing of sampled sessions, off until given an output path
+    Tracer *tracer() const;
+    
+    // Reports event-loop stalls while the server runs
+    StallWatchdog *stallWatchdog() const;
+    
+    // Records sessions for tools/ftpreplay, off until given a path
+    SessionCapture *sessionCapture() const;
+    
+    // Atomic replace and durability for uploads
+    void setUploadPolicy(const UploadPolicy &policy);
+    UploadPolicy uploadPolicy() const;
+    
+    // TCP options for new control and data connections
+    void setSocketPolicy(const SocketPolicy &policy);
+    const SocketPolicy &socketPolicy() const;
+    
+    // FTPS (AUTH TLS). Returns false if the certificate or key can't be loaded.
+    bool setTlsCertificate(const QString &certificatePath, const QString &keyPath);
+    bool isTlsAvailable() const;
+    QSslConfiguration tlsConfiguration() const;
+    
+    // Refuse logins and data transfers that are not encrypted
+    void setTlsRequired(bool required);
+    bool isTlsRequired() const;
+    
+    // Shared copy of a string many sessions hold (usernames, working
+    // directories), so idle sessions don't each keep their own
+    QString internString(const QString &value);
+    
+    // Running totals. Sessions add to them as they go; readers such as
+    // the dashboard sample them at their own pace.
+    struct Counters
+    {
+        quint64 connections;
+        quint64 commands;
+        quint64 bytesReceived;
+        quint64 bytesSent;
+        // Sampled pages of transfer reads found in the page cache, and not
+        quint64 cacheResidentPages;
+        quint64 cacheMissedPages;
+    };
+    Counters counters() const;
+    void countCommand();
+    void countBytesReceived(qint64 bytes);
+    void countBytesSent(qint64 bytes);
+    
+    // Snapshot of every session, in id order
+    QVector<SessionInfo> sessions() const;
+    
     // Authenticate user - very basic implementation for demo
     bool authenticateUser(const QString &username, const QString &password);
 
@@ -29,17 +153,51 @@ signals:
     void newConnection(const QString &clientAddress);
     void clientDisconnected(const QString &clientAddress);
     void logMessage(const QString &message);
+    void handedOff();
+    void drained();
 
 private slots:
     void onNewConnection();
     void onClientDisconnected();
 
 private:
-    QTcpServer *m_server;
-    QList<FtpConnection*> m_connections;
+    static const int MaxInternedStrings = 10000;
+    
+    void onListening();
+    static QString quotaJournalPath(const QString &rootPath);
+    void checkDrained();
+    
+    SslTcpServer *m_server;
+    QSet<FtpConnection*> m_connections;
+    QSet<QString> m_internedStrings;
     QString m_rootPath;
+    QSharedPointer<Vfs> m_vfs;
+    FsService *m_fsService;
+    FileIoService *m_fileIo;
+    HotFileCache *m_hotFileCache;
+    StatCache *m_statCache;
+    TreeManifest *m_manifest;
+    UploadCommitter *m_uploadCommitter;
+    QuotaManager *m_quota;
+    TransferLog *m_transferLog;
+    Tracer *m_tracer;
+    StallWatchdog *m_stallWatchdog;
+    SessionCapture *m_sessionCapture;
+    CachePolicy m_cachePolicy;
+    UploadPolicy m_uploadPolicy;
+    SocketPolicy m_socketPolicy;
+    QSslConfiguration m_tlsConfiguration;
+    bool m_tlsRequired;
+    ListenerHandoff *m_handoff;
+    QString m_handoffPath;
+    QTimer *m_drainTimer;
+    bool m_draining;
     int m_port;
     bool m_isRunning;
+    QAtomicInteger<quint64> m_connectionCount;
+    QAtomicInteger<quint64> m_commandCount;
+    QAtomicInteger<quint64> m_bytesReceived;
+    QAtomicInteger<quint64> m_bytesSent;
 };
 
 #endif // FTPSERVER_H
@@ -0,0 +1,138 @@
+#include "hotfilecache.h"
+#include "fileioservice.h"
+
+HotFileCache::HotFileCache(FileIoService *fileIo, QObject *parent) : QObject(parent),
+    m_fileIo(fileIo),
+    m_capacity(64 * 1024 * 1024),
+    m_maxFileSize(1024 * 1024),
+    m_usedBytes(0),
+    m_hits(0),
+    m_misses(0)
+{
+}
+
+void HotFileCache::setCapacity(qint64 bytes)
+{
+    m_capacity = qMax(qint64(0), bytes);
+    evict(0);
+}
+
+qint64 HotFileCache::capacity() const
+{
+    return m_capacity;
+}
+
+void HotFileCache::setMaxFileSize(qint64 bytes)
+{
+    m_maxFileSize = bytes;
+}
+
+qint64 HotFileCache::maxFileSize() const
+{
+    return m_maxFileSize;
+}
+
+bool HotFileCache::isCacheable(qint64 size) const
+{
+    return size > 0 && size <= m_maxFileSize && size <= m_capacity;
+}
+
+QByteArray HotFileCache::lookup(const QString &path, qint64 size, qint64 mtime)
+{
+    auto it = m_entries.find(path);
+    if (it == m_entries.end() || it->size != size || it->mtime != mtime) {
+        ++m_misses;
+        return QByteArray();
+    }
+
+    // Move to the most recently used end
+    m_lru.splice(m_lru.end(), m_lru, it->lruPosition);
+    ++m_hits;
+    return it->contents;
+}
+
+void HotFileCache::load(const QSharedPointer<QFile> &file, const QString &path, qint64 size,
+                        qint64 mtime, QObject *owner, LoadCallback done)
+{
+    QSharedPointer<PendingLoad> pending = m_pending.value(path);
+    if (pending && pending->size == size && pending->mtime == mtime) {
+        // Someone is already reading this version of the file
+        pending->waiters.append(qMakePair(QPointer<QObject>(owner), done));
+        return;
+    }
+
+    pending.reset(new PendingLoad);
+    pending->size = size;
+    pending->mtime = mtime;
+    pending->waiters.append(qMakePair(QPointer<QObject>(owner), done));
+    m_pending.insert(path, pending);
+
+    m_fileIo->read(file, 0, size, this, [this, path, pending](qint64 result, const QByteArray &data) {
+        if (m_pending.value(path) == pending) {
+            m_pending.remove(path);
+        }
+
+        QByteArray contents;
+        if (result == pending->size) {
+            contents = data;
+            insert(path, contents, pending->size, pending->mtime);
+        }
+
+        for (const auto &waiter : pending->waiters) {
+            if (waiter.first) {
+                waiter.second(contents);
+            }
+        }
+    });
+}
+
+void HotFileCache::invalidate(const QString &path)
+{
+    auto it = m_entries.find(path);
+    if (it != m_entries.end()) {
+        m_usedBytes -= it->contents.size();
+        m_lru.erase(it->lruPosition);
+        m_entries.erase(it);
+    }
+}
+
+void HotFileCache::clear()
+{
+    m_entries.clear();
+    m_lru.clear();
+    m_usedBytes = 0;
+}
+
+HotFileCache::Stats HotFileCache::stats() const
+{
+    Stats stats;
+    stats.hits = m_hits;
+    stats.misses = m_misses;
+    stats.usedBytes = m_usedBytes;
+    stats.entries = m_entries.size();
+    return stats;
+}
+
+void HotFileCache::insert(const QString &path, const QByteArray &contents, qint64 size, qint64 mtime)
+{
+    invalidate(path);
+    evict(contents.size());
+
+    Entry entry;
+    entry.contents = contents;
+    entry.size = size;
+    entry.mtime = mtime;
+    entry.lruPosition = m_lru.insert(m_lru.end(), path);
+    m_entries.insert(path, entry);
+    m_usedBytes += contents.size();
+}
+
+void HotFileCache::evict(qint64 needed)
+{
+    while (!m_lru.empty() && m_usedBytes + needed > m_capacity) {
+        auto it = m_entries.find(m_lru.front());
+        m_usedBytes -= it->contents.size();
+        m_entries.erase(it);
+        m_lru.pop_front();
+    }
+}
@@ -0,0 +1,88 @@
+#ifndef HOTFILECACHE_H
+#define HOTFILECACHE_H
+
+#include <QObject>
+#include <QByteArray>
+#include <QHash>
+#include <QList>
+#include <QPair>
+#include <QPointer>
+#include <QSharedPointer>
+#include <QFile>
+#include <functional>
+#include <list>
+
+class FileIoService;
+
+// Server-wide LRU cache of small file contents for RETR. Entries are keyed
+// by path and validated against the file's size and mtime, so a changed
+// file is simply a miss. Contents are shared QByteArrays: every download of
+// a cached file sends from the same copy, and concurrent misses on the same
+// file share one disk read.
+class HotFileCache : public QObject
+{
+    Q_OBJECT
+public:
+    struct Stats
+    {
+        quint64 hits;
+        quint64 misses;
+        qint64 usedBytes;
+        int entries;
+    };
+
+    using LoadCallback = std::function<void(const QByteArray &contents)>;
+
+    explicit HotFileCache(FileIoService *fileIo, QObject *parent = nullptr);
+
+    void setCapacity(qint64 bytes);
+    qint64 capacity() const;
+    void setMaxFileSize(qint64 bytes);
+    qint64 maxFileSize() const;
+
+    bool isCacheable(qint64 size) const;
+
+    // Returns the cached contents, or a null QByteArray on a miss
+    QByteArray lookup(const QString &path, qint64 size, qint64 mtime);
+
+    // Reads the file and caches it. done gets a null QByteArray if the
+    // read failed or came up short.
+    void load(const QSharedPointer<QFile> &file, const QString &path, qint64 size, qint64 mtime,
+              QObject *owner, LoadCallback done);
+
+    void invalidate(const QString &path);
+    void clear();
+
+    Stats stats() const;
+
+private:
+    struct Entry
+    {
+        QByteArray contents;
+        qint64 size;
+        qint64 mtime;
+        std::list<QString>::iterator lruPosition;
+    };
+
+    struct PendingLoad
+    {
+        qint64 size;
+        qint64 mtime;
+        QList<QPair<QPointer<QObject>, LoadCallback>> waiters;
+    };
+
+    void insert(const QString &path, const QByteArray &contents, qint64 size, qint64 mtime);
+    void evict(qint64 needed);
+
+    FileIoService *m_fileIo;
+    QHash<QString, Entry> m_entries;
+    QHash<QString, QSharedPointer<PendingLoad>> m_pending;
+    std::list<QString> m_lru;
+    qint64 m_capacity;
+    qint64 m_maxFileSize;
+    qint64 m_usedBytes;
+    quint64 m_hits;
+    quint64 m_misses;
+};
+
+#endif // HOTFILECACHE_H
@@ -0,0 +1,203 @@
+#include "listenerhandoff.h"
+#include <QLocalServer>
+#include <QLocalSocket>
+#include <QFile>
+#include <QDebug>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+
+namespace {
+
+// Room for exactly one descriptor, suitably aligned for cmsghdr
+union DescriptorMessage
+{
+    struct cmsghdr header;
+    char buffer[CMSG_SPACE(sizeof(int))];
+};
+
+}
+
+ListenerHandoff::ListenerHandoff(QObject *parent) : QObject(parent),
+    m_server(nullptr),
+    m_listenerFd(-1)
+{
+}
+
+ListenerHandoff::~ListenerHandoff()
+{
+    withdraw();
+}
+
+bool ListenerHandoff::offer(const QString &path, qintptr listenerFd, const QString &rootPath)
+{
+    withdraw();
+
+    // A socket file left behind by a server that crashed would make
+    // listen() fail. A live predecessor has already closed its own.
+    QLocalServer::removeServer(path);
+
+    m_server = new QLocalServer(this);
+    m_server->setSocketOptions(QLocalServer::UserAccessOption);
+    if (!m_server->listen(path)) {
+        qDebug() << "Listener handoff: cannot listen on" << path << m_server->errorString();
+        delete m_server;
+        m_server = nullptr;
+        return false;
+    }
+
+    connect(m_server, &QLocalServer::newConnection, this, &ListenerHandoff::onSuccessorConnected);
+    m_path = path;
+    m_listenerFd = listenerFd;
+    m_rootPath = rootPath;
+    return true;
+}
+
+void ListenerHandoff::withdraw()
+{
+    if (m_server) {
+        m_server->close();
+        delete m_server;
+        m_server = nullptr;
+    }
+    m_listenerFd = -1;
+}
+
+void ListenerHandoff::onSuccessorConnected()
+{
+    QLocalSocket *socket = m_server->nextPendingConnection();
+    if (!socket) {
+        return;
+    }
+
+    // Give up the path first, so the successor can offer it in turn
+    // without our close() later unlinking its socket file
+    QString path = m_path;
+    qintptr listenerFd = m_listenerFd;
+    QString rootPath = m_rootPath;
+    m_server->disconnect(this);
+    m_server->close();
+    m_server->deleteLater();
+    m_server = nullptr;
+
+    // The descriptor rides on a marker byte, followed by the root path
+    QByteArray payload = 'L' + rootPath.toUtf8();
+    struct iovec iov;
+    iov.iov_base = payload.data();
+    iov.iov_len = size_t(payload.size());
+
+    DescriptorMessage control;
+    memset(&control, 0, sizeof(control));
+
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.buffer;
+    message.msg_controllen = sizeof(control.buffer);
+
+    struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int));
+    int fd = int(listenerFd);
+    memcpy(CMSG_DATA(header), &fd, sizeof(int));
+
+    ssize_t sent;
+    do {
+        sent = ::sendmsg(int(socket->socketDescriptor()), &message, MSG_NOSIGNAL);
+    } while (sent < 0 && errno == EINTR);
+
+    socket->disconnectFromServer();
+    socket->deleteLater();
+
+    if (sent != payload.size()) {
+        qDebug() << "Listener handoff failed:" << strerror(errno);
+        offer(path, listenerFd, rootPath);
+        return;
+    }
+
+    m_listenerFd = -1;
+    emit handedOff();
+}
+
+qintptr ListenerHandoff::adopt(const QString &path, int timeoutMs, QString *rootPath)
+{
+    QByteArray encodedPath = QFile::encodeName(path);
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (encodedPath.size() >= int(sizeof(address.sun_path))) {
+        return -1;
+    }
+    memcpy(address.sun_path, encodedPath.constData(), encodedPath.size());
+
+    int sock = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        return -1;
+    }
+
+    // Don't hang at startup if the old server is wedged
+    struct timeval timeout;
+    timeout.tv_sec = timeoutMs / 1000;
+    timeout.tv_usec = (timeoutMs % 1000) * 1000;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    if (::connect(sock, reinterpret_cast<struct sockaddr *>(&address), sizeof(address)) != 0) {
+        // Nobody there; this is a cold start
+        ::close(sock);
+        return -1;
+    }
+
+    char buffer[4096];
+    struct iovec iov;
+    iov.iov_base = buffer;
+    iov.iov_len = sizeof(buffer);
+
+    DescriptorMessage control;
+    memset(&control, 0, sizeof(control));
+
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.buffer;
+    message.msg_controllen = sizeof(control.buffer);
+
+    ssize_t received;
+    do {
+        received = ::recvmsg(sock, &message, MSG_CMSG_CLOEXEC);
+    } while (received < 0 && errno == EINTR);
+
+    // The rest of the root path, if it didn't come in one piece; the old
+    // server hangs up once it has sent everything
+    QByteArray payload(buffer, int(qMax<ssize_t>(received, 0)));
+    ssize_t more = received;
+    while (more > 0 || (more < 0 && errno == EINTR)) {
+        more = ::recv(sock, buffer, sizeof(buffer), 0);
+        if (more > 0) {
+            payload.append(buffer, int(more));
+        }
+    }
+    ::close(sock);
+
+    int fd = -1;
+    for (struct cmsghdr *header = CMSG_FIRSTHDR(&message); header;
+         header = CMSG_NXTHDR(&message, header)) {
+        if (header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS) {
+            memcpy(&fd, CMSG_DATA(header), sizeof(int));
+        }
+    }
+    if (received < 1 || payload.at(0) != 'L') {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        return -1;
+    }
+    *rootPath = QString::fromUtf8(payload.mid(1));
+    return fd;
+}
@@ -0,0 +1,44 @@
+#ifndef LISTENERHANDOFF_H
+#define LISTENERHANDOFF_H
+
+#include <QObject>
+#include <QString>
+
+class QLocalServer;
+
+// Passes the control listener to a newly started server process over a
+// Unix socket (SCM_RIGHTS). The kernel keeps queueing connections on the
+// listener throughout, so a restart never refuses a client. The running
+// server offers its listener, the new one adopts it at startup, and the
+// old one then drains. The root of the tree being served travels with
+// the listener, so the new server serves the same files.
+class ListenerHandoff : public QObject
+{
+    Q_OBJECT
+public:
+    explicit ListenerHandoff(QObject *parent = nullptr);
+    ~ListenerHandoff();
+
+    // Waits at path for a successor and sends it listenerFd and rootPath
+    // (empty when not serving a local directory)
+    bool offer(const QString &path, qintptr listenerFd, const QString &rootPath);
+    void withdraw();
+
+    // Connects to a running server at path and takes its listener and
+    // root. Returns -1 if there is nobody to take over from.
+    static qintptr adopt(const QString &path, int timeoutMs, QString *rootPath);
+
+signals:
+    void handedOff();
+
+private slots:
+    void onSuccessorConnected();
+
+private:
+    QLocalServer *m_server;
+    QString m_path;
+    qintptr m_listenerFd;
+    QString m_rootPath;
+};
+
+#endif // LISTENERHANDOFF_H
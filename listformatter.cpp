@@ -0,0 +1,157 @@
+#include "listformatter.h"
+#include <cstring>
+
+namespace {
+
+const char *const Months[] = {
+    "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+};
+
+// Seconds since 4713 BC on the datetime's own wall clock. Cheap, unlike
+// toSecsSinceEpoch(), which has to work out the UTC offset of local times.
+qint64 wallSeconds(const QDateTime &time)
+{
+    return time.date().toJulianDay() * 86400 + time.time().msecsSinceStartOfDay() / 1000;
+}
+
+char *writePadded(char *out, quint64 value, int width)
+{
+    char digits[20];
+    int count = 0;
+    do {
+        digits[count++] = char('0' + value % 10);
+        value /= 10;
+    } while (value);
+
+    for (int i = count; i < width; ++i) {
+        *out++ = ' ';
+    }
+    while (count) {
+        *out++ = digits[--count];
+    }
+    return out;
+}
+
+char *writeName(char *out, const QByteArray &name, int width)
+{
+    memcpy(out, name.constData(), size_t(name.size()));
+    out += name.size();
+    for (int i = name.size(); i < width; ++i) {
+        *out++ = ' ';
+    }
+    return out;
+}
+
+char *writeTwoDigits(char *out, int value)
+{
+    *out++ = char('0' + value / 10);
+    *out++ = char('0' + value % 10);
+    return out;
+}
+
+}
+
+ListFormatter::ListFormatter() :
+    m_now(wallSeconds(QDateTime::currentDateTime()))
+{
+    for (DateSlot &slot : m_dates) {
+        slot.second = -1;
+    }
+}
+
+const QByteArray &ListFormatter::encode(const QString &name, QString *last, QByteArray *encoded)
+{
+    if (name != *last || encoded->isEmpty()) {
+        *last = name;
+        *encoded = name.toUtf8();
+    }
+    return *encoded;
+}
+
+const char *ListFormatter::formatDate(const QDateTime &modified)
+{
+    if (!modified.isValid()) {
+        return "Jan  1  1970";
+    }
+
+    qint64 second = wallSeconds(modified);
+    DateSlot &slot = m_dates[quint64(second) % DateSlots];
+    if (slot.second == second) {
+        return slot.text;
+    }
+
+    // "Mmm dd hh:mm" or "Mmm dd  yyyy", the day padded with a space
+    QDate date = modified.date();
+    char *out = slot.text;
+    memcpy(out, Months[date.month() - 1], 3);
+    out += 3;
+    *out++ = ' ';
+    out = writePadded(out, quint64(date.day()), 2);
+    *out++ = ' ';
+    if (second > m_now - RecentSeconds && second <= m_now) {
+        QTime time = modified.time();
+        out = writeTwoDigits(out, time.hour());
+        *out++ = ':';
+        writeTwoDigits(out, time.minute());
+    } else {
+        *out++ = ' ';
+        writePadded(out, quint64(qBound(0, date.year(), 9999)), 4);
+    }
+    slot.second = second;
+    return slot.text;
+}
+
+void ListFormatter::append(const Vfs::Entry &entry, QByteArray *out)
+{
+    // Symlinks show as ls shows them; the rest of the line is the target's
+    int permissions = entry.isSymLink ? 0777
+                      : entry.permissions >= 0 ? entry.permissions : (entry.isDir ? 0755 : 0644);
+    const QByteArray &user = encode(entry.userName.isEmpty() ? QStringLiteral("owner") : entry.userName,
+                                    &m_user, &m_userBytes);
+    const QByteArray &group = encode(entry.groupName.isEmpty() ? QStringLiteral("group") : entry.groupName,
+                                     &m_group, &m_groupBytes);
+    QByteArray name = entry.name.toUtf8();
+    if (entry.isSymLink && !entry.linkTarget.isEmpty()) {
+        name += " -> " + entry.linkTarget.toUtf8();
+    }
+
+    // Room for the longest line, trimmed to what was written at the end
+    int start = out->size();
+    out->resize(start + 96 + user.size() + group.size() + name.size());
+    char *p = out->data() + start;
+
+    *p++ = entry.isSymLink ? 'l' : entry.isDir ? 'd' : '-';
+    static const char Bits[] = "rwxrwxrwx";
+    for (int i = 0; i < 9; ++i) {
+        p[i] = (permissions & (0400 >> i)) ? Bits[i] : '-';
+    }
+    if (permissions & 04000) {
+        p[2] = p[2] == 'x' ? 's' : 'S';
+    }
+    if (permissions & 02000) {
+        p[5] = p[5] == 'x' ? 's' : 'S';
+    }
+    if (permissions & 01000) {
+        p[8] = p[8] == 'x' ? 't' : 'T';
+    }
+    p += 9;
+
+    *p++ = ' ';
+    p = writePadded(p, entry.links, 3);
+    *p++ = ' ';
+    p = writeName(p, user, 8);
+    *p++ = ' ';
+    p = writeName(p, group, 8);
+    *p++ = ' ';
+    p = writePadded(p, quint64(qMax<qint64>(0, entry.size)), 8);
+    *p++ = ' ';
+    memcpy(p, formatDate(entry.modified), DateLength);
+    p += DateLength;
+    *p++ = ' ';
+    memcpy(p, name.constData(), size_t(name.size()));
+    p += name.size();
+    *p++ = '\r';
+    *p++ = '\n';
+
+    out->resize(int(p - out->constData()));
+}
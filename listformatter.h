@@ -0,0 +1,45 @@
+#ifndef LISTFORMATTER_H
+#define LISTFORMATTER_H
+
+#include <QByteArray>
+#include <QString>
+#include "vfs.h"
+
+// Formats directory entries as ls -l lines, which is how clients parse
+// LIST output. Lines are written straight into the caller's buffer; each
+// distinct date is formatted once, and owner and group names are encoded
+// once per run of entries sharing them. Whether a date counts as recent
+// depends on when the formatter was made, so use one per listing.
+class ListFormatter
+{
+public:
+    ListFormatter();
+
+    // Appends entry's line, CRLF included, to out
+    void append(const Vfs::Entry &entry, QByteArray *out);
+
+private:
+    // Dates within the last six months show the time, older ones the year
+    static const qint64 RecentSeconds = 15778476;
+    static const int DateSlots = 64;
+    static const int DateLength = 12;
+
+    struct DateSlot
+    {
+        qint64 second;
+        char text[DateLength];
+    };
+
+    const char *formatDate(const QDateTime &modified);
+    static const QByteArray &encode(const QString &name, QString *last, QByteArray *encoded);
+
+    // Wall-clock seconds, as in the entries' own time spec
+    qint64 m_now;
+    DateSlot m_dates[DateSlots];
+    QString m_user;
+    QByteArray m_userBytes;
+    QString m_group;
+    QByteArray m_groupBytes;
+};
+
+#endif // LISTFORMATTER_H
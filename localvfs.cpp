@@ -0,0 +1,292 @@
+#include "localvfs.h"
+#include <QDir>
+#include <QDirIterator>
+#include <QFileInfo>
+#include <QHash>
+#include <QMutex>
+#include <fcntl.h>
+#include <unistd.h>
+#include <climits>
+#include <cstdio>
+#ifdef Q_OS_LINUX
+#include <sys/xattr.h>
+#include <sys/stat.h>
+#include <grp.h>
+#include <pwd.h>
+#endif
+
+namespace {
+
+// Records which user stored a file, for quotas
+const char OwnerAttribute[] = "user.ftp.owner";
+
+#ifdef Q_OS_LINUX
+// Names of uids and gids, looked up once each: the lookup may go over the
+// network (LDAP, NIS), and a directory's entries mostly share one owner.
+// Shared by all pool threads; ids without a name show as numbers.
+QString idName(uint id, bool group)
+{
+    static QMutex mutex;
+    static QHash<uint, QString> users;
+    static QHash<uint, QString> groups;
+
+    QHash<uint, QString> &names = group ? groups : users;
+    QMutexLocker locker(&mutex);
+    auto cached = names.constFind(id);
+    if (cached != names.constEnd()) {
+        return *cached;
+    }
+    locker.unlock();
+
+    QString name = QString::number(id);
+    char buffer[16384];
+    if (group) {
+        struct group entry;
+        struct group *found = nullptr;
+        if (getgrgid_r(gid_t(id), &entry, buffer, sizeof(buffer), &found) == 0 && found) {
+            name = QString::fromLocal8Bit(found->gr_name);
+        }
+    } else {
+        struct passwd entry;
+        struct passwd *found = nullptr;
+        if (getpwuid_r(uid_t(id), &entry, buffer, sizeof(buffer), &found) == 0 && found) {
+            name = QString::fromLocal8Bit(found->pw_name);
+        }
+    }
+
+    locker.relock();
+    names.insert(id, name);
+    return name;
+}
+#endif
+
+Vfs::Entry entryFor(const QFileInfo &info)
+{
+    Vfs::Entry entry;
+    entry.name = info.fileName();
+#ifdef Q_OS_LINUX
+    // One lstat, and a stat for symlinks, is all QFileInfo would do too,
+    // and it also gives the mode, link count and owner for listings.
+    // Symlinks describe their target, as QFileInfo does.
+    QByteArray path = QFile::encodeName(info.filePath());
+    struct stat st;
+    if (::lstat(path.constData(), &st) != 0) {
+        return entry;
+    }
+    entry.isSymLink = S_ISLNK(st.st_mode);
+    if (entry.isSymLink) {
+        // st_size is the target's length, but is 0 on some filesystems
+        QByteArray target(st.st_size > 0 ? int(st.st_size) : PATH_MAX, Qt::Uninitialized);
+        ssize_t length = ::readlink(path.constData(), target.data(), size_t(target.size()));
+        if (length > 0) {
+            target.truncate(int(length));
+            entry.linkTarget = QFile::decodeName(target);
+        }
+    }
+    if (entry.isSymLink && ::stat(path.constData(), &st) != 0) {
+        // Dangling
+        return entry;
+    }
+    entry.exists = true;
+    entry.isDir = S_ISDIR(st.st_mode);
+    entry.size = st.st_size;
+    entry.modified = QDateTime::fromMSecsSinceEpoch(qint64(st.st_mtim.tv_sec) * 1000
+                                                    + st.st_mtim.tv_nsec / 1000000);
+    entry.permissions = int(st.st_mode & 07777);
+    entry.links = uint(st.st_nlink);
+    entry.userName = idName(st.st_uid, false);
+    entry.groupName = idName(st.st_gid, true);
+#else
+    entry.exists = true;
+    entry.isDir = info.isDir();
+    entry.isSymLink = info.isSymLink();
+    if (entry.isSymLink) {
+        entry.linkTarget = info.symLinkTarget();
+    }
+    entry.size = info.size();
+    entry.modified = info.lastModified();
+#endif
+    return entry;
+}
+
+// Walks the directory with one QDirIterator, which reads entries from the
+// kernel as it goes rather than collecting them all up front
+class IteratedDirectory : public Vfs::Listing
+{
+public:
+    IteratedDirectory(const QString &path, QDir::Filters filters, const QRegularExpression &names) :
+        m_iterator(path, filters),
+        m_names(names),
+        m_filtered(!names.pattern().isEmpty())
+    {
+    }
+
+    bool next(int max, QVector<Vfs::Entry> *entries) override
+    {
+        for (int i = 0; i < max && m_iterator.hasNext(); ++i) {
+            m_iterator.next();
+            // Checked on the name alone, before entryFor() stats it
+            if (m_filtered && !m_names.match(m_iterator.fileName()).hasMatch()) {
+                continue;
+            }
+            entries->append(entryFor(m_iterator.fileInfo()));
+        }
+        return m_iterator.hasNext();
+    }
+
+private:
+    QDirIterator m_iterator;
+    QRegularExpression m_names;
+    bool m_filtered;
+};
+
+QDir::Filters listingFilters(bool includeHidden)
+{
+    QDir::Filters filters = QDir::AllEntries | QDir::NoDotAndDotDot;
+    if (includeHidden) {
+        filters |= QDir::Hidden | QDir::System;
+    }
+    return filters;
+}
+
+}
+
+LocalVfs::LocalVfs(const QString &rootPath) :
+    m_rootPath(rootPath)
+{
+}
+
+QString LocalVfs::rootPath() const
+{
+    return m_rootPath;
+}
+
+QString LocalVfs::description() const
+{
+    return "local disk at " + m_rootPath;
+}
+
+Vfs::Entry LocalVfs::stat(const QString &path)
+{
+    QFileInfo info(localPath(path));
+    if (!info.exists()) {
+        return Entry();
+    }
+    return entryFor(info);
+}
+
+bool LocalVfs::list(const QString &path, bool includeHidden, QVector<Entry> *entries)
+{
+    QDir dir(localPath(path));
+    if (!dir.exists()) {
+        return false;
+    }
+
+    // Everything is stat'ed here, on the pool, so callers only touch
+    // cached data
+    const QFileInfoList infos = dir.entryInfoList(listingFilters(includeHidden), QDir::Name);
+    entries->reserve(infos.size());
+    for (const QFileInfo &info : infos) {
+        entries->append(entryFor(info));
+    }
+    return true;
+}
+
+QSharedPointer<Vfs::Listing> LocalVfs::openListing(const QString &path, bool includeHidden,
+                                                   const QRegularExpression &names)
+{
+    QString local = localPath(path);
+    if (!QFileInfo(local).isDir()) {
+        return QSharedPointer<Listing>();
+    }
+    return QSharedPointer<Listing>(new IteratedDirectory(local, listingFilters(includeHidden),
+                                                         names));
+}
+
+QSharedPointer<QFile> LocalVfs::open(const QString &path, QIODevice::OpenMode mode)
+{
+    QSharedPointer<QFile> file(new QFile(localPath(path)));
+    if (!file->open(mode)) {
+        return QSharedPointer<QFile>();
+    }
+    return file;
+}
+
+bool LocalVfs::rename(const QString &from, const QString &to, bool replace)
+{
+    if (!replace) {
+        // QFile refuses to overwrite an existing file
+        return QFile::rename(localPath(from), localPath(to));
+    }
+
+    QByteArray source = QFile::encodeName(localPath(from));
+    QByteArray target = QFile::encodeName(localPath(to));
+    return ::rename(source.constData(), target.constData()) == 0;
+}
+
+bool LocalVfs::mkdir(const QString &path)
+{
+    return QDir().mkdir(localPath(path));
+}
+
+bool LocalVfs::rmdir(const QString &path)
+{
+    return QDir().rmdir(localPath(path));
+}
+
+bool LocalVfs::remove(const QString &path)
+{
+    return QFile::remove(localPath(path));
+}
+
+bool LocalVfs::setModified(const QString &path, const QDateTime &modified)
+{
+    QFile file(localPath(path));
+    return file.open(QIODevice::ReadOnly)
+        && file.setFileTime(modified, QFileDevice::FileModificationTime);
+}
+
+QString LocalVfs::owner(const QString &path)
+{
+#ifdef Q_OS_LINUX
+    char buffer[256];
+    ssize_t length = getxattr(QFile::encodeName(localPath(path)).constData(), OwnerAttribute,
+                              buffer, sizeof(buffer));
+    if (length > 0) {
+        return QString::fromUtf8(buffer, int(length));
+    }
+#else
+    Q_UNUSED(path);
+#endif
+    return QString();
+}
+
+void LocalVfs::setOwner(const QString &path, const QString &user)
+{
+#ifdef Q_OS_LINUX
+    // Best effort: without xattr support the file just isn't attributed
+    QByteArray value = user.toUtf8();
+    setxattr(QFile::encodeName(localPath(path)).constData(), OwnerAttribute,
+             value.constData(), size_t(value.size()), 0);
+#else
+    Q_UNUSED(path);
+    Q_UNUSED(user);
+#endif
+}
+
+bool LocalVfs::syncDirectory(const QString &path)
+{
+    int fd = ::open(QFile::encodeName(localPath(path)).constData(),
+                    O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = fsync(fd) == 0;
+    close(fd);
+    return ok;
+}
+
+QString LocalVfs::localPath(const QString &path) const
+{
+    return m_rootPath + path;
+}
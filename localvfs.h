@@ -0,0 +1,34 @@
+#ifndef LOCALVFS_H
+#define LOCALVFS_H
+
+#include "vfs.h"
+
+// Serves a directory on the local disk
+class LocalVfs : public Vfs
+{
+public:
+    explicit LocalVfs(const QString &rootPath);
+
+    QString rootPath() const;
+
+    QString description() const override;
+    Entry stat(const QString &path) override;
+    bool list(const QString &path, bool includeHidden, QVector<Entry> *entries) override;
+    QSharedPointer<Listing> openListing(const QString &path, bool includeHidden,
+                                        const QRegularExpression &names) override;
+    QSharedPointer<QFile> open(const QString &path, QIODevice::OpenMode mode) override;
+    bool rename(const QString &from, const QString &to, bool replace) override;
+    bool mkdir(const QString &path) override;
+    bool rmdir(const QString &path) override;
+    bool remove(const QString &path) override;
+    bool setModified(const QString &path, const QDateTime &modified) override;
+    QString owner(const QString &path) override;
+    void setOwner(const QString &path, const QString &user) override;
+    bool syncDirectory(const QString &path) override;
+    QString localPath(const QString &path) const override;
+
+private:
+    QString m_rootPath;
+};
+
+#endif // LOCALVFS_H
@@ -1,10 +1,129 @@
 #include "mainwindow.h"
+#include "memoryvfs.h"
+#include "s3vfs.h"
 #include <QApplication>
+#include <QCommandLineParser>
+#include <QDebug>
 
 int main(int argc, char *argv[])
 {
     QApplication a(argc, argv);
+    
+    QCommandLineParser parser;
+    parser.addHelpOption();
+    QCommandLineOption handoffOption("handoff-socket",
+        "Unix socket for zero-downtime restarts. A server started with the same path "
+        "takes over the listener of the one already running, which then drains.",
+        "path");
+    parser.addOption(handoffOption);
+    QCommandLineOption memoryOption("memory-storage",
+        "Serve an empty in-memory filesystem instead of the root directory, to measure "
+        "protocol throughput without disk I/O. Uploaded files are lost on exit.");
+    parser.addOption(memoryOption);
+    QCommandLineOption s3Option("s3-config",
+        "Serve a bucket on S3 or an S3-compatible store, as described in file "
+        "(endpoint, bucket, region, access_key, secret_key, prefix, part_size, "
+        "parallel_parts, read_ahead, listing_ttl).",
+        "file");
+    parser.addOption(s3Option);
+    QCommandLineOption traceOption("trace-file",
+        "Write span traces of the sessions chosen by --trace-sample and --trace-users "
+        "to file, as Chrome trace JSON (open in chrome://tracing or ui.perfetto.dev).",
+        "file");
+    parser.addOption(traceOption);
+    QCommandLineOption traceSampleOption("trace-sample",
+        "Fraction of sessions to trace, from 0 to 1.", "fraction", "0");
+    parser.addOption(traceSampleOption);
+    QCommandLineOption traceUsersOption("trace-users",
+        "Comma-separated users whose sessions are always traced.", "users");
+    parser.addOption(traceUsersOption);
+    QCommandLineOption captureOption("capture",
+        "Record the control channel, timing and transfer sizes of every session to file, "
+        "for replay with ftpreplay. File contents and passwords are not recorded.",
+        "file");
+    parser.addOption(captureOption);
+    QCommandLineOption tcpProfileOption("tcp-profile",
+        "TCP options for control and data connections: " + SocketPolicy::profiles().join(", ")
+        + ". \"wan\" suits links with a large bandwidth-delay product.",
+        "profile", "default");
+    parser.addOption(tcpProfileOption);
+    QCommandLineOption congestionOption("tcp-congestion",
+        "Congestion control for data connections, e.g. bbr or cubic (Linux).", "algorithm");
+    parser.addOption(congestionOption);
+    QCommandLineOption streamingOption("streaming-threshold",
+        "Transfers of at least this many MiB are streamed past the page cache: downloads "
+        "with read-ahead and drop-behind, uploads with periodic writeback. 0 leaves all "
+        "caching to the kernel.",
+        "MiB", "16");
+    parser.addOption(streamingOption);
+    QCommandLineOption uploadSyncOption("upload-sync",
+        "What is flushed to disk before an upload is acknowledged: none, data (the file's "
+        "contents) or full (the file and its directory entry).",
+        "level", "data");
+    parser.addOption(uploadSyncOption);
+    QCommandLineOption directUploadsOption("direct-uploads",
+        "Write uploads in place instead of to a temporary file renamed over the target "
+        "once complete. Readers may then see partial files.");
+    parser.addOption(directUploadsOption);
+    parser.process(a);
+    
     MainWindow w;
+    if (parser.isSet(memoryOption)) {
+        w.setStorage(QSharedPointer<Vfs>(new MemoryVfs));
+    } else if (parser.isSet(s3Option)) {
+        S3Vfs::Config config;
+        if (!S3Vfs::loadConfig(parser.value(s3Option), &config)) {
+            qCritical() << "Can't use S3 config" << parser.value(s3Option)
+                        << "- it needs at least an endpoint and a bucket";
+            return 1;
+        }
+        w.setStorage(QSharedPointer<Vfs>(new S3Vfs(config)));
+    }
+    if (parser.isSet(traceOption)) {
+        w.setTracing(parser.value(traceOption), parser.value(traceSampleOption).toDouble(),
+                     parser.value(traceUsersOption).split(',', Qt::SkipEmptyParts));
+    }
+    if (parser.isSet(captureOption)) {
+        w.setCapturePath(parser.value(captureOption));
+    }
+    SocketPolicy socketPolicy;
+    if (!SocketPolicy::fromProfile(parser.value(tcpProfileOption), &socketPolicy)) {
+        qCritical() << "Unknown TCP profile" << parser.value(tcpProfileOption) << "- use one of"
+                    << SocketPolicy::profiles().join(", ");
+        return 1;
+    }
+    if (parser.isSet(congestionOption)) {
+        socketPolicy.congestionControl = parser.value(congestionOption);
+    }
+    w.setSocketPolicy(socketPolicy);
+    bool thresholdOk = false;
+    qint64 threshold = parser.value(streamingOption).toLongLong(&thresholdOk);
+    if (!thresholdOk || threshold < 0) {
+        qCritical() << "Invalid streaming threshold" << parser.value(streamingOption);
+        return 1;
+    }
+    CachePolicy cachePolicy;
+    cachePolicy.enabled = threshold > 0;
+    cachePolicy.downloadThreshold = threshold * 1024 * 1024;
+    cachePolicy.uploadThreshold = threshold * 1024 * 1024;
+    w.setCachePolicy(cachePolicy);
+    UploadPolicy uploadPolicy;
+    uploadPolicy.atomic = !parser.isSet(directUploadsOption);
+    QString uploadSync = parser.value(uploadSyncOption);
+    if (uploadSync == "none") {
+        uploadPolicy.durability = UploadPolicy::NoSync;
+    } else if (uploadSync == "data") {
+        uploadPolicy.durability = UploadPolicy::SyncData;
+    } else if (uploadSync == "full") {
+        uploadPolicy.durability = UploadPolicy::SyncFull;
+    } else {
+        qCritical() << "Unknown upload sync level" << uploadSync << "- use none, data or full";
+        return 1;
+    }
+    w.setUploadPolicy(uploadPolicy);
+    if (parser.isSet(handoffOption)) {
+        w.setHandoffPath(parser.value(handoffOption));
+    }
     w.show();
     
     return a.exec();
@@ -1,17 +1,52 @@
 #include "mainwindow.h"
 #include "ui_mainwindow.h"
 #include "ftpserver.h"
+#include "quotamanager.h"
+#include "tracer.h"
+#include "sessioncapture.h"
+#include "sessiontablemodel.h"
 #include <QFileDialog>
 #include <QMessageBox>
 #include <QDateTime>
+#include <QStandardPaths>
+#include <QFileInfo>
+#include <QHeaderView>
+
+namespace {
+
+QString formatHitRatio(quint64 resident, quint64 missed)
+{
+    quint64 total = resident + missed;
+    if (total == 0) {
+        return QString("n/a");
+    }
+    return QString("%1%").arg(double(resident) * 100.0 / double(total), 0, 'f', 1);
+}
+
+}
 
 MainWindow::MainWindow(QWidget *parent)
     : QMainWindow(parent)
     , ui(new Ui::MainWindow)
     , m_server(new FtpServer(this))
+    , m_handedOff(false)
+    , m_customStorage(false)
+    , m_sessionModel(new SessionTableModel(this))
+    , m_lastCounters(m_server->counters())
+    , m_cacheWindowStart(m_lastCounters)
+    , m_cacheWindowTicks(0)
+    , m_recentHitRatio("n/a")
+    , m_droppedLogLines(0)
 {
     ui->setupUi(this);
     
+    // Live view of the sessions, refreshed by refreshDashboard()
+    ui->sessionTableView->setModel(m_sessionModel);
+    ui->sessionTableView->horizontalHeader()->setSectionResizeMode(QHeaderView::Interactive);
+    ui->sessionTableView->horizontalHeader()->setStretchLastSection(true);
+    ui->sessionTableView->verticalHeader()->hide();
+    ui->logTextEdit->document()->setMaximumBlockCount(MaxLogLines);
+    
     // Set up default root directory
     ui->rootDirEdit->setText(QDir::homePath() + "/ftp");
     
@@ -27,14 +62,22 @@ MainWindow::MainWindow(QWidget *parent)
                            "Copyright © 2025");
     });
     
-    // Connect server signals
-    connect(m_server, &FtpServer::newConnection, this, &MainWindow::onNewConnection);
-    connect(m_server, &FtpServer::clientDisconnected, this, &MainWindow::onClientDisconnected);
+    // Connect server signals; sessions coming and going show up on the
+    // dashboard instead
     connect(m_server, &FtpServer::logMessage, this, &MainWindow::onServerLogMessage);
+    connect(m_server, &FtpServer::drained, this, &MainWindow::onServerDrained);
+    connect(m_server, &FtpServer::handedOff, this, [this]() {
+        m_handedOff = true;
+    });
     
     // Set initial UI state
     updateUiState(false);
     
+    m_dashboardClock.start();
+    m_dashboardTimer.setInterval(DashboardInterval);
+    connect(&m_dashboardTimer, &QTimer::timeout, this, &MainWindow::refreshDashboard);
+    m_dashboardTimer.start();
+    
     // Show startup message
     addLogMessage("Server ready. Click 'Start Server' to begin.");
 }
@@ -55,7 +98,7 @@ void MainWindow::onStartButtonClicked()
     
     // Validate root path
     QDir dir(rootPath);
-    if (!dir.exists()) {
+    if (!m_customStorage && !dir.exists()) {
         if (QMessageBox::question(this, "Create Directory?", 
                                  "The specified directory does not exist. Create it?",
                                  QMessageBox::Yes | QMessageBox::No) == QMessageBox::Yes) {
@@ -68,8 +111,7 @@ void MainWindow::onStartButtonClicked()
         }
     }
     
-    // Set root path and start server
-    m_server->setRootPath(rootPath);
+    configureServer(rootPath);
     if (!m_server->start(port)) {
         QMessageBox::critical(this, "Error", "Failed to start FTP server");
         return;
@@ -79,10 +121,101 @@ void MainWindow::onStartButtonClicked()
     updateUiState(true);
 }
 
+void MainWindow::configureServer(const QString &rootPath)
+{
+    // Enable FTPS if a certificate has been installed next to the settings
+    QString configDir = QStandardPaths::writableLocation(QStandardPaths::AppConfigLocation);
+    if (QFileInfo::exists(configDir + "/server.crt") && QFileInfo::exists(configDir + "/server.key")) {
+        m_server->setTlsCertificate(configDir + "/server.crt", configDir + "/server.key");
+    }
+    
+    // Set root path, then the quotas that apply to it
+    if (!m_customStorage) {
+        m_server->setRootPath(rootPath);
+    }
+    if (QFileInfo::exists(configDir + "/quota.conf")) {
+        m_server->quota()->loadConfig(configDir + "/quota.conf");
+    }
+}
+
+void MainWindow::setHandoffPath(const QString &path)
+{
+    m_server->setHandoffPath(path);
+    
+    // Serve the same tree as the server we are replacing, which sends
+    // its root along with the listener
+    bool tookOver = m_server->takeOverListener([this](const QString &rootPath) {
+        if (!rootPath.isEmpty()) {
+            ui->rootDirEdit->setText(rootPath);
+        }
+        configureServer(ui->rootDirEdit->text());
+    });
+    if (tookOver) {
+        updateUiState(true);
+    }
+}
+
+void MainWindow::setStorage(const QSharedPointer<Vfs> &vfs)
+{
+    // Kept across stop and start, like a directory on disk would be
+    m_customStorage = true;
+    m_server->setVfs(vfs);
+    updateUiState(m_server->isRunning());
+}
+
+void MainWindow::setTracing(const QString &path, double sampleRate, const QStringList &users)
+{
+    m_server->tracer()->setSampleRate(sampleRate);
+    m_server->tracer()->setTracedUsers(users);
+    m_server->tracer()->setOutputPath(path);
+}
+
+void MainWindow::setCapturePath(const QString &path)
+{
+    m_server->sessionCapture()->setPath(path);
+}
+
+void MainWindow::setSocketPolicy(const SocketPolicy &policy)
+{
+    m_server->setSocketPolicy(policy);
+}
+
+void MainWindow::setCachePolicy(const CachePolicy &policy)
+{
+    m_server->setCachePolicy(policy);
+}
+
+void MainWindow::setUploadPolicy(const UploadPolicy &policy)
+{
+    m_server->setUploadPolicy(policy);
+}
+
 void MainWindow::onStopButtonClicked()
 {
-    m_server->stop();
+    // The first click lets running transfers finish, a second one
+    // closes everything straight away
+    if (m_server->isDraining()) {
+        m_server->stop();
+    } else {
+        m_server->drain();
+    }
+    
+    if (m_server->isRunning()) {
+        addLogMessage("Waiting for transfers to finish. Click 'Stop Server' again to close them now.");
+        return;
+    }
+    
+    updateUiState(false);
+}
+
+void MainWindow::onServerDrained()
+{
     updateUiState(false);
+    
+    // A new server process has taken over; this one is done
+    if (m_handedOff) {
+        close();
+    }
 }
 
 void MainWindow::onBrowseButtonClicked()
@@ -102,16 +235,6 @@ void MainWindow::onClearLogButtonClicked()
     ui->logTextEdit->clear();
 }
 
-void MainWindow::onNewConnection(const QString &clientAddress)
-{
-    addLogMessage("New connection from: " + clientAddress);
-}
-
-void MainWindow::onClientDisconnected(const QString &clientAddress)
-{
-    addLogMessage("Client disconnected: " + clientAddress);
-}
-
 void MainWindow::onServerLogMessage(const QString &message)
 {
     addLogMessage(message);
@@ -122,8 +245,8 @@ void MainWindow::updateUiState(bool serverRunning)
     ui->startButton->setEnabled(!serverRunning);
     ui->stopButton->setEnabled(serverRunning);
     ui->portSpinBox->setEnabled(!serverRunning);
-    ui->rootDirEdit->setEnabled(!serverRunning);
-    ui->browseButton->setEnabled(!serverRunning);
+    ui->rootDirEdit->setEnabled(!serverRunning && !m_customStorage);
+    ui->browseButton->setEnabled(!serverRunning && !m_customStorage);
     
     ui->statusLabel->setText(serverRunning ? "Running" : "Stopped");
     if (serverRunning) {
@@ -135,6 +258,67 @@ void MainWindow::updateUiState(bool serverRunning)
 
 void MainWindow::addLogMessage(const QString &message)
 {
+    // Shown on the next dashboard tick; a burst beyond what fits in one
+    // is thinned to its most recent lines
+    if (m_pendingLog.size() >= MaxPendingLogLines) {
+        m_pendingLog.removeFirst();
+        ++m_droppedLogLines;
+    }
     QString timestamp = QDateTime::currentDateTime().toString("yyyy-MM-dd hh:mm:ss");
-    ui->logTextEdit->append(QString("[%1] %2").arg(timestamp, message));
+    m_pendingLog.append(QString("[%1] %2").arg(timestamp, message));
+}
+
+void MainWindow::flushLog()
+{
+    if (m_droppedLogLines > 0) {
+        ui->logTextEdit->append(QString("(%1 earlier messages not shown)").arg(m_droppedLogLines));
+        m_droppedLogLines = 0;
+    }
+    if (!m_pendingLog.isEmpty()) {
+        ui->logTextEdit->append(m_pendingLog.join('\n'));
+        m_pendingLog.clear();
+    }
+}
+
+void MainWindow::refreshDashboard()
+{
+    qint64 elapsed = m_dashboardClock.restart();
+    
+    QVector<SessionInfo> sessions = m_server->sessions();
+    m_sessionModel->update(sessions, elapsed);
+    
+    FtpServer::Counters counters = m_server->counters();
+    if (elapsed > 0) {
+        ui->throughputGraph->addSample(
+            double(counters.bytesReceived - m_lastCounters.bytesReceived) * 1000.0 / elapsed,
+            double(counters.bytesSent - m_lastCounters.bytesSent) * 1000.0 / elapsed);
+    }
+    m_lastCounters = counters;
+    
+    // The server resets its cache counters when it starts listening
+    if (counters.cacheResidentPages < m_cacheWindowStart.cacheResidentPages
+            || counters.cacheMissedPages < m_cacheWindowStart.cacheMissedPages) {
+        m_cacheWindowStart = counters;
+        m_cacheWindowTicks = 0;
+    }
+    if (++m_cacheWindowTicks >= CacheWindowTicks) {
+        m_recentHitRatio = formatHitRatio(
+            counters.cacheResidentPages - m_cacheWindowStart.cacheResidentPages,
+            counters.cacheMissedPages - m_cacheWindowStart.cacheMissedPages);
+        m_cacheWindowStart = counters;
+        m_cacheWindowTicks = 0;
+    }
+    
+    ui->activityLabel->setText(QString("%1 sessions, %2 connections and %3 commands so far, "
+                                       "%4 received, %5 sent, page cache hits %6 (last 5 s: %7)")
+                               .arg(sessions.size())
+                               .arg(counters.connections)
+                               .arg(counters.commands)
+                               .arg(SessionTableModel::formatBytes(counters.bytesReceived))
+                               .arg(SessionTableModel::formatBytes(counters.bytesSent))
+                               .arg(formatHitRatio(counters.cacheResidentPages,
+                                                   counters.cacheMissedPages))
+                               .arg(m_recentHitRatio));
+    
+    flushLog();
 }
@@ -4,8 +4,13 @@
 #include <QMainWindow>
 #include <QFileDialog>
 #include <QMessageBox>
+#include <QElapsedTimer>
+#include <QStringList>
+#include <QTimer>
 #include "ftpserver.h"
 
+class SessionTableModel;
+
 QT_BEGIN_NAMESPACE
 namespace Ui { class MainWindow; }
 QT_END_NAMESPACE
@@ -17,21 +22,70 @@ class MainWindow : public QMainWindow
 public:
     MainWindow(QWidget *parent = nullptr);
     ~MainWindow();
+    
+    // Enables listener handoff at path, taking over from a server that
+    // is already running there
+    void setHandoffPath(const QString &path);
+    
+    // Serve from vfs (memory, object storage) rather than the root
+    // directory
+    void setStorage(const QSharedPointer<Vfs> &vfs);
+    
+    // Traces a sampleRate fraction of sessions, and every session of
+    // users, to a Chrome trace at path
+    void setTracing(const QString &path, double sampleRate, const QStringList &users);
+    
+    // Records every new session to path, for replay with tools/ftpreplay
+    void setCapturePath(const QString &path);
+    
+    // TCP options for control and data connections
+    void setSocketPolicy(const SocketPolicy &policy);
+    
+    // Page-cache handling of large transfers
+    void setCachePolicy(const CachePolicy &policy);
+    
+    // Atomic uploads and what is on disk before 226
+    void setUploadPolicy(const UploadPolicy &policy);
 
 private slots:
     void onStartButtonClicked();
     void onStopButtonClicked();
     void onBrowseButtonClicked();
     void onClearLogButtonClicked();
-    void onNewConnection(const QString &clientAddress);
-    void onClientDisconnected(const QString &clientAddress);
     void onServerLogMessage(const QString &message);
+    void onServerDrained();
+    void refreshDashboard();
 
 private:
     Ui::MainWindow *ui;
     FtpServer *m_server;
+    bool m_handedOff;
+    bool m_customStorage;
+    
+    // The dashboard samples the server at a fixed rate instead of
+    // following its events, so a busy server costs the UI no more than
+    // an idle one. Log lines are queued and appended on the same tick.
+    static const int DashboardInterval = 200;
+    static const int MaxPendingLogLines = 500;
+    static const int MaxLogLines = 10000;
+    SessionTableModel *m_sessionModel;
+    QTimer m_dashboardTimer;
+    QElapsedTimer m_dashboardClock;
+    FtpServer::Counters m_lastCounters;
+    // Page-cache hit ratio over the last few seconds as well as since the
+    // start, so the effect of a bulk transfer shows while it runs
+    static const int CacheWindowTicks = 25;
+    FtpServer::Counters m_cacheWindowStart;
+    int m_cacheWindowTicks;
+    QString m_recentHitRatio;
+    QStringList m_pendingLog;
+    int m_droppedLogLines;
     
+    // TLS certificate, root and quotas, set up the same way for a cold
+    // start and for taking over from a running server
+    void configureServer(const QString &rootPath);
     void updateUiState(bool serverRunning);
     void addLogMessage(const QString &message);
+    void flushLog();
 };
 #endif // MAINWINDOW_H
@@ -0,0 +1,319 @@
+#include "memoryvfs.h"
+#include <QDir>
+#include <QMutexLocker>
+#include <QStringList>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdlib>
+
+namespace {
+
+int createAnonymousFile(const QString &name)
+{
+#if defined(Q_OS_LINUX) && defined(MFD_CLOEXEC)
+    // The name only shows up in /proc; it is limited to 249 bytes
+    return memfd_create(QFile::encodeName(name).left(200).constData(), MFD_CLOEXEC);
+#else
+    // An unlinked temporary file is the closest portable equivalent
+    QByteArray pattern = QFile::encodeName(QDir::tempPath() + "/ftpvfs-XXXXXX");
+    int fd = mkstemp(pattern.data());
+    if (fd >= 0) {
+        unlink(pattern.constData());
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+    return fd;
+#endif
+}
+
+}
+
+MemoryVfs::Node::Node() :
+    isDir(false),
+    fd(-1)
+{
+}
+
+MemoryVfs::Node::~Node()
+{
+    // Files still open keep their own descriptor, and with it the contents
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+MemoryVfs::MemoryVfs() :
+    m_root(new Node)
+{
+    m_root->isDir = true;
+    m_root->modified = QDateTime::currentDateTime();
+}
+
+QString MemoryVfs::description() const
+{
+    return "in-memory filesystem";
+}
+
+Vfs::Entry MemoryVfs::stat(const QString &path)
+{
+    QMutexLocker locker(&m_mutex);
+    QSharedPointer<Node> node = find(path);
+    if (!node) {
+        return Entry();
+    }
+    return entryFor(path.mid(path.lastIndexOf('/') + 1), *node);
+}
+
+bool MemoryVfs::list(const QString &path, bool includeHidden, QVector<Entry> *entries)
+{
+    QMutexLocker locker(&m_mutex);
+    QSharedPointer<Node> node = find(path);
+    if (!node || !node->isDir) {
+        return false;
+    }
+
+    entries->reserve(node->children.size());
+    for (auto it = node->children.constBegin(); it != node->children.constEnd(); ++it) {
+        if (includeHidden || !it.key().startsWith('.')) {
+            entries->append(entryFor(it.key(), *it.value()));
+        }
+    }
+    return true;
+}
+
+QSharedPointer<QFile> MemoryVfs::open(const QString &path, QIODevice::OpenMode mode)
+{
+    int fd;
+    {
+        QMutexLocker locker(&m_mutex);
+        QString name;
+        QSharedPointer<Node> parent = findParent(path, &name);
+        if (!parent || !parent->isDir || name.isEmpty()) {
+            return QSharedPointer<QFile>();
+        }
+
+        QSharedPointer<Node> node = parent->children.value(name);
+        if (node && (node->isDir || (mode & QIODevice::NewOnly))) {
+            return QSharedPointer<QFile>();
+        }
+        if (!node && ((mode & QIODevice::ExistingOnly) || !(mode & QIODevice::WriteOnly))) {
+            return QSharedPointer<QFile>();
+        }
+
+        if (!node) {
+            node.reset(new Node);
+            node->fd = createAnonymousFile(name);
+            if (node->fd < 0) {
+                return QSharedPointer<QFile>();
+            }
+            parent->children.insert(name, node);
+            parent->modified = QDateTime::currentDateTime();
+        } else if ((mode & QIODevice::Truncate)
+                   || ((mode & QIODevice::WriteOnly) && !(mode & (QIODevice::ReadOnly | QIODevice::Append)))) {
+            // Same rule QFile applies to files on disk
+            if (ftruncate(node->fd, 0) != 0) {
+                return QSharedPointer<QFile>();
+            }
+        }
+
+        // Transfers use pread/pwrite, so sharing the file offset is harmless
+        fd = fcntl(node->fd, F_DUPFD_CLOEXEC, 0);
+        if (fd < 0) {
+            return QSharedPointer<QFile>();
+        }
+    }
+
+    QSharedPointer<QFile> file(new QFile);
+    QIODevice::OpenMode fdMode = mode & ~(QIODevice::NewOnly | QIODevice::ExistingOnly | QIODevice::Truncate);
+    if (!file->open(fd, fdMode, QFileDevice::AutoCloseHandle)) {
+        close(fd);
+        return QSharedPointer<QFile>();
+    }
+    return file;
+}
+
+bool MemoryVfs::rename(const QString &from, const QString &to, bool replace)
+{
+    QMutexLocker locker(&m_mutex);
+
+    QString fromName;
+    QString toName;
+    QSharedPointer<Node> fromParent = findParent(from, &fromName);
+    QSharedPointer<Node> toParent = findParent(to, &toName);
+    if (!fromParent || !toParent || !toParent->isDir || fromName.isEmpty() || toName.isEmpty()) {
+        return false;
+    }
+
+    QSharedPointer<Node> node = fromParent->children.value(fromName);
+    if (!node) {
+        return false;
+    }
+    if (from == to) {
+        return true;
+    }
+
+    // A directory can't be moved into itself
+    if (node->isDir && to.startsWith(from + '/')) {
+        return false;
+    }
+
+    QSharedPointer<Node> existing = toParent->children.value(toName);
+    if (existing && (!replace || existing->isDir || node->isDir)) {
+        return false;
+    }
+
+    fromParent->children.remove(fromName);
+    toParent->children.insert(toName, node);
+
+    QDateTime now = QDateTime::currentDateTime();
+    fromParent->modified = now;
+    toParent->modified = now;
+    return true;
+}
+
+bool MemoryVfs::mkdir(const QString &path)
+{
+    QMutexLocker locker(&m_mutex);
+    QString name;
+    QSharedPointer<Node> parent = findParent(path, &name);
+    if (!parent || !parent->isDir || name.isEmpty() || parent->children.contains(name)) {
+        return false;
+    }
+
+    QSharedPointer<Node> node(new Node);
+    node->isDir = true;
+    node->modified = QDateTime::currentDateTime();
+    parent->children.insert(name, node);
+    parent->modified = node->modified;
+    return true;
+}
+
+bool MemoryVfs::rmdir(const QString &path)
+{
+    QMutexLocker locker(&m_mutex);
+    QString name;
+    QSharedPointer<Node> parent = findParent(path, &name);
+    if (!parent || name.isEmpty()) {
+        return false;
+    }
+
+    QSharedPointer<Node> node = parent->children.value(name);
+    if (!node || !node->isDir || !node->children.isEmpty()) {
+        return false;
+    }
+
+    parent->children.remove(name);
+    parent->modified = QDateTime::currentDateTime();
+    return true;
+}
+
+bool MemoryVfs::remove(const QString &path)
+{
+    QMutexLocker locker(&m_mutex);
+    QString name;
+    QSharedPointer<Node> parent = findParent(path, &name);
+    if (!parent || name.isEmpty()) {
+        return false;
+    }
+
+    QSharedPointer<Node> node = parent->children.value(name);
+    if (!node || node->isDir) {
+        return false;
+    }
+
+    parent->children.remove(name);
+    parent->modified = QDateTime::currentDateTime();
+    return true;
+}
+
+bool MemoryVfs::setModified(const QString &path, const QDateTime &modified)
+{
+    QMutexLocker locker(&m_mutex);
+    QSharedPointer<Node> node = find(path);
+    if (!node) {
+        return false;
+    }
+
+    if (node->isDir) {
+        node->modified = modified;
+        return true;
+    }
+
+    qint64 msecs = modified.toMSecsSinceEpoch();
+    struct timespec times[2];
+    times[0].tv_sec = 0;
+    times[0].tv_nsec = UTIME_OMIT;
+    times[1].tv_sec = time_t(msecs / 1000);
+    times[1].tv_nsec = long(msecs % 1000) * 1000000;
+    return futimens(node->fd, times) == 0;
+}
+
+QString MemoryVfs::owner(const QString &path)
+{
+    QMutexLocker locker(&m_mutex);
+    QSharedPointer<Node> node = find(path);
+    return node ? node->owner : QString();
+}
+
+void MemoryVfs::setOwner(const QString &path, const QString &user)
+{
+    QMutexLocker locker(&m_mutex);
+    QSharedPointer<Node> node = find(path);
+    if (node) {
+        node->owner = user;
+    }
+}
+
+bool MemoryVfs::syncDirectory(const QString &path)
+{
+    // Nothing here outlives the process anyway
+    Q_UNUSED(path);
+    return true;
+}
+
+QString MemoryVfs::localPath(const QString &path) const
+{
+    Q_UNUSED(path);
+    return QString();
+}
+
+QSharedPointer<MemoryVfs::Node> MemoryVfs::find(const QString &path) const
+{
+    QSharedPointer<Node> node = m_root;
+    const QStringList segments = path.split('/', Qt::SkipEmptyParts);
+    for (const QString &segment : segments) {
+        if (!node->isDir) {
+            return QSharedPointer<Node>();
+        }
+        node = node->children.value(segment);
+        if (!node) {
+            return node;
+        }
+    }
+    return node;
+}
+
+QSharedPointer<MemoryVfs::Node> MemoryVfs::findParent(const QString &path, QString *name) const
+{
+    int slash = path.lastIndexOf('/');
+    *name = path.mid(slash + 1);
+    return find(slash <= 0 ? QString() : path.left(slash));
+}
+
+Vfs::Entry MemoryVfs::entryFor(const QString &name, const Node &node)
+{
+    Entry entry;
+    entry.name = name;
+    entry.exists = true;
+    entry.isDir = node.isDir;
+    entry.modified = node.modified;
+
+    struct stat st;
+    if (!node.isDir && fstat(node.fd, &st) == 0) {
+        entry.size = st.st_size;
+        entry.modified = QDateTime::fromMSecsSinceEpoch(qint64(st.st_mtim.tv_sec) * 1000
+                                                        + st.st_mtim.tv_nsec / 1000000);
+    }
+    return entry;
+}
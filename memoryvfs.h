@@ -0,0 +1,54 @@
+#ifndef MEMORYVFS_H
+#define MEMORYVFS_H
+
+#include "vfs.h"
+#include <QMap>
+#include <QMutex>
+
+// Keeps the whole tree in memory, so the protocol layer can be measured
+// without disk I/O. Each file is an anonymous in-memory file (memfd on
+// Linux), which gives transfers the same descriptor-based path as files
+// on disk. Contents are lost when the backend is destroyed.
+class MemoryVfs : public Vfs
+{
+public:
+    MemoryVfs();
+
+    QString description() const override;
+    Entry stat(const QString &path) override;
+    bool list(const QString &path, bool includeHidden, QVector<Entry> *entries) override;
+    QSharedPointer<QFile> open(const QString &path, QIODevice::OpenMode mode) override;
+    bool rename(const QString &from, const QString &to, bool replace) override;
+    bool mkdir(const QString &path) override;
+    bool rmdir(const QString &path) override;
+    bool remove(const QString &path) override;
+    bool setModified(const QString &path, const QDateTime &modified) override;
+    QString owner(const QString &path) override;
+    void setOwner(const QString &path, const QString &user) override;
+    bool syncDirectory(const QString &path) override;
+    QString localPath(const QString &path) const override;
+
+private:
+    struct Node
+    {
+        Node();
+        ~Node();
+
+        bool isDir;
+        // Holds a file's contents, size and mtime; -1 for directories
+        int fd;
+        QDateTime modified;
+        QString owner;
+        QMap<QString, QSharedPointer<Node>> children;
+    };
+
+    // Called with m_mutex held
+    QSharedPointer<Node> find(const QString &path) const;
+    QSharedPointer<Node> findParent(const QString &path, QString *name) const;
+    static Entry entryFor(const QString &name, const Node &node);
+
+    mutable QMutex m_mutex;
+    QSharedPointer<Node> m_root;
+};
+
+#endif // MEMORYVFS_H
@@ -0,0 +1,176 @@
+#include "pathindex.h"
+#include <algorithm>
+
+namespace {
+
+// Below this many removals a sweep isn't worth the work
+const int MinSweep = 65536;
+
+// Postings checked per step of a sweep, so no add or remove takes long
+const int SweepBudget = 16384;
+
+QStringRef nameOf(const QString &path)
+{
+    return path.midRef(path.lastIndexOf('/') + 1);
+}
+
+}
+
+bool PathIndex::Search::atEnd() const
+{
+    return m_position >= m_end;
+}
+
+QByteArray PathIndex::Search::next(int maxBytes)
+{
+    QByteArray out;
+    int checked = 0;
+    while (m_position < m_end && out.size() < maxBytes && checked < MaxChecksPerBatch) {
+        quint32 id = m_all ? quint32(m_position) : m_candidates.at(m_position);
+        ++m_position;
+        ++checked;
+
+        // The entry may have been removed since the search started
+        if (int(id) >= m_index->m_paths.size()) {
+            continue;
+        }
+        const QString &path = m_index->m_paths.at(int(id));
+        if (!path.isNull() && m_pattern.match(nameOf(path)).hasMatch()) {
+            out += '/' + path.toUtf8() + "\r\n";
+        }
+    }
+    return out;
+}
+
+PathIndex::PathIndex() :
+    m_live(0)
+{
+}
+
+quint32 PathIndex::add(const QString &path)
+{
+    if (!m_sweepIds.isEmpty()) {
+        sweepStep();
+    }
+
+    quint32 id;
+    if (!m_free.isEmpty()) {
+        id = m_free.takeLast();
+        m_paths[int(id)] = path;
+    } else {
+        id = quint32(m_paths.size());
+        m_paths.append(path);
+    }
+    ++m_live;
+
+    QString name = nameOf(path).toString().toCaseFolded();
+    for (int i = 0; i + 3 <= name.size(); ++i) {
+        QVector<quint32> &posting = m_postings[trigram(name.constData() + i)];
+        // A name repeating a trigram is only filed once
+        if (posting.isEmpty() || posting.last() != id) {
+            posting.append(id);
+        }
+    }
+    return id;
+}
+
+void PathIndex::remove(quint32 id)
+{
+    if (id == NoId || int(id) >= m_paths.size() || m_paths.at(int(id)).isNull()) {
+        return;
+    }
+
+    m_paths[int(id)] = QString();
+    --m_live;
+    m_removed.append(id);
+
+    // Ids removed from here on wait for the next sweep
+    if (m_sweepIds.isEmpty() && m_removed.size() >= MinSweep && m_removed.size() > m_live) {
+        m_sweepIds.swap(m_removed);
+        m_sweepKeys = m_postings.keys().toVector();
+    }
+    if (!m_sweepIds.isEmpty()) {
+        sweepStep();
+    }
+}
+
+int PathIndex::size() const
+{
+    return m_live;
+}
+
+QSharedPointer<PathIndex::Search> PathIndex::search(const QSharedPointer<PathIndex> &index,
+                                                    const QString &pattern)
+{
+    bool wildcard = pattern.contains(QRegularExpression("[*?\\[]"));
+    QString glob = wildcard ? pattern : '*' + pattern + '*';
+
+    QSharedPointer<Search> search(new Search);
+    search->m_index = index;
+    search->m_pattern = QRegularExpression(QRegularExpression::wildcardToRegularExpression(glob),
+                                           QRegularExpression::CaseInsensitiveOption);
+    // Compiled up front rather than on the first of many matches
+    search->m_pattern.optimize();
+    search->m_all = true;
+    search->m_position = 0;
+
+    // Every literal run of the pattern has to appear in a match; the
+    // rarest trigram among them gives the fewest candidates
+    const QVector<quint32> *best = nullptr;
+    bool impossible = false;
+    const QStringList runs = pattern.toCaseFolded().split(QRegularExpression("\\[[^\\]]*\\]?|[*?\\\\]"),
+                                                          Qt::SkipEmptyParts);
+    for (const QString &run : runs) {
+        for (int i = 0; i + 3 <= run.size() && !impossible; ++i) {
+            auto posting = index->m_postings.constFind(trigram(run.constData() + i));
+            if (posting == index->m_postings.constEnd()) {
+                impossible = true;
+            } else if (!best || posting->size() < best->size()) {
+                best = &posting.value();
+            }
+        }
+    }
+
+    if (impossible) {
+        search->m_all = false;
+    } else if (best) {
+        search->m_all = false;
+        search->m_candidates = *best;
+    }
+    search->m_end = search->m_all ? index->m_paths.size() : search->m_candidates.size();
+    return search;
+}
+
+quint64 PathIndex::trigram(const QChar *chars)
+{
+    return (quint64(chars[0].unicode()) << 32) | (quint64(chars[1].unicode()) << 16)
+        | chars[2].unicode();
+}
+
+void PathIndex::sweepStep()
+{
+    // Posting lists created since the sweep started can't hold its ids
+    int checked = 0;
+    while (!m_sweepKeys.isEmpty() && checked < SweepBudget) {
+        auto it = m_postings.find(m_sweepKeys.takeLast());
+        if (it == m_postings.end()) {
+            continue;
+        }
+
+        QVector<quint32> &posting = it.value();
+        checked += posting.size();
+        posting.erase(std::remove_if(posting.begin(), posting.end(), [this](quint32 id) {
+            return m_paths.at(int(id)).isNull();
+        }), posting.end());
+
+        if (posting.isEmpty()) {
+            m_postings.erase(it);
+        }
+    }
+
+    // Only now that no posting refers to them can the ids be reused
+    if (m_sweepKeys.isEmpty()) {
+        m_free += m_sweepIds;
+        m_sweepIds.clear();
+    }
+}
@@ -0,0 +1,80 @@
+#ifndef PATHINDEX_H
+#define PATHINDEX_H
+
+#include <QHash>
+#include <QRegularExpression>
+#include <QSharedPointer>
+#include <QString>
+#include <QVector>
+
+// Trigram index over the names of everything in the manifest, for SITE
+// FIND. Every name is filed under each case-folded trigram it contains,
+// so a pattern is only checked against the entries holding its rarest
+// trigram. Paths are the manifest's own keys, shared rather than copied.
+//
+// Removal is lazy: a removed entry's slot is emptied, and once removals
+// outnumber live entries the posting lists are swept a few at a time,
+// alongside the adds and removes that follow.
+class PathIndex
+{
+public:
+    static const quint32 NoId = 0xffffffff;
+
+    // Matches for one pattern, checked a batch at a time as they are
+    // written out, so even a pattern the index can't narrow down never
+    // holds up the event loop for long
+    class Search
+    {
+    public:
+        bool atEnd() const;
+
+        // One "/path\r\n" line per match; may be empty before the end
+        // when a batch turned up nothing
+        QByteArray next(int maxBytes);
+
+    private:
+        friend class PathIndex;
+
+        static const int MaxChecksPerBatch = 50000;
+
+        QSharedPointer<PathIndex> m_index;
+        QRegularExpression m_pattern;
+        // Without a usable trigram every entry is a candidate
+        bool m_all;
+        QVector<quint32> m_candidates;
+        int m_position;
+        int m_end;
+    };
+
+    PathIndex();
+
+    // path is relative to the root
+    quint32 add(const QString &path);
+    void remove(quint32 id);
+
+    int size() const;
+
+    // pattern is a shell wildcard matched against names, case-insensitively;
+    // one without wildcards matches names containing it
+    static QSharedPointer<Search> search(const QSharedPointer<PathIndex> &index,
+                                         const QString &pattern);
+
+private:
+    static quint64 trigram(const QChar *chars);
+    void sweepStep();
+
+    // Indexed by id; null once removed
+    QVector<QString> m_paths;
+    QHash<quint64, QVector<quint32>> m_postings;
+    // Ids whose stale postings have been swept, free for reuse
+    QVector<quint32> m_free;
+    // Removed since the last sweep started
+    QVector<quint32> m_removed;
+    // Sweep under way: the ids it frees once the posting lists still to
+    // visit are done
+    QVector<quint32> m_sweepIds;
+    QVector<quint64> m_sweepKeys;
+    int m_live;
+};
+
+#endif // PATHINDEX_H
@@ -0,0 +1,610 @@
+#include "quotamanager.h"
+#include "fsservice.h"
+#include <QDataStream>
+#include <QFile>
+#include <QRegularExpression>
+#include <QSaveFile>
+#include <QSemaphore>
+#include <QSet>
+#include <QTextStream>
+#include <QDebug>
+
+namespace {
+
+const quint32 JournalMagic = 0x46545051; // "FTPQ"
+const quint8 JournalVersion = 1;
+
+enum JournalOp : quint8 { SetRecord = 0, AddRecord = 1 };
+
+// Appends records to the journal, or with snapshot set replaces it
+bool writeJournal(const QString &path, const QByteArray &records, bool snapshot)
+{
+    QByteArray header;
+    {
+        QDataStream out(&header, QIODevice::WriteOnly);
+        out << JournalMagic << JournalVersion;
+    }
+
+    if (snapshot) {
+        QSaveFile file(path);
+        if (!file.open(QIODevice::WriteOnly)) {
+            return false;
+        }
+        file.write(header);
+        file.write(records);
+        return file.commit();
+    }
+
+    QFile file(path);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Append)) {
+        return false;
+    }
+    if (file.size() == 0) {
+        file.write(header);
+    }
+    return file.write(records) == records.size();
+}
+
+qint64 parseSize(const QString &text, bool *ok)
+{
+    static const QRegularExpression pattern("^(\\d+)([KMGT]?)$",
+                                            QRegularExpression::CaseInsensitiveOption);
+    QRegularExpressionMatch match = pattern.match(text.trimmed());
+    *ok = match.hasMatch();
+    if (!*ok) {
+        return 0;
+    }
+
+    qint64 value = match.captured(1).toLongLong();
+    QString unit = match.captured(2).toUpper();
+    switch (unit.isEmpty() ? 0 : unit.at(0).unicode()) {
+    case 'T': value *= 1024;
+        Q_FALLTHROUGH();
+    case 'G': value *= 1024;
+        Q_FALLTHROUGH();
+    case 'M': value *= 1024;
+        Q_FALLTHROUGH();
+    case 'K': value *= 1024;
+        break;
+    default:
+        break;
+    }
+    return value;
+}
+
+QString formatSize(qint64 bytes)
+{
+    return QString("%1 MiB").arg(double(bytes) / (1024 * 1024), 0, 'f', 1);
+}
+
+}
+
+QuotaManager::QuotaManager(FsService *fs, QObject *parent) : QObject(parent),
+    m_fs(fs),
+    m_journalBusy(false),
+    m_compact(false),
+    m_journalRecords(0),
+    m_reconciling(false),
+    m_generation(0)
+{
+    m_flushTimer.setSingleShot(true);
+    m_flushTimer.setInterval(FlushDelay);
+    connect(&m_flushTimer, &QTimer::timeout, this, &QuotaManager::flushJournal);
+
+    m_reconcileTimer.setInterval(ReconcileInterval);
+    connect(&m_reconcileTimer, &QTimer::timeout, this, &QuotaManager::reconcile);
+}
+
+QuotaManager::~QuotaManager()
+{
+    // Last deltas are written synchronously, after any write still on the
+    // pool, which may be a snapshot that would replace them
+    if (m_journalBusy) {
+        m_journalWritten->acquire();
+    }
+    if (!m_unflushed.isEmpty() && !m_journalPath.isEmpty()) {
+        QByteArray records;
+        QDataStream out(&records, QIODevice::WriteOnly);
+        for (auto it = m_unflushed.constBegin(); it != m_unflushed.constEnd(); ++it) {
+            out << quint8(AddRecord) << it.key() << it.value();
+        }
+        writeJournal(m_journalPath, records, false);
+    }
+}
+
+void QuotaManager::setStorage(const QSharedPointer<Vfs> &vfs, const QString &journalPath)
+{
+    if (vfs == m_vfs && journalPath == m_journalPath) {
+        return;
+    }
+
+    flushJournal();
+
+    ++m_generation;
+    m_vfs = vfs;
+    m_journalPath = journalPath;
+    m_usage.clear();
+    m_unflushed.clear();
+    m_scanDeltas.clear();
+    m_reconciling = false;
+
+    loadJournal();
+    m_reconcileTimer.start();
+}
+
+bool QuotaManager::loadConfig(const QString &path)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly | QIODevice::Text)) {
+        return false;
+    }
+
+    bool newDirectory = false;
+    QTextStream in(&file);
+    while (!in.atEnd()) {
+        QString line = in.readLine().trimmed();
+        if (line.isEmpty() || line.startsWith('#')) {
+            continue;
+        }
+
+        QStringList fields = line.split(QRegularExpression("\\s+"));
+        bool ok = false;
+        qint64 limit = fields.size() == 3 ? parseSize(fields.at(2), &ok) : 0;
+        if (!ok) {
+            qDebug() << "Ignoring quota line:" << line;
+            continue;
+        }
+
+        if (fields.at(0) == "user") {
+            setUserQuota(fields.at(1), limit);
+        } else if (fields.at(0) == "dir") {
+            newDirectory |= !m_limits.contains(directoryKey(fields.at(1)));
+            setDirectoryQuota(fields.at(1), limit);
+        }
+    }
+
+    // Directory counters are only kept for directories with a quota, so a
+    // new one starts out unknown
+    if (newDirectory) {
+        reconcile();
+    }
+    return true;
+}
+
+void QuotaManager::setUserQuota(const QString &user, qint64 bytes)
+{
+    if (bytes < 0) {
+        m_limits.remove(userKey(user));
+    } else {
+        m_limits.insert(userKey(user), bytes);
+    }
+}
+
+void QuotaManager::setDirectoryQuota(const QString &path, qint64 bytes)
+{
+    if (bytes < 0) {
+        m_limits.remove(directoryKey(path));
+    } else {
+        m_limits.insert(directoryKey(path), bytes);
+    }
+}
+
+qint64 QuotaManager::remaining(const QString &user, const QString &path) const
+{
+    qint64 result = -1;
+
+    QStringList keys = scopesFor(path);
+    keys.append(userKey(user));
+    for (const QString &key : keys) {
+        QHash<QString, qint64>::const_iterator limit = m_limits.constFind(key);
+        if (limit == m_limits.constEnd()) {
+            continue;
+        }
+        qint64 left = qMax<qint64>(0, limit.value() - m_usage.value(key));
+        result = result < 0 ? left : qMin(result, left);
+    }
+
+    return result;
+}
+
+QStringList QuotaManager::report(const QString &user) const
+{
+    QStringList lines;
+
+    QString key = userKey(user);
+    QString limit = m_limits.contains(key) ? formatSize(m_limits.value(key)) : QString("unlimited");
+    lines.append(QString("user %1: %2 of %3").arg(user, formatSize(m_usage.value(key)), limit));
+
+    QStringList directories;
+    for (auto it = m_limits.constBegin(); it != m_limits.constEnd(); ++it) {
+        if (it.key().startsWith("d:")) {
+            directories.append(it.key());
+        }
+    }
+    directories.sort();
+    for (const QString &directory : directories) {
+        lines.append(QString("dir %1: %2 of %3").arg(directory.mid(2),
+                                                     formatSize(m_usage.value(directory)),
+                                                     formatSize(m_limits.value(directory))));
+    }
+
+    if (m_reconciling) {
+        lines.append("recount in progress");
+    }
+    return lines;
+}
+
+void QuotaManager::recordStored(const QString &user, const QString &path, qint64 bytes,
+                                const Usage &replaced)
+{
+    qint64 oldBytes = replaced.exists && !replaced.isDir ? replaced.bytes : 0;
+
+    for (const QString &key : scopesFor(path)) {
+        add(key, bytes - oldBytes);
+    }
+
+    if (oldBytes > 0 && !replaced.owner.isEmpty()) {
+        add(userKey(replaced.owner), -oldBytes);
+    }
+    add(userKey(user), bytes);
+}
+
+void QuotaManager::recordRemoved(const QString &path, const Usage &removed)
+{
+    if (!removed.exists) {
+        return;
+    }
+
+    if (removed.isDir) {
+        // RMD only removes empty directories
+        if (m_usage.contains(directoryKey(path))) {
+            add(directoryKey(path), -m_usage.value(directoryKey(path)));
+        }
+        return;
+    }
+
+    for (const QString &key : scopesFor(path)) {
+        add(key, -removed.bytes);
+    }
+    if (!removed.owner.isEmpty()) {
+        add(userKey(removed.owner), -removed.bytes);
+    }
+}
+
+void QuotaManager::recordMoved(const QString &from, const QString &to, const Usage &moved)
+{
+    // Quotas on the moved directory and below move with it
+    QString fromPrefix = directoryKey(from);
+    QList<QString> keys = m_limits.keys();
+    for (const QString &key : keys) {
+        if (key != fromPrefix && !key.startsWith(fromPrefix + '/')) {
+            continue;
+        }
+        QString newKey = directoryKey(to) + key.mid(fromPrefix.size());
+        m_limits.insert(newKey, m_limits.take(key));
+        if (m_usage.contains(key)) {
+            qint64 usage = m_usage.value(key);
+            add(key, -usage);
+            add(newKey, usage);
+        }
+    }
+
+    if (!moved.exists) {
+        return;
+    }
+
+    QStringList fromScopes = scopesFor(from);
+    QStringList toScopes = scopesFor(to);
+    for (const QString &key : fromScopes) {
+        if (!toScopes.contains(key)) {
+            add(key, -moved.bytes);
+        }
+    }
+    for (const QString &key : toScopes) {
+        if (!fromScopes.contains(key)) {
+            add(key, moved.bytes);
+        }
+    }
+}
+
+bool QuotaManager::affectsDirectoryQuotas(const QString &from, const QString &to) const
+{
+    QStringList fromScopes = scopesFor(from);
+    QStringList toScopes = scopesFor(to);
+    fromScopes.sort();
+    toScopes.sort();
+    return fromScopes != toScopes;
+}
+
+QuotaManager::Usage QuotaManager::measure(Vfs *vfs, const QString &path, bool recursive)
+{
+    Usage usage;
+
+    Vfs::Entry entry = vfs->stat(path);
+    if (!entry.exists) {
+        return usage;
+    }
+
+    // A symlink takes no quota, whatever it points to
+    usage.exists = true;
+    usage.isDir = entry.isDir && !entry.isSymLink;
+    if (entry.isSymLink) {
+        return usage;
+    }
+    if (!usage.isDir) {
+        usage.bytes = entry.size;
+        usage.owner = vfs->owner(path);
+        return usage;
+    }
+
+    if (recursive) {
+        usage.bytes = treeSize(vfs, path);
+    }
+    return usage;
+}
+
+qint64 QuotaManager::treeSize(Vfs *vfs, const QString &path)
+{
+    qint64 bytes = 0;
+    QStringList pending(path);
+    while (!pending.isEmpty()) {
+        QString directory = pending.takeLast();
+        QVector<Vfs::Entry> entries;
+        vfs->list(directory, true, &entries);
+        for (const Vfs::Entry &entry : entries) {
+            if (entry.isSymLink) {
+                continue;
+            }
+            if (entry.isDir) {
+                pending.append((directory == "/" ? QString() : directory) + '/' + entry.name);
+            } else {
+                bytes += entry.size;
+            }
+        }
+    }
+    return bytes;
+}
+
+void QuotaManager::reconcile()
+{
+    if (m_reconciling || !m_vfs) {
+        return;
+    }
+
+    QStringList directories;
+    for (auto it = m_limits.constBegin(); it != m_limits.constEnd(); ++it) {
+        if (it.key().startsWith("d:")) {
+            directories.append(it.key().mid(2));
+        }
+    }
+
+    m_reconciling = true;
+    m_scanDeltas.clear();
+
+    QSharedPointer<Vfs> vfs = m_vfs;
+    quint32 generation = m_generation;
+    m_fs->submit<ScanResult>(this, [vfs, directories]() {
+        return scan(vfs.data(), directories);
+    }, [this, generation](const ScanResult &result) {
+        if (generation != m_generation) {
+            return;
+        }
+
+        // Files changed after the scan passed them are only in the deltas;
+        // the next recount settles any that were counted twice
+        QHash<QString, qint64> usage = result.usage;
+        for (auto it = m_scanDeltas.constBegin(); it != m_scanDeltas.constEnd(); ++it) {
+            usage[it.key()] += it.value();
+        }
+
+        m_usage = usage;
+        m_unflushed.clear();
+        m_scanDeltas.clear();
+        m_reconciling = false;
+
+        m_compact = true;
+        flushJournal();
+    });
+}
+
+QuotaManager::ScanResult QuotaManager::scan(Vfs *vfs, const QStringList &directories)
+{
+    ScanResult result;
+
+    QSet<QString> quotaDirectories(directories.begin(), directories.end());
+    for (const QString &directory : directories) {
+        result.usage.insert(directoryKey(directory), 0);
+    }
+
+    QStringList pending(QString("/"));
+    while (!pending.isEmpty()) {
+        QString directory = pending.takeLast();
+        QString prefix = directory == "/" ? QString() : directory;
+        QVector<Vfs::Entry> entries;
+        vfs->list(directory, true, &entries);
+
+        for (const Vfs::Entry &entry : entries) {
+            // Symlinks are not storage, and unfinished atomic uploads aren't yet
+            if (entry.isSymLink || (entry.name.startsWith('.') && entry.name.endsWith(".part"))) {
+                continue;
+            }
+
+            QString path = prefix + '/' + entry.name;
+            if (entry.isDir) {
+                pending.append(path);
+                continue;
+            }
+
+            qint64 size = entry.size;
+            QString owner = vfs->owner(path);
+            if (!owner.isEmpty()) {
+                result.usage[userKey(owner)] += size;
+            }
+
+            // Charge every quota directory above the file
+            int slash = path.lastIndexOf('/');
+            while (slash >= 0 && !quotaDirectories.isEmpty()) {
+                QString ancestor = slash == 0 ? QString("/") : path.left(slash);
+                if (quotaDirectories.contains(ancestor)) {
+                    result.usage[directoryKey(ancestor)] += size;
+                }
+                if (slash == 0) {
+                    break;
+                }
+                slash = path.lastIndexOf('/', slash - 1);
+            }
+        }
+    }
+
+    return result;
+}
+
+QString QuotaManager::userKey(const QString &user)
+{
+    return "u:" + user;
+}
+
+QString QuotaManager::directoryKey(const QString &path)
+{
+    // Stored without a trailing slash, except for the root itself
+    QString normalized = path;
+    while (normalized.size() > 1 && normalized.endsWith('/')) {
+        normalized.chop(1);
+    }
+    return "d:" + normalized;
+}
+
+QStringList QuotaManager::scopesFor(const QString &path) const
+{
+    QStringList scopes;
+
+    // Directory quotas above path; a handful of hash lookups at most
+    int slash = path.lastIndexOf('/');
+    while (slash >= 0) {
+        QString key = directoryKey(slash == 0 ? QString("/") : path.left(slash));
+        if (m_limits.contains(key)) {
+            scopes.append(key);
+        }
+        if (slash == 0) {
+            break;
+        }
+        slash = path.lastIndexOf('/', slash - 1);
+    }
+
+    return scopes;
+}
+
+void QuotaManager::add(const QString &key, qint64 delta)
+{
+    if (delta == 0) {
+        return;
+    }
+
+    m_usage[key] += delta;
+    m_unflushed[key] += delta;
+    if (m_reconciling) {
+        m_scanDeltas[key] += delta;
+    }
+
+    if (!m_flushTimer.isActive()) {
+        m_flushTimer.start();
+    }
+}
+
+void QuotaManager::loadJournal()
+{
+    QFile file(m_journalPath);
+    if (!file.open(QIODevice::ReadOnly)) {
+        // First run on this root; count what is there
+        reconcile();
+        return;
+    }
+
+    QDataStream in(&file);
+    quint32 magic = 0;
+    quint8 version = 0;
+    in >> magic >> version;
+    if (magic != JournalMagic || version != JournalVersion) {
+        qDebug() << "Quota journal unreadable, recounting:" << m_journalPath;
+        reconcile();
+        return;
+    }
+
+    int records = 0;
+    while (!in.atEnd()) {
+        quint8 op;
+        QString key;
+        qint64 value;
+        in >> op >> key >> value;
+        if (in.status() != QDataStream::Ok) {
+            // A record cut short by a crash; the recount fixes the rest
+            reconcile();
+            break;
+        }
+
+        if (op == SetRecord) {
+            m_usage.insert(key, value);
+        } else {
+            m_usage[key] += value;
+        }
+        ++records;
+    }
+
+    m_journalRecords = records;
+    m_compact = records > MaxJournalRecords;
+}
+
+void QuotaManager::flushJournal()
+{
+    m_flushTimer.stop();
+
+    if (m_journalPath.isEmpty()) {
+        m_unflushed.clear();
+        return;
+    }
+    if (m_unflushed.isEmpty() && !m_compact) {
+        return;
+    }
+
+    // One write at a time, so records land in order
+    if (m_journalBusy) {
+        return;
+    }
+
+    QByteArray records;
+    QDataStream out(&records, QIODevice::WriteOnly);
+    bool snapshot = m_compact || m_journalRecords + m_unflushed.size() > MaxJournalRecords;
+    if (snapshot) {
+        for (auto it = m_usage.constBegin(); it != m_usage.constEnd(); ++it) {
+            out << quint8(SetRecord) << it.key() << it.value();
+        }
+        m_journalRecords = m_usage.size();
+    } else {
+        for (auto it = m_unflushed.constBegin(); it != m_unflushed.constEnd(); ++it) {
+            out << quint8(AddRecord) << it.key() << it.value();
+        }
+        m_journalRecords += m_unflushed.size();
+    }
+    m_unflushed.clear();
+    m_compact = false;
+
+    m_journalBusy = true;
+    m_journalWritten.reset(new QSemaphore);
+    QString path = m_journalPath;
+    QSharedPointer<QSemaphore> written = m_journalWritten;
+    m_fs->submit<bool>(this, [path, records, snapshot, written]() {
+        bool ok = writeJournal(path, records, snapshot);
+        written->release();
+        return ok;
+    }, [this](bool ok) {
+        m_journalBusy = false;
+        if (!ok) {
+            qDebug() << "Failed to write quota journal" << m_journalPath;
+        }
+
+        // Deltas that arrived during the write
+        if (!m_unflushed.isEmpty() && !m_flushTimer.isActive()) {
+            m_flushTimer.start();
+        }
+    });
+}
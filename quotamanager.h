@@ -0,0 +1,115 @@
+#ifndef QUOTAMANAGER_H
+#define QUOTAMANAGER_H
+
+#include <QObject>
+#include <QHash>
+#include <QSharedPointer>
+#include <QStringList>
+#include <QTimer>
+#include "vfs.h"
+
+class FsService;
+class QSemaphore;
+
+// Per-user and per-directory storage quotas. Usage counters are kept
+// current from the server's own STOR, DELE, RNTO and RMD, so checking an
+// upload never touches the disk. Changes are appended to a small journal
+// that is replayed at startup, and a background scan now and then resets
+// the counters to what is actually on disk.
+//
+// Paths are relative to the server root ("/pub/file"). A file counts
+// against the user who stored it, as recorded by the storage backend.
+class QuotaManager : public QObject
+{
+    Q_OBJECT
+public:
+    // What a path contributes to usage
+    struct Usage
+    {
+        bool exists = false;
+        bool isDir = false;
+        qint64 bytes = 0;
+        QString owner;
+    };
+
+    explicit QuotaManager(FsService *fs, QObject *parent = nullptr);
+    ~QuotaManager();
+
+    // Without a journal path, usage is only kept in memory
+    void setStorage(const QSharedPointer<Vfs> &vfs, const QString &journalPath);
+
+    // Lines of "user <name> <limit>" or "dir <path> <limit>"; limits take
+    // K, M, G and T suffixes
+    bool loadConfig(const QString &path);
+
+    // A negative limit removes the quota
+    void setUserQuota(const QString &user, qint64 bytes);
+    void setDirectoryQuota(const QString &path, qint64 bytes);
+
+    // Bytes user may still store at path, or -1 if no quota applies
+    qint64 remaining(const QString &user, const QString &path) const;
+
+    // Human-readable usage of the quotas that apply to user
+    QStringList report(const QString &user) const;
+
+    void recordStored(const QString &user, const QString &path, qint64 bytes, const Usage &replaced);
+    void recordRemoved(const QString &path, const Usage &removed);
+    void recordMoved(const QString &from, const QString &to, const Usage &moved);
+
+    // Whether a rename moves bytes between directory quotas, in which case
+    // the size of the whole subtree is needed
+    bool affectsDirectoryQuotas(const QString &from, const QString &to) const;
+
+    // Run on the filesystem pool
+    static Usage measure(Vfs *vfs, const QString &path, bool recursive);
+
+    // Recount usage from disk in the background
+    void reconcile();
+
+private slots:
+    void flushJournal();
+
+private:
+    struct ScanResult
+    {
+        QHash<QString, qint64> usage;
+    };
+
+    static ScanResult scan(Vfs *vfs, const QStringList &directories);
+    static qint64 treeSize(Vfs *vfs, const QString &path);
+    static QString userKey(const QString &user);
+    static QString directoryKey(const QString &path);
+
+    QStringList scopesFor(const QString &path) const;
+    void add(const QString &key, qint64 delta);
+    void loadJournal();
+
+    static const int FlushDelay = 1000;
+    static const int ReconcileInterval = 6 * 60 * 60 * 1000;
+    static const int MaxJournalRecords = 4096;
+
+    FsService *m_fs;
+    QSharedPointer<Vfs> m_vfs;
+    QString m_journalPath;
+
+    QHash<QString, qint64> m_limits;
+    QHash<QString, qint64> m_usage;
+
+    // Deltas not yet written to the journal
+    QHash<QString, qint64> m_unflushed;
+    bool m_journalBusy;
+    // Released by the pool once the write in flight is on disk
+    QSharedPointer<QSemaphore> m_journalWritten;
+    bool m_compact;
+    int m_journalRecords;
+    QTimer m_flushTimer;
+
+    // Changes made while a reconciliation scan is running are reapplied
+    // on top of its result
+    bool m_reconciling;
+    QHash<QString, qint64> m_scanDeltas;
+    QTimer m_reconcileTimer;
+    quint32 m_generation;
+};
+
+#endif // QUOTAMANAGER_H
@@ -0,0 +1,1248 @@
+#include "s3vfs.h"
+#include <QCryptographicHash>
+#include <QElapsedTimer>
+#include <QEventLoop>
+#include <QHash>
+#include <QMap>
+#include <QMessageAuthenticationCode>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QNetworkAccessManager>
+#include <QNetworkReply>
+#include <QNetworkRequest>
+#include <QPointer>
+#include <QRegularExpression>
+#include <QTextStream>
+#include <QThreadStorage>
+#include <QTimer>
+#include <QXmlStreamReader>
+#include <QDebug>
+#include <algorithm>
+#include <cerrno>
+
+namespace {
+
+using Query = QList<QPair<QString, QString>>;
+using Headers = QList<QPair<QByteArray, QByteArray>>;
+
+const char OwnerHeader[] = "x-amz-meta-ftp-owner";
+
+// S3 rejects multipart parts smaller than this, except the last
+const qint64 MinPartSize = 5 * 1024 * 1024;
+
+const int RequestTimeout = 60000;
+
+struct Response
+{
+    int status = 0;
+    QByteArray body;
+    QHash<QByteArray, QByteArray> headers;
+    QDateTime lastModified;
+
+    bool ok() const { return status >= 200 && status < 300; }
+};
+
+Response responseFor(QNetworkReply *reply)
+{
+    Response response;
+    response.status = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+    response.body = reply->readAll();
+    response.lastModified = reply->header(QNetworkRequest::LastModifiedHeader).toDateTime();
+    for (const QNetworkReply::RawHeaderPair &header : reply->rawHeaderPairs()) {
+        response.headers.insert(header.first.toLower(), header.second);
+    }
+    return response;
+}
+
+// Each thread gets its own: pool threads block on theirs, streams run
+// on the session's event loop
+QNetworkAccessManager *threadNetwork()
+{
+    static QThreadStorage<QNetworkAccessManager *> networks;
+    if (!networks.hasLocalData()) {
+        networks.setLocalData(new QNetworkAccessManager);
+    }
+    return networks.localData();
+}
+
+// Drops a request nobody is waiting for any more
+void discard(QNetworkReply *reply)
+{
+    reply->disconnect();
+    reply->abort();
+    reply->deleteLater();
+}
+
+// Completions never run inside the call that asked for them, and are
+// dropped if owner has gone
+void deliver(const QPointer<QObject> &owner, std::function<void()> call)
+{
+    if (owner) {
+        QMetaObject::invokeMethod(owner.data(), call, Qt::QueuedConnection);
+    }
+}
+
+QByteArray hmac(const QByteArray &key, const QByteArray &message)
+{
+    return QMessageAuthenticationCode::hash(message, key, QCryptographicHash::Sha256);
+}
+
+QByteArray sha256Hex(const QByteArray &data)
+{
+    return QCryptographicHash::hash(data, QCryptographicHash::Sha256).toHex();
+}
+
+QByteArray encodeKey(const QString &key)
+{
+    // Every segment is encoded, but the slashes between them are not
+    QByteArray encoded;
+    const QStringList segments = key.split('/');
+    for (int i = 0; i < segments.size(); ++i) {
+        if (i > 0) {
+            encoded += '/';
+        }
+        encoded += QUrl::toPercentEncoding(segments.at(i));
+    }
+    return encoded;
+}
+
+qint64 parseSize(const QString &text, bool *ok)
+{
+    static const QRegularExpression pattern("^(\\d+)([KMG]?)$",
+                                            QRegularExpression::CaseInsensitiveOption);
+    QRegularExpressionMatch match = pattern.match(text);
+    *ok = match.hasMatch();
+    qint64 value = match.captured(1).toLongLong();
+    int shift = QString("KMG").indexOf(match.captured(2).toUpper()) + 1;
+    return match.captured(2).isEmpty() ? value : value << (10 * shift);
+}
+
+QString parentOf(const QString &path)
+{
+    int slash = path.lastIndexOf('/');
+    return slash <= 0 ? QString() : path.left(slash);
+}
+
+bool isRoot(const QString &path)
+{
+    return path.isEmpty() || path == "/";
+}
+
+}
+
+// What the backend and its streams share: the configuration, request
+// signing and the listing cache. Used from the pool and the session's
+// thread alike.
+class S3Bucket
+{
+public:
+    struct Object
+    {
+        QString key;
+        qint64 size = 0;
+        QDateTime modified;
+    };
+
+    struct Listing
+    {
+        QVector<Object> objects;
+        // Subdirectory prefixes, with their trailing '/'
+        QStringList prefixes;
+    };
+
+    explicit S3Bucket(const S3Vfs::Config &config);
+
+    const S3Vfs::Config &config() const { return m_config; }
+
+    QString key(const QString &path) const;
+    // Prefix of everything in a directory, ending in '/' unless it is the
+    // bucket's root
+    QString directoryKey(const QString &path) const;
+
+    QNetworkReply *send(QNetworkAccessManager *network, const QByteArray &method,
+                        const QString &key, const Query &query = Query(),
+                        const Headers &headers = Headers(),
+                        const QByteArray &body = QByteArray()) const;
+
+    // Blocks; for the pool
+    Response call(const QByteArray &method, const QString &key, const Query &query = Query(),
+                  const Headers &headers = Headers(), const QByteArray &body = QByteArray()) const;
+
+    // Every page of a prefix listing; delimited stops at the next '/'
+    bool listAll(const QString &prefix, bool delimited, Listing *listing) const;
+
+    // A directory's entries through the cache; false if the request failed
+    bool listDirectory(const QString &path, bool *exists, QVector<Vfs::Entry> *entries);
+    bool cachedEntry(const QString &path, Vfs::Entry *entry);
+    // Drops what is cached for path, its parent and anything below it
+    void invalidate(const QString &path);
+
+private:
+    struct CachedListing
+    {
+        QElapsedTimer age;
+        bool exists = false;
+        QVector<Vfs::Entry> entries;
+    };
+
+    QNetworkRequest request(const QByteArray &method, const QString &key, const Query &query,
+                            const Headers &headers) const;
+
+    S3Vfs::Config m_config;
+    QMutex m_cacheMutex;
+    QHash<QString, CachedListing> m_listings;
+};
+
+S3Bucket::S3Bucket(const S3Vfs::Config &config) :
+    m_config(config)
+{
+    if (!m_config.prefix.isEmpty() && !m_config.prefix.endsWith('/')) {
+        m_config.prefix += '/';
+    }
+    m_config.partSize = qMax(m_config.partSize, MinPartSize);
+    m_config.parallelParts = qMax(m_config.parallelParts, 1);
+    m_config.readAhead = qMax(m_config.readAhead, qint64(64 * 1024));
+}
+
+QString S3Bucket::key(const QString &path) const
+{
+    return m_config.prefix + path.mid(1);
+}
+
+QString S3Bucket::directoryKey(const QString &path) const
+{
+    return isRoot(path) ? m_config.prefix : key(path) + '/';
+}
+
+QNetworkRequest S3Bucket::request(const QByteArray &method, const QString &key,
+                                  const Query &query, const Headers &headers) const
+{
+    // AWS Signature Version 4, with path-style addressing so any endpoint
+    // works without wildcard DNS
+    QDateTime now = QDateTime::currentDateTimeUtc();
+    QByteArray amzDate = now.toString("yyyyMMdd'T'hhmmss'Z'").toLatin1();
+    QByteArray dateStamp = amzDate.left(8);
+    QByteArray payloadHash = "UNSIGNED-PAYLOAD";
+
+    QByteArray path = "/" + QUrl::toPercentEncoding(m_config.bucket) + "/" + encodeKey(key);
+
+    QList<QByteArray> queryItems;
+    for (const QPair<QString, QString> &item : query) {
+        queryItems.append(QUrl::toPercentEncoding(item.first) + "="
+                          + QUrl::toPercentEncoding(item.second));
+    }
+    std::sort(queryItems.begin(), queryItems.end());
+    QByteArray canonicalQuery = queryItems.join('&');
+
+    QByteArray host = m_config.endpoint.host().toLatin1();
+    int port = m_config.endpoint.port();
+    if (port > 0 && port != (m_config.endpoint.scheme() == "https" ? 443 : 80)) {
+        host += ":" + QByteArray::number(port);
+    }
+
+    QMap<QByteArray, QByteArray> signedHeaders;
+    signedHeaders.insert("host", host);
+    signedHeaders.insert("x-amz-content-sha256", payloadHash);
+    signedHeaders.insert("x-amz-date", amzDate);
+    for (const QPair<QByteArray, QByteArray> &header : headers) {
+        if (header.first.toLower().startsWith("x-amz-")) {
+            signedHeaders.insert(header.first.toLower(), header.second.trimmed());
+        }
+    }
+
+    QByteArray canonicalHeaders;
+    for (auto it = signedHeaders.constBegin(); it != signedHeaders.constEnd(); ++it) {
+        canonicalHeaders += it.key() + ":" + it.value() + "\n";
+    }
+    QByteArray signedNames = signedHeaders.keys().join(';');
+
+    QByteArray canonicalRequest = method + "\n" + path + "\n" + canonicalQuery + "\n"
+        + canonicalHeaders + "\n" + signedNames + "\n" + payloadHash;
+    QByteArray scope = dateStamp + "/" + m_config.region.toLatin1() + "/s3/aws4_request";
+    QByteArray stringToSign = "AWS4-HMAC-SHA256\n" + amzDate + "\n" + scope + "\n"
+        + sha256Hex(canonicalRequest);
+
+    QByteArray signingKey = hmac("AWS4" + m_config.secretKey.toUtf8(), dateStamp);
+    signingKey = hmac(signingKey, m_config.region.toLatin1());
+    signingKey = hmac(signingKey, "s3");
+    signingKey = hmac(signingKey, "aws4_request");
+    QByteArray signature = hmac(signingKey, stringToSign).toHex();
+
+    QByteArray base = m_config.endpoint.toString(QUrl::RemovePath | QUrl::RemoveQuery
+                                                 | QUrl::RemoveFragment | QUrl::RemoveUserInfo
+                                                 | QUrl::StripTrailingSlash).toLatin1();
+    QUrl url = QUrl::fromEncoded(base + path + (canonicalQuery.isEmpty() ? QByteArray()
+                                                                          : "?" + canonicalQuery));
+
+    QNetworkRequest request(url);
+    request.setHeader(QNetworkRequest::ContentTypeHeader, "application/octet-stream");
+    for (auto it = signedHeaders.constBegin(); it != signedHeaders.constEnd(); ++it) {
+        request.setRawHeader(it.key(), it.value());
+    }
+    for (const QPair<QByteArray, QByteArray> &header : headers) {
+        request.setRawHeader(header.first, header.second);
+    }
+    request.setRawHeader("Authorization", "AWS4-HMAC-SHA256 Credential="
+                         + m_config.accessKey.toUtf8() + "/" + scope
+                         + ", SignedHeaders=" + signedNames + ", Signature=" + signature);
+    return request;
+}
+
+QNetworkReply *S3Bucket::send(QNetworkAccessManager *network, const QByteArray &method,
+                              const QString &key, const Query &query, const Headers &headers,
+                              const QByteArray &body) const
+{
+    QNetworkRequest req = request(method, key, query, headers);
+    if (method == "GET") {
+        return network->get(req);
+    } else if (method == "HEAD") {
+        return network->head(req);
+    } else if (method == "PUT") {
+        return network->put(req, body);
+    } else if (method == "POST") {
+        return network->post(req, body);
+    }
+    return network->deleteResource(req);
+}
+
+Response S3Bucket::call(const QByteArray &method, const QString &key, const Query &query,
+                        const Headers &headers, const QByteArray &body) const
+{
+    QNetworkReply *reply = send(threadNetwork(), method, key, query, headers, body);
+    QEventLoop loop;
+    QObject::connect(reply, &QNetworkReply::finished, &loop, &QEventLoop::quit);
+    QTimer::singleShot(RequestTimeout, reply, &QNetworkReply::abort);
+    if (!reply->isFinished()) {
+        loop.exec();
+    }
+
+    Response response = responseFor(reply);
+    delete reply;
+    return response;
+}
+
+bool S3Bucket::listAll(const QString &prefix, bool delimited, Listing *listing) const
+{
+    QString token;
+    do {
+        Query query;
+        query.append(qMakePair(QString("list-type"), QString("2")));
+        query.append(qMakePair(QString("prefix"), prefix));
+        if (delimited) {
+            query.append(qMakePair(QString("delimiter"), QString("/")));
+        }
+        if (!token.isEmpty()) {
+            query.append(qMakePair(QString("continuation-token"), token));
+        }
+
+        Response response = call("GET", QString(), query);
+        if (!response.ok()) {
+            return false;
+        }
+
+        // Pages hold up to 1000 keys; IsTruncated says whether more follow
+        token.clear();
+        bool truncated = false;
+        Object object;
+        QXmlStreamReader xml(response.body);
+        while (!xml.atEnd()) {
+            xml.readNext();
+            if (xml.isEndElement() && xml.name() == QLatin1String("Contents")) {
+                listing->objects.append(object);
+                object = Object();
+                continue;
+            }
+            if (!xml.isStartElement()) {
+                continue;
+            }
+
+            if (xml.name() == QLatin1String("Key")) {
+                object.key = xml.readElementText();
+            } else if (xml.name() == QLatin1String("Size")) {
+                object.size = xml.readElementText().toLongLong();
+            } else if (xml.name() == QLatin1String("LastModified")) {
+                object.modified = QDateTime::fromString(xml.readElementText(), Qt::ISODateWithMs);
+            } else if (xml.name() == QLatin1String("Prefix")) {
+                // Besides CommonPrefixes, the response echoes the request's
+                QString text = xml.readElementText();
+                if (text != prefix) {
+                    listing->prefixes.append(text);
+                }
+            } else if (xml.name() == QLatin1String("IsTruncated")) {
+                truncated = xml.readElementText() == QLatin1String("true");
+            } else if (xml.name() == QLatin1String("NextContinuationToken")) {
+                token = xml.readElementText();
+            }
+        }
+        if (xml.hasError() || (truncated && token.isEmpty())) {
+            return false;
+        }
+    } while (!token.isEmpty());
+    return true;
+}
+
+bool S3Bucket::listDirectory(const QString &path, bool *exists, QVector<Vfs::Entry> *entries)
+{
+    QString dirPath = isRoot(path) ? QString() : path;
+    {
+        QMutexLocker locker(&m_cacheMutex);
+        auto it = m_listings.constFind(dirPath);
+        if (it != m_listings.constEnd() && !it->age.hasExpired(m_config.listingTtl)) {
+            *exists = it->exists;
+            *entries = it->entries;
+            return true;
+        }
+    }
+
+    QString prefix = directoryKey(path);
+    Listing listing;
+    if (!listAll(prefix, true, &listing)) {
+        return false;
+    }
+
+    // A prefix without a key under it is no directory; the empty "dir/"
+    // marker left by MKD counts as one
+    CachedListing cached;
+    cached.exists = isRoot(path) || !listing.objects.isEmpty() || !listing.prefixes.isEmpty();
+    for (const Object &object : qAsConst(listing.objects)) {
+        if (object.key == prefix) {
+            continue;
+        }
+        Vfs::Entry entry;
+        entry.name = object.key.mid(prefix.size());
+        entry.exists = true;
+        entry.size = object.size;
+        entry.modified = object.modified.toLocalTime();
+        cached.entries.append(entry);
+    }
+
+    // Listings don't date prefixes, so implied directories show as new
+    QDateTime now = QDateTime::currentDateTime();
+    for (const QString &subdirectory : qAsConst(listing.prefixes)) {
+        Vfs::Entry entry;
+        entry.name = subdirectory.mid(prefix.size()).chopped(1);
+        entry.exists = true;
+        entry.isDir = true;
+        entry.modified = now;
+        cached.entries.append(entry);
+    }
+    std::sort(cached.entries.begin(), cached.entries.end(),
+              [](const Vfs::Entry &a, const Vfs::Entry &b) { return a.name < b.name; });
+    cached.age.start();
+
+    *exists = cached.exists;
+    *entries = cached.entries;
+
+    QMutexLocker locker(&m_cacheMutex);
+    m_listings.insert(dirPath, cached);
+    return true;
+}
+
+bool S3Bucket::cachedEntry(const QString &path, Vfs::Entry *entry)
+{
+    QString parent = parentOf(path);
+    QString name = path.mid(path.lastIndexOf('/') + 1);
+
+    QMutexLocker locker(&m_cacheMutex);
+    auto it = m_listings.constFind(parent);
+    if (it == m_listings.constEnd() || it->age.hasExpired(m_config.listingTtl)) {
+        return false;
+    }
+
+    *entry = Vfs::Entry();
+    for (const Vfs::Entry &candidate : it->entries) {
+        if (candidate.name == name) {
+            *entry = candidate;
+            break;
+        }
+    }
+    return true;
+}
+
+void S3Bucket::invalidate(const QString &path)
+{
+    QMutexLocker locker(&m_cacheMutex);
+    m_listings.remove(parentOf(path));
+    for (auto it = m_listings.begin(); it != m_listings.end();) {
+        if (it.key() == path || it.key().startsWith(path + '/')) {
+            it = m_listings.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+namespace {
+
+// Fetches the object in windows of readAhead bytes with ranged GETs,
+// keeping the next window in flight while the current one is sent
+class S3ReadStream : public VfsStream
+{
+public:
+    S3ReadStream(const QSharedPointer<S3Bucket> &bucket, const QString &key, qint64 size);
+    ~S3ReadStream() override;
+
+    qint64 size() const override;
+    void read(qint64 offset, qint64 length, QObject *owner, Completion done) override;
+    void write(qint64 offset, const QByteArray &data, QObject *owner, Completion done) override;
+    void commit(QObject *owner, std::function<void(bool ok)> done) override;
+    void abort() override;
+
+private:
+    struct Window
+    {
+        // Null once the range has arrived
+        QNetworkReply *reply = nullptr;
+        QByteArray data;
+        bool failed = false;
+    };
+
+    struct Read
+    {
+        qint64 offset;
+        qint64 length;
+        QPointer<QObject> owner;
+        Completion done;
+    };
+
+    qint64 windowStart(qint64 offset) const;
+    void fetch(qint64 start);
+    void serve();
+
+    QSharedPointer<S3Bucket> m_bucket;
+    QString m_key;
+    qint64 m_size;
+    qint64 m_windowSize;
+    QMap<qint64, Window> m_windows;
+    QList<Read> m_reads;
+};
+
+S3ReadStream::S3ReadStream(const QSharedPointer<S3Bucket> &bucket, const QString &key,
+                           qint64 size) :
+    m_bucket(bucket),
+    m_key(key),
+    m_size(size),
+    m_windowSize(bucket->config().readAhead)
+{
+}
+
+S3ReadStream::~S3ReadStream()
+{
+    for (const Window &window : qAsConst(m_windows)) {
+        if (window.reply) {
+            discard(window.reply);
+        }
+    }
+}
+
+qint64 S3ReadStream::size() const
+{
+    return m_size;
+}
+
+void S3ReadStream::read(qint64 offset, qint64 length, QObject *owner, Completion done)
+{
+    QPointer<QObject> guard(owner);
+    if (offset >= m_size || length <= 0) {
+        deliver(guard, [done]() { done(0, QByteArray()); });
+        return;
+    }
+
+    qint64 start = windowStart(offset);
+    length = qMin(length, qMin(m_size, start + m_windowSize) - offset);
+
+    // Let go of windows the reader has moved past
+    qint64 needed = m_reads.isEmpty() ? start : qMin(start, windowStart(m_reads.first().offset));
+    for (auto it = m_windows.begin(); it != m_windows.end() && it.key() < needed;) {
+        if (it->reply) {
+            discard(it->reply);
+        }
+        it = m_windows.erase(it);
+    }
+
+    fetch(start);
+    if (start + m_windowSize < m_size) {
+        fetch(start + m_windowSize);
+    }
+
+    m_reads.append(Read{offset, length, guard, done});
+    serve();
+}
+
+void S3ReadStream::write(qint64 offset, const QByteArray &data, QObject *owner, Completion done)
+{
+    Q_UNUSED(offset);
+    Q_UNUSED(data);
+    deliver(owner, [done]() { done(-EBADF, QByteArray()); });
+}
+
+void S3ReadStream::commit(QObject *owner, std::function<void(bool ok)> done)
+{
+    deliver(owner, [done]() { done(false); });
+}
+
+void S3ReadStream::abort()
+{
+}
+
+qint64 S3ReadStream::windowStart(qint64 offset) const
+{
+    return offset - offset % m_windowSize;
+}
+
+void S3ReadStream::fetch(qint64 start)
+{
+    if (m_windows.contains(start)) {
+        return;
+    }
+
+    qint64 end = qMin(m_size, start + m_windowSize);
+    Headers headers;
+    headers.append(qMakePair(QByteArray("Range"), "bytes=" + QByteArray::number(start) + "-"
+                             + QByteArray::number(end - 1)));
+    QNetworkReply *reply = m_bucket->send(threadNetwork(), "GET", m_key, Query(), headers);
+    m_windows[start].reply = reply;
+
+    QObject::connect(reply, &QNetworkReply::finished, reply, [this, reply, start, end]() {
+        Window &window = m_windows[start];
+        Response response = responseFor(reply);
+        window.reply = nullptr;
+        reply->deleteLater();
+
+        // A store that ignores Range sends the whole object with a 200
+        if (response.status == 200 && start == 0) {
+            response.body.truncate(int(end));
+        }
+        window.failed = !response.ok() || response.body.size() != end - start;
+        window.data = response.body;
+        serve();
+    });
+}
+
+void S3ReadStream::serve()
+{
+    for (auto it = m_reads.begin(); it != m_reads.end();) {
+        auto window = m_windows.constFind(windowStart(it->offset));
+        if (window == m_windows.constEnd() || window->reply) {
+            ++it;
+            continue;
+        }
+
+        Completion done = it->done;
+        if (window->failed) {
+            deliver(it->owner, [done]() { done(-EIO, QByteArray()); });
+        } else {
+            QByteArray data = window->data.mid(int(it->offset - window.key()), int(it->length));
+            deliver(it->owner, [done, data]() { done(data.size(), data); });
+        }
+        it = m_reads.erase(it);
+    }
+}
+
+// Cuts what is written into partSize parts and sends them as a multipart
+// upload, parallelParts at a time. Writes complete as soon as their data
+// is buffered, unless more than parallelParts parts are waiting, so a
+// slow store pushes back on the client instead of filling memory.
+class S3WriteStream : public VfsStream
+{
+public:
+    S3WriteStream(const QSharedPointer<S3Bucket> &bucket, const QString &path,
+                  const QString &owner);
+    ~S3WriteStream() override;
+
+    qint64 size() const override;
+    void read(qint64 offset, qint64 length, QObject *owner, Completion done) override;
+    void write(qint64 offset, const QByteArray &data, QObject *owner, Completion done) override;
+    void commit(QObject *owner, std::function<void(bool ok)> done) override;
+    void abort() override;
+
+private:
+    struct Held
+    {
+        QPointer<QObject> owner;
+        Completion done;
+        qint64 result;
+    };
+
+    int backlog() const;
+    void cutPart();
+    void pump();
+    void createUpload();
+    void completeUpload();
+    void partFinished(QNetworkReply *reply);
+    void release();
+    void fail();
+    void finishCommit(bool ok);
+
+    QSharedPointer<S3Bucket> m_bucket;
+    QString m_path;
+    QString m_key;
+    Headers m_ownerHeaders;
+
+    qint64 m_written;
+    QByteArray m_buffer;
+    int m_nextPart;
+    QList<QPair<int, QByteArray>> m_queued;
+    QHash<QNetworkReply *, int> m_inFlight;
+    QMap<int, QByteArray> m_etags;
+    QString m_uploadId;
+    // Creating, completing or the single PUT of a small file
+    QNetworkReply *m_control;
+    QList<Held> m_held;
+
+    bool m_failed;
+    bool m_committing;
+    // Committed or aborted; nothing more is sent
+    bool m_finished;
+    QPointer<QObject> m_commitOwner;
+    std::function<void(bool ok)> m_commitDone;
+};
+
+S3WriteStream::S3WriteStream(const QSharedPointer<S3Bucket> &bucket, const QString &path,
+                             const QString &owner) :
+    m_bucket(bucket),
+    m_path(path),
+    m_key(bucket->key(path)),
+    m_written(0),
+    m_nextPart(1),
+    m_control(nullptr),
+    m_failed(false),
+    m_committing(false),
+    m_finished(false)
+{
+    if (!owner.isEmpty()) {
+        m_ownerHeaders.append(qMakePair(QByteArray(OwnerHeader), QUrl::toPercentEncoding(owner)));
+    }
+}
+
+S3WriteStream::~S3WriteStream()
+{
+    abort();
+}
+
+qint64 S3WriteStream::size() const
+{
+    return m_written;
+}
+
+void S3WriteStream::read(qint64 offset, qint64 length, QObject *owner, Completion done)
+{
+    Q_UNUSED(offset);
+    Q_UNUSED(length);
+    deliver(owner, [done]() { done(-EBADF, QByteArray()); });
+}
+
+void S3WriteStream::write(qint64 offset, const QByteArray &data, QObject *owner, Completion done)
+{
+    QPointer<QObject> guard(owner);
+    if (m_failed || m_finished || offset != m_written) {
+        deliver(guard, [done]() { done(-EIO, QByteArray()); });
+        return;
+    }
+
+    m_buffer.append(data);
+    m_written += data.size();
+    while (m_buffer.size() >= m_bucket->config().partSize) {
+        cutPart();
+    }
+    pump();
+
+    if (backlog() > m_bucket->config().parallelParts) {
+        m_held.append(Held{guard, done, data.size()});
+    } else {
+        qint64 result = data.size();
+        deliver(guard, [done, result]() { done(result, QByteArray()); });
+    }
+}
+
+void S3WriteStream::commit(QObject *owner, std::function<void(bool ok)> done)
+{
+    if (m_finished) {
+        deliver(owner, [done]() { done(false); });
+        return;
+    }
+
+    m_commitOwner = owner;
+    m_commitDone = done;
+    m_committing = true;
+    if (m_failed) {
+        finishCommit(false);
+        return;
+    }
+
+    if (m_uploadId.isEmpty() && m_queued.isEmpty() && !m_control) {
+        // Never filled a part: one PUT is all it takes
+        m_control = m_bucket->send(threadNetwork(), "PUT", m_key, Query(), m_ownerHeaders,
+                                   m_buffer);
+        m_buffer.clear();
+        QNetworkReply *reply = m_control;
+        QObject::connect(reply, &QNetworkReply::finished, reply, [this, reply]() {
+            Response response = responseFor(reply);
+            m_control = nullptr;
+            reply->deleteLater();
+            finishCommit(response.ok());
+        });
+        return;
+    }
+
+    // The last part may be short
+    if (!m_buffer.isEmpty()) {
+        cutPart();
+    }
+    pump();
+}
+
+void S3WriteStream::abort()
+{
+    if (m_finished) {
+        return;
+    }
+    m_finished = true;
+
+    for (QNetworkReply *reply : m_inFlight.keys()) {
+        discard(reply);
+    }
+    m_inFlight.clear();
+    if (m_control) {
+        discard(m_control);
+        m_control = nullptr;
+    }
+    m_queued.clear();
+    m_buffer.clear();
+    m_held.clear();
+
+    // Let the store free the parts it already has; nobody waits for this
+    if (!m_uploadId.isEmpty()) {
+        Query query;
+        query.append(qMakePair(QString("uploadId"), m_uploadId));
+        QNetworkReply *reply = m_bucket->send(threadNetwork(), "DELETE", m_key, query);
+        QObject::connect(reply, &QNetworkReply::finished, reply, &QObject::deleteLater);
+    }
+}
+
+int S3WriteStream::backlog() const
+{
+    return m_queued.size() + m_inFlight.size();
+}
+
+void S3WriteStream::cutPart()
+{
+    qint64 partSize = m_bucket->config().partSize;
+    m_queued.append(qMakePair(m_nextPart++, m_buffer.left(int(partSize))));
+    m_buffer = m_buffer.mid(int(partSize));
+}
+
+void S3WriteStream::pump()
+{
+    if (m_failed || m_finished) {
+        return;
+    }
+
+    if (m_uploadId.isEmpty()) {
+        if (!m_queued.isEmpty() && !m_control) {
+            createUpload();
+        }
+        return;
+    }
+
+    while (!m_queued.isEmpty() && m_inFlight.size() < m_bucket->config().parallelParts) {
+        QPair<int, QByteArray> part = m_queued.takeFirst();
+        Query query;
+        query.append(qMakePair(QString("partNumber"), QString::number(part.first)));
+        query.append(qMakePair(QString("uploadId"), m_uploadId));
+        QNetworkReply *reply = m_bucket->send(threadNetwork(), "PUT", m_key, query, Headers(),
+                                              part.second);
+        m_inFlight.insert(reply, part.first);
+        QObject::connect(reply, &QNetworkReply::finished, reply, [this, reply]() {
+            partFinished(reply);
+        });
+    }
+
+    if (m_committing && m_queued.isEmpty() && m_inFlight.isEmpty() && !m_control) {
+        completeUpload();
+    }
+}
+
+void S3WriteStream::createUpload()
+{
+    Query query;
+    query.append(qMakePair(QString("uploads"), QString()));
+    m_control = m_bucket->send(threadNetwork(), "POST", m_key, query, m_ownerHeaders);
+    QNetworkReply *reply = m_control;
+    QObject::connect(reply, &QNetworkReply::finished, reply, [this, reply]() {
+        Response response = responseFor(reply);
+        m_control = nullptr;
+        reply->deleteLater();
+
+        QXmlStreamReader xml(response.body);
+        while (response.ok() && xml.readNextStartElement()) {
+            if (xml.name() == QLatin1String("UploadId")) {
+                m_uploadId = xml.readElementText();
+                break;
+            }
+            if (xml.name() != QLatin1String("InitiateMultipartUploadResult")) {
+                xml.skipCurrentElement();
+            }
+        }
+
+        if (m_uploadId.isEmpty()) {
+            fail();
+        } else {
+            pump();
+        }
+    });
+}
+
+void S3WriteStream::completeUpload()
+{
+    QByteArray body = "<CompleteMultipartUpload>";
+    for (auto it = m_etags.constBegin(); it != m_etags.constEnd(); ++it) {
+        body += "<Part><PartNumber>" + QByteArray::number(it.key()) + "</PartNumber><ETag>"
+            + it.value() + "</ETag></Part>";
+    }
+    body += "</CompleteMultipartUpload>";
+
+    Query query;
+    query.append(qMakePair(QString("uploadId"), m_uploadId));
+    m_control = m_bucket->send(threadNetwork(), "POST", m_key, query, Headers(), body);
+    QNetworkReply *reply = m_control;
+    QObject::connect(reply, &QNetworkReply::finished, reply, [this, reply]() {
+        Response response = responseFor(reply);
+        m_control = nullptr;
+        reply->deleteLater();
+
+        // S3 can report a failed completion inside a 200 response
+        finishCommit(response.ok() && !response.body.contains("<Error>"));
+    });
+}
+
+void S3WriteStream::partFinished(QNetworkReply *reply)
+{
+    int part = m_inFlight.take(reply);
+    Response response = responseFor(reply);
+    reply->deleteLater();
+
+    QByteArray etag = response.headers.value("etag");
+    if (!response.ok() || etag.isEmpty()) {
+        fail();
+        return;
+    }
+    m_etags.insert(part, etag);
+    release();
+    pump();
+}
+
+void S3WriteStream::release()
+{
+    while (!m_held.isEmpty() && backlog() <= m_bucket->config().parallelParts) {
+        Held held = m_held.takeFirst();
+        Completion done = held.done;
+        qint64 result = held.result;
+        deliver(held.owner, [done, result]() { done(result, QByteArray()); });
+    }
+}
+
+void S3WriteStream::fail()
+{
+    m_failed = true;
+    for (const Held &held : qAsConst(m_held)) {
+        Completion done = held.done;
+        deliver(held.owner, [done]() { done(-EIO, QByteArray()); });
+    }
+    m_held.clear();
+
+    if (m_committing) {
+        finishCommit(false);
+    }
+}
+
+void S3WriteStream::finishCommit(bool ok)
+{
+    m_committing = false;
+    if (ok) {
+        m_finished = true;
+        m_bucket->invalidate(m_path);
+    }
+
+    std::function<void(bool ok)> done = m_commitDone;
+    m_commitDone = nullptr;
+    deliver(m_commitOwner, [done, ok]() { done(ok); });
+}
+
+}
+
+bool S3Vfs::loadConfig(const QString &path, Config *config)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly | QIODevice::Text)) {
+        return false;
+    }
+
+    QTextStream in(&file);
+    while (!in.atEnd()) {
+        QString line = in.readLine().trimmed();
+        if (line.isEmpty() || line.startsWith('#')) {
+            continue;
+        }
+
+        int equals = line.indexOf('=');
+        QString name = line.left(equals).trimmed();
+        QString value = line.mid(equals + 1).trimmed();
+        bool ok = equals > 0;
+        if (name == "endpoint") {
+            config->endpoint = QUrl(value);
+            ok = config->endpoint.isValid();
+        } else if (name == "bucket") {
+            config->bucket = value;
+        } else if (name == "region") {
+            config->region = value;
+        } else if (name == "access_key") {
+            config->accessKey = value;
+        } else if (name == "secret_key") {
+            config->secretKey = value;
+        } else if (name == "prefix") {
+            config->prefix = value;
+        } else if (name == "part_size") {
+            config->partSize = parseSize(value, &ok);
+        } else if (name == "parallel_parts") {
+            config->parallelParts = value.toInt(&ok);
+        } else if (name == "read_ahead") {
+            config->readAhead = parseSize(value, &ok);
+        } else if (name == "listing_ttl") {
+            config->listingTtl = value.toInt(&ok);
+        } else {
+            ok = false;
+        }
+
+        if (!ok) {
+            qDebug() << "Ignoring S3 config line:" << line;
+        }
+    }
+    return config->endpoint.isValid() && !config->bucket.isEmpty();
+}
+
+S3Vfs::S3Vfs(const Config &config) :
+    m_bucket(new S3Bucket(config))
+{
+}
+
+QString S3Vfs::description() const
+{
+    const Config &config = m_bucket->config();
+    return QString("S3 bucket %1/%2 at %3").arg(config.bucket, config.prefix,
+                                               config.endpoint.toString());
+}
+
+Vfs::Entry S3Vfs::stat(const QString &path)
+{
+    Entry entry;
+    if (isRoot(path)) {
+        entry.exists = true;
+        entry.isDir = true;
+        entry.modified = QDateTime::currentDateTime();
+        return entry;
+    }
+
+    // Most stats follow a listing of the same directory
+    if (m_bucket->cachedEntry(path, &entry)) {
+        return entry;
+    }
+
+    entry.name = path.mid(path.lastIndexOf('/') + 1);
+    Response response = m_bucket->call("HEAD", m_bucket->key(path));
+    if (response.ok()) {
+        entry.exists = true;
+        entry.size = response.headers.value("content-length").toLongLong();
+        entry.modified = response.lastModified.toLocalTime();
+        return entry;
+    }
+
+    bool exists = false;
+    QVector<Entry> entries;
+    if (m_bucket->listDirectory(path, &exists, &entries) && exists) {
+        entry.exists = true;
+        entry.isDir = true;
+        entry.modified = QDateTime::currentDateTime();
+    }
+    return entry;
+}
+
+bool S3Vfs::list(const QString &path, bool includeHidden, QVector<Entry> *entries)
+{
+    bool exists = false;
+    QVector<Entry> all;
+    if (!m_bucket->listDirectory(path, &exists, &all) || !exists) {
+        return false;
+    }
+
+    entries->reserve(all.size());
+    for (const Entry &entry : qAsConst(all)) {
+        if (includeHidden || !entry.name.startsWith('.')) {
+            entries->append(entry);
+        }
+    }
+    return true;
+}
+
+QSharedPointer<QFile> S3Vfs::open(const QString &path, QIODevice::OpenMode mode)
+{
+    // Objects have no descriptors; transfers use openStream()
+    Q_UNUSED(path);
+    Q_UNUSED(mode);
+    return QSharedPointer<QFile>();
+}
+
+bool S3Vfs::usesStreams() const
+{
+    return true;
+}
+
+QSharedPointer<VfsStream> S3Vfs::openStream(const QString &path, QIODevice::OpenMode mode,
+                                            const QString &owner)
+{
+    if (mode & QIODevice::WriteOnly) {
+        // Objects can only be replaced whole
+        if (mode & QIODevice::Append) {
+            return QSharedPointer<VfsStream>();
+        }
+        return QSharedPointer<VfsStream>(new S3WriteStream(m_bucket, path, owner));
+    }
+
+    QString key = m_bucket->key(path);
+    Response response = m_bucket->call("HEAD", key);
+    if (!response.ok()) {
+        return QSharedPointer<VfsStream>();
+    }
+    qint64 size = response.headers.value("content-length").toLongLong();
+    return QSharedPointer<VfsStream>(new S3ReadStream(m_bucket, key, size));
+}
+
+bool S3Vfs::rename(const QString &from, const QString &to, bool replace)
+{
+    Entry source = stat(from);
+    Entry target = stat(to);
+    if (!source.exists || isRoot(from) || (target.exists && (!replace || target.isDir))) {
+        return false;
+    }
+    if (from == to) {
+        return true;
+    }
+
+    // There is no rename: everything is copied, then the originals go
+    bool ok = true;
+    if (source.isDir) {
+        if (to.startsWith(from + '/')) {
+            return false;
+        }
+
+        QString fromPrefix = m_bucket->directoryKey(from);
+        QString toPrefix = m_bucket->directoryKey(to);
+        S3Bucket::Listing listing;
+        if (!m_bucket->listAll(fromPrefix, false, &listing)) {
+            return false;
+        }
+        for (const S3Bucket::Object &object : qAsConst(listing.objects)) {
+            ok = ok && copyObject(object.key, toPrefix + object.key.mid(fromPrefix.size()));
+        }
+        if (ok) {
+            for (const S3Bucket::Object &object : qAsConst(listing.objects)) {
+                m_bucket->call("DELETE", object.key);
+            }
+        }
+    } else {
+        ok = copyObject(m_bucket->key(from), m_bucket->key(to))
+            && m_bucket->call("DELETE", m_bucket->key(from)).ok();
+    }
+
+    m_bucket->invalidate(from);
+    m_bucket->invalidate(to);
+    return ok;
+}
+
+bool S3Vfs::mkdir(const QString &path)
+{
+    if (isRoot(path) || stat(path).exists) {
+        return false;
+    }
+    QString parent = parentOf(path);
+    if (!isRoot(parent) && !stat(parent).isDir) {
+        return false;
+    }
+
+    bool ok = m_bucket->call("PUT", m_bucket->directoryKey(path)).ok();
+    m_bucket->invalidate(path);
+    return ok;
+}
+
+bool S3Vfs::rmdir(const QString &path)
+{
+    bool exists = false;
+    QVector<Entry> entries;
+    if (isRoot(path) || !m_bucket->listDirectory(path, &exists, &entries)
+            || !exists || !entries.isEmpty()) {
+        return false;
+    }
+
+    bool ok = m_bucket->call("DELETE", m_bucket->directoryKey(path)).ok();
+    m_bucket->invalidate(path);
+    return ok;
+}
+
+bool S3Vfs::remove(const QString &path)
+{
+    // DELETE succeeds for keys that don't exist
+    QString key = m_bucket->key(path);
+    if (isRoot(path) || !m_bucket->call("HEAD", key).ok()) {
+        return false;
+    }
+
+    bool ok = m_bucket->call("DELETE", key).ok();
+    m_bucket->invalidate(path);
+    return ok;
+}
+
+bool S3Vfs::setModified(const QString &path, const QDateTime &modified)
+{
+    // Last-Modified is set by the store
+    Q_UNUSED(path);
+    Q_UNUSED(modified);
+    return false;
+}
+
+QString S3Vfs::owner(const QString &path)
+{
+    Response response = m_bucket->call("HEAD", m_bucket->key(path));
+    return QUrl::fromPercentEncoding(response.headers.value(OwnerHeader));
+}
+
+void S3Vfs::setOwner(const QString &path, const QString &user)
+{
+    // Recorded as metadata when the upload starts; it can't be changed
+    // without rewriting the object
+    Q_UNUSED(path);
+    Q_UNUSED(user);
+}
+
+bool S3Vfs::syncDirectory(const QString &path)
+{
+    // A completed PUT is already durable
+    Q_UNUSED(path);
+    return true;
+}
+
+QString S3Vfs::localPath(const QString &path) const
+{
+    Q_UNUSED(path);
+    return QString();
+}
+
+bool S3Vfs::copyObject(const QString &fromKey, const QString &toKey)
+{
+    Headers headers;
+    headers.append(qMakePair(QByteArray("x-amz-copy-source"),
+                             "/" + QUrl::toPercentEncoding(m_bucket->config().bucket) + "/"
+                             + encodeKey(fromKey)));
+    Response response = m_bucket->call("PUT", toKey, Query(), headers);
+    // Like completions, a copy can fail inside a 200
+    return response.ok() && !response.body.contains("<Error>");
+}
@@ -0,0 +1,67 @@
+#ifndef S3VFS_H
+#define S3VFS_H
+
+#include "vfs.h"
+#include <QUrl>
+
+class S3Bucket;
+
+// Serves a bucket on S3 or an S3-compatible store such as MinIO, using
+// path-style requests signed with AWS Signature V4. Directories are key
+// prefixes, plus an empty "dir/" object for ones created by MKD.
+//
+// Downloads are ranged GETs with a few windows of read-ahead. Uploads go
+// out as multipart uploads whose parts are sent in parallel as they fill;
+// only a bounded number of parts is ever held in memory, and nothing is
+// staged on disk. Directory listings are paginated prefix listings, cached
+// briefly and dropped by the server's own changes.
+class S3Vfs : public Vfs
+{
+public:
+    struct Config
+    {
+        QUrl endpoint;
+        QString bucket;
+        QString region = "us-east-1";
+        QString accessKey;
+        QString secretKey;
+        // Key prefix the served tree lives under, e.g. "ftp/"
+        QString prefix;
+        qint64 partSize = 8 * 1024 * 1024;
+        int parallelParts = 4;
+        qint64 readAhead = 4 * 1024 * 1024;
+        int listingTtl = 5000;
+    };
+
+    // "key = value" lines: endpoint, bucket, region, access_key,
+    // secret_key, prefix, part_size, parallel_parts, read_ahead, listing_ttl
+    static bool loadConfig(const QString &path, Config *config);
+
+    // Create on the thread that runs the sessions; transfers use its
+    // network access from there
+    explicit S3Vfs(const Config &config);
+
+    QString description() const override;
+    Entry stat(const QString &path) override;
+    bool list(const QString &path, bool includeHidden, QVector<Entry> *entries) override;
+    QSharedPointer<QFile> open(const QString &path, QIODevice::OpenMode mode) override;
+    bool usesStreams() const override;
+    QSharedPointer<VfsStream> openStream(const QString &path, QIODevice::OpenMode mode,
+                                         const QString &owner) override;
+    bool rename(const QString &from, const QString &to, bool replace) override;
+    bool mkdir(const QString &path) override;
+    bool rmdir(const QString &path) override;
+    bool remove(const QString &path) override;
+    bool setModified(const QString &path, const QDateTime &modified) override;
+    QString owner(const QString &path) override;
+    void setOwner(const QString &path, const QString &user) override;
+    bool syncDirectory(const QString &path) override;
+    QString localPath(const QString &path) const override;
+
+private:
+    bool copyObject(const QString &fromKey, const QString &toKey);
+
+    QSharedPointer<S3Bucket> m_bucket;
+};
+
+#endif // S3VFS_H
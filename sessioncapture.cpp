@@ -0,0 +1,131 @@
+#include "sessioncapture.h"
+#include "fsservice.h"
+#include <QDataStream>
+#include <QFile>
+#include <QDebug>
+
+SessionCapture::SessionCapture(FsService *fs, QObject *parent) : QObject(parent),
+    m_fs(fs),
+    m_nextSession(1),
+    m_inFlight(false)
+{
+    m_pending.reserve(MaxBatch);
+
+    m_flushTimer.setSingleShot(true);
+    m_flushTimer.setInterval(FlushInterval);
+    connect(&m_flushTimer, &QTimer::timeout, this, &SessionCapture::flush);
+}
+
+SessionCapture::~SessionCapture()
+{
+    flushNow();
+}
+
+void SessionCapture::setPath(const QString &path)
+{
+    // Records already queued go to the capture they were made for
+    flushNow();
+    m_path = path;
+    if (m_path.isEmpty()) {
+        return;
+    }
+
+    QFile file(m_path);
+    QByteArray header = CaptureRecord::fileHeader();
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate) || file.write(header) != header.size()) {
+        qWarning() << "Can't write a session capture to" << m_path;
+        m_path.clear();
+        return;
+    }
+    m_clock.start();
+}
+
+bool SessionCapture::isEnabled() const
+{
+    return !m_path.isEmpty();
+}
+
+quint64 SessionCapture::startSession()
+{
+    return m_nextSession++;
+}
+
+qint64 SessionCapture::now() const
+{
+    return m_clock.nsecsElapsed() / 1000;
+}
+
+void SessionCapture::append(const CaptureRecord &record)
+{
+    if (m_path.isEmpty()) {
+        return;
+    }
+
+    m_pending.append(record);
+    if (m_pending.size() >= MaxBatch) {
+        flush();
+    } else if (!m_flushTimer.isActive()) {
+        m_flushTimer.start();
+    }
+}
+
+void SessionCapture::flushNow()
+{
+    m_flushTimer.stop();
+    if (m_pending.isEmpty()) {
+        return;
+    }
+
+    // Written right here, for shutdown; each batch is a single append
+    QVector<CaptureRecord> records;
+    records.swap(m_pending);
+    m_pending.reserve(MaxBatch);
+    if (!writeBatch(m_path, records)) {
+        qWarning() << "Failed to write the session capture";
+    }
+}
+
+void SessionCapture::flush()
+{
+    if (m_pending.isEmpty() || m_inFlight) {
+        // Picked up when the batch in flight completes
+        return;
+    }
+
+    QString path = m_path;
+    QVector<CaptureRecord> records;
+    records.swap(m_pending);
+    m_pending.reserve(MaxBatch);
+    m_inFlight = true;
+
+    m_fs->submit<bool>(this, [path, records]() {
+        return writeBatch(path, records);
+    }, [this](bool ok) {
+        if (!ok) {
+            qWarning() << "Failed to write the session capture";
+        }
+        m_inFlight = false;
+
+        // Whatever was recorded while this batch was being written goes next
+        if (!m_pending.isEmpty()) {
+            flush();
+        }
+    });
+}
+
+bool SessionCapture::writeBatch(const QString &path, const QVector<CaptureRecord> &records)
+{
+    QByteArray data;
+    {
+        QDataStream out(&data, QIODevice::WriteOnly);
+        for (const CaptureRecord &record : records) {
+            record.write(out);
+        }
+    }
+
+    QFile file(path);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Append | QIODevice::Unbuffered)) {
+        return false;
+    }
+    return file.write(data) == data.size();
+}
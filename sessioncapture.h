@@ -0,0 +1,59 @@
+#ifndef SESSIONCAPTURE_H
+#define SESSIONCAPTURE_H
+
+#include <QObject>
+#include <QElapsedTimer>
+#include <QTimer>
+#include <QVector>
+#include "capturerecord.h"
+
+class FsService;
+
+// Records what sessions do on the control channel, with timing and
+// transfer sizes, so tools/ftpreplay can reproduce the same traffic
+// against another build. Like the transfer log, sessions only queue
+// records; they are encoded and appended on the filesystem pool, one
+// batch at a time.
+class SessionCapture : public QObject
+{
+    Q_OBJECT
+public:
+    explicit SessionCapture(FsService *fs, QObject *parent = nullptr);
+    ~SessionCapture();
+
+    // Starts a new capture at path, replacing what was there; empty (the
+    // default) stops capturing
+    void setPath(const QString &path);
+    bool isEnabled() const;
+
+    // Identifies a session that starts being captured now
+    quint64 startSession();
+
+    // Microseconds since the capture started
+    qint64 now() const;
+
+    void append(const CaptureRecord &record);
+
+    // Writes out everything queued, waiting for it to reach the file
+    void flushNow();
+
+private slots:
+    void flush();
+
+private:
+    static bool writeBatch(const QString &path, const QVector<CaptureRecord> &records);
+
+    // Records are held at most this long, or until this many are queued
+    static const int FlushInterval = 200;
+    static const int MaxBatch = 4096;
+
+    FsService *m_fs;
+    QString m_path;
+    QElapsedTimer m_clock;
+    quint64 m_nextSession;
+    QVector<CaptureRecord> m_pending;
+    bool m_inFlight;
+    QTimer m_flushTimer;
+};
+
+#endif // SESSIONCAPTURE_H
@@ -0,0 +1,21 @@
+#ifndef SESSIONINFO_H
+#define SESSIONINFO_H
+
+#include <QString>
+
+// Snapshot of one session for the dashboard. Taken on demand, so the
+// session itself only keeps the running byte count.
+struct SessionInfo
+{
+    // Unique for the server's lifetime; sessions are listed in this order
+    quint64 id = 0;
+    QString peer;
+    QString user;
+    QString directory;
+    // What is on the data connection, empty when idle
+    QString transfer;
+    // Data-connection bytes in both directions over the session
+    quint64 bytes = 0;
+};
+
+#endif // SESSIONINFO_H
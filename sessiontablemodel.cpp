@@ -0,0 +1,128 @@
+#include "sessiontablemodel.h"
+
+SessionTableModel::SessionTableModel(QObject *parent) : QAbstractTableModel(parent)
+{
+}
+
+void SessionTableModel::update(const QVector<SessionInfo> &sessions, qint64 elapsedMs)
+{
+    // Merge by id: sessions that are gone are removed and new ones
+    // inserted, a run of rows at a time; the rest are updated in place
+    int row = 0;
+    int next = 0;
+    while (row < m_rows.size() || next < sessions.size()) {
+        if (next == sessions.size() || (row < m_rows.size() && m_rows[row].info.id < sessions[next].id)) {
+            int last = row;
+            while (last + 1 < m_rows.size()
+                   && (next == sessions.size() || m_rows[last + 1].info.id < sessions[next].id)) {
+                ++last;
+            }
+            beginRemoveRows(QModelIndex(), row, last);
+            m_rows.remove(row, last - row + 1);
+            endRemoveRows();
+            continue;
+        }
+
+        if (row == m_rows.size() || sessions[next].id < m_rows[row].info.id) {
+            int end = next + 1;
+            while (end < sessions.size()
+                   && (row == m_rows.size() || sessions[end].id < m_rows[row].info.id)) {
+                ++end;
+            }
+            beginInsertRows(QModelIndex(), row, row + end - next - 1);
+            for (int i = next; i < end; ++i) {
+                m_rows.insert(row + i - next, Row{ sessions[i], 0.0 });
+            }
+            endInsertRows();
+            row += end - next;
+            next = end;
+            continue;
+        }
+
+        Row &current = m_rows[row];
+        quint64 bytes = sessions[next].bytes;
+        current.rate = elapsedMs > 0 && bytes >= current.info.bytes
+            ? double(bytes - current.info.bytes) * 1000.0 / elapsedMs : 0.0;
+        current.info = sessions[next];
+        ++row;
+        ++next;
+    }
+
+    if (!m_rows.isEmpty()) {
+        emit dataChanged(index(0, 0), index(m_rows.size() - 1, ColumnCount - 1));
+    }
+}
+
+void SessionTableModel::clear()
+{
+    beginResetModel();
+    m_rows.clear();
+    endResetModel();
+}
+
+int SessionTableModel::rowCount(const QModelIndex &parent) const
+{
+    return parent.isValid() ? 0 : m_rows.size();
+}
+
+int SessionTableModel::columnCount(const QModelIndex &parent) const
+{
+    return parent.isValid() ? 0 : ColumnCount;
+}
+
+QVariant SessionTableModel::data(const QModelIndex &index, int role) const
+{
+    if (!index.isValid() || index.row() >= m_rows.size()) {
+        return QVariant();
+    }
+
+    const Row &row = m_rows[index.row()];
+    if (role == Qt::TextAlignmentRole) {
+        if (index.column() == Rate || index.column() == Bytes) {
+            return int(Qt::AlignRight | Qt::AlignVCenter);
+        }
+        return QVariant();
+    }
+    if (role != Qt::DisplayRole) {
+        return QVariant();
+    }
+
+    switch (index.column()) {
+    case Peer:
+        return row.info.peer;
+    case User:
+        return row.info.user;
+    case Directory:
+        return row.info.directory;
+    case Transfer:
+        return row.info.transfer;
+    case Rate:
+        return row.rate > 0 ? formatBytes(row.rate) + "/s" : QString();
+    case Bytes:
+        return formatBytes(row.info.bytes);
+    }
+    return QVariant();
+}
+
+QVariant SessionTableModel::headerData(int section, Qt::Orientation orientation, int role) const
+{
+    if (orientation != Qt::Horizontal || role != Qt::DisplayRole) {
+        return QVariant();
+    }
+
+    static const char *const Headers[] = {
+        "Client", "User", "Directory", "Transfer", "Rate", "Bytes"
+    };
+    return section >= 0 && section < ColumnCount ? QString(Headers[section]) : QVariant();
+}
+
+QString SessionTableModel::formatBytes(double bytes)
+{
+    static const char *const Units[] = { "B", "KiB", "MiB", "GiB", "TiB" };
+    int unit = 0;
+    while (bytes >= 1024.0 && unit < 4) {
+        bytes /= 1024.0;
+        ++unit;
+    }
+    return QString("%1 %2").arg(bytes, 0, 'f', unit == 0 ? 0 : 1).arg(Units[unit]);
+}
@@ -0,0 +1,43 @@
+#ifndef SESSIONTABLEMODEL_H
+#define SESSIONTABLEMODEL_H
+
+#include <QAbstractTableModel>
+#include <QVector>
+#include "sessioninfo.h"
+
+// Active sessions, one row each, refreshed from periodic snapshots
+// rather than per event. Rows are kept in session order and updated in
+// place, so the view keeps its selection and scroll position.
+class SessionTableModel : public QAbstractTableModel
+{
+    Q_OBJECT
+public:
+    enum Column { Peer, User, Directory, Transfer, Rate, Bytes, ColumnCount };
+
+    explicit SessionTableModel(QObject *parent = nullptr);
+
+    // sessions must be sorted by id; rates are taken over elapsedMs since
+    // the previous update
+    void update(const QVector<SessionInfo> &sessions, qint64 elapsedMs);
+    void clear();
+
+    int rowCount(const QModelIndex &parent = QModelIndex()) const override;
+    int columnCount(const QModelIndex &parent = QModelIndex()) const override;
+    QVariant data(const QModelIndex &index, int role = Qt::DisplayRole) const override;
+    QVariant headerData(int section, Qt::Orientation orientation,
+                        int role = Qt::DisplayRole) const override;
+
+    // "1.5 MiB" and the like
+    static QString formatBytes(double bytes);
+
+private:
+    struct Row
+    {
+        SessionInfo info;
+        double rate;
+    };
+
+    QVector<Row> m_rows;
+};
+
+#endif // SESSIONTABLEMODEL_H
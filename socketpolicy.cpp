@@ -0,0 +1,123 @@
+#include "socketpolicy.h"
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QDebug>
+
+#ifdef Q_OS_UNIX
+#include <sys/socket.h>
+#endif
+#ifdef Q_OS_LINUX
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <cerrno>
+#include <cstring>
+#endif
+
+namespace {
+
+void setBuffers(qintptr descriptor, int sendBuffer, int receiveBuffer)
+{
+#ifdef Q_OS_UNIX
+    if (sendBuffer > 0) {
+        setsockopt(int(descriptor), SOL_SOCKET, SO_SNDBUF, &sendBuffer, sizeof(sendBuffer));
+    }
+    if (receiveBuffer > 0) {
+        setsockopt(int(descriptor), SOL_SOCKET, SO_RCVBUF, &receiveBuffer, sizeof(receiveBuffer));
+    }
+#else
+    Q_UNUSED(descriptor);
+    Q_UNUSED(sendBuffer);
+    Q_UNUSED(receiveBuffer);
+#endif
+}
+
+}
+
+QStringList SocketPolicy::profiles()
+{
+    return QStringList() << "default" << "lan" << "wan";
+}
+
+bool SocketPolicy::fromProfile(const QString &name, SocketPolicy *policy)
+{
+    SocketPolicy profile;
+    if (name == "default") {
+        // As constructed
+    } else if (name == "lan") {
+        // Short round trips: autotuned buffers are enough, but a shallow
+        // kernel queue keeps aborts and the 226 that follows prompt
+        profile.notSentLowWater = 256 * 1024;
+        profile.corkData = true;
+    } else if (name == "wan") {
+        // Room for a window of 16 MB, e.g. 1 Gbit/s at 130 ms
+        profile.dataSendBuffer = 16 * 1024 * 1024;
+        profile.dataReceiveBuffer = 16 * 1024 * 1024;
+        profile.notSentLowWater = 1024 * 1024;
+        profile.corkData = true;
+        profile.congestionControl = "bbr";
+    } else {
+        return false;
+    }
+    *policy = profile;
+    return true;
+}
+
+void SocketPolicy::applyToControl(QTcpSocket *socket) const
+{
+    if (controlNoDelay) {
+        socket->setSocketOption(QAbstractSocket::LowDelayOption, 1);
+    }
+}
+
+void SocketPolicy::applyToListener(QTcpServer *server) const
+{
+    // Accepted connections inherit these, window scale included
+    setBuffers(server->socketDescriptor(), dataSendBuffer, dataReceiveBuffer);
+}
+
+void SocketPolicy::applyToData(QTcpSocket *socket) const
+{
+    qintptr descriptor = socket->socketDescriptor();
+    if (descriptor < 0) {
+        return;
+    }
+
+    // An active-mode connection is already up, so its receive window
+    // scale is settled; the buffer can still grow to it
+    setBuffers(descriptor, dataSendBuffer, dataReceiveBuffer);
+
+#ifdef Q_OS_LINUX
+    int fd = int(descriptor);
+    if (notSentLowWater > 0) {
+        setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &notSentLowWater, sizeof(notSentLowWater));
+    }
+    if (!congestionControl.isEmpty()) {
+        QByteArray algorithm = congestionControl.toLatin1();
+        if (setsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, algorithm.constData(),
+                       socklen_t(algorithm.size())) != 0) {
+            // Reported once; the module may be missing or not allowed
+            static bool warned = false;
+            if (!warned) {
+                warned = true;
+                qWarning() << "Can't use congestion control" << congestionControl << "-"
+                           << strerror(errno);
+            }
+        }
+    }
+#endif
+}
+
+void SocketPolicy::setCorked(QTcpSocket *socket, bool corked) const
+{
+#ifdef Q_OS_LINUX
+    qintptr descriptor = socket->socketDescriptor();
+    if (!corkData || descriptor < 0) {
+        return;
+    }
+    int on = corked ? 1 : 0;
+    setsockopt(int(descriptor), IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+#else
+    Q_UNUSED(socket);
+    Q_UNUSED(corked);
+#endif
+}
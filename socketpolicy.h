@@ -0,0 +1,53 @@
+#ifndef SOCKETPOLICY_H
+#define SOCKETPOLICY_H
+
+#include <QString>
+#include <QStringList>
+
+class QTcpServer;
+class QTcpSocket;
+
+// TCP options for control and data connections. Control connections
+// carry short replies that should leave at once; data connections may
+// cross long, fast links that the kernel's defaults leave underused.
+// TCP_NOTSENT_LOWAT, TCP_CORK and TCP_CONGESTION are Linux-only and
+// ignored elsewhere.
+struct SocketPolicy
+{
+    // TCP_NODELAY on control connections, so a reply isn't held back
+    // waiting for the ACK of the one before
+    bool controlNoDelay = true;
+
+    // SO_SNDBUF and SO_RCVBUF for data connections; 0 keeps the kernel's
+    // autotuning, which setting a size turns off. Passive-mode listeners
+    // get them too, so the receive window scale is negotiated for them.
+    int dataSendBuffer = 0;
+    int dataReceiveBuffer = 0;
+
+    // TCP_NOTSENT_LOWAT: how much unsent data the kernel queues per data
+    // connection before reporting it writable; 0 leaves it unlimited.
+    // Keeps data in our buffers, where closing or aborting is cheap.
+    int notSentLowWater = 0;
+
+    // TCP_CORK on data connections from connect (or the end of the TLS
+    // handshake) until EOF, so the stream goes out as full segments; the
+    // cork comes off before the close, so the tail isn't held back
+    bool corkData = false;
+
+    // TCP_CONGESTION for data connections, e.g. "bbr"; empty for the
+    // system default. Must be in net.ipv4.tcp_allowed_congestion_control.
+    QString congestionControl;
+
+    // Named presets: "default" (Qt's defaults plus TCP_NODELAY on control),
+    // "lan" and "wan" (high bandwidth-delay product links)
+    static QStringList profiles();
+    static bool fromProfile(const QString &name, SocketPolicy *policy);
+
+    void applyToControl(QTcpSocket *socket) const;
+    void applyToListener(QTcpServer *server) const;
+    void applyToData(QTcpSocket *socket) const;
+    // No-op unless corkData
+    void setCorked(QTcpSocket *socket, bool corked) const;
+};
+
+#endif // SOCKETPOLICY_H
@@ -0,0 +1,27 @@
+#include "ssltcpserver.h"
+#include <QSslSocket>
+
+SslTcpServer::SslTcpServer(QObject *parent) : QTcpServer(parent),
+    m_tlsEnabled(true)
+{
+}
+
+void SslTcpServer::setTlsEnabled(bool enabled)
+{
+    m_tlsEnabled = enabled;
+}
+
+bool SslTcpServer::isTlsEnabled() const
+{
+    return m_tlsEnabled;
+}
+
+void SslTcpServer::incomingConnection(qintptr socketDescriptor)
+{
+    QTcpSocket *socket = m_tlsEnabled ? new QSslSocket(this) : new QTcpSocket(this);
+    if (socket->setSocketDescriptor(socketDescriptor)) {
+        addPendingConnection(socket);
+    } else {
+        delete socket;
+    }
+}
@@ -0,0 +1,27 @@
+#ifndef SSLTCPSERVER_H
+#define SSLTCPSERVER_H
+
+#include <QTcpServer>
+
+// QTcpServer that hands out QSslSockets, so a control or data connection
+// can be upgraded with AUTH TLS / PROT P after it has been accepted. Until
+// encryption is started the sockets behave exactly like QTcpSocket.
+// QSslSocket carries a second, internal socket, so with TLS disabled plain
+// QTcpSockets are handed out instead.
+class SslTcpServer : public QTcpServer
+{
+    Q_OBJECT
+public:
+    explicit SslTcpServer(QObject *parent = nullptr);
+
+    void setTlsEnabled(bool enabled);
+    bool isTlsEnabled() const;
+
+protected:
+    void incomingConnection(qintptr socketDescriptor) override;
+
+private:
+    bool m_tlsEnabled;
+};
+
+#endif // SSLTCPSERVER_H
@@ -0,0 +1,397 @@
+#include "stallwatchdog.h"
+#include <QAtomicInteger>
+#include <QElapsedTimer>
+#include <QMutexLocker>
+#include <QThread>
+#include <QTimer>
+#include <QWaitCondition>
+#include <QDebug>
+
+#if defined(Q_OS_LINUX) && defined(__GLIBC__)
+#include <cerrno>
+#include <csignal>
+#include <ctime>
+#include <cstdlib>
+#include <execinfo.h>
+#include <pthread.h>
+#include <semaphore.h>
+#define FTP_HAVE_STACK_SAMPLES
+#endif
+
+const int StallWatchdog::BucketLimits[StallWatchdog::BucketCount - 1] = {
+    500, 1000, 2500, 5000, 10000
+};
+
+struct WatchedLoop
+{
+    QString name;
+    QThread *thread;
+    // Lives in the watched thread
+    QTimer *heartbeat;
+    QAtomicInteger<qint64> lastBeat;
+#ifdef FTP_HAVE_STACK_SAMPLES
+    QAtomicInteger<int> hasHandle;
+    pthread_t handle;
+#endif
+    // Heartbeat a sample was last taken for; watchdog thread only
+    qint64 sampledBeat;
+    // Under the watchdog's mutex
+    QString activity;
+    QString stalledActivity;
+    QStringList stack;
+};
+
+namespace {
+
+qint64 monotonicMs()
+{
+    static QElapsedTimer clock = []() {
+        QElapsedTimer timer;
+        timer.start();
+        return timer;
+    }();
+    return clock.elapsed();
+}
+
+#ifdef FTP_HAVE_STACK_SAMPLES
+// A stalled thread is asked for its stack with a signal nothing else in
+// the server uses; the handler records the frames and posts the semaphore.
+// The watchdog thread takes one sample at a time.
+const int MaxFrames = 48;
+void *sampleFrames[MaxFrames];
+volatile sig_atomic_t sampleFrameCount = 0;
+sem_t sampleDone;
+
+void onSampleSignal(int)
+{
+    int savedErrno = errno;
+    sampleFrameCount = backtrace(sampleFrames, MaxFrames);
+    sem_post(&sampleDone);
+    errno = savedErrno;
+}
+
+int sampleSignal()
+{
+    return SIGRTMIN + 2;
+}
+
+bool installSampler()
+{
+    // backtrace() loads libgcc on first use, which must not happen in
+    // the handler
+    void *warmup[1];
+    backtrace(warmup, 1);
+
+    sem_init(&sampleDone, 0, 0);
+    struct sigaction action = {};
+    action.sa_handler = onSampleSignal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    return sigaction(sampleSignal(), &action, nullptr) == 0;
+}
+
+QStringList sampleStack(pthread_t thread)
+{
+    static bool installed = installSampler();
+    if (!installed) {
+        return QStringList();
+    }
+
+    // Drop a late answer to a sample that timed out
+    while (sem_trywait(&sampleDone) == 0) {
+    }
+
+    if (pthread_kill(thread, sampleSignal()) != 0) {
+        return QStringList();
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += 100 * 1000 * 1000;
+    if (deadline.tv_nsec >= 1000 * 1000 * 1000) {
+        deadline.tv_sec += 1;
+        deadline.tv_nsec -= 1000 * 1000 * 1000;
+    }
+    int result;
+    do {
+        result = sem_timedwait(&sampleDone, &deadline);
+    } while (result != 0 && errno == EINTR);
+    if (result != 0) {
+        return QStringList();
+    }
+
+    // The first two frames are the handler and the signal trampoline
+    int count = sampleFrameCount;
+    QStringList stack;
+    char **symbols = backtrace_symbols(sampleFrames, count);
+    if (symbols) {
+        for (int i = 2; i < count; ++i) {
+            stack.append(QString::fromLocal8Bit(symbols[i]));
+        }
+        free(symbols);
+    }
+    return stack;
+}
+#endif
+
+}
+
+class WatchdogThread : public QThread
+{
+public:
+    explicit WatchdogThread(StallWatchdog *watchdog)
+        : m_watchdog(watchdog), m_stopping(false) {}
+
+    void start()
+    {
+        m_stopping = false;
+        QThread::start();
+    }
+
+    void shutdown()
+    {
+        {
+            QMutexLocker locker(&m_mutex);
+            m_stopping = true;
+        }
+        m_wake.wakeAll();
+        wait();
+    }
+
+protected:
+    void run() override
+    {
+        QMutexLocker locker(&m_mutex);
+        while (!m_stopping) {
+            m_wake.wait(&m_mutex, StallWatchdog::HeartbeatInterval);
+            if (m_stopping) {
+                break;
+            }
+            locker.unlock();
+            m_watchdog->check();
+            locker.relock();
+        }
+    }
+
+private:
+    StallWatchdog *m_watchdog;
+    QMutex m_mutex;
+    QWaitCondition m_wake;
+    bool m_stopping;
+};
+
+StallWatchdog::StallWatchdog(QObject *parent) : QObject(parent),
+    m_thread(new WatchdogThread(this)),
+    m_threshold(DefaultThreshold),
+    m_running(false)
+{
+    resetStats();
+}
+
+StallWatchdog::~StallWatchdog()
+{
+    stop();
+
+    QMutexLocker locker(&m_mutex);
+    for (WatchedLoop *loop : qAsConst(m_loops)) {
+        if (loop->heartbeat->thread() == QThread::currentThread()) {
+            delete loop->heartbeat;
+        } else {
+            loop->heartbeat->deleteLater();
+        }
+        delete loop;
+    }
+    m_loops.clear();
+}
+
+void StallWatchdog::setThreshold(int ms)
+{
+    QMutexLocker locker(&m_mutex);
+    m_threshold = ms;
+}
+
+int StallWatchdog::threshold() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_threshold;
+}
+
+void StallWatchdog::watch(QThread *thread, const QString &name)
+{
+    WatchedLoop *loop = new WatchedLoop;
+    loop->name = name;
+    loop->thread = thread;
+    loop->lastBeat.storeRelease(monotonicMs());
+#ifdef FTP_HAVE_STACK_SAMPLES
+    loop->hasHandle.storeRelease(0);
+#endif
+    loop->sampledBeat = -1;
+
+    loop->heartbeat = new QTimer;
+    loop->heartbeat->setInterval(HeartbeatInterval);
+    loop->heartbeat->moveToThread(thread);
+    connect(loop->heartbeat, &QTimer::timeout, loop->heartbeat, [this, loop]() {
+        beat(loop);
+    });
+    connect(thread, &QThread::finished, this, [this, thread]() {
+        unwatch(thread);
+    }, Qt::DirectConnection);
+
+    QMutexLocker locker(&m_mutex);
+    m_loops.append(loop);
+    if (m_running) {
+        startLoop(loop);
+    }
+}
+
+void StallWatchdog::startLoop(WatchedLoop *loop)
+{
+    // Runs in the watched thread, which is the one a sample is taken of
+    QMetaObject::invokeMethod(loop->heartbeat, [loop]() {
+#ifdef FTP_HAVE_STACK_SAMPLES
+        loop->handle = pthread_self();
+        loop->hasHandle.storeRelease(1);
+#endif
+        loop->lastBeat.storeRelease(monotonicMs());
+        loop->heartbeat->start();
+    });
+}
+
+void StallWatchdog::unwatch(QThread *thread)
+{
+    QMutexLocker locker(&m_mutex);
+    for (int i = 0; i < m_loops.size(); ++i) {
+        if (m_loops[i]->thread == thread) {
+            // Called from the finishing thread, which owns the timer
+            delete m_loops[i]->heartbeat;
+            delete m_loops.takeAt(i);
+            return;
+        }
+    }
+}
+
+void StallWatchdog::start()
+{
+    QMutexLocker locker(&m_mutex);
+    if (m_running) {
+        return;
+    }
+    m_running = true;
+    for (WatchedLoop *loop : qAsConst(m_loops)) {
+        startLoop(loop);
+    }
+    m_thread->start();
+}
+
+void StallWatchdog::stop()
+{
+    {
+        QMutexLocker locker(&m_mutex);
+        if (!m_running) {
+            return;
+        }
+        m_running = false;
+        for (WatchedLoop *loop : qAsConst(m_loops)) {
+            QMetaObject::invokeMethod(loop->heartbeat, &QTimer::stop);
+        }
+    }
+    m_thread->shutdown();
+}
+
+void StallWatchdog::setActivity(const QString &activity)
+{
+    QThread *current = QThread::currentThread();
+    QMutexLocker locker(&m_mutex);
+    for (WatchedLoop *loop : qAsConst(m_loops)) {
+        if (loop->thread == current) {
+            loop->activity = activity;
+            return;
+        }
+    }
+}
+
+StallWatchdog::Stats StallWatchdog::stats() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_stats;
+}
+
+void StallWatchdog::resetStats()
+{
+    QMutexLocker locker(&m_mutex);
+    m_stats.stalls = 0;
+    m_stats.longest = 0;
+    for (int i = 0; i < BucketCount; ++i) {
+        m_stats.histogram[i] = 0;
+    }
+}
+
+void StallWatchdog::beat(WatchedLoop *loop)
+{
+    qint64 now = monotonicMs();
+    qint64 latency = now - loop->lastBeat.loadAcquire() - HeartbeatInterval;
+    loop->lastBeat.storeRelease(now);
+
+    QMutexLocker locker(&m_mutex);
+    if (latency < m_threshold) {
+        return;
+    }
+
+    ++m_stats.stalls;
+    m_stats.longest = qMax(m_stats.longest, latency);
+    int bucket = 0;
+    while (bucket < BucketCount - 1 && latency >= BucketLimits[bucket]) {
+        ++bucket;
+    }
+    ++m_stats.histogram[bucket];
+
+    // Sampled while stuck, unless the stall ended between checks
+    QString activity = loop->stack.isEmpty() ? loop->activity : loop->stalledActivity;
+    QStringList stack;
+    stack.swap(loop->stack);
+    QString name = loop->name;
+    locker.unlock();
+
+    emit stalled(name, latency, activity, stack);
+}
+
+void StallWatchdog::check()
+{
+    // Runs on the watchdog thread
+    qint64 now = monotonicMs();
+    QMutexLocker locker(&m_mutex);
+    for (int i = 0; i < m_loops.size(); ++i) {
+        WatchedLoop *loop = m_loops[i];
+        qint64 lastBeat = loop->lastBeat.loadAcquire();
+        if (now - lastBeat - HeartbeatInterval < m_threshold || loop->sampledBeat == lastBeat) {
+            continue;
+        }
+        loop->sampledBeat = lastBeat;
+        loop->stalledActivity = loop->activity;
+
+#ifdef FTP_HAVE_STACK_SAMPLES
+        if (loop->hasHandle.loadAcquire()) {
+            // Not under the lock: the stalled thread may be about to take it
+            pthread_t handle = loop->handle;
+            locker.unlock();
+            QStringList stack = sampleStack(handle);
+            locker.relock();
+            if (i >= m_loops.size() || m_loops[i] != loop) {
+                // The list changed while sampling; the rest wait for the
+                // next check
+                return;
+            }
+            loop->stack = stack;
+        }
+#endif
+
+        // Logged right away, as the stalled thread can't report it yet
+        qWarning().noquote() << QString("Event loop of %1 stalled for over %2 ms, last command: %3")
+                                .arg(loop->name)
+                                .arg(now - lastBeat - HeartbeatInterval)
+                                .arg(loop->stalledActivity.isEmpty() ? "none" : loop->stalledActivity);
+        for (const QString &frame : qAsConst(loop->stack)) {
+            qWarning().noquote() << "    " << frame;
+        }
+    }
+}
@@ -0,0 +1,82 @@
+#ifndef STALLWATCHDOG_H
+#define STALLWATCHDOG_H
+
+#include <QObject>
+#include <QList>
+#include <QMutex>
+#include <QString>
+#include <QStringList>
+
+class QThread;
+class WatchdogThread;
+struct WatchedLoop;
+
+// Catches blocking calls that freeze an event loop, and with it every
+// session the loop serves. Each watched thread stamps a heartbeat from a
+// timer; a watchdog thread of its own checks the stamps, and once one is
+// older than the threshold it samples the stuck thread's stack and notes
+// the command that thread last started. The stall's full length is
+// known when the heartbeat resumes; it is then counted in stats() and
+// reported through stalled().
+class StallWatchdog : public QObject
+{
+    Q_OBJECT
+public:
+    // Stall counts by length: bucket i counts stalls shorter than
+    // BucketLimits[i] milliseconds, the last bucket all longer ones
+    static const int BucketCount = 6;
+    static const int BucketLimits[BucketCount - 1];
+
+    struct Stats
+    {
+        quint64 stalls;
+        qint64 longest;
+        quint64 histogram[BucketCount];
+    };
+
+    explicit StallWatchdog(QObject *parent = nullptr);
+    ~StallWatchdog();
+
+    // Event-loop latency, in milliseconds, that counts as a stall
+    void setThreshold(int ms);
+    int threshold() const;
+
+    // Watches thread's event loop until it finishes
+    void watch(QThread *thread, const QString &name);
+
+    void start();
+    void stop();
+
+    // What the calling thread is working on, reported if it stalls
+    void setActivity(const QString &activity);
+
+    Stats stats() const;
+    void resetStats();
+
+signals:
+    // Emitted from the stalled thread once it is running again. stack is
+    // empty if no sample could be taken.
+    void stalled(const QString &thread, qint64 durationMs, const QString &activity,
+                 const QStringList &stack);
+
+private:
+    friend class WatchdogThread;
+
+    // How often heartbeats are stamped and checked
+    static const int HeartbeatInterval = 50;
+    static const int DefaultThreshold = 250;
+
+    void startLoop(WatchedLoop *loop);
+    void beat(WatchedLoop *loop);
+    void check();
+    void unwatch(QThread *thread);
+
+    mutable QMutex m_mutex;
+    QList<WatchedLoop *> m_loops;
+    WatchdogThread *m_thread;
+    int m_threshold;
+    bool m_running;
+    Stats m_stats;
+};
+
+#endif // STALLWATCHDOG_H
@@ -0,0 +1,94 @@
+#include "statcache.h"
+
+StatCache::StatCache(QObject *parent) : QObject(parent),
+    m_entries(100000),
+    m_ttl(2000)
+{
+    m_clock.start();
+}
+
+void StatCache::setTtl(int msecs)
+{
+    m_ttl = msecs;
+}
+
+int StatCache::ttl() const
+{
+    return m_ttl;
+}
+
+void StatCache::setMaxEntries(int count)
+{
+    m_entries.setMaxCost(count);
+}
+
+bool StatCache::lookup(const QString &path, Info *info)
+{
+    Entry *entry = m_entries.object(path);
+    if (!entry) {
+        return false;
+    }
+
+    if (entry->expires <= m_clock.elapsed()) {
+        m_entries.remove(path);
+        return false;
+    }
+
+    *info = entry->info;
+    return true;
+}
+
+void StatCache::insert(const QString &path, const Info &info)
+{
+    if (m_ttl <= 0) {
+        return;
+    }
+
+    Entry *entry = new Entry;
+    entry->info = info;
+    entry->expires = m_clock.elapsed() + m_ttl;
+    m_entries.insert(path, entry);
+}
+
+void StatCache::insertListing(const QString &directory, const QVector<Vfs::Entry> &entries)
+{
+    if (m_ttl <= 0) {
+        return;
+    }
+
+    QString prefix = (directory == "/" ? QString() : directory) + '/';
+    qint64 expires = m_clock.elapsed() + m_ttl;
+    for (const Vfs::Entry &listed : entries) {
+        Entry *entry = new Entry;
+        entry->info.exists = true;
+        entry->info.isDir = listed.isDir;
+        entry->info.size = listed.size;
+        entry->info.modified = listed.modified;
+        entry->expires = expires;
+        m_entries.insert(prefix + listed.name, entry);
+    }
+}
+
+void StatCache::invalidate(const QString &path)
+{
+    m_entries.remove(path);
+}
+
+void StatCache::invalidateTree(const QString &path)
+{
+    m_entries.remove(path);
+
+    // Rare (RMD, renaming a directory), so a scan of the keys will do
+    QString prefix = (path == "/" ? QString() : path) + '/';
+    const QList<QString> keys = m_entries.keys();
+    for (const QString &key : keys) {
+        if (key.startsWith(prefix)) {
+            m_entries.remove(key);
+        }
+    }
+}
+
+void StatCache::clear()
+{
+    m_entries.clear();
+}
@@ -0,0 +1,55 @@
+#ifndef STATCACHE_H
+#define STATCACHE_H
+
+#include <QObject>
+#include <QCache>
+#include <QDateTime>
+#include <QElapsedTimer>
+#include <QVector>
+#include "vfs.h"
+
+// Short-lived cache of file metadata for SIZE/MDTM probes. Directory
+// listings (LIST, STAT, recursive walks) fill it with every entry they
+// read, so a mirror client asking about thousands of files right after
+// listing their directory costs one hash lookup per file. Entries expire
+// after a TTL and are dropped by the server's own mutating commands.
+class StatCache : public QObject
+{
+    Q_OBJECT
+public:
+    struct Info
+    {
+        bool exists = false;
+        bool isDir = false;
+        qint64 size = 0;
+        QDateTime modified;
+    };
+
+    explicit StatCache(QObject *parent = nullptr);
+
+    void setTtl(int msecs);
+    int ttl() const;
+    void setMaxEntries(int count);
+
+    bool lookup(const QString &path, Info *info);
+    void insert(const QString &path, const Info &info);
+    // Caches every entry of a listing of directory
+    void insertListing(const QString &directory, const QVector<Vfs::Entry> &entries);
+    void invalidate(const QString &path);
+    // Drops path and everything below it, for a directory renamed or removed
+    void invalidateTree(const QString &path);
+    void clear();
+
+private:
+    struct Entry
+    {
+        Info info;
+        qint64 expires;
+    };
+
+    QCache<QString, Entry> m_entries;
+    QElapsedTimer m_clock;
+    int m_ttl;
+};
+
+#endif // STATCACHE_H
@@ -0,0 +1,88 @@
+#include "throughputgraph.h"
+#include "sessiontablemodel.h"
+#include <QPainter>
+#include <QPainterPath>
+#include <algorithm>
+
+ThroughputGraph::ThroughputGraph(QWidget *parent) : QWidget(parent)
+{
+    m_received.reserve(MaxSamples);
+    m_sent.reserve(MaxSamples);
+    setMinimumHeight(80);
+}
+
+void ThroughputGraph::addSample(double received, double sent)
+{
+    if (m_received.size() == MaxSamples) {
+        m_received.removeFirst();
+        m_sent.removeFirst();
+    }
+    m_received.append(received);
+    m_sent.append(sent);
+    update();
+}
+
+void ThroughputGraph::clear()
+{
+    m_received.clear();
+    m_sent.clear();
+    update();
+}
+
+QSize ThroughputGraph::sizeHint() const
+{
+    return QSize(400, 100);
+}
+
+void ThroughputGraph::paintEvent(QPaintEvent *event)
+{
+    Q_UNUSED(event);
+
+    QPainter painter(this);
+    painter.setRenderHint(QPainter::Antialiasing);
+    painter.fillRect(rect(), palette().base());
+    painter.setPen(palette().mid().color());
+    painter.drawRect(rect().adjusted(0, 0, -1, -1));
+
+    // Scaled to the busiest sample shown, at least 1 KiB/s
+    double peak = 1024.0;
+    if (!m_received.isEmpty()) {
+        peak = std::max({ peak, *std::max_element(m_received.begin(), m_received.end()),
+                          *std::max_element(m_sent.begin(), m_sent.end()) });
+    }
+
+    QRectF area = QRectF(rect()).adjusted(2, 2, -2, -2);
+    double step = area.width() / (MaxSamples - 1);
+    auto plot = [&](const QVector<double> &samples, const QColor &color) {
+        if (samples.size() < 2) {
+            return;
+        }
+        // Newest sample at the right edge
+        QPainterPath path;
+        double x = area.right() - step * (samples.size() - 1);
+        for (int i = 0; i < samples.size(); ++i, x += step) {
+            QPointF point(x, area.bottom() - samples[i] / peak * area.height());
+            if (i == 0) {
+                path.moveTo(point);
+            } else {
+                path.lineTo(point);
+            }
+        }
+        painter.setPen(QPen(color, 1.5));
+        painter.drawPath(path);
+    };
+    plot(m_received, QColor(0, 120, 215));
+    plot(m_sent, QColor(0, 160, 60));
+
+    double received = m_received.isEmpty() ? 0.0 : m_received.last();
+    double sent = m_sent.isEmpty() ? 0.0 : m_sent.last();
+    painter.setPen(palette().text().color());
+    painter.drawText(area.adjusted(4, 2, -4, -2), Qt::AlignLeft | Qt::AlignTop,
+                     "Peak " + SessionTableModel::formatBytes(peak) + "/s");
+    painter.setPen(QColor(0, 120, 215));
+    painter.drawText(area.adjusted(4, 2, -4, -2), Qt::AlignRight | Qt::AlignTop,
+                     "Upload " + SessionTableModel::formatBytes(received) + "/s");
+    painter.setPen(QColor(0, 160, 60));
+    painter.drawText(area.adjusted(4, 2, -4, -2), Qt::AlignRight | Qt::AlignBottom,
+                     "Download " + SessionTableModel::formatBytes(sent) + "/s");
+}
@@ -0,0 +1,33 @@
+#ifndef THROUGHPUTGRAPH_H
+#define THROUGHPUTGRAPH_H
+
+#include <QWidget>
+#include <QVector>
+
+// Scrolling graph of the server's aggregate upload and download rates.
+// Fed one sample per dashboard tick, so it repaints at that rate however
+// busy the server is.
+class ThroughputGraph : public QWidget
+{
+    Q_OBJECT
+public:
+    explicit ThroughputGraph(QWidget *parent = nullptr);
+
+    // Rates in bytes per second; the oldest sample scrolls out
+    void addSample(double received, double sent);
+    void clear();
+
+    QSize sizeHint() const override;
+
+protected:
+    void paintEvent(QPaintEvent *event) override;
+
+private:
+    // A minute of history at 5 samples a second
+    static const int MaxSamples = 300;
+
+    QVector<double> m_received;
+    QVector<double> m_sent;
+};
+
+#endif // THROUGHPUTGRAPH_H
@@ -0,0 +1,22 @@
+QT       += core network
+QT       -= gui
+
+TARGET = ftpreplay
+TEMPLATE = app
+CONFIG += console
+CONFIG -= app_bundle
+
+DEFINES += QT_DEPRECATED_WARNINGS
+
+INCLUDEPATH += ../..
+
+SOURCES += \
+        main.cpp \
+        idlesessions.cpp \
+        replaysession.cpp \
+        ../../capturerecord.cpp
+
+HEADERS += \
+        idlesessions.h \
+        replaysession.h \
+        ../../capturerecord.h
@@ -0,0 +1,129 @@
+#include "idlesessions.h"
+#include <QFile>
+#include <QTimer>
+
+IdleSessions::IdleSessions(const QString &host, quint16 port, const QByteArray &user,
+                           const QByteArray &password, int count, const QList<QHostAddress> &sources,
+                           QObject *parent) : QObject(parent),
+    m_host(host),
+    m_port(port),
+    m_user(user),
+    m_password(password),
+    m_count(count),
+    m_sources(sources),
+    m_opened(0),
+    m_pending(0),
+    m_loggedIn(0),
+    m_failed(0)
+{
+}
+
+void IdleSessions::start()
+{
+    openMore();
+}
+
+qint64 IdleSessions::residentBytes(qint64 pid)
+{
+    QFile status(QString("/proc/%1/status").arg(pid));
+    if (!status.open(QIODevice::ReadOnly)) {
+        return -1;
+    }
+    while (!status.atEnd()) {
+        QByteArray line = status.readLine();
+        if (line.startsWith("VmRSS:")) {
+            // "VmRSS:     12345 kB"
+            return line.mid(6).trimmed().split(' ').first().toLongLong() * 1024;
+        }
+    }
+    return -1;
+}
+
+void IdleSessions::openMore()
+{
+    while (m_opened < m_count && m_pending < MaxPending) {
+        QTcpSocket *socket = new QTcpSocket(this);
+        if (!m_sources.isEmpty()) {
+            socket->bind(m_sources.at(m_opened % m_sources.size()));
+        }
+        ++m_opened;
+        ++m_pending;
+        m_replies.insert(socket, 0);
+
+        connect(socket, &QTcpSocket::readyRead, this, [this, socket]() {
+            onReadyRead(socket);
+        });
+        connect(socket, &QTcpSocket::errorOccurred, this, [this, socket]() {
+            settle(socket, false);
+        });
+        QTimer::singleShot(LoginTimeout, socket, [this, socket]() {
+            settle(socket, false);
+        });
+        socket->connectToHost(m_host, m_port);
+    }
+
+    if (m_opened == m_count && m_pending == 0) {
+        emit ready();
+    }
+}
+
+void IdleSessions::onReadyRead(QTcpSocket *socket)
+{
+    auto it = m_replies.find(socket);
+    if (it == m_replies.end()) {
+        // Logged in already; anything more is the server giving up on it
+        socket->readAll();
+        return;
+    }
+
+    while (socket->canReadLine()) {
+        QByteArray line = socket->readLine().trimmed();
+        bool isCode = false;
+        int code = line.left(3).toInt(&isCode);
+        if (!isCode || (line.size() > 3 && line.at(3) != ' ') || code < 200) {
+            continue;
+        }
+
+        // Greeting, then USER, then PASS
+        switch (it.value()++) {
+        case 0:
+            if (code != 220) {
+                settle(socket, false);
+                return;
+            }
+            socket->write("USER " + m_user + "\r\n");
+            break;
+        case 1:
+            if (code == 230) {
+                settle(socket, true);
+                return;
+            }
+            if (code != 331) {
+                settle(socket, false);
+                return;
+            }
+            socket->write("PASS " + m_password + "\r\n");
+            break;
+        default:
+            settle(socket, code == 230);
+            return;
+        }
+    }
+}
+
+void IdleSessions::settle(QTcpSocket *socket, bool ok)
+{
+    if (!m_replies.remove(socket)) {
+        return;
+    }
+
+    --m_pending;
+    if (ok) {
+        ++m_loggedIn;
+    } else {
+        ++m_failed;
+        socket->abort();
+        socket->deleteLater();
+    }
+    openMore();
+}
@@ -0,0 +1,58 @@
+#ifndef IDLESESSIONS_H
+#define IDLESESSIONS_H
+
+#include <QObject>
+#include <QHash>
+#include <QHostAddress>
+#include <QList>
+#include <QTcpSocket>
+
+// Opens a number of control connections, logs each one in and leaves it
+// idle, then reads the server's resident set size, so the memory cost of
+// an idle session can be compared between builds. Connections go out a
+// bounded number at a time, and can be spread over several local
+// addresses when one runs out of ephemeral ports.
+class IdleSessions : public QObject
+{
+    Q_OBJECT
+public:
+    IdleSessions(const QString &host, quint16 port, const QByteArray &user, const QByteArray &password,
+                 int count, const QList<QHostAddress> &sources, QObject *parent = nullptr);
+
+    void start();
+
+    int loggedIn() const { return m_loggedIn; }
+    int failed() const { return m_failed; }
+
+    // VmRSS of a process in bytes, from /proc; -1 if it can't be read
+    static qint64 residentBytes(qint64 pid);
+
+signals:
+    // Every session is logged in or has failed; they stay connected
+    void ready();
+
+private:
+    // Connections still waiting for their greeting or login
+    static const int MaxPending = 256;
+    // A session gets this long to log in
+    static const int LoginTimeout = 30000;
+
+    void openMore();
+    void onReadyRead(QTcpSocket *socket);
+    void settle(QTcpSocket *socket, bool ok);
+
+    QString m_host;
+    quint16 m_port;
+    QByteArray m_user;
+    QByteArray m_password;
+    int m_count;
+    QList<QHostAddress> m_sources;
+    // Final replies seen so far, for sessions still logging in
+    QHash<QTcpSocket *, int> m_replies;
+    int m_opened;
+    int m_pending;
+    int m_loggedIn;
+    int m_failed;
+};
+
+#endif // IDLESESSIONS_H
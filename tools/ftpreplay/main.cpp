@@ -0,0 +1,446 @@
+#include "capturerecord.h"
+#include "idlesessions.h"
+#include "replaysession.h"
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QDataStream>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QMap>
+#include <QTextStream>
+#include <QTimer>
+#include <algorithm>
+#include <cmath>
+
+namespace {
+
+// Commands that can't be replayed as captured. Active mode would need
+// the server to reach us, so it becomes passive; TLS isn't replayed.
+const char *const SkippedVerbs[] = { "AUTH", "PBSZ", "PROT", "CCC" };
+
+bool loadScripts(const QString &path, const QByteArray &password, QVector<ReplayScript> *scripts)
+{
+    QTextStream err(stderr);
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        err << "Can't open " << path << ": " << file.errorString() << "\n";
+        return false;
+    }
+
+    QDataStream in(&file);
+    if (!CaptureRecord::readHeader(in)) {
+        err << path << " is not a session capture\n";
+        return false;
+    }
+
+    // Final replies answer commands in order; a transfer's size belongs
+    // to the command awaiting its reply
+    QMap<quint64, ReplayScript> bySession;
+    QHash<quint64, int> answered;
+    CaptureRecord record;
+    while (!in.atEnd()) {
+        if (!record.read(in)) {
+            err << "Stopped at a damaged record at offset " << file.pos() << "\n";
+            break;
+        }
+
+        ReplayScript &script = bySession[record.session];
+        script.session = record.session;
+        int &cursor = answered[record.session];
+        switch (record.kind) {
+        case CaptureRecord::SessionStart:
+            script.start = record.time;
+            break;
+        case CaptureRecord::Command: {
+            ReplayStep step;
+            step.time = record.time;
+            step.line = record.line;
+            step.verb = record.line.left(record.line.indexOf(' ')).toUpper();
+            script.steps.append(step);
+            break;
+        }
+        case CaptureRecord::Reply:
+            if (record.code >= 200 && cursor < script.steps.size()) {
+                script.steps[cursor++].recordedCode = record.code;
+            }
+            break;
+        case CaptureRecord::DataTransfer:
+            if (cursor < script.steps.size()) {
+                script.steps[cursor].bytes = record.bytes;
+            }
+            break;
+        case CaptureRecord::SessionEnd:
+            break;
+        }
+    }
+
+    // Sessions are replayed relative to the first one
+    qint64 origin = -1;
+    for (const ReplayScript &script : qAsConst(bySession)) {
+        if (origin < 0 || script.start < origin) {
+            origin = script.start;
+        }
+    }
+
+    for (ReplayScript script : qAsConst(bySession)) {
+        script.start -= origin;
+        QVector<ReplayStep> steps;
+        for (ReplayStep step : qAsConst(script.steps)) {
+            if (std::find(std::begin(SkippedVerbs), std::end(SkippedVerbs), step.verb) != std::end(SkippedVerbs)) {
+                continue;
+            }
+            if (step.verb == "PORT" || step.verb == "EPRT") {
+                step.verb = "PASV";
+                step.line = "PASV";
+            } else if (step.verb == "PASS") {
+                step.line = "PASS " + password;
+            }
+            step.time -= origin;
+            steps.append(step);
+        }
+        script.steps = steps;
+        scripts->append(script);
+    }
+    return true;
+}
+
+QString resolve(const QString &directory, const QString &path)
+{
+    return QDir::cleanPath(path.startsWith('/') ? path : directory + '/' + path);
+}
+
+// Creates every file the capture downloaded, at its captured size, so a
+// replay against an empty server finds them
+int seed(const QVector<ReplayScript> &scripts, const QString &root)
+{
+    QHash<QString, qint64> sizes;
+    for (const ReplayScript &script : scripts) {
+        QString directory = "/";
+        for (const ReplayStep &step : script.steps) {
+            QString argument = QString::fromUtf8(step.line.mid(step.verb.size() + 1));
+            if (step.recordedCode / 100 != 2) {
+                continue;
+            }
+            if (step.verb == "CWD") {
+                directory = resolve(directory, argument);
+            } else if (step.verb == "CDUP") {
+                directory = resolve(directory, "..");
+            } else if (step.verb == "RETR" && step.bytes > 0) {
+                qint64 &size = sizes[resolve(directory, argument)];
+                size = qMax(size, step.bytes);
+            }
+        }
+    }
+
+    int created = 0;
+    for (auto it = sizes.constBegin(); it != sizes.constEnd(); ++it) {
+        QFile file(root + it.key());
+        if (file.exists() && file.size() >= it.value()) {
+            continue;
+        }
+        QDir().mkpath(QFileInfo(file).path());
+        if (file.open(QIODevice::ReadWrite) && file.resize(it.value())) {
+            ++created;
+        }
+    }
+    return created;
+}
+
+double percentile(const QVector<double> &sorted, double fraction)
+{
+    if (sorted.isEmpty()) {
+        return 0;
+    }
+    int index = int(std::ceil(fraction * sorted.size())) - 1;
+    return sorted[qBound(0, index, sorted.size() - 1)];
+}
+
+// Summary of a run, as written by --results and read by --compare
+QJsonObject summarize(const ReplayResults &results, double wallSeconds)
+{
+    QJsonObject verbs;
+    for (auto it = results.latency.constBegin(); it != results.latency.constEnd(); ++it) {
+        QVector<double> sorted = it.value();
+        std::sort(sorted.begin(), sorted.end());
+        double total = 0;
+        for (double latency : qAsConst(sorted)) {
+            total += latency;
+        }
+
+        QJsonObject verb;
+        verb["count"] = sorted.size();
+        verb["mean"] = total / sorted.size();
+        verb["p50"] = percentile(sorted, 0.50);
+        verb["p95"] = percentile(sorted, 0.95);
+        verb["p99"] = percentile(sorted, 0.99);
+        verbs[QString::fromLatin1(it.key())] = verb;
+    }
+
+    QJsonObject summary;
+    summary["verbs"] = verbs;
+    summary["sessions"] = results.sessions;
+    summary["failedSessions"] = results.failedSessions;
+    summary["replyMismatches"] = results.replyMismatches;
+    summary["transferBytes"] = double(results.transferBytes);
+    summary["throughput"] = results.transferSeconds > 0
+        ? results.transferBytes / results.transferSeconds : 0.0;
+    summary["wallSeconds"] = wallSeconds;
+    return summary;
+}
+
+void printSummary(const QJsonObject &summary)
+{
+    QTextStream out(stdout);
+    out << qSetFieldWidth(8) << Qt::left << "verb" << Qt::right << "count" << "mean" << "p50" << "p95" << "p99"
+        << qSetFieldWidth(0) << "  (ms)\n";
+    QJsonObject verbs = summary["verbs"].toObject();
+    for (auto it = verbs.constBegin(); it != verbs.constEnd(); ++it) {
+        QJsonObject verb = it.value().toObject();
+        out << qSetFieldWidth(8) << Qt::left << it.key() << Qt::right << verb["count"].toInt()
+            << qSetRealNumberPrecision(3)
+            << verb["mean"].toDouble() << verb["p50"].toDouble()
+            << verb["p95"].toDouble() << verb["p99"].toDouble() << qSetFieldWidth(0) << '\n';
+    }
+    out << "sessions " << summary["sessions"].toInt()
+        << ", failed " << summary["failedSessions"].toInt()
+        << ", reply mismatches " << summary["replyMismatches"].toInt() << '\n'
+        << "transferred " << qint64(summary["transferBytes"].toDouble()) << " bytes at "
+        << summary["throughput"].toDouble() / (1024 * 1024) << " MB/s\n"
+        << "wall time " << summary["wallSeconds"].toDouble() << " s\n";
+}
+
+bool readSummary(const QString &path, QJsonObject *summary)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        QTextStream(stderr) << "Can't open " << path << ": " << file.errorString() << "\n";
+        return false;
+    }
+    *summary = QJsonDocument::fromJson(file.readAll()).object();
+    return true;
+}
+
+QString change(double before, double after)
+{
+    if (before <= 0) {
+        return QString::number(after, 'g', 4);
+    }
+    return QString("%1 -> %2 (%3%4%)")
+        .arg(before, 0, 'g', 4)
+        .arg(after, 0, 'g', 4)
+        .arg(after >= before ? "+" : "")
+        .arg((after - before) * 100 / before, 0, 'f', 1);
+}
+
+// Latency percentiles, throughput and wall time of two runs side by side
+int compare(const QString &basePath, const QString &newPath)
+{
+    QJsonObject base;
+    QJsonObject current;
+    if (!readSummary(basePath, &base) || !readSummary(newPath, &current)) {
+        return 1;
+    }
+
+    QTextStream out(stdout);
+    QJsonObject baseVerbs = base["verbs"].toObject();
+    QJsonObject currentVerbs = current["verbs"].toObject();
+    QStringList verbs = baseVerbs.keys() + currentVerbs.keys();
+    verbs.removeDuplicates();
+    verbs.sort();
+    for (const QString &name : qAsConst(verbs)) {
+        QJsonObject before = baseVerbs[name].toObject();
+        QJsonObject after = currentVerbs[name].toObject();
+        out << name << '\n';
+        for (const char *key : { "p50", "p95", "p99" }) {
+            out << "    " << key << " ms  " << change(before[key].toDouble(), after[key].toDouble()) << '\n';
+        }
+    }
+    out << "throughput MB/s  "
+        << change(base["throughput"].toDouble() / (1024 * 1024),
+                  current["throughput"].toDouble() / (1024 * 1024)) << '\n'
+        << "wall time s  "
+        << change(base["wallSeconds"].toDouble(), current["wallSeconds"].toDouble()) << '\n';
+    return 0;
+}
+
+bool writeSummary(const QString &path, const QJsonObject &summary)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        QTextStream(stderr) << "Can't write " << file.fileName() << ": " << file.errorString() << "\n";
+        return false;
+    }
+    file.write(QJsonDocument(summary).toJson());
+    return true;
+}
+
+// Logs in count sessions and leaves them idle, then reports how much the
+// server's resident set grew per session. The server should be otherwise
+// idle, and started fresh, so earlier peaks don't hide the growth.
+int measureIdle(const QString &host, quint16 port, const QByteArray &user, const QByteArray &password,
+                int count, const QList<QHostAddress> &sources, qint64 serverPid, int settleSeconds,
+                QJsonObject *summary)
+{
+    QTextStream out(stdout);
+    qint64 before = IdleSessions::residentBytes(serverPid);
+    if (before < 0) {
+        QTextStream(stderr) << "Can't read the resident set of process " << serverPid << "\n";
+        return 1;
+    }
+
+    IdleSessions sessions(host, port, user, password, count, sources);
+    QElapsedTimer clock;
+    clock.start();
+    QObject::connect(&sessions, &IdleSessions::ready, [&]() {
+        out << sessions.loggedIn() << " sessions logged in, " << sessions.failed() << " failed, in "
+            << clock.elapsed() / 1000.0 << " s; settling for " << settleSeconds << " s\n";
+        out.flush();
+        QTimer::singleShot(settleSeconds * 1000, &QCoreApplication::quit);
+    });
+    sessions.start();
+    QCoreApplication::exec();
+
+    qint64 after = IdleSessions::residentBytes(serverPid);
+    double perSession = sessions.loggedIn() > 0 ? double(after - before) / sessions.loggedIn() : 0.0;
+    out << "server RSS " << before / 1024 << " KiB -> " << after / 1024 << " KiB, "
+        << qSetRealNumberPrecision(4) << perSession / 1024 << " KiB per idle session\n";
+
+    (*summary)["idleSessions"] = sessions.loggedIn();
+    (*summary)["failedSessions"] = sessions.failed();
+    (*summary)["rssBefore"] = double(before);
+    (*summary)["rssAfter"] = double(after);
+    (*summary)["bytesPerSession"] = perSession;
+    return sessions.loggedIn() == count ? 0 : 1;
+}
+
+}
+
+// Replays a session capture (--capture on the server) against a server,
+// with the original command timing and transfer sizes, and reports the
+// latency of each command verb and the transfer throughput
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Replays a captured FTP workload against a server.");
+    parser.addHelpOption();
+    QCommandLineOption hostOption("host", "Server to replay against.", "host", "127.0.0.1");
+    parser.addOption(hostOption);
+    QCommandLineOption portOption("port", "Control port of the server.", "port", "21");
+    parser.addOption(portOption);
+    QCommandLineOption speedOption("speed",
+        "Replay this many times faster than captured; commands still wait for the "
+        "previous reply.", "factor", "1");
+    parser.addOption(speedOption);
+    QCommandLineOption passwordOption("password",
+        "Password sent for every login, as captures don't keep them.", "password", "password");
+    parser.addOption(passwordOption);
+    QCommandLineOption resultsOption("results", "Also write the summary to file as JSON.", "file");
+    parser.addOption(resultsOption);
+    QCommandLineOption seedOption("seed-root",
+        "Before replaying, create the files the capture downloads under directory (the "
+        "server's root), at their captured sizes.", "directory");
+    parser.addOption(seedOption);
+    QCommandLineOption compareOption("compare",
+        "Instead of replaying, compare the --results file given in place of the capture "
+        "(the baseline) with file.", "file");
+    parser.addOption(compareOption);
+    QCommandLineOption idleOption("idle-sessions",
+        "Instead of replaying, log in count sessions, leave them idle and report the "
+        "growth of the server's resident set per session. Needs --server-pid, and a "
+        "file descriptor limit above count.", "count");
+    parser.addOption(idleOption);
+    QCommandLineOption serverPidOption("server-pid",
+        "Process whose resident set --idle-sessions measures; it must run on this host.", "pid");
+    parser.addOption(serverPidOption);
+    QCommandLineOption userOption("user", "User --idle-sessions logs in as.", "name", "username");
+    parser.addOption(userOption);
+    QCommandLineOption sourcesOption("source-addresses",
+        "Comma-separated local addresses --idle-sessions connects from, in turn; each "
+        "one only has some 28k ephemeral ports per server port, so 100k sessions "
+        "against 127.0.0.1 need e.g. 127.0.0.1,127.0.0.2,127.0.0.3,127.0.0.4.", "addresses");
+    parser.addOption(sourcesOption);
+    QCommandLineOption settleOption("settle",
+        "Seconds --idle-sessions waits after the last login before measuring.", "seconds", "5");
+    parser.addOption(settleOption);
+    parser.addPositionalArgument("capture", "Session capture to replay.");
+    parser.process(app);
+
+    if (parser.isSet(idleOption)) {
+        int count = parser.value(idleOption).toInt();
+        qint64 serverPid = parser.value(serverPidOption).toLongLong();
+        if (count <= 0 || serverPid <= 0) {
+            QTextStream(stderr) << "--idle-sessions needs a positive count and --server-pid\n";
+            return 1;
+        }
+        QList<QHostAddress> sources;
+        for (const QString &address : parser.value(sourcesOption).split(',', Qt::SkipEmptyParts)) {
+            sources.append(QHostAddress(address));
+        }
+
+        QJsonObject summary;
+        int status = measureIdle(parser.value(hostOption), quint16(parser.value(portOption).toUInt()),
+                                 parser.value(userOption).toUtf8(), parser.value(passwordOption).toUtf8(),
+                                 count, sources, serverPid, parser.value(settleOption).toInt(), &summary);
+        if (parser.isSet(resultsOption) && !writeSummary(parser.value(resultsOption), summary)) {
+            return 1;
+        }
+        return status;
+    }
+
+    if (parser.positionalArguments().size() != 1) {
+        parser.showHelp(1);
+    }
+    if (parser.isSet(compareOption)) {
+        return compare(parser.positionalArguments().first(), parser.value(compareOption));
+    }
+
+    double speed = parser.value(speedOption).toDouble();
+    if (speed <= 0) {
+        QTextStream(stderr) << "--speed must be positive\n";
+        return 1;
+    }
+
+    QVector<ReplayScript> scripts;
+    if (!loadScripts(parser.positionalArguments().first(), parser.value(passwordOption).toUtf8(),
+                     &scripts)) {
+        return 1;
+    }
+    if (parser.isSet(seedOption)) {
+        QTextStream(stdout) << "Seeded " << seed(scripts, parser.value(seedOption)) << " files\n";
+    }
+    if (scripts.isEmpty()) {
+        QTextStream(stderr) << "The capture has no sessions\n";
+        return 1;
+    }
+
+    ReplayResults results;
+    QElapsedTimer clock;
+    clock.start();
+    int running = scripts.size();
+    for (const ReplayScript &script : qAsConst(scripts)) {
+        ReplaySession *session = new ReplaySession(script, parser.value(hostOption),
+                                                   quint16(parser.value(portOption).toUInt()),
+                                                   speed, clock, &results, &app);
+        QObject::connect(session, &ReplaySession::finished, &app, [&running, session]() {
+            session->deleteLater();
+            if (--running == 0) {
+                QCoreApplication::quit();
+            }
+        });
+        session->start();
+    }
+    app.exec();
+
+    QJsonObject summary = summarize(results, clock.elapsed() / 1000.0);
+    printSummary(summary);
+    if (parser.isSet(resultsOption) && !writeSummary(parser.value(resultsOption), summary)) {
+        return 1;
+    }
+    return 0;
+}
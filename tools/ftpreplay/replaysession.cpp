@@ -0,0 +1,252 @@
+#include "replaysession.h"
+#include <QRegularExpression>
+
+ReplaySession::ReplaySession(const ReplayScript &script, const QString &host, quint16 port,
+                             double speed, const QElapsedTimer &clock, ReplayResults *results,
+                             QObject *parent) : QObject(parent),
+    m_script(script),
+    m_host(host),
+    m_port(port),
+    m_speed(speed),
+    m_clock(clock),
+    m_results(results),
+    m_greeted(false),
+    m_done(false),
+    m_next(0),
+    m_current(-1),
+    m_sentAt(0),
+    m_replied(false),
+    m_dataDone(false),
+    m_dataBytes(0),
+    m_uploadRemaining(0),
+    m_uploading(false),
+    m_passivePort(0)
+{
+    m_stepTimer.setSingleShot(true);
+    connect(&m_stepTimer, &QTimer::timeout, this, &ReplaySession::sendStep);
+
+    m_timeout.setSingleShot(true);
+    m_timeout.setInterval(StepTimeout);
+    connect(&m_timeout, &QTimer::timeout, this, [this]() {
+        finish(true);
+    });
+
+    connect(&m_control, &QTcpSocket::readyRead, this, &ReplaySession::onControlReadyRead);
+    connect(&m_control, &QTcpSocket::disconnected, this, [this]() {
+        // Fine after the last command, a failure before it
+        finish(m_current >= 0 || m_next < m_script.steps.size());
+    });
+    connect(&m_control, &QTcpSocket::errorOccurred, this, [this](QAbstractSocket::SocketError error) {
+        if (error != QAbstractSocket::RemoteHostClosedError) {
+            finish(true);
+        }
+    });
+}
+
+void ReplaySession::start()
+{
+    qint64 delay = qMax<qint64>(0, dueMs(m_script.start) - m_clock.elapsed());
+    QTimer::singleShot(int(delay), this, [this]() {
+        m_timeout.start();
+        m_control.connectToHost(m_host, m_port);
+    });
+}
+
+qint64 ReplaySession::dueMs(qint64 captureTime) const
+{
+    return qint64(captureTime / 1000.0 / m_speed);
+}
+
+void ReplaySession::scheduleNext()
+{
+    if (m_next >= m_script.steps.size()) {
+        // The capture ended without a QUIT
+        finish(false);
+        return;
+    }
+
+    qint64 delay = dueMs(m_script.steps[m_next].time) - m_clock.elapsed();
+    m_stepTimer.start(int(qMax<qint64>(0, delay)));
+}
+
+void ReplaySession::sendStep()
+{
+    const ReplayStep &step = m_script.steps[m_next];
+    m_current = m_next++;
+    m_replied = false;
+    m_dataDone = step.bytes < 0;
+    m_dataBytes = 0;
+
+    // Connect first, the way a passive-mode client does
+    if (!m_dataDone) {
+        if (m_passivePort) {
+            openDataConnection();
+        } else {
+            m_dataDone = true;
+        }
+    }
+
+    m_sentAt = m_clock.nsecsElapsed();
+    m_control.write(step.line + "\r\n");
+    m_timeout.start();
+}
+
+void ReplaySession::onControlReadyRead()
+{
+    while (m_control.canReadLine()) {
+        QByteArray line = m_control.readLine().trimmed();
+        bool isCode = false;
+        int code = line.left(3).toInt(&isCode);
+
+        // Skip the body of multi-line replies and preliminary 1xx ones
+        if (!isCode || line.size() < 3 || (line.size() > 3 && line.at(3) != ' ') || code < 200) {
+            continue;
+        }
+        onFinalReply(code, line);
+        if (m_done) {
+            return;
+        }
+    }
+}
+
+void ReplaySession::onFinalReply(int code, const QByteArray &text)
+{
+    if (!m_greeted) {
+        m_greeted = true;
+        if (code != 220) {
+            finish(true);
+            return;
+        }
+        scheduleNext();
+        return;
+    }
+
+    if (m_current < 0) {
+        return;
+    }
+
+    const ReplayStep &step = m_script.steps[m_current];
+    double latency = (m_clock.nsecsElapsed() - m_sentAt) / 1e6;
+    m_results->latency[step.verb].append(latency);
+    if (step.recordedCode && code / 100 != step.recordedCode / 100) {
+        ++m_results->replyMismatches;
+    }
+
+    if (code == 227) {
+        static const QRegularExpression address("\\((\\d+),(\\d+),(\\d+),(\\d+),(\\d+),(\\d+)\\)");
+        QRegularExpressionMatch match = address.match(QString::fromLatin1(text));
+        if (match.hasMatch()) {
+            m_passivePort = quint16(match.captured(5).toInt() * 256 + match.captured(6).toInt());
+        }
+    }
+
+    // A refused or failed transfer won't get its data connection served
+    if (code >= 400 && !m_dataDone) {
+        m_dataDone = true;
+        if (m_data) {
+            m_data->abort();
+            m_data->deleteLater();
+        }
+    }
+
+    m_replied = true;
+    completeStepIfDone();
+}
+
+void ReplaySession::openDataConnection()
+{
+    const ReplayStep &step = m_script.steps[m_current];
+    m_uploading = step.verb == "STOR" || step.verb == "APPE" || step.verb == "STOU";
+    m_uploadRemaining = m_uploading ? step.bytes : 0;
+
+    QTcpSocket *socket = new QTcpSocket(this);
+    m_data = socket;
+    connect(socket, &QTcpSocket::connected, this, &ReplaySession::sendUploadData);
+    connect(socket, &QTcpSocket::bytesWritten, this, [this](qint64 bytes) {
+        m_dataBytes += bytes;
+        sendUploadData();
+    });
+    connect(socket, &QTcpSocket::readyRead, this, [this, socket]() {
+        // Downloads are counted and dropped
+        m_dataBytes += socket->readAll().size();
+    });
+    connect(socket, &QTcpSocket::disconnected, this, [this, socket]() {
+        m_dataBytes += socket->readAll().size();
+        socket->deleteLater();
+        m_dataDone = true;
+        completeStepIfDone();
+    });
+    connect(socket, &QTcpSocket::errorOccurred, this, [this, socket](QAbstractSocket::SocketError error) {
+        if (error != QAbstractSocket::RemoteHostClosedError) {
+            socket->deleteLater();
+            m_dataDone = true;
+            completeStepIfDone();
+        }
+    });
+
+    // The server's own address may not be reachable from here; its port is
+    socket->connectToHost(m_host, m_passivePort);
+    m_passivePort = 0;
+}
+
+void ReplaySession::sendUploadData()
+{
+    if (!m_data || !m_uploading || m_data->state() != QAbstractSocket::ConnectedState) {
+        return;
+    }
+
+    static const QByteArray chunk(int(UploadChunk), '\0');
+    while (m_uploadRemaining > 0 && m_data->bytesToWrite() < 4 * UploadChunk) {
+        qint64 length = qMin(m_uploadRemaining, UploadChunk);
+        m_data->write(chunk.constData(), length);
+        m_uploadRemaining -= length;
+    }
+
+    // Closed once everything queued has gone out
+    if (m_uploadRemaining == 0) {
+        m_uploading = false;
+        m_data->disconnectFromHost();
+    }
+}
+
+void ReplaySession::completeStepIfDone()
+{
+    if (m_current < 0 || !m_replied || !m_dataDone) {
+        return;
+    }
+
+    const ReplayStep &step = m_script.steps[m_current];
+    if (step.bytes >= 0 && m_dataBytes > 0) {
+        m_results->transferBytes += m_dataBytes;
+        m_results->transferSeconds += (m_clock.nsecsElapsed() - m_sentAt) / 1e9;
+    }
+    m_current = -1;
+    m_timeout.stop();
+
+    if (step.verb == "QUIT") {
+        finish(false);
+        return;
+    }
+    scheduleNext();
+}
+
+void ReplaySession::finish(bool failed)
+{
+    if (m_done) {
+        return;
+    }
+    m_done = true;
+    m_stepTimer.stop();
+    m_timeout.stop();
+
+    ++m_results->sessions;
+    if (failed) {
+        ++m_results->failedSessions;
+    }
+
+    if (m_data) {
+        m_data->abort();
+    }
+    m_control.disconnectFromHost();
+    emit finished();
+}
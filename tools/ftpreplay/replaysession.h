@@ -0,0 +1,102 @@
+#ifndef REPLAYSESSION_H
+#define REPLAYSESSION_H
+
+#include <QObject>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QPointer>
+#include <QTcpSocket>
+#include <QTimer>
+#include <QVector>
+
+// One command of a captured session, ready to send
+struct ReplayStep
+{
+    // Microseconds after the capture started that it was received
+    qint64 time = 0;
+    QByteArray line;
+    QByteArray verb;
+    // Final reply the server originally gave, 0 if none was captured
+    int recordedCode = 0;
+    // Bytes on the data connection, -1 for commands without one
+    qint64 bytes = -1;
+};
+
+struct ReplayScript
+{
+    quint64 session = 0;
+    qint64 start = 0;
+    QVector<ReplayStep> steps;
+};
+
+// What a replay measured, across all sessions
+struct ReplayResults
+{
+    // Milliseconds from sending a command to its final reply, by verb
+    QHash<QByteArray, QVector<double>> latency;
+    qint64 transferBytes = 0;
+    double transferSeconds = 0;
+    int sessions = 0;
+    int failedSessions = 0;
+    // Final replies in a different class (2xx, 4xx, 5xx) from the capture
+    int replyMismatches = 0;
+};
+
+// Plays one captured session against a server: connects when it
+// originally did, sends each command no earlier than its original time
+// (scaled by speed) and never before the previous one is answered,
+// uploading or draining the captured number of bytes on data connections.
+class ReplaySession : public QObject
+{
+    Q_OBJECT
+public:
+    ReplaySession(const ReplayScript &script, const QString &host, quint16 port, double speed,
+                  const QElapsedTimer &clock, ReplayResults *results, QObject *parent = nullptr);
+
+    void start();
+
+signals:
+    void finished();
+
+private:
+    // A command gets this long to be answered and its data moved
+    static const int StepTimeout = 60000;
+    static const qint64 UploadChunk = 64 * 1024;
+
+    void scheduleNext();
+    void sendStep();
+    void onControlReadyRead();
+    void onFinalReply(int code, const QByteArray &text);
+    void openDataConnection();
+    void sendUploadData();
+    void completeStepIfDone();
+    void finish(bool failed);
+    qint64 dueMs(qint64 captureTime) const;
+
+    ReplayScript m_script;
+    QString m_host;
+    quint16 m_port;
+    double m_speed;
+    const QElapsedTimer &m_clock;
+    ReplayResults *m_results;
+
+    QTcpSocket m_control;
+    QPointer<QTcpSocket> m_data;
+    QTimer m_stepTimer;
+    QTimer m_timeout;
+    bool m_greeted;
+    bool m_done;
+    int m_next;
+    // The step in flight: when it was sent, and what is still outstanding
+    int m_current;
+    qint64 m_sentAt;
+    bool m_replied;
+    bool m_dataDone;
+    qint64 m_dataBytes;
+    qint64 m_uploadRemaining;
+    bool m_uploading;
+    // Port from the last 227 reply, 0 if none is open
+    quint16 m_passivePort;
+};
+
+#endif // REPLAYSESSION_H
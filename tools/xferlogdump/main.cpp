@@ -0,0 +1,95 @@
+#include "transferrecord.h"
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QDataStream>
+#include <QDateTime>
+#include <QFile>
+#include <QMap>
+#include <QTextStream>
+
+// Reads the server's binary transfer log (xferlog.bin) and prints it as
+// tab-separated records, as xferlog text, or as per-user totals
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Prints a binary FTP transfer log.");
+    parser.addHelpOption();
+    QCommandLineOption xferlogOption("xferlog", "Print in wu-ftpd xferlog format.");
+    parser.addOption(xferlogOption);
+    QCommandLineOption totalsOption("totals",
+        "Print bytes and operation counts per user instead of records.");
+    parser.addOption(totalsOption);
+    parser.addPositionalArgument("file", "Binary transfer log to read.");
+    parser.process(app);
+
+    if (parser.positionalArguments().size() != 1) {
+        parser.showHelp(1);
+    }
+
+    QTextStream err(stderr);
+    QFile file(parser.positionalArguments().first());
+    if (!file.open(QIODevice::ReadOnly)) {
+        err << "Can't open " << file.fileName() << ": " << file.errorString() << "\n";
+        return 1;
+    }
+
+    QDataStream in(&file);
+    if (!TransferRecord::readHeader(in)) {
+        err << file.fileName() << " is not a transfer log\n";
+        return 1;
+    }
+
+    static const char *const Operations[] = { "RETR", "STOR", "DELE", "RNTO" };
+    static const char *const Results[] = { "complete", "incomplete", "failed" };
+
+    struct Totals
+    {
+        qint64 downloaded = 0;
+        qint64 uploaded = 0;
+        int operations = 0;
+    };
+    QMap<QString, Totals> totals;
+
+    QTextStream out(stdout);
+    TransferRecord record;
+    while (!in.atEnd()) {
+        if (!record.read(in)) {
+            // A record cut short by a crash ends the log
+            err << "Stopped at a damaged record at offset " << file.pos() << "\n";
+            break;
+        }
+
+        if (parser.isSet(totalsOption)) {
+            Totals &user = totals[record.user];
+            ++user.operations;
+            if (record.operation == TransferRecord::Retrieve) {
+                user.downloaded += record.bytes;
+            } else if (record.operation == TransferRecord::Store) {
+                user.uploaded += record.bytes;
+            }
+        } else if (parser.isSet(xferlogOption)) {
+            out << record.toXferlog();
+        } else {
+            out << QDateTime::fromMSecsSinceEpoch(record.start).toString(Qt::ISODateWithMs)
+                << '\t' << record.duration
+                << '\t' << record.peer.toString()
+                << '\t' << record.user
+                << '\t' << Operations[record.operation]
+                << '\t' << Results[record.result]
+                << '\t' << record.bytes
+                << '\t' << record.path;
+            if (!record.target.isEmpty()) {
+                out << '\t' << record.target;
+            }
+            out << '\n';
+        }
+    }
+
+    for (auto it = totals.constBegin(); it != totals.constEnd(); ++it) {
+        out << it.key() << "\tdownloaded " << it->downloaded << "\tuploaded " << it->uploaded
+            << "\toperations " << it->operations << '\n';
+    }
+    return 0;
+}
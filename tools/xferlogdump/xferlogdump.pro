@@ -0,0 +1,18 @@
+QT       += core network
+QT       -= gui
+
+TARGET = xferlogdump
+TEMPLATE = app
+CONFIG += console
+CONFIG -= app_bundle
+
+DEFINES += QT_DEPRECATED_WARNINGS
+
+INCLUDEPATH += ../..
+
+SOURCES += \
+        main.cpp \
+        ../../transferrecord.cpp
+
+HEADERS += \
+        ../../transferrecord.h
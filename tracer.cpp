@@ -0,0 +1,280 @@
+#include "tracer.h"
+#include "fsservice.h"
+#include <QAtomicInteger>
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QMutex>
+#include <QRandomGenerator>
+#include <QThreadStorage>
+#include <QDebug>
+#include <memory>
+
+namespace {
+
+// Spans recorded by one thread. Its lock is only ever contended by a
+// collection, once per flush interval.
+struct ThreadBuffer
+{
+    QMutex mutex;
+    QVector<Tracer::Event> events;
+    int dropped = 0;
+};
+
+// Every thread's buffer, including those of threads that have exited
+// and still hold spans
+QMutex registryMutex;
+QVector<std::shared_ptr<ThreadBuffer>> registry;
+
+QAtomicInteger<quint64> nextAsyncId(1);
+
+ThreadBuffer *threadBuffer()
+{
+    static QThreadStorage<std::shared_ptr<ThreadBuffer>> buffers;
+    if (!buffers.hasLocalData()) {
+        std::shared_ptr<ThreadBuffer> buffer = std::make_shared<ThreadBuffer>();
+        QMutexLocker locker(&registryMutex);
+        registry.append(buffer);
+        buffers.setLocalData(buffer);
+    }
+    return buffers.localData().get();
+}
+
+QJsonObject toJson(const Tracer::Event &event, qint64 pid, const char *phase, qint64 ts)
+{
+    QJsonObject object;
+    object["name"] = event.name;
+    object["ph"] = QLatin1String(phase);
+    object["pid"] = pid;
+    object["tid"] = qint64(event.track);
+    object["ts"] = ts;
+    return object;
+}
+
+}
+
+Tracer::Tracer(FsService *fs, QObject *parent) : QObject(parent),
+    m_fs(fs),
+    m_sampleRate(0.0),
+    m_nextTrack(1),
+    m_inFlight(false)
+{
+    m_flushTimer.setInterval(FlushInterval);
+    connect(&m_flushTimer, &QTimer::timeout, this, &Tracer::flush);
+}
+
+Tracer::~Tracer()
+{
+    flushNow();
+}
+
+void Tracer::setOutputPath(const QString &path)
+{
+    // Spans already recorded go to the trace they were recorded for
+    flushNow();
+    m_path = path;
+    if (m_path.isEmpty()) {
+        m_flushTimer.stop();
+        return;
+    }
+
+    // Chrome's JSON array format, left open: the closing bracket is
+    // optional, so each batch can simply be appended
+    QFile file(m_path);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate) || file.write("[\n") != 2) {
+        qWarning() << "Can't write a trace to" << m_path;
+    }
+    m_flushTimer.start();
+}
+
+QString Tracer::outputPath() const
+{
+    return m_path;
+}
+
+void Tracer::setSampleRate(double rate)
+{
+    m_sampleRate = qBound(0.0, rate, 1.0);
+}
+
+void Tracer::setTracedUsers(const QStringList &users)
+{
+    m_users = QSet<QString>(users.begin(), users.end());
+}
+
+quint64 Tracer::sampleSession()
+{
+    if (m_path.isEmpty() || m_sampleRate <= 0.0
+            || QRandomGenerator::global()->generateDouble() >= m_sampleRate) {
+        return 0;
+    }
+    return m_nextTrack++;
+}
+
+quint64 Tracer::traceUser(const QString &user)
+{
+    if (m_path.isEmpty() || !m_users.contains(user)) {
+        return 0;
+    }
+    return m_nextTrack++;
+}
+
+qint64 Tracer::now()
+{
+    static QElapsedTimer clock = []() {
+        QElapsedTimer timer;
+        timer.start();
+        return timer;
+    }();
+    return clock.nsecsElapsed() / 1000;
+}
+
+void Tracer::span(quint64 track, const QString &name, qint64 start, const QString &detail)
+{
+    if (track) {
+        record({ Event::Span, track, 0, start, now() - start, name, detail });
+    }
+}
+
+void Tracer::asyncSpan(quint64 track, const QString &name, qint64 start, const QString &detail)
+{
+    if (track) {
+        record({ Event::AsyncSpan, track, nextAsyncId.fetchAndAddRelaxed(1), start, now() - start,
+                 name, detail });
+    }
+}
+
+void Tracer::nameTrack(quint64 track, const QString &name)
+{
+    if (track) {
+        record({ Event::TrackName, track, 0, 0, 0, QString(), name });
+    }
+}
+
+void Tracer::record(Event &&event)
+{
+    ThreadBuffer *buffer = threadBuffer();
+    QMutexLocker locker(&buffer->mutex);
+    if (buffer->events.size() >= MaxEvents) {
+        ++buffer->dropped;
+        return;
+    }
+    buffer->events.append(std::move(event));
+}
+
+void Tracer::collect(Batch *batch)
+{
+    batch->path = m_path;
+    batch->dropped = 0;
+
+    QMutexLocker registryLocker(&registryMutex);
+    for (int i = registry.size() - 1; i >= 0; --i) {
+        ThreadBuffer *buffer = registry[i].get();
+        {
+            QMutexLocker locker(&buffer->mutex);
+            batch->events += buffer->events;
+            batch->dropped += buffer->dropped;
+            buffer->events.clear();
+            buffer->dropped = 0;
+        }
+
+        // Only the registry still refers to the buffer of a thread that
+        // has exited, and it has nothing left to give
+        if (registry[i].use_count() == 1) {
+            registry.remove(i);
+        }
+    }
+}
+
+void Tracer::flushNow()
+{
+    if (m_path.isEmpty()) {
+        return;
+    }
+
+    // Written right here, for shutdown. A batch still on the pool may
+    // land after this one; viewers sort by timestamp.
+    Batch batch;
+    collect(&batch);
+    writeBatch(batch);
+}
+
+void Tracer::flush()
+{
+    if (m_inFlight) {
+        // Picked up on the next interval
+        return;
+    }
+
+    Batch batch;
+    collect(&batch);
+    if (batch.events.isEmpty()) {
+        return;
+    }
+    m_inFlight = true;
+
+    m_fs->submit<bool>(this, [batch]() {
+        return writeBatch(batch);
+    }, [this](bool ok) {
+        if (!ok) {
+            qWarning() << "Failed to write the trace to" << m_path;
+        }
+        m_inFlight = false;
+    });
+}
+
+bool Tracer::writeBatch(const Batch &batch)
+{
+    if (batch.dropped > 0) {
+        qWarning() << "Trace buffers full," << batch.dropped << "spans dropped";
+    }
+
+    QByteArray data;
+    qint64 pid = QCoreApplication::applicationPid();
+    for (const Event &event : batch.events) {
+        QJsonObject args;
+        if (!event.detail.isEmpty()) {
+            args["detail"] = event.detail;
+        }
+
+        switch (event.kind) {
+        case Event::Span: {
+            QJsonObject object = toJson(event, pid, "X", event.start);
+            object["dur"] = event.duration;
+            object["args"] = args;
+            data += QJsonDocument(object).toJson(QJsonDocument::Compact) + ",\n";
+            break;
+        }
+        case Event::AsyncSpan: {
+            QJsonObject begin = toJson(event, pid, "b", event.start);
+            begin["cat"] = QLatin1String("io");
+            begin["id"] = qint64(event.id);
+            begin["args"] = args;
+            QJsonObject end = toJson(event, pid, "e", event.start + event.duration);
+            end["cat"] = QLatin1String("io");
+            end["id"] = qint64(event.id);
+            data += QJsonDocument(begin).toJson(QJsonDocument::Compact) + ",\n";
+            data += QJsonDocument(end).toJson(QJsonDocument::Compact) + ",\n";
+            break;
+        }
+        case Event::TrackName: {
+            Event metadata = event;
+            metadata.name = QStringLiteral("thread_name");
+            QJsonObject object = toJson(metadata, pid, "M", 0);
+            QJsonObject name;
+            name["name"] = event.detail;
+            object["args"] = name;
+            data += QJsonDocument(object).toJson(QJsonDocument::Compact) + ",\n";
+            break;
+        }
+        }
+    }
+
+    QFile file(batch.path);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Append | QIODevice::Unbuffered)) {
+        return false;
+    }
+    return file.write(data) == data.size();
+}
@@ -0,0 +1,104 @@
+#ifndef TRACER_H
+#define TRACER_H
+
+#include <QObject>
+#include <QSet>
+#include <QString>
+#include <QStringList>
+#include <QTimer>
+#include <QVector>
+
+class FsService;
+
+// Span tracing of sessions and their phases (accept, login, commands,
+// data connect, disk I/O, replies), for finding where a slow transfer
+// spent its time. Only sessions picked by sampling, or logged in as a
+// traced user, record anything; the rest pay one branch per span.
+//
+// Spans go into a buffer owned by the thread recording them, so threads
+// never contend on a shared log. The buffers are collected periodically
+// and appended, formatted on the filesystem pool, to a Chrome trace JSON
+// file, which chrome://tracing and the Perfetto UI both open.
+class Tracer : public QObject
+{
+    Q_OBJECT
+public:
+    struct Event
+    {
+        enum Kind { Span, AsyncSpan, TrackName };
+
+        Kind kind;
+        quint64 track;
+        quint64 id;
+        qint64 start;
+        qint64 duration;
+        QString name;
+        QString detail;
+    };
+
+    explicit Tracer(FsService *fs, QObject *parent = nullptr);
+    ~Tracer();
+
+    // Where the trace is written, replacing what was there; empty (the
+    // default) disables tracing
+    void setOutputPath(const QString &path);
+    QString outputPath() const;
+
+    // Fraction of sessions traced from the moment they are accepted
+    void setSampleRate(double rate);
+
+    // Sessions logging in as one of these are traced from then on
+    void setTracedUsers(const QStringList &users);
+
+    // A track for a new session, or 0 if it isn't sampled
+    quint64 sampleSession();
+
+    // A track for a session that just logged in as user, or 0 if that
+    // user isn't traced
+    quint64 traceUser(const QString &user);
+
+    // Microseconds on a monotonic clock shared by all threads
+    static qint64 now();
+
+    // Records a span from start until now on track. Callable from any
+    // thread; nothing is recorded for track 0. Async spans may overlap
+    // others on their track and are shown on a lane of their own.
+    static void span(quint64 track, const QString &name, qint64 start,
+                     const QString &detail = QString());
+    static void asyncSpan(quint64 track, const QString &name, qint64 start,
+                          const QString &detail = QString());
+    static void nameTrack(quint64 track, const QString &name);
+
+    // Writes out everything recorded, waiting for it to reach the file
+    void flushNow();
+
+private slots:
+    void flush();
+
+private:
+    struct Batch
+    {
+        QString path;
+        QVector<Event> events;
+        int dropped;
+    };
+
+    static void record(Event &&event);
+    void collect(Batch *batch);
+    static bool writeBatch(const Batch &batch);
+
+    // Buffers are collected this often; each holds at most MaxEvents, and
+    // spans past that are dropped until the next collection
+    static const int FlushInterval = 1000;
+    static const int MaxEvents = 256 * 1024;
+
+    FsService *m_fs;
+    QString m_path;
+    double m_sampleRate;
+    QSet<QString> m_users;
+    quint64 m_nextTrack;
+    bool m_inFlight;
+    QTimer m_flushTimer;
+};
+
+#endif // TRACER_H
@@ -0,0 +1,132 @@
+#include "transferlog.h"
+#include "fsservice.h"
+#include <QDataStream>
+#include <QFile>
+#include <QDebug>
+
+TransferLog::TransferLog(FsService *fs, QObject *parent) : QObject(parent),
+    m_fs(fs),
+    m_inFlight(false)
+{
+    m_pending.reserve(MaxBatch);
+
+    m_flushTimer.setSingleShot(true);
+    m_flushTimer.setInterval(FlushInterval);
+    connect(&m_flushTimer, &QTimer::timeout, this, &TransferLog::flush);
+}
+
+TransferLog::~TransferLog()
+{
+    flushNow();
+}
+
+void TransferLog::setPaths(const QString &binaryPath, const QString &textPath)
+{
+    // Records already queued go to the files they were logged for
+    flushNow();
+    m_binaryPath = binaryPath;
+    m_textPath = textPath;
+}
+
+void TransferLog::append(const TransferRecord &record)
+{
+    // All a session pays: copying the record, whose strings are shared
+    if (m_binaryPath.isEmpty() && m_textPath.isEmpty()) {
+        return;
+    }
+
+    m_pending.append(record);
+    if (m_pending.size() >= MaxBatch) {
+        flush();
+    } else if (!m_flushTimer.isActive()) {
+        m_flushTimer.start();
+    }
+}
+
+void TransferLog::flushNow()
+{
+    m_flushTimer.stop();
+    if (m_pending.isEmpty()) {
+        return;
+    }
+
+    // Written right here, for shutdown. A batch still on the pool may
+    // land after this one, but each is a single append, so records are
+    // never torn.
+    Batch batch;
+    batch.binaryPath = m_binaryPath;
+    batch.textPath = m_textPath;
+    batch.records.swap(m_pending);
+    m_pending.reserve(MaxBatch);
+    writeBatch(batch);
+}
+
+void TransferLog::flush()
+{
+    if (m_pending.isEmpty() || m_inFlight) {
+        // Picked up when the batch in flight completes
+        return;
+    }
+
+    Batch batch;
+    batch.binaryPath = m_binaryPath;
+    batch.textPath = m_textPath;
+    batch.records.swap(m_pending);
+    m_pending.reserve(MaxBatch);
+    m_inFlight = true;
+
+    m_fs->submit<bool>(this, [batch]() {
+        return writeBatch(batch);
+    }, [this](bool ok) {
+        if (!ok) {
+            qWarning() << "Failed to write the transfer log";
+        }
+        m_inFlight = false;
+
+        // Whatever was logged while this batch was being written goes next
+        if (!m_pending.isEmpty()) {
+            flush();
+        }
+    });
+}
+
+bool TransferLog::writeBatch(const Batch &batch)
+{
+    bool ok = true;
+
+    if (!batch.binaryPath.isEmpty()) {
+        QByteArray data;
+        {
+            QDataStream out(&data, QIODevice::WriteOnly);
+            for (const TransferRecord &record : batch.records) {
+                record.write(out);
+            }
+        }
+
+        QFile file(batch.binaryPath);
+        if (file.open(QIODevice::WriteOnly | QIODevice::Append | QIODevice::Unbuffered)) {
+            if (file.size() == 0) {
+                file.write(TransferRecord::fileHeader());
+            }
+            ok = file.write(data) == data.size() && ok;
+        } else {
+            ok = false;
+        }
+    }
+
+    if (!batch.textPath.isEmpty()) {
+        QByteArray text;
+        for (const TransferRecord &record : batch.records) {
+            text += record.toXferlog();
+        }
+
+        QFile file(batch.textPath);
+        if (file.open(QIODevice::WriteOnly | QIODevice::Append | QIODevice::Unbuffered)) {
+            ok = file.write(text) == text.size() && ok;
+        } else {
+            ok = false;
+        }
+    }
+
+    return ok;
+}
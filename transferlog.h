@@ -0,0 +1,56 @@
+#ifndef TRANSFERLOG_H
+#define TRANSFERLOG_H
+
+#include <QObject>
+#include <QTimer>
+#include <QVector>
+#include "transferrecord.h"
+
+class FsService;
+
+// Audit log of finished transfers, written in two forms: a compact binary
+// log (read back with tools/xferlogdump) and classic xferlog text.
+// Sessions only queue the record; formatting and writing happen on the
+// filesystem pool, a batch at a time, and one batch at a time so the
+// log stays in order.
+class TransferLog : public QObject
+{
+    Q_OBJECT
+public:
+    explicit TransferLog(FsService *fs, QObject *parent = nullptr);
+    ~TransferLog();
+
+    // Either path may be empty to skip that form
+    void setPaths(const QString &binaryPath, const QString &textPath);
+
+    void append(const TransferRecord &record);
+
+    // Writes out everything queued, waiting for it to reach the files
+    void flushNow();
+
+private slots:
+    void flush();
+
+private:
+    struct Batch
+    {
+        QString binaryPath;
+        QString textPath;
+        QVector<TransferRecord> records;
+    };
+
+    static bool writeBatch(const Batch &batch);
+
+    // Records are held at most this long, or until this many are queued
+    static const int FlushInterval = 200;
+    static const int MaxBatch = 4096;
+
+    FsService *m_fs;
+    QString m_binaryPath;
+    QString m_textPath;
+    QVector<TransferRecord> m_pending;
+    bool m_inFlight;
+    QTimer m_flushTimer;
+};
+
+#endif // TRANSFERLOG_H
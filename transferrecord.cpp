@@ -0,0 +1,86 @@
+#include "transferrecord.h"
+#include <QDataStream>
+#include <QDateTime>
+#include <QLocale>
+
+namespace {
+
+const quint32 LogMagic = 0x46545058; // "FTPX"
+const quint8 LogVersion = 1;
+
+// xferlog fields are separated by spaces, so names can't contain any
+QByteArray xferlogName(const QString &path)
+{
+    QByteArray name = path.toUtf8();
+    name.replace(' ', '_');
+    return name.isEmpty() ? QByteArray("-") : name;
+}
+
+}
+
+QByteArray TransferRecord::fileHeader()
+{
+    QByteArray header;
+    QDataStream out(&header, QIODevice::WriteOnly);
+    out << LogMagic << LogVersion;
+    return header;
+}
+
+bool TransferRecord::readHeader(QDataStream &in)
+{
+    quint32 magic = 0;
+    quint8 version = 0;
+    in >> magic >> version;
+    return in.status() == QDataStream::Ok && magic == LogMagic && version == LogVersion;
+}
+
+void TransferRecord::write(QDataStream &out) const
+{
+    out << quint8(operation) << quint8(result) << quint8(ascii)
+        << start << duration << bytes
+        << user.toUtf8() << peer.toString().toLatin1() << path.toUtf8() << target.toUtf8();
+}
+
+bool TransferRecord::read(QDataStream &in)
+{
+    quint8 op, res, flags;
+    QByteArray userBytes, peerBytes, pathBytes, targetBytes;
+    in >> op >> res >> flags >> start >> duration >> bytes
+       >> userBytes >> peerBytes >> pathBytes >> targetBytes;
+    if (in.status() != QDataStream::Ok || op > Rename || res > Failed) {
+        return false;
+    }
+
+    operation = Operation(op);
+    result = Result(res);
+    ascii = flags != 0;
+    user = QString::fromUtf8(userBytes);
+    peer = QHostAddress(QString::fromLatin1(peerBytes));
+    path = QString::fromUtf8(pathBytes);
+    target = QString::fromUtf8(targetBytes);
+    return true;
+}
+
+QByteArray TransferRecord::toXferlog() const
+{
+    static const char Directions[] = { 'o', 'i', 'd', 'm' };
+    bool anonymous = user == "anonymous" || user == "ftp";
+
+    // current-time transfer-time remote-host file-size filename
+    // transfer-type special-action-flag direction access-mode username
+    // service-name authentication-method authenticated-user-id
+    // completion-status
+    QByteArray line = QLocale::c().toString(QDateTime::fromMSecsSinceEpoch(start + duration),
+                                            "ddd MMM dd hh:mm:ss yyyy").toLatin1();
+    line += ' ' + QByteArray::number((duration + 999) / 1000);
+    line += ' ' + peer.toString().toLatin1();
+    line += ' ' + QByteArray::number(bytes);
+    line += ' ' + xferlogName(operation == Rename ? target : path);
+    line += ascii ? " a _ " : " b _ ";
+    line += Directions[operation];
+    line += anonymous ? " a " : " r ";
+    line += xferlogName(user);
+    line += " ftp 0 * ";
+    line += result == Complete ? "c\n" : "i\n";
+    return line;
+}
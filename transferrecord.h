@@ -0,0 +1,46 @@
+#ifndef TRANSFERRECORD_H
+#define TRANSFERRECORD_H
+
+#include <QByteArray>
+#include <QHostAddress>
+#include <QString>
+
+class QDataStream;
+
+// One line of the transfer log: a finished RETR, STOR, DELE or RNTO.
+// Shared by the server, which writes the log, and xferlogdump, which
+// reads the binary form back.
+struct TransferRecord
+{
+    enum Operation : quint8 { Retrieve, Store, Delete, Rename };
+    // Incomplete transfers were cut off partway; failed operations did
+    // nothing
+    enum Result : quint8 { Complete, Incomplete, Failed };
+
+    Operation operation = Retrieve;
+    Result result = Complete;
+    bool ascii = false;
+    // Milliseconds since the epoch, and how long it took
+    qint64 start = 0;
+    qint64 duration = 0;
+    qint64 bytes = 0;
+    QString user;
+    QHostAddress peer;
+    QString path;
+    // Where RNTO moved path to
+    QString target;
+
+    // The binary log is a header followed by records, all in QDataStream
+    // format; a torn last record is ignored when read back
+    static QByteArray fileHeader();
+    static bool readHeader(QDataStream &in);
+    void write(QDataStream &out) const;
+    bool read(QDataStream &in);
+
+    // wu-ftpd xferlog format, newline included. xferlog has no code for
+    // deletes and renames; they use ProFTPD's 'd' and a non-standard 'm'
+    // direction, with the target as the file name.
+    QByteArray toXferlog() const;
+};
+
+#endif // TRANSFERRECORD_H
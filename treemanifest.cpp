@@ -0,0 +1,604 @@
+#include "treemanifest.h"
+#include "fsservice.h"
+#include <QDateTime>
+#include <QDir>
+#include <QDirIterator>
+#include <QFile>
+#include <QFileInfo>
+#include <QSocketNotifier>
+#include <QDebug>
+#include <unistd.h>
+
+#ifdef Q_OS_LINUX
+#include <sys/inotify.h>
+#endif
+
+namespace {
+
+#ifdef Q_OS_LINUX
+const quint32 WatchMask = IN_CREATE | IN_DELETE | IN_CLOSE_WRITE | IN_MOVED_FROM
+                        | IN_MOVED_TO | IN_ATTRIB | IN_DELETE_SELF | IN_ONLYDIR;
+#endif
+
+TreeManifest::Entry entryFor(const QFileInfo &info)
+{
+    TreeManifest::Entry entry;
+    entry.isDir = info.isDir();
+    entry.size = entry.isDir ? 0 : info.size();
+    entry.mtime = info.lastModified().toMSecsSinceEpoch();
+    entry.deleted = false;
+    entry.version = 0;
+    entry.indexId = PathIndex::NoId;
+    return entry;
+}
+
+// Unfinished atomic uploads (".name.xxxx.part") aren't files yet; the
+// rename that commits one shows up as the real name
+bool isUploadTemp(const QString &name)
+{
+    return name.startsWith('.') && name.endsWith(".part");
+}
+
+void appendJsonString(QByteArray &out, const QString &value)
+{
+    out += '"';
+    const QByteArray utf8 = value.toUtf8();
+    for (char c : utf8) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (uchar(c) < 0x20) {
+            out += QByteArray("\\u00") + QByteArray::number(uchar(c), 16).rightJustified(2, '0');
+        } else {
+            out += c;
+        }
+    }
+    out += '"';
+}
+
+}
+
+bool TreeManifest::Reader::atEnd() const
+{
+    return m_header.isEmpty() && m_done;
+}
+
+QByteArray TreeManifest::Reader::next(int maxBytes)
+{
+    QByteArray out;
+    out.reserve(maxBytes + 256);
+    out += m_header;
+    m_header.clear();
+
+    // A manifest rebuilt for another root has nothing more for us
+    const TreeManifest *manifest = m_manifest.data();
+    if (!manifest || manifest->m_generation != m_generation) {
+        m_done = true;
+        return out;
+    }
+
+    if (m_full) {
+        const QMap<QString, Entry> &entries = manifest->m_entries;
+        auto it = m_lastPath.isNull() ? entries.lowerBound(m_prefix) : entries.upperBound(m_lastPath);
+        for (; it != entries.constEnd() && out.size() < maxBytes; ++it) {
+            m_lastPath = it.key();
+            if (!m_prefix.isEmpty() && !matches(it.key())) {
+                // Keys are sorted, so once past the prefix there is nothing more
+                if (it.key() > m_prefix + QChar(0xffff)) {
+                    it = entries.constEnd();
+                    break;
+                }
+                continue;
+            }
+            if (!it->deleted) {
+                appendEntry(out, it.key(), it.value());
+            }
+        }
+        m_done = it == entries.constEnd();
+    } else {
+        const QMap<quint64, QString> &changes = manifest->m_byVersion;
+        auto it = changes.upperBound(m_lastVersion);
+        for (; it != changes.constEnd() && it.key() <= m_until && out.size() < maxBytes; ++it) {
+            m_lastVersion = it.key();
+            const QString &path = it.value();
+            auto entry = manifest->m_entries.constFind(path);
+            if (entry != manifest->m_entries.constEnd() && matches(path)) {
+                appendEntry(out, path, entry.value());
+            }
+        }
+        m_done = it == changes.constEnd() || it.key() > m_until;
+    }
+
+    return out;
+}
+
+bool TreeManifest::Reader::matches(const QString &path) const
+{
+    return m_prefix.isEmpty() || path == m_prefix || path.startsWith(m_prefix + '/');
+}
+
+void TreeManifest::Reader::appendEntry(QByteArray &out, const QString &path, const Entry &entry) const
+{
+    out += "{\"p\":";
+    appendJsonString(out, path);
+    if (entry.deleted) {
+        out += ",\"d\":1}\n";
+        return;
+    }
+    out += entry.isDir ? ",\"t\":\"d\"" : ",\"t\":\"f\"";
+    out += ",\"s\":" + QByteArray::number(entry.size);
+    out += ",\"m\":" + QByteArray::number(entry.mtime);
+    out += "}\n";
+}
+
+TreeManifest::TreeManifest(FsService *fs, QObject *parent) : QObject(parent),
+    m_fs(fs),
+    m_index(new PathIndex),
+    m_version(0),
+    m_floor(0),
+    m_tombstones(0),
+    m_state(Empty),
+    m_inotifyFd(-1),
+    m_notifier(nullptr),
+    m_restatRunning(false),
+    m_generation(0)
+{
+    // Coalesce bursts of changes into one restat on the pool
+    m_flushTimer.setSingleShot(true);
+    m_flushTimer.setInterval(50);
+    connect(&m_flushTimer, &QTimer::timeout, this, &TreeManifest::flushDirty);
+}
+
+TreeManifest::~TreeManifest()
+{
+    reset();
+}
+
+void TreeManifest::setRootPath(const QString &path)
+{
+    if (path == m_rootPath) {
+        return;
+    }
+
+    reset();
+    m_rootPath = path;
+
+    // Sessions waiting on a build of the old root get the new one
+    if (!m_waiters.isEmpty()) {
+        startBuild();
+    }
+}
+
+bool TreeManifest::isReady() const
+{
+    return m_state == Ready;
+}
+
+void TreeManifest::whenReady(QObject *owner, std::function<void()> done)
+{
+    if (m_state == Ready) {
+        done();
+        return;
+    }
+
+    m_waiters.append(qMakePair(QPointer<QObject>(owner), done));
+    if (m_state == Empty) {
+        startBuild();
+    }
+}
+
+void TreeManifest::notifyChanged(const QString &fullPath)
+{
+    if (m_state == Empty) {
+        return;
+    }
+
+    QString relative = relativePathFor(fullPath);
+    if (relative.isNull()) {
+        return;
+    }
+
+    m_dirty.insert(relative);
+    if (!m_flushTimer.isActive()) {
+        m_flushTimer.start();
+    }
+}
+
+QSharedPointer<TreeManifest::Reader> TreeManifest::read(const QString &relativePath,
+                                                         const QString &sinceToken) const
+{
+    QSharedPointer<Reader> reader(new Reader);
+    reader->m_manifest = this;
+    reader->m_generation = m_generation;
+    reader->m_prefix = relativePath;
+    reader->m_done = false;
+    reader->m_lastVersion = 0;
+    reader->m_until = m_version;
+
+    // Tokens are "<epoch>:<sequence>"; anything from another run or older
+    // than the pruned tombstones cannot be answered as a delta
+    quint64 since = 0;
+    bool delta = false;
+    int colon = sinceToken.indexOf(':');
+    if (colon > 0 && sinceToken.left(colon) == m_epoch) {
+        since = sinceToken.mid(colon + 1).toULongLong(&delta);
+        delta = delta && since >= m_floor && since <= m_version;
+    }
+
+    reader->m_full = !delta;
+    if (delta) {
+        reader->m_lastVersion = since;
+    }
+
+    QByteArray header = "{\"token\":";
+    appendJsonString(header, currentToken());
+    header += reader->m_full ? ",\"full\":true}\n" : ",\"full\":false}\n";
+    reader->m_header = header;
+
+    return reader;
+}
+
+QString TreeManifest::currentToken() const
+{
+    return m_epoch + ':' + QString::number(m_version);
+}
+
+QSharedPointer<PathIndex::Search> TreeManifest::find(const QString &pattern) const
+{
+    return PathIndex::search(m_index, pattern);
+}
+
+void TreeManifest::reset()
+{
+    m_flushTimer.stop();
+
+    delete m_notifier;
+    m_notifier = nullptr;
+    if (m_inotifyFd >= 0) {
+        ::close(m_inotifyFd);
+        m_inotifyFd = -1;
+    }
+
+    // Results of scans still running for the old tree are discarded
+    ++m_generation;
+    m_entries.clear();
+    m_byVersion.clear();
+    m_index.reset(new PathIndex);
+    m_watches.clear();
+    m_dirty.clear();
+    m_version = 0;
+    m_floor = 0;
+    m_tombstones = 0;
+    m_restatRunning = false;
+    m_state = Empty;
+}
+
+void TreeManifest::startBuild()
+{
+    m_state = Building;
+    m_epoch = QString::number(QDateTime::currentMSecsSinceEpoch(), 36);
+
+#ifdef Q_OS_LINUX
+    m_inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (m_inotifyFd >= 0) {
+        m_notifier = new QSocketNotifier(m_inotifyFd, QSocketNotifier::Read, this);
+        connect(m_notifier, SIGNAL(activated(int)), this, SLOT(onInotifyEvents()));
+    } else {
+        qWarning() << "inotify unavailable; manifest only tracks changes made through the server";
+    }
+#endif
+
+    int inotifyFd = m_inotifyFd;
+    QString rootPath = m_rootPath;
+    quint32 generation = m_generation;
+
+    m_fs->submit<ScanResult>(this, [inotifyFd, rootPath]() {
+        ScanResult result;
+        scanTree(inotifyFd, rootPath, QString(), &result);
+        result.index.reset(new PathIndex);
+        for (auto &item : result.entries) {
+            item.second.indexId = result.index->add(item.first);
+        }
+        return result;
+    }, [this, generation](const ScanResult &result) {
+        if (generation != m_generation) {
+            return;
+        }
+
+        apply(result);
+        m_state = Ready;
+
+        auto waiters = m_waiters;
+        m_waiters.clear();
+        for (const auto &waiter : waiters) {
+            if (waiter.first) {
+                waiter.second();
+            }
+        }
+
+        // Changes seen while the initial scan was running
+        if (!m_dirty.isEmpty()) {
+            m_flushTimer.start();
+        }
+    });
+}
+
+void TreeManifest::scanTree(int inotifyFd, const QString &rootPath, const QString &relative,
+                            ScanResult *result)
+{
+    result->scannedRoots.append(relative);
+
+    QStringList pending;
+    pending.append(relative);
+
+    while (!pending.isEmpty()) {
+        QString directory = pending.takeLast();
+        QString fullPath = directory.isEmpty() ? rootPath : rootPath + '/' + directory;
+
+#ifdef Q_OS_LINUX
+        // Watch before listing so nothing created in between is missed
+        if (inotifyFd >= 0) {
+            int wd = inotify_add_watch(inotifyFd, QFile::encodeName(fullPath).constData(), WatchMask);
+            if (wd >= 0) {
+                result->watches.insert(wd, directory);
+            }
+        }
+#else
+        Q_UNUSED(inotifyFd);
+#endif
+
+        QDirIterator it(fullPath, QDir::AllEntries | QDir::Hidden | QDir::NoDotAndDotDot);
+        while (it.hasNext()) {
+            it.next();
+            QFileInfo info = it.fileInfo();
+            if (isUploadTemp(info.fileName())) {
+                continue;
+            }
+            QString path = directory.isEmpty() ? info.fileName() : directory + '/' + info.fileName();
+            result->entries.append(qMakePair(path, entryFor(info)));
+            if (info.isDir() && !info.isSymLink()) {
+                pending.append(path);
+            }
+        }
+    }
+}
+
+TreeManifest::ScanResult TreeManifest::restat(int inotifyFd, const QString &rootPath,
+                                              const QStringList &paths)
+{
+    ScanResult result;
+
+    for (const QString &path : paths) {
+        if (isUploadTemp(path.mid(path.lastIndexOf('/') + 1))) {
+            continue;
+        }
+
+        QFileInfo info(path.isEmpty() ? rootPath : rootPath + '/' + path);
+        if (!info.exists()) {
+            result.missing.append(path);
+            continue;
+        }
+
+        if (!path.isEmpty()) {
+            result.entries.append(qMakePair(path, entryFor(info)));
+        }
+
+        // A directory may have been moved in with contents, or the event
+        // queue overflowed; either way rescan everything below it
+        if (info.isDir() && !info.isSymLink()) {
+            scanTree(inotifyFd, rootPath, path, &result);
+        }
+    }
+
+    return result;
+}
+
+void TreeManifest::onInotifyEvents()
+{
+#ifdef Q_OS_LINUX
+    alignas(struct inotify_event) char buffer[64 * 1024];
+
+    forever {
+        ssize_t length = ::read(m_inotifyFd, buffer, sizeof(buffer));
+        if (length <= 0) {
+            break;
+        }
+
+        for (char *p = buffer; p < buffer + length; ) {
+            struct inotify_event *event = reinterpret_cast<struct inotify_event *>(p);
+            p += sizeof(struct inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                // Events were lost; rescan the whole tree
+                m_dirty.insert(QString());
+                continue;
+            }
+
+            if (event->mask & IN_IGNORED) {
+                m_watches.remove(event->wd);
+                continue;
+            }
+
+            auto watch = m_watches.constFind(event->wd);
+            if (watch == m_watches.constEnd()) {
+                continue;
+            }
+
+            QString path = watch.value();
+            if (event->len > 0) {
+                QString name = QFile::decodeName(event->name);
+                if (isUploadTemp(name)) {
+                    continue;
+                }
+                path = path.isEmpty() ? name : path + '/' + name;
+            }
+            m_dirty.insert(path);
+        }
+    }
+
+    if (!m_dirty.isEmpty() && !m_flushTimer.isActive()) {
+        m_flushTimer.start();
+    }
+#endif
+}
+
+void TreeManifest::flushDirty()
+{
+    if (m_state != Ready || m_dirty.isEmpty()) {
+        return;
+    }
+
+    // One restat batch at a time keeps updates applied in order
+    if (m_restatRunning) {
+        m_flushTimer.start();
+        return;
+    }
+
+    QStringList paths = m_dirty.values();
+    m_dirty.clear();
+    m_restatRunning = true;
+
+    int inotifyFd = m_inotifyFd;
+    QString rootPath = m_rootPath;
+    quint32 generation = m_generation;
+
+    m_fs->submit<ScanResult>(this, [inotifyFd, rootPath, paths]() {
+        return restat(inotifyFd, rootPath, paths);
+    }, [this, generation](const ScanResult &result) {
+        if (generation != m_generation) {
+            return;
+        }
+
+        m_restatRunning = false;
+        apply(result);
+
+        if (!m_dirty.isEmpty()) {
+            m_flushTimer.start();
+        }
+    });
+}
+
+void TreeManifest::apply(const ScanResult &result)
+{
+    if (result.index) {
+        m_index = result.index;
+    }
+
+    for (auto it = result.watches.constBegin(); it != result.watches.constEnd(); ++it) {
+        m_watches.insert(it.key(), it.value());
+    }
+
+    for (const QString &path : result.missing) {
+        markDeleted(path);
+    }
+
+    // Anything under a rescanned directory that the scan did not see is gone
+    QSet<QString> seen;
+    for (const auto &item : result.entries) {
+        seen.insert(item.first);
+    }
+    for (const QString &root : result.scannedRoots) {
+        QString prefix = root.isEmpty() ? QString() : root + '/';
+        QStringList vanished;
+        for (auto it = m_entries.lowerBound(prefix);
+             it != m_entries.end() && it.key().startsWith(prefix); ++it) {
+            if (!it->deleted && !seen.contains(it.key())) {
+                vanished.append(it.key());
+            }
+        }
+        for (const QString &path : vanished) {
+            markDeleted(path);
+        }
+    }
+
+    for (const auto &item : result.entries) {
+        upsert(item.first, item.second);
+    }
+
+    pruneTombstones();
+}
+
+void TreeManifest::upsert(const QString &path, const Entry &entry)
+{
+    auto it = m_entries.find(path);
+    if (it != m_entries.end()) {
+        if (!it->deleted && it->isDir == entry.isDir && it->size == entry.size
+                && it->mtime == entry.mtime) {
+            return;
+        }
+        if (it->deleted) {
+            --m_tombstones;
+        }
+        m_byVersion.remove(it->version);
+    }
+
+    // A path that stays keeps its slot in the index
+    Entry updated = entry;
+    if (it != m_entries.end() && !it->deleted) {
+        updated.indexId = it->indexId;
+    } else if (updated.indexId == PathIndex::NoId) {
+        updated.indexId = m_index->add(path);
+    }
+    updated.deleted = false;
+    updated.version = ++m_version;
+    m_entries.insert(path, updated);
+    m_byVersion.insert(updated.version, path);
+}
+
+void TreeManifest::markDeleted(const QString &path)
+{
+    // The path itself, then everything below it
+    QStringList victims;
+    if (!path.isEmpty()) {
+        victims.append(path);
+    }
+    QString prefix = path.isEmpty() ? QString() : path + '/';
+    for (auto it = m_entries.lowerBound(prefix);
+         it != m_entries.end() && it.key().startsWith(prefix); ++it) {
+        victims.append(it.key());
+    }
+
+    for (const QString &victim : victims) {
+        auto it = m_entries.find(victim);
+        if (it == m_entries.end() || it->deleted) {
+            continue;
+        }
+
+        m_byVersion.remove(it->version);
+        m_index->remove(it->indexId);
+        it->indexId = PathIndex::NoId;
+        it->deleted = true;
+        it->version = ++m_version;
+        m_byVersion.insert(it->version, victim);
+        ++m_tombstones;
+    }
+}
+
+void TreeManifest::pruneTombstones()
+{
+    // Drop the oldest tombstones; tokens older than the last one dropped
+    // can no longer be answered with a delta
+    auto it = m_byVersion.begin();
+    while (m_tombstones > MaxTombstones && it != m_byVersion.end()) {
+        auto entry = m_entries.find(it.value());
+        if (entry != m_entries.end() && entry->deleted) {
+            m_floor = it.key();
+            m_entries.erase(entry);
+            it = m_byVersion.erase(it);
+            --m_tombstones;
+        } else {
+            ++it;
+        }
+    }
+}
+
+QString TreeManifest::relativePathFor(const QString &fullPath) const
+{
+    if (fullPath == m_rootPath) {
+        return QString("");
+    }
+    if (!fullPath.startsWith(m_rootPath + '/')) {
+        return QString();
+    }
+    return QDir::cleanPath(fullPath.mid(m_rootPath.size() + 1));
+}
@@ -0,0 +1,147 @@
+#ifndef TREEMANIFEST_H
+#define TREEMANIFEST_H
+
+#include <QObject>
+#include <QMap>
+#include <QHash>
+#include <QSet>
+#include <QList>
+#include <QPair>
+#include <QPointer>
+#include <QSharedPointer>
+#include <QTimer>
+#include <functional>
+#include "pathindex.h"
+
+class FsService;
+class QSocketNotifier;
+
+// In-memory manifest of every file and directory under the server root,
+// built once in the background and then kept current from inotify and from
+// the server's own mutating commands. Every change is stamped with a
+// sequence number, so a client holding a token from an earlier SITE
+// MANIFEST gets just the entries changed since then. Names are also kept
+// in a trigram index for SITE FIND.
+class TreeManifest : public QObject
+{
+    Q_OBJECT
+public:
+    struct Entry
+    {
+        qint64 size;
+        qint64 mtime;
+        bool isDir;
+        bool deleted;
+        quint64 version;
+        // Slot in the search index; PathIndex::NoId once deleted
+        quint32 indexId;
+    };
+
+    // Streams one manifest as JSON lines: a header carrying the new token,
+    // then one object per entry. Nothing is copied: each batch resumes in
+    // the live manifest after the last key sent, so it can keep changing
+    // while a large manifest is being sent. An entry changed meanwhile may
+    // go out in its newer state; it is sent again in the next delta, so a
+    // client applying both still ends up right.
+    class Reader
+    {
+    public:
+        bool atEnd() const;
+        QByteArray next(int maxBytes);
+
+    private:
+        friend class TreeManifest;
+
+        bool matches(const QString &path) const;
+        void appendEntry(QByteArray &out, const QString &path, const Entry &entry) const;
+
+        QPointer<const TreeManifest> m_manifest;
+        quint32 m_generation;
+        QByteArray m_header;
+        QString m_prefix;
+        bool m_full;
+        bool m_done;
+        // Where to resume: the last path of a full manifest, the last
+        // version of a delta, which stops at the token it was opened with
+        QString m_lastPath;
+        quint64 m_lastVersion;
+        quint64 m_until;
+    };
+
+    explicit TreeManifest(FsService *fs, QObject *parent = nullptr);
+    ~TreeManifest();
+
+    void setRootPath(const QString &path);
+
+    bool isReady() const;
+
+    // Starts building the manifest if needed and calls done once it is ready
+    void whenReady(QObject *owner, std::function<void()> done);
+
+    // Something at this path was created, modified or removed
+    void notifyChanged(const QString &fullPath);
+
+    // relativePath is relative to the root ("" for everything). An unknown
+    // or expired token yields a full manifest.
+    QSharedPointer<Reader> read(const QString &relativePath, const QString &sinceToken) const;
+
+    QString currentToken() const;
+
+    // Entries whose name matches pattern (see PathIndex::search)
+    QSharedPointer<PathIndex::Search> find(const QString &pattern) const;
+
+private slots:
+    void onInotifyEvents();
+    void flushDirty();
+
+private:
+    struct ScanResult
+    {
+        QList<QPair<QString, Entry>> entries;
+        QStringList missing;
+        QStringList scannedRoots;
+        QHash<int, QString> watches;
+        // Built alongside a full scan, so the initial build doesn't index
+        // on the event loop
+        QSharedPointer<PathIndex> index;
+    };
+
+    static void scanTree(int inotifyFd, const QString &rootPath, const QString &relative,
+                         ScanResult *result);
+    static ScanResult restat(int inotifyFd, const QString &rootPath, const QStringList &paths);
+
+    void reset();
+    void startBuild();
+    void apply(const ScanResult &result);
+    void upsert(const QString &path, const Entry &entry);
+    void markDeleted(const QString &path);
+    void pruneTombstones();
+    QString relativePathFor(const QString &fullPath) const;
+
+    static const int MaxTombstones = 100000;
+
+    FsService *m_fs;
+    QString m_rootPath;
+    QString m_epoch;
+
+    QMap<QString, Entry> m_entries;
+    QMap<quint64, QString> m_byVersion;
+    QSharedPointer<PathIndex> m_index;
+    quint64 m_version;
+    quint64 m_floor;
+    int m_tombstones;
+
+    enum State { Empty, Building, Ready };
+    State m_state;
+    QList<QPair<QPointer<QObject>, std::function<void()>>> m_waiters;
+
+    int m_inotifyFd;
+    QSocketNotifier *m_notifier;
+    QHash<int, QString> m_watches;
+    QSet<QString> m_dirty;
+    bool m_restatRunning;
+    QTimer m_flushTimer;
+    quint32 m_generation;
+};
+
+#endif // TREEMANIFEST_H
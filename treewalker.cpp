@@ -0,0 +1,144 @@
+#include "treewalker.h"
+#include "fsservice.h"
+#include <QPointer>
+
+namespace {
+
+struct DirectoryRead
+{
+    bool exists;
+    QVector<Vfs::Entry> entries;
+};
+
+}
+
+TreeWalker::TreeWalker(FsService *fs, const QSharedPointer<Vfs> &vfs, const QString &rootPath,
+                       QObject *parent) : QObject(parent),
+    m_fs(fs),
+    m_vfs(vfs),
+    m_rootPath(rootPath),
+    m_prefetch(32),
+    m_outstanding(0),
+    m_paused(false),
+    m_draining(false),
+    m_finished(false)
+{
+}
+
+void TreeWalker::setPrefetch(int directories)
+{
+    m_prefetch = qMax(1, directories);
+}
+
+void TreeWalker::start()
+{
+    QSharedPointer<Node> root(new Node);
+    root->state = Node::Idle;
+    root->exists = false;
+    m_stack.append(root);
+    schedule();
+}
+
+void TreeWalker::pause()
+{
+    m_paused = true;
+}
+
+void TreeWalker::resume()
+{
+    if (m_paused) {
+        m_paused = false;
+        drain();
+    }
+}
+
+void TreeWalker::abort()
+{
+    m_finished = true;
+    m_stack.clear();
+}
+
+void TreeWalker::schedule()
+{
+    if (m_finished) {
+        return;
+    }
+
+    // The top of the stack is reported next, so reads are issued from the
+    // top down. Every node skipped here is already counted in m_outstanding,
+    // which keeps the scan proportional to the prefetch window.
+    for (int i = m_stack.size() - 1; i >= 0 && m_outstanding < m_prefetch; --i) {
+        QSharedPointer<Node> node = m_stack.at(i);
+        if (node->state != Node::Idle) {
+            continue;
+        }
+
+        node->state = Node::Reading;
+        ++m_outstanding;
+
+        QString path = node->relativePath.isEmpty()
+                       ? m_rootPath
+                       : (m_rootPath == "/" ? QString() : m_rootPath) + node->relativePath.mid(1);
+        QSharedPointer<Vfs> vfs = m_vfs;
+        m_fs->submit<DirectoryRead>(this, [vfs, path]() {
+            DirectoryRead result;
+            result.exists = vfs->list(path, false, &result.entries);
+            return result;
+        }, [this, node](const DirectoryRead &result) {
+            node->exists = result.exists;
+            node->entries = result.entries;
+            node->state = Node::Ready;
+            drain();
+        });
+    }
+}
+
+void TreeWalker::drain()
+{
+    if (m_draining || m_finished) {
+        return;
+    }
+    m_draining = true;
+
+    QPointer<TreeWalker> self(this);
+
+    while (!m_paused && !m_stack.isEmpty() && m_stack.last()->state == Node::Ready) {
+        QSharedPointer<Node> node = m_stack.takeLast();
+        --m_outstanding;
+
+        if (node->relativePath.isEmpty() && !node->exists) {
+            m_finished = true;
+            emit finished(false);
+            return;
+        }
+
+        emit directoryReady(node->relativePath, node->entries);
+        if (!self || m_finished) {
+            return;
+        }
+
+        // Push subdirectories in reverse so the first by name is on top.
+        // Symlinked directories are not followed, to avoid cycles.
+        QString prefix = node->relativePath.isEmpty() ? QString(".") : node->relativePath;
+        for (int i = node->entries.size() - 1; i >= 0; --i) {
+            const Vfs::Entry &entry = node->entries.at(i);
+            if (entry.isDir && !entry.isSymLink) {
+                QSharedPointer<Node> child(new Node);
+                child->relativePath = prefix + '/' + entry.name;
+                child->state = Node::Idle;
+                child->exists = false;
+                m_stack.append(child);
+            }
+        }
+    }
+
+    m_draining = false;
+
+    if (m_stack.isEmpty()) {
+        m_finished = true;
+        emit finished(true);
+        return;
+    }
+
+    schedule();
+}
@@ -0,0 +1,68 @@
+#ifndef TREEWALKER_H
+#define TREEWALKER_H
+
+#include <QObject>
+#include <QList>
+#include <QSharedPointer>
+#include "vfs.h"
+
+class FsService;
+
+// Walks a directory tree for recursive listings. Directories are read in
+// parallel on the filesystem pool, a bounded window ahead of the output,
+// but are always reported in depth-first, name-sorted order, so the result
+// is deterministic. Only directories in the window hold their entries;
+// the rest of the stack is one path per subdirectory not yet visited, so
+// it grows with the breadth of the tree times its depth, not its size.
+class TreeWalker : public QObject
+{
+    Q_OBJECT
+public:
+    explicit TreeWalker(FsService *fs, const QSharedPointer<Vfs> &vfs, const QString &rootPath,
+                        QObject *parent = nullptr);
+
+    // Maximum number of directories being read or waiting to be reported
+    void setPrefetch(int directories);
+
+    void start();
+
+    // Output back-pressure: no directoryReady is emitted while paused
+    void pause();
+    void resume();
+    // Stops for good: drops the stack and issues no further reads. Reads
+    // already on the pool still complete, but are ignored. Never emits
+    // finished.
+    void abort();
+
+signals:
+    // relativePath is empty for the root, otherwise "./a/b"
+    void directoryReady(const QString &relativePath, const QVector<Vfs::Entry> &entries);
+    // ok is false if the root could not be read
+    void finished(bool ok);
+
+private:
+    struct Node
+    {
+        enum State { Idle, Reading, Ready };
+
+        QString relativePath;
+        State state;
+        bool exists;
+        QVector<Vfs::Entry> entries;
+    };
+
+    void schedule();
+    void drain();
+
+    FsService *m_fs;
+    QSharedPointer<Vfs> m_vfs;
+    QString m_rootPath;
+    QList<QSharedPointer<Node>> m_stack;
+    int m_prefetch;
+    int m_outstanding;
+    bool m_paused;
+    bool m_draining;
+    bool m_finished;
+};
+
+#endif // TREEWALKER_H
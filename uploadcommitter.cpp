@@ -0,0 +1,164 @@
+#include "uploadcommitter.h"
+#include "fsservice.h"
+#include <QFileInfo>
+#include <QPair>
+#include <QSet>
+#include <fcntl.h>
+#include <unistd.h>
+
+UploadCommitter::UploadCommitter(FsService *fs, QObject *parent) : QObject(parent),
+    m_fs(fs),
+    m_inFlight(false)
+{
+    resetStats();
+}
+
+void UploadCommitter::commit(const QSharedPointer<Vfs> &vfs, const QSharedPointer<QFile> &file, const QString &tempPath,
+                             const QString &finalPath, UploadPolicy::Durability durability,
+                             QObject *owner, Completion done)
+{
+    if (tempPath.isEmpty() && durability == UploadPolicy::NoSync) {
+        // Nothing to flush or move
+        done(true);
+        return;
+    }
+
+    Pending pending;
+    pending.vfs = vfs;
+    pending.file = file;
+    pending.tempPath = tempPath;
+    pending.finalPath = finalPath;
+    pending.durability = durability;
+    pending.owner = owner;
+    pending.done = done;
+    m_pending.append(pending);
+
+    // With a batch already syncing, this waits to go out with the next one
+    if (!m_inFlight) {
+        flush();
+    }
+}
+
+UploadCommitter::Stats UploadCommitter::stats() const
+{
+    return m_stats;
+}
+
+void UploadCommitter::resetStats()
+{
+    m_stats.files = 0;
+    m_stats.batches = 0;
+    m_stats.syncCalls = 0;
+}
+
+void UploadCommitter::flush()
+{
+    if (m_pending.isEmpty()) {
+        m_inFlight = false;
+        return;
+    }
+
+    QList<Pending> batch;
+    batch.swap(m_pending);
+    m_inFlight = true;
+
+    QVector<Job> jobs;
+    jobs.reserve(batch.size());
+    for (const Pending &pending : batch) {
+        Job job;
+        job.vfs = pending.vfs;
+        job.fd = pending.file->handle();
+        job.tempPath = pending.tempPath;
+        job.finalPath = pending.finalPath;
+        job.durability = pending.durability;
+        jobs.append(job);
+    }
+
+    m_fs->submit<BatchResult>(this, [jobs]() {
+        return commitBatch(jobs);
+    }, [this, batch](const BatchResult &result) {
+        m_stats.files += batch.size();
+        m_stats.batches += 1;
+        m_stats.syncCalls += result.syncCalls;
+
+        for (int i = 0; i < batch.size(); ++i) {
+            if (batch.at(i).owner) {
+                batch.at(i).done(result.ok.at(i));
+            }
+        }
+
+        // Whatever finished while this batch was syncing goes next
+        flush();
+    });
+}
+
+UploadCommitter::BatchResult UploadCommitter::commitBatch(const QVector<Job> &jobs)
+{
+    BatchResult result;
+    result.ok.fill(true, jobs.size());
+    result.syncCalls = 0;
+
+    // Only these files are flushed; syncfs() would also wait for every
+    // other writer on the filesystem
+    QVector<int> indexes;
+    for (int i = 0; i < jobs.size(); ++i) {
+        if (jobs.at(i).fd < 0) {
+            result.ok[i] = false;
+        } else if (jobs.at(i).durability != UploadPolicy::NoSync) {
+            indexes.append(i);
+        }
+    }
+
+#ifdef Q_OS_LINUX
+    // Queue writeback for the whole batch first, so the flushes below
+    // mostly wait on I/O that is already under way
+    if (indexes.size() > 1) {
+        for (int i : indexes) {
+            sync_file_range(jobs.at(i).fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+        }
+    }
+#endif
+
+    for (int i : indexes) {
+        const Job &job = jobs.at(i);
+        ++result.syncCalls;
+        int rc = job.durability == UploadPolicy::SyncFull ? fsync(job.fd) : fdatasync(job.fd);
+        if (rc != 0) {
+            result.ok[i] = false;
+        }
+    }
+
+    // Move the files into place; a file that failed to flush is dropped
+    // rather than replacing an intact older version
+    QSet<QPair<Vfs *, QString>> directories;
+    for (int i = 0; i < jobs.size(); ++i) {
+        const Job &job = jobs.at(i);
+        if (job.tempPath.isEmpty()) {
+            continue;
+        }
+
+        if (!result.ok.at(i)) {
+            job.vfs->remove(job.tempPath);
+            continue;
+        }
+
+        if (!job.vfs->rename(job.tempPath, job.finalPath, true)) {
+            job.vfs->remove(job.tempPath);
+            result.ok[i] = false;
+            continue;
+        }
+
+        if (job.durability == UploadPolicy::SyncFull) {
+            directories.insert(qMakePair(job.vfs.data(), QFileInfo(job.finalPath).path()));
+        }
+    }
+
+    // The renames themselves are durable once their directories are flushed.
+    // The jobs keep every backend in the set alive until we return.
+    for (const QPair<Vfs *, QString> &directory : directories) {
+        ++result.syncCalls;
+        directory.first->syncDirectory(directory.second);
+    }
+
+    return result;
+}
@@ -0,0 +1,83 @@
+#ifndef UPLOADCOMMITTER_H
+#define UPLOADCOMMITTER_H
+
+#include <QObject>
+#include <QFile>
+#include <QList>
+#include <QPointer>
+#include <QSharedPointer>
+#include <QVector>
+#include <functional>
+#include "uploadpolicy.h"
+#include "vfs.h"
+
+class FsService;
+
+// Makes finished uploads durable and moves them into place. Flushes are
+// group-committed: while one batch is being synced on the filesystem pool
+// the next uploads to finish queue up, and are then flushed together.
+// Writeback of the whole batch is started before each file is flushed,
+// so the disk works through them at once rather than one after another.
+class UploadCommitter : public QObject
+{
+    Q_OBJECT
+public:
+    using Completion = std::function<void(bool ok)>;
+
+    struct Stats
+    {
+        quint64 files;
+        quint64 batches;
+        quint64 syncCalls;
+    };
+
+    explicit UploadCommitter(FsService *fs, QObject *parent = nullptr);
+
+    // tempPath is renamed to finalPath within vfs once the data is on
+    // disk; leave it empty for a file written in place. file is kept open
+    // until then.
+    void commit(const QSharedPointer<Vfs> &vfs, const QSharedPointer<QFile> &file, const QString &tempPath,
+                const QString &finalPath, UploadPolicy::Durability durability,
+                QObject *owner, Completion done);
+
+    Stats stats() const;
+    void resetStats();
+
+private:
+    struct Pending
+    {
+        QSharedPointer<Vfs> vfs;
+        QSharedPointer<QFile> file;
+        QString tempPath;
+        QString finalPath;
+        UploadPolicy::Durability durability;
+        QPointer<QObject> owner;
+        Completion done;
+    };
+
+    // What the pool thread needs; the QFiles stay owned by this thread
+    struct Job
+    {
+        QSharedPointer<Vfs> vfs;
+        int fd;
+        QString tempPath;
+        QString finalPath;
+        UploadPolicy::Durability durability;
+    };
+
+    struct BatchResult
+    {
+        QVector<bool> ok;
+        int syncCalls;
+    };
+
+    void flush();
+    static BatchResult commitBatch(const QVector<Job> &jobs);
+
+    FsService *m_fs;
+    QList<Pending> m_pending;
+    bool m_inFlight;
+    Stats m_stats;
+};
+
+#endif // UPLOADCOMMITTER_H
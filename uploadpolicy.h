@@ -0,0 +1,23 @@
+#ifndef UPLOADPOLICY_H
+#define UPLOADPOLICY_H
+
+// How uploads reach their final path. Atomic uploads are written to a
+// hidden temporary file next to the target and renamed over it once
+// complete, so readers never see a partial file. The durability level
+// decides what has been flushed to disk before 226 is sent.
+struct UploadPolicy
+{
+    enum Durability {
+        // Leave flushing to the kernel
+        NoSync,
+        // fdatasync the file: its contents survive a crash
+        SyncData,
+        // fsync the file and its directory: so does the rename
+        SyncFull
+    };
+
+    bool atomic = true;
+    Durability durability = SyncData;
+};
+
+#endif // UPLOADPOLICY_H
@@ -0,0 +1,167 @@
+#ifndef VFS_H
+#define VFS_H
+
+#include <QString>
+#include <QDateTime>
+#include <QVector>
+#include <QFile>
+#include <QRegularExpression>
+#include <QSharedPointer>
+#include <functional>
+
+class QObject;
+
+// A file on storage that has no descriptors (an object store). Used from
+// the session's thread; every call returns at once and completes later on
+// owner's thread, and is dropped if owner has gone by then.
+class VfsStream
+{
+public:
+    // result is the number of bytes transferred, or -errno on failure
+    using Completion = std::function<void(qint64 result, const QByteArray &data)>;
+
+    virtual ~VfsStream() {}
+
+    virtual qint64 size() const = 0;
+
+    // May return less than length, but never crosses the end of the file
+    virtual void read(qint64 offset, qint64 length, QObject *owner, Completion done) = 0;
+
+    // Writes must be sequential. Completions are held back while too much
+    // data is buffered, which is what bounds an upload's memory.
+    virtual void write(qint64 offset, const QByteArray &data, QObject *owner, Completion done) = 0;
+
+    // Makes a written file appear at its path, all at once
+    virtual void commit(QObject *owner, std::function<void(bool ok)> done) = 0;
+
+    // Drops an unfinished write
+    virtual void abort() = 0;
+};
+
+// Storage the server serves files from. Paths are absolute within the
+// served tree ("/pub/file") and have already been normalised, so they
+// never contain "." or ".." segments.
+//
+// Every call may block and is made from the filesystem pool, several at
+// a time, so implementations must be thread-safe. Opened files are plain
+// QFiles with a real descriptor, which transfers read and write through
+// FileIoService; backends that can't provide one stream instead.
+class Vfs
+{
+public:
+    struct Entry
+    {
+        QString name;
+        bool exists = false;
+        bool isDir = false;
+        bool isSymLink = false;
+        // Where a symlink points, as stored in it; empty otherwise
+        QString linkTarget;
+        qint64 size = 0;
+        QDateTime modified;
+        // As ls -l shows them. Backends that don't have them leave the
+        // defaults: permissions -1 (typical ones are shown) and no names.
+        int permissions = -1;
+        uint links = 1;
+        QString userName;
+        QString groupName;
+    };
+
+    // A directory read a batch at a time, so that a huge one never has to
+    // be held in memory whole. Calls block; they are made on the pool, one
+    // at a time.
+    class Listing
+    {
+    public:
+        virtual ~Listing() {}
+
+        // Looks at up to max more entries and appends those that match,
+        // so a batch may come back empty; false once the directory is done
+        virtual bool next(int max, QVector<Entry> *entries) = 0;
+    };
+
+    virtual ~Vfs() {}
+
+    // For the log, e.g. "local disk at /srv/ftp"
+    virtual QString description() const = 0;
+
+    virtual Entry stat(const QString &path) = 0;
+
+    // Entries sorted by name; false if path is not a directory. Hidden
+    // entries (names starting with '.') only with includeHidden.
+    virtual bool list(const QString &path, bool includeHidden, QVector<Entry> *entries) = 0;
+
+    // Entries in no particular order; null if path is not a directory.
+    // With a names pattern, only entries whose whole name matches it are
+    // returned, and the rest are dropped before being stat'ed where the
+    // backend can. The default reads the whole directory with list() and
+    // hands it out in batches; backends that can enumerate incrementally
+    // override it.
+    virtual QSharedPointer<Listing> openListing(const QString &path, bool includeHidden,
+                                                const QRegularExpression &names)
+    {
+        class ListedDirectory : public Listing
+        {
+        public:
+            QVector<Entry> entries;
+            QRegularExpression names;
+            int position = 0;
+
+            bool next(int max, QVector<Entry> *batch) override
+            {
+                int end = qMin(position + max, entries.size());
+                for (; position < end; ++position) {
+                    const Entry &entry = entries.at(position);
+                    if (names.pattern().isEmpty() || names.match(entry.name).hasMatch()) {
+                        batch->append(entry);
+                    }
+                }
+                return position < entries.size();
+            }
+        };
+
+        QSharedPointer<ListedDirectory> listing(new ListedDirectory);
+        if (!list(path, includeHidden, &listing->entries)) {
+            return QSharedPointer<Listing>();
+        }
+        listing->names = names;
+        return listing;
+    }
+
+    // Null if the file cannot be opened with mode
+    virtual QSharedPointer<QFile> open(const QString &path, QIODevice::OpenMode mode) = 0;
+
+    // Whether transfers go through openStream() rather than open()
+    virtual bool usesStreams() const { return false; }
+
+    // Opening for reading may block. Opening for writing must not: it is
+    // done on the session's thread, and the file is attributed to owner.
+    virtual QSharedPointer<VfsStream> openStream(const QString &path, QIODevice::OpenMode mode,
+                                                 const QString &owner)
+    {
+        Q_UNUSED(path);
+        Q_UNUSED(mode);
+        Q_UNUSED(owner);
+        return QSharedPointer<VfsStream>();
+    }
+
+    // With replace, an existing file at to is atomically replaced
+    virtual bool rename(const QString &from, const QString &to, bool replace) = 0;
+    virtual bool mkdir(const QString &path) = 0;
+    virtual bool rmdir(const QString &path) = 0;
+    virtual bool remove(const QString &path) = 0;
+    virtual bool setModified(const QString &path, const QDateTime &modified) = 0;
+
+    // User a file is charged to for quotas; empty if unknown
+    virtual QString owner(const QString &path) = 0;
+    virtual void setOwner(const QString &path, const QString &user) = 0;
+
+    // Makes renames and creations in a directory durable
+    virtual bool syncDirectory(const QString &path) = 0;
+
+    // Where path lives on the local disk, for services that watch or scan
+    // the real tree; empty if the backend is not disk-backed
+    virtual QString localPath(const QString &path) const = 0;
+};
+
+#endif // VFS_H